@@ -110,56 +110,78 @@ public:
 	double			tau;
 };
 
-class HiLoPair {
-public:
-	LowpassFilter		hi,lo;	// highpass, lowpass
+/* Audio is processed in blocks of up to AUDIO_BLOCK sample periods, with the channels in the lanes of a vector
+ * (stereo doubles fill one SSE2 register). composite_audio_process() converts the interleaved 16-bit samples to
+ * lanes once, runs each filter over the whole block with its state held in a register, and converts back once.
+ * The arithmetic is that of LowpassFilter, in the same order, so each channel comes out as it did one sample at
+ * a time. */
+#define AUDIO_LANES 2           /* output_audio_channels is 1 or 2 */
+#define AUDIO_BLOCK 256
+#define AUDIO_HILO_PASSES 6     /* most passes HiLoComboPass can run */
+
+typedef double audio_lanes_t __attribute__((vector_size(sizeof(double) * AUDIO_LANES)));
+
+static inline void audio_lanes_set(audio_lanes_t &r,const double v) {
+	for (unsigned int l=0;l < AUDIO_LANES;l++) r[l] = v;
+}
+
+class LowpassFilterAudioLanes {
 public:
-	void setFilter(const double rate/*sample rate of audio*/,const double low_hz,const double high_hz) {
-		lo.setFilter(rate,low_hz);
-		hi.setFilter(rate,high_hz);
+	LowpassFilterAudioLanes() {
+		audio_lanes_set(alpha,0);
+		audio_lanes_set(prev,0);
 	}
-	double filter(const double sample) {
-		return hi.highpass(lo.lowpass(sample)); /* first lowpass, then highpass */
-	}
-};
+	void setFilter(const double rate/*sample rate of audio*/,const double hz/*cutoff*/) {
+		LowpassFilter f;
 
-class HiLoPass : public vector<HiLoPair> { // all passes, one sample of one channel
-public:
-	HiLoPass() : vector() { }
-public:
-	void setFilter(const double rate/*sample rate of audio*/,const double low_hz,const double high_hz) {
-		for (size_t i=0;i < size();i++) (*this)[i].setFilter(rate,low_hz,high_hz);
+		f.setFilter(rate,hz);
+		audio_lanes_set(alpha,f.alpha);
 	}
-	double filter(double sample) {
-		for (size_t i=0;i < size();i++) sample = (*this)[i].lo.lowpass(sample);
-		for (size_t i=0;i < size();i++) sample = (*this)[i].hi.highpass(sample);
-		return sample;
+	void resetFilter(const double val=0) {
+		audio_lanes_set(prev,val);
 	}
-	void init(const unsigned int passes) {
-		clear();
-		resize(passes);
-		assert(size() >= passes);
+	void lowpass(audio_lanes_t *s,const unsigned int n) { /* in place, n sample periods */
+		audio_lanes_t p = prev;
+
+		for (unsigned int i=0;i < n;i++) {
+			const audio_lanes_t stage1 = s[i] * alpha;
+			const audio_lanes_t stage2 = p - (p * alpha); /* NTS: Instead of prev * (1.0 - alpha) */
+			s[i] = p = stage1 + stage2;
+		}
+
+		prev = p;
 	}
-};
+	void highpass(audio_lanes_t *s,const unsigned int n) { /* in place, n sample periods */
+		audio_lanes_t p = prev;
 
-class HiLoSample : public vector<HiLoPass> { // all passes, all channels of one sample period
-public:
-	HiLoSample() : vector() { }
-public:
-	void init(const unsigned int channels,const unsigned int passes) {
-		clear();
-		resize(channels);
-		assert(size() >= channels);
-		for (size_t i=0;i < size();i++) (*this)[i].init(passes);
+		for (unsigned int i=0;i < n;i++) {
+			const audio_lanes_t stage1 = s[i] * alpha;
+			const audio_lanes_t stage2 = p - (p * alpha);
+			s[i] -= (p = stage1 + stage2);
+		}
+
+		prev = p;
 	}
-	void setFilter(const double rate/*sample rate of audio*/,const double low_hz,const double high_hz) {
-		for (size_t i=0;i < size();i++) (*this)[i].setFilter(rate,low_hz,high_hz);
+	void highboost(audio_lanes_t *s,const unsigned int n,const double amount) { /* s += highpass(s) * amount */
+		audio_lanes_t p = prev;
+
+		for (unsigned int i=0;i < n;i++) {
+			const audio_lanes_t stage1 = s[i] * alpha;
+			const audio_lanes_t stage2 = p - (p * alpha);
+			p = stage1 + stage2;
+			s[i] += (s[i] - p) * amount;
+		}
+
+		prev = p;
 	}
+public:
+	audio_lanes_t		alpha;
+	audio_lanes_t		prev;
 };
 
 class HiLoComboPass {
 public:
-	HiLoComboPass() : passes(0), channels(0), rate(0), low_cutoff(0), high_cutoff(0) {
+	HiLoComboPass() : rate(0), passes(0), channels(0), low_cutoff(0), high_cutoff(0), ready(false) {
 	}
 	~HiLoComboPass() {
 		clear();
@@ -190,13 +212,50 @@ public:
 		}
 	}
 	void clear() {
-		audiostate.clear();
+		ready = false;
 	}
 	void init() {
 		clear();
 		if (channels == 0 || passes == 0 || rate == 0 || low_cutoff == 0 || high_cutoff == 0) return;
-		audiostate.init(channels,passes);
-		audiostate.setFilter(rate,low_cutoff,high_cutoff);
+		if (channels > AUDIO_LANES || passes > AUDIO_HILO_PASSES) return;
+		/* the passes not used let the sample through unchanged: a lowpass with alpha 1, a highpass with alpha 0 */
+		for (size_t i=0;i < AUDIO_HILO_PASSES;i++) {
+			lo[i].setFilter(rate,low_cutoff);
+			hi[i].setFilter(rate,high_cutoff);
+			if (i >= passes) {
+				audio_lanes_set(lo[i].alpha,1.0);
+				audio_lanes_set(hi[i].alpha,0.0);
+			}
+			lo[i].resetFilter();
+			hi[i].resetFilter();
+		}
+		ready = true;
+	}
+	void filter(audio_lanes_t *s,const unsigned int n) { /* in place, n sample periods */
+		/* all passes in one loop, first the lowpasses, then the highpasses. the state of every pass stays in a
+		 * register and the passes of neighbouring samples overlap, where pass after pass over the block would
+		 * wait on each pass's own chain of multiply and add */
+		audio_lanes_t lp[AUDIO_HILO_PASSES],hp[AUDIO_HILO_PASSES];
+		unsigned int i,k;
+
+		for (k=0;k < AUDIO_HILO_PASSES;k++) {
+			lp[k] = lo[k].prev;
+			hp[k] = hi[k].prev;
+		}
+		for (i=0;i < n;i++) {
+			audio_lanes_t v = s[i];
+
+			for (k=0;k < AUDIO_HILO_PASSES;k++)
+				v = lp[k] = (v * lo[k].alpha) + (lp[k] - (lp[k] * lo[k].alpha));
+			for (k=0;k < AUDIO_HILO_PASSES;k++)
+				v -= (hp[k] = (v * hi[k].alpha) + (hp[k] - (hp[k] * hi[k].alpha)));
+
+			s[i] = v;
+		}
+		for (k=0;k < AUDIO_HILO_PASSES;k++) {
+			lo[k].prev = lp[k];
+			hi[k].prev = hp[k];
+		}
 	}
 public:
 	double		rate;
@@ -204,14 +263,16 @@ public:
 	size_t		channels;
 	double		low_cutoff;
 	double		high_cutoff;
-	HiLoSample	audiostate;
+	bool		ready;
+	LowpassFilterAudioLanes lo[AUDIO_HILO_PASSES];	// one pole stages, all channels in the lanes
+	LowpassFilterAudioLanes hi[AUDIO_HILO_PASSES];
 };
 
 HiLoComboPass		audio_hilopass;
 
 // preemphsis emuluation
-LowpassFilter		audio_linear_preemphasis_pre[2];
-LowpassFilter		audio_linear_preemphasis_post[2];
+LowpassFilterAudioLanes	audio_linear_preemphasis_pre;	// one per channel, in the lanes
+LowpassFilterAudioLanes	audio_linear_preemphasis_post;
 
 AVFormatContext*	input_avfmt = NULL;
 AVStream*		input_avstream_audio = NULL;	// do not free
@@ -272,57 +333,101 @@ static inline int clips16(const int x) {
 	return x;
 }
 
+/* Counter-based random numbers for the hiss. A number is a pure function of (seed, sample, channel):
+ * the seed and the sample's block of 65536 are hashed into the key of a stream and the rest goes through
+ * a keyed 32-bit integer hash, so the hiss is the same on every render with the same -seed. */
+enum {
+    NOISE_STAGE_AUDIO_HISS=1    // -audio-hiss (field = sample >> 16, scanline = channel)
+};
+
+static unsigned long long noise_seed = 0;
+
+static inline uint64_t noise_mix64(uint64_t z) { /* splitmix64 finalizer */
+    z = (z ^ (z >> 30ULL)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27ULL)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31ULL);
+}
+
+/* key of one stream of random numbers */
+static inline uint64_t noise_key(const unsigned long long field,const unsigned int scanline,const unsigned int stage) {
+    return noise_mix64(noise_mix64(noise_mix64(noise_seed) ^ field) ^ (((uint64_t)stage << 32ULL) + scanline));
+}
+
+static inline uint32_t noise_hash32(uint32_t x) {
+    x ^= x >> 16U; x *= 0x7FEB352DU;
+    x ^= x >> 15U; x *= 0x846CA68BU;
+    x ^= x >> 16U;
+    return x;
+}
+
+/* number n of the stream */
+static inline uint32_t noise_at(const uint64_t key,const uint32_t n) {
+    return noise_hash32(noise_hash32(n ^ (uint32_t)key) + (uint32_t)(key >> 32ULL));
+}
+
 static unsigned long long audio_proc_count = 0;
 
-class ConvolutionMap {
+/* head tilt as a fractional delay of each lane. the kernel is a triangle |tilt|+1 samples wide either side of its
+ * center, which sits somewhere between two samples. only the taps that fall under the triangle are visited, at
+ * most 2*ceil(width) of them, and their weights come straight from the distance to the center. the history is
+ * stored twice, back to back, so the last length samples are always contiguous no matter where the ring is. */
+class FractionalDelayLine { // all channels in the lanes
 public:
-    ConvolutionMap() : length(0), map(NULL), multiply(NULL) {
+    FractionalDelayLine() : length(0), pos(0), hist(NULL) {
     }
-    ~ConvolutionMap() {
+    ~FractionalDelayLine() {
         freemap();
     }
     bool allocmap(const size_t len) {
-        if (map != NULL && len == length)
+        if (hist != NULL && len == length)
             return true;
 
         freemap();
         length = len;
+        pos = 0;
         if (length == 0)
             return true;
 
-        map = new double[length];
-        memset(map,0,sizeof(double) * length);
-        multiply = new double[length];
-        memset(multiply,0,sizeof(double) * length);
+        hist = new audio_lanes_t[length * 2];
+        memset(hist,0,sizeof(audio_lanes_t) * length * 2);
         return true;
     }
 public:
     void freemap(void) {
-        if (map) delete[] map;
-        map = NULL;
-
-        if (multiply) delete[] multiply;
-        multiply = NULL;
+        if (hist) delete[] hist;
+        hist = NULL;
     }
-    double calc(double s) {
+    void push(const audio_lanes_t s) {
+        if (++pos == length) pos = 0;
+        hist[pos] = hist[pos + length] = s;
+    }
+    /* lane c, delay samples back from the last push, through a triangle width samples wide either side.
+     * taps past either end of the history are left out. */
+    double tap(const unsigned int c,const double delay,const double width) const {
+        const double iw = 1.0 / width;
+        const double iw2 = iw * iw;
+        const double fm = floor(delay);
+        const double f = delay - fm;
+        const int m = (int)fm;
+        const int jlo = std::max((int)floor(f - width) + 1,-m); // |j - f| < width
+        const int jhi = std::min((int)ceil(f + width) - 1,(int)length - 1 - m);
+        const audio_lanes_t *h = hist + pos + length - m; // h[-j] is m+j samples back
         double r = 0;
-        size_t i;
-
-        for (i=0;(i+1) < length;i++) map[i] = map[i+1];
-        map[i] = s;
 
-        for (i=0;i < length;i++)
-            r += map[i] * multiply[i];
+        for (int j=jlo;j <= jhi;j++) {
+            const double d = iw - (iw2 * fabs((double)j - f)); // FIXME: sinc would be more appropriate?
+            r += d * h[-j][c];
+        }
 
         return r;
     }
 public:
     size_t                  length;
-    double*                 map;
-    double*                 multiply;
+    size_t                  pos;        // last sample pushed, also at pos + length
+    audio_lanes_t*          hist;
 };
 
-ConvolutionMap          audio_conv[2];
+FractionalDelayLine     audio_conv;
 double                  lr_delay = 2;               // part of head tilt, as a consequence of storing stereo left + right on separate halves of the tape
 double                  head_tilt = 0.2;            // everyone's a little out of alignment
 double                  head_tilt_waver = 0.5;      // and variation in tape speed changes it over time
@@ -330,87 +435,87 @@ double                  head_tilt_final = 0;
 
 bool                    mono_downmix = false;
 
+static audio_lanes_t audio_block[AUDIO_BLOCK];
+
 void composite_audio_process(int16_t *audio,unsigned int samples) { // number of channels = output_audio_channels, sample rate = output_audio_rate. audio is interleaved.
-	assert(audio_hilopass.audiostate.size() >= output_audio_channels);
+	assert(audio_hilopass.ready && output_audio_channels <= AUDIO_LANES);
+	const unsigned int channels = output_audio_channels;
 
-    if (audio_conv[0].map == NULL) {
-        audio_conv[0].allocmap((int)floor(fabs(head_tilt * 2) + fabs(head_tilt * 3) + 7.5));
-        audio_conv[1].allocmap((int)floor(fabs(head_tilt * 2) + fabs(head_tilt * 3) + 7.5));
-    }
+	if (audio_conv.hist == NULL)
+		audio_conv.allocmap((int)floor(fabs(head_tilt * 2) + fabs(head_tilt * 3) + 7.5));
 
-	for (unsigned int s=0;s < samples;s++,audio += output_audio_channels) {
-        {
-            double t = (double)audio_proc_count / output_audio_rate;
-            head_tilt_final = (head_tilt_waver * sin(t * M_PI * 2 * 1.5)) + head_tilt;
-            lr_delay = head_tilt_final * 1.5;
-
-            {
-                double mid = lr_delay + ((double)audio_conv[0].length / 2);
-
-                for (size_t i=0;i < audio_conv[0].length;i++) {
-                    double d = ((double)i - mid) / (fabs(head_tilt_final) + 1.0);
-                    d = 1.0 - fabs(d); // FIXME: sinc would be more appropriate?
-                    if (d < 0) d = 0;
-                    d /= fabs(head_tilt_final) + 1.0;
-                    audio_conv[0].multiply[i] = d;
-                }
-            }
+	while (samples > 0) {
+		const unsigned int n = std::min(samples,(unsigned int)AUDIO_BLOCK);
+		audio_lanes_t *b = audio_block;
+		unsigned int i,c;
 
-            {
-                double mid = -lr_delay + ((double)audio_conv[1].length / 2);
+		/* to lanes. a lane without a channel is zero */
+		for (i=0;i < n;i++) {
+			audio_lanes_set(b[i],0);
+			for (c=0;c < channels;c++) b[i][c] = (double)audio[(i * channels) + c] / 32768;
+		}
 
-                for (size_t i=0;i < audio_conv[1].length;i++) {
-                    double d = ((double)i - mid) / (fabs(head_tilt_final) + 1.0);
-                    d = 1.0 - fabs(d); // FIXME: sinc would be more appropriate?
-                    if (d < 0) d = 0;
-                    d /= fabs(head_tilt_final) + 1.0;
-                    audio_conv[1].multiply[i] = d;
-                }
-            }
-        }
+		/* lowpass filter */
+		audio_hilopass.filter(b,n);
 
-		for (unsigned int c=0;c < output_audio_channels;c++) {
-			double s;
+		/* preemphasis */
+		if (emulating_preemphasis)
+			audio_linear_preemphasis_pre.highboost(b,n,1.0);
 
-			s = (double)audio[c] / 32768;
+		/* analog limiting (when the signal is too loud) */
+		for (i=0;i < n;i++) {
+			b[i] = b[i] > 1.0 ? 1.0 : b[i];
+			b[i] = b[i] < -1.0 ? -1.0 : b[i];
+		}
 
-			/* lowpass filter */
-			s = audio_hilopass.audiostate[c].filter(s);
+		/* hiss */
+		if (output_audio_hiss_level != 0) {
+			for (i=0;i < n;i++) {
+				const unsigned long long count = audio_proc_count + i;
 
-			/* preemphasis */
-			if (emulating_preemphasis) {
-				for (unsigned int i=0;i < output_audio_channels;i++) {
-					s = s + audio_linear_preemphasis_pre[i].highpass(s);
-				}
+				for (c=0;c < channels;c++)
+					b[i][c] += ((double)(((int)(noise_at(noise_key(count >> 16ULL,c,NOISE_STAGE_AUDIO_HISS),(uint32_t)(count & 0xFFFFULL)) % ((output_audio_hiss_level * 2) + 1))) - output_audio_hiss_level)) / 20000;
 			}
+		}
 
-			/* analog limiting (when the signal is too loud) */
-			if (s > 1.0)
-				s = 1.0;
-			else if (s < -1.0)
-				s = -1.0;
+		/* convolution (head tilt, the kernel moves with the tape speed waver). the waver is a 1.5Hz sine, taken at
+		 * both ends of the block and followed in a straight line in between. */
+		{
+			const double t0 = (double)audio_proc_count / output_audio_rate;
+			const double t1 = (double)(audio_proc_count + n) / output_audio_rate;
+			const double tilt0 = (head_tilt_waver * sin(t0 * M_PI * 2 * 1.5)) + head_tilt;
+			const double tilt1 = (head_tilt_waver * sin(t1 * M_PI * 2 * 1.5)) + head_tilt;
+			const double center = (double)(audio_conv.length - 1) - ((double)audio_conv.length / 2); // samples back
 
-			/* hiss */
-			if (output_audio_hiss_level != 0)
-				s += ((double)(((int)((unsigned int)rand() % ((output_audio_hiss_level * 2) + 1))) - output_audio_hiss_level)) / 20000;
+			for (i=0;i < n;i++) {
+				head_tilt_final = tilt0 + (((tilt1 - tilt0) * i) / n);
+				lr_delay = head_tilt_final * 1.5;
 
-            /* convolution */
-            s = audio_conv[c].calc(s);
+				const double width = fabs(head_tilt_final) + 1.0;
 
-			/* deemphasis */
-			if (emulating_deemphasis) {
-				for (unsigned int i=0;i < output_audio_channels;i++) {
-					s = audio_linear_preemphasis_post[i].lowpass(s);
-				}
+				audio_conv.push(b[i]);
+				for (c=0;c < channels;c++)
+					b[i][c] = audio_conv.tap(c,c == 0 ? (center - lr_delay) : (center + lr_delay),width);
 			}
-
-			audio[c] = clips16(s * 32768);
 		}
 
-        if (mono_downmix)
-            audio[0] = audio[1] = (audio[0] + audio[1]) / 2;
+		/* deemphasis */
+		if (emulating_deemphasis)
+			audio_linear_preemphasis_post.lowpass(b,n);
+
+		/* back to 16-bit interleaved */
+		for (i=0;i < n;i++) {
+			int16_t *a = audio + (i * channels);
+
+			for (c=0;c < channels;c++) a[c] = clips16(b[i][c] * 32768);
 
-		audio_proc_count++;
+			if (mono_downmix && channels == 2)
+				a[0] = a[1] = (a[0] + a[1]) / 2;
+		}
+
+		audio_proc_count += n;
+		audio += n * channels;
+		samples -= n;
 	}
 }
 
@@ -421,6 +526,7 @@ static void help(const char *arg0) {
 	fprintf(stderr," -preemphasis <0|1>        Enable preemphasis emulation\n");
 	fprintf(stderr," -deemphasis <0|1>         Enable deepmhasis emulation\n");
 	fprintf(stderr," -audio-hiss <-120..0>     Audio hiss in decibels (0=100%)\n");
+	fprintf(stderr," -seed <n>                 Seed for the hiss, the same seed gives the same hiss (default 0)\n");
 	fprintf(stderr," -a <n>                    Pick the n'th audio stream\n");
 	fprintf(stderr," -an                       Don't render any audio stream\n");
     fprintf(stderr," -ss <t>                   Start transcoding from t seconds\n");
@@ -494,6 +600,9 @@ static int parse_argv(int argc,char **argv) {
 			else if (!strcmp(a,"an")) {
 				audio_stream_index = -1;
 			}
+			else if (!strcmp(a,"seed")) {
+				noise_seed = strtoull(argv[i++],NULL,0);
+			}
 			else if (!strcmp(a,"audio-hiss")) {
 				output_audio_hiss_db = atof(argv[i++]);
 			}
@@ -601,6 +710,30 @@ int audio_dst_data_alloc_samples = 0;
 int audio_dst_data_linesize = 0;
 int audio_dst_data_samples = 0;
 
+/* audio packets up to this many samples come from a pool, larger ones (pad fill) are allocated as before */
+#define OUTPUT_AUDIO_PACKET_POOL_SAMPLES    16384
+
+AVBufferPool*               output_audio_packet_pool = NULL;
+int                         output_audio_packet_pool_size = 0;
+
+int output_audio_new_packet(AVPacket *pkt,int size) {
+    if (output_audio_packet_pool == NULL) {
+        output_audio_packet_pool_size = OUTPUT_AUDIO_PACKET_POOL_SAMPLES * 2 * output_audio_channels;
+        output_audio_packet_pool = av_buffer_pool_init(output_audio_packet_pool_size + AV_INPUT_BUFFER_PADDING_SIZE,NULL);
+        if (output_audio_packet_pool == NULL) return AVERROR(ENOMEM);
+    }
+
+    if (size > output_audio_packet_pool_size)
+        return av_new_packet(pkt,size);
+
+    pkt->buf = av_buffer_pool_get(output_audio_packet_pool);
+    if (pkt->buf == NULL) return AVERROR(ENOMEM);
+    pkt->data = pkt->buf->data;
+    pkt->size = size;
+    memset(pkt->data + size,0,AV_INPUT_BUFFER_PADDING_SIZE);
+    return 0;
+}
+
 bool do_audio_decode_and_render(AVPacket &pkt,unsigned long long &audio_sample) {
     int got_frame = 0;
 
@@ -690,7 +823,7 @@ bool do_audio_decode_and_render(AVPacket &pkt,unsigned long long &audio_sample)
 
                 AVPacket dstpkt;
                 av_init_packet(&dstpkt);
-                if (av_new_packet(&dstpkt,out_samples * 2 * output_audio_channels) >= 0) { // NTS: Will reset fields too!
+                if (output_audio_new_packet(&dstpkt,out_samples * 2 * output_audio_channels) >= 0) { // NTS: Will reset fields too!
                     assert(dstpkt.data != NULL);
                     assert(dstpkt.size >= (out_samples * 2 * output_audio_channels));
                     memset(dstpkt.data,0,out_samples * 2 * output_audio_channels);
@@ -718,7 +851,7 @@ bool do_audio_decode_and_render(AVPacket &pkt,unsigned long long &audio_sample)
                     // that way we can render directly to MP4 our VHS emulation.
                     AVPacket dstpkt;
                     av_init_packet(&dstpkt);
-                    if (av_new_packet(&dstpkt,out_samples * 2 * output_audio_channels) >= 0) { // NTS: Will reset fields too!
+                    if (output_audio_new_packet(&dstpkt,out_samples * 2 * output_audio_channels) >= 0) { // NTS: Will reset fields too!
                         assert(dstpkt.data != NULL);
                         assert(dstpkt.size >= (out_samples * 2 * output_audio_channels));
                         memcpy(dstpkt.data,audio_dst_data[0],out_samples * 2 * output_audio_channels);
@@ -868,14 +1001,10 @@ int main(int argc,char **argv) {
 	audio_hilopass.init();
 
 	if (emulating_preemphasis) {
-        for (unsigned int i=0;i < output_audio_channels;i++) {
-            audio_linear_preemphasis_pre[i].setFilter(output_audio_rate,4000/*FIXME: Guess! Also let user set this.*/);
-        }
+        audio_linear_preemphasis_pre.setFilter(output_audio_rate,4000/*FIXME: Guess! Also let user set this.*/);
     }
 	if (emulating_deemphasis) {
-        for (unsigned int i=0;i < output_audio_channels;i++) {
-            audio_linear_preemphasis_post[i].setFilter(output_audio_rate,4000/*FIXME: Guess! Also let user set this.*/);
-        }
+        audio_linear_preemphasis_post.setFilter(output_audio_rate,4000/*FIXME: Guess! Also let user set this.*/);
     }
 
 	/* prepare audio decoding */
@@ -897,6 +1026,15 @@ int main(int argc,char **argv) {
         double t,pt = -1;
 		AVPacket pkt;
 
+        /* -ss: seek to the packet before the start, instead of reading and throwing away everything up to it.
+         * packets before the start are still dropped below, so the start stays exact */
+        if (transcode_start > 0) {
+            if (av_seek_frame(input_avfmt,-1,(int64_t)(transcode_start * AV_TIME_BASE),AVSEEK_FLAG_BACKWARD) >= 0)
+                fprintf(stderr,"Seeked to %.3f\n",transcode_start);
+            else
+                fprintf(stderr,"WARNING: Unable to seek to %.3f, reading from the start\n",transcode_start);
+        }
+
 		av_init_packet(&pkt);
 		while (av_read_frame(input_avfmt,&pkt) >= 0) {
 			if (DIE != 0) break;
@@ -993,6 +1131,7 @@ int main(int argc,char **argv) {
 	if (output_avfmt != NULL && !(output_avfmt->oformat->flags & AVFMT_NOFILE))
 		avio_closep(&output_avfmt->pb);
 	avformat_free_context(output_avfmt);
+	av_buffer_pool_uninit(&output_audio_packet_pool);
 	avformat_close_input(&input_avfmt);
 	return 0;
 }
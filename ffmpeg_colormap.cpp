@@ -15,6 +15,8 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 extern "C" {
 #include <libavutil/opt.h>
@@ -45,6 +47,8 @@ using namespace std;
 #include <vector>
 #include <stdexcept>
 
+#include "output_video_encode.h"
+
 bool            use_422_colorspace = false; // I would default this to true but Adobe Premiere Pro apparently can't handle 4:2:2 H.264 >:(
 AVRational	output_field_rate = { 60000, 1001 };	// NTSC 60Hz default
 int		output_width = 720;
@@ -53,6 +57,13 @@ bool		output_ntsc = true;	// NTSC color subcarrier emulation
 bool		output_pal = false;	// PAL color subcarrier emulation
 int		output_audio_channels = 2;	// VHS stereo (set to 1 for mono)
 int		output_audio_rate = 44100;	// VHS Hi-Fi goes up to 20KHz
+unsigned int decode_ahead = 8;      // frames each input decodes and scales ahead on its own thread (0 = decode on the main thread)
+std::string     output_video_codec = "h264";        // -vcodec, see output_video_encoder()
+std::string     output_video_preset;                // -preset, passed to the encoder if it has one
+std::string     output_video_crf;                   // -crf, passed to the encoder if it has one
+long            output_video_bitrate = 0;           // -b:v (0 = encoder default)
+int             output_video_threads = 0;           // encoder threads (0 = one per CPU core)
+unsigned int    output_video_encode_queue = 8;      // frames queued to the encode thread (0 = encode on the main thread)
 
 uint32_t                    colormap[256];
 
@@ -81,6 +92,13 @@ public:
         input_avstream_video_frame_rgb = NULL;
         input_avstream_video_resampler = NULL;
         input_avstream_video_codec_context = NULL;
+        decoder = NULL;
+        decode_ring = NULL;
+        decode_ring_size = 0;
+        decode_head = 0;
+        decode_quit = false;
+        pending_rgb = NULL;
+        pending_video = false;
         next_pts = next_dts = -1LL;
         avpkt_valid = false;
         eof_stream = false;
@@ -138,6 +156,8 @@ public:
                     }
                     else if (isctx->codec_type == AVMEDIA_TYPE_VIDEO) {
                         if (input_avstream_video == NULL && vc == 0) {
+                            isctx->thread_count = 0; // auto
+                            isctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
                             if (avcodec_open2(isctx,avcodec_find_decoder(isctx->codec_id),NULL) >= 0) {
                                 input_avstream_video = is;
                                 input_avstream_video_codec_context = isctx;
@@ -220,7 +240,222 @@ public:
         next_pts = next_dts = -1LL;
         return (input_avfmt != NULL);
     }
+    /* decode ahead. the decoder is a copy of this InputFile that takes over the demuxer, decoders and scalers, and
+     * runs decode_packet() and frame_copy_scale() on its own thread into a ring of slots. the ring is single producer,
+     * single consumer, the two semaphores count the free and filled slots. this InputFile keeps only what the field
+     * loop looks at, and next_packet() / frame_copy_scale() swap frames and buffers with the slots instead. */
+    struct DecodeSlot {
+        bool                got_audio,got_video,eof;
+        AVFrame*            video;              // decoded frame (timestamps, flags)
+        AVFrame*            rgb;                // scaled ARGB
+        uint8_t**           audio_dst_data;
+        int                 audio_dst_data_alloc_samples;
+        int                 audio_dst_data_linesize;
+        int                 audio_dst_data_samples;
+        int                 audio_dst_data_out_samples;
+        unsigned long long  audio_dst_data_out_audio_sample;
+    };
+    void swap_audio(DecodeSlot &s) {
+        std::swap(audio_dst_data,s.audio_dst_data);
+        std::swap(audio_dst_data_alloc_samples,s.audio_dst_data_alloc_samples);
+        std::swap(audio_dst_data_linesize,s.audio_dst_data_linesize);
+        audio_dst_data_samples = s.audio_dst_data_samples;
+        audio_dst_data_out_samples = s.audio_dst_data_out_samples;
+        audio_dst_data_out_audio_sample = s.audio_dst_data_out_audio_sample;
+    }
+    static void *decode_ahead_thread(void *arg) {
+        ((InputFile*)arg)->decode_ahead_loop();
+        return NULL;
+    }
+    /* decoder thread (runs on the field loop's InputFile, works on the decoder) */
+    void decode_ahead_loop(void) {
+        unsigned int idx = 0;
+        bool done = false;
+
+        do {
+            while (sem_wait(&decode_free) != 0);
+            if (decode_quit) break;
+
+            DecodeSlot &s = decode_ring[idx];
+            if ((++idx) >= decode_ring_size) idx = 0;
+
+            decoder->decode_packet();
+            s.got_audio = decoder->got_audio;
+            s.got_video = decoder->got_video;
+            s.eof = done = decoder->eof;
+
+            if (s.got_video) {
+                decoder->frame_copy_scale();
+                std::swap(s.video,decoder->input_avstream_video_frame);
+                std::swap(s.rgb,decoder->input_avstream_video_frame_rgb);
+            }
+            if (s.got_audio) {
+                decoder->swap_audio(s);
+                s.audio_dst_data_samples = decoder->audio_dst_data_samples;
+                s.audio_dst_data_out_samples = decoder->audio_dst_data_out_samples;
+                s.audio_dst_data_out_audio_sample = decoder->audio_dst_data_out_audio_sample;
+            }
+
+            sem_post(&decode_used);
+        } while (!done);
+    }
+    /* the slots' frames and buffers, and the ring */
+    void free_decode_ring(void) {
+        unsigned int i;
+
+        for (i=0;i < decode_ring_size;i++) {
+            DecodeSlot &s = decode_ring[i];
+
+            if (s.video != NULL) av_frame_free(&s.video);
+            if (s.rgb != NULL) av_frame_free(&s.rgb);
+            if (s.audio_dst_data != NULL) {
+                av_freep(&s.audio_dst_data[0]);
+                av_freep(&s.audio_dst_data);
+            }
+        }
+        delete[] decode_ring;
+        decode_ring = NULL;
+        decode_ring_size = 0;
+    }
+    bool start_decode_ahead(void) {
+        AVFrame *video_frame = NULL;
+        bool ok = true;
+        unsigned int i;
+
+        if (decode_ahead == 0 || input_avfmt == NULL || eof || decoder != NULL)
+            return false;
+
+        /* everything that can fail first, while the demuxer is still ours to decode from. if it does, decode
+         * on the main thread from now on instead of trying again on every packet */
+        decode_ring = new DecodeSlot[decode_ahead];
+        decode_ring_size = decode_ahead;
+        decode_head = 0;
+        decode_quit = false;
+        for (i=0;i < decode_ring_size;i++) {
+            DecodeSlot &s = decode_ring[i];
+
+            s.got_audio = s.got_video = s.eof = false;
+            s.video = av_frame_alloc();
+            s.rgb = NULL;
+            s.audio_dst_data = NULL;
+            s.audio_dst_data_alloc_samples = 0;
+            s.audio_dst_data_linesize = 0;
+            s.audio_dst_data_samples = 0;
+            s.audio_dst_data_out_samples = 0;
+            s.audio_dst_data_out_audio_sample = 0;
+            if (s.video == NULL) ok = false;
+        }
+        if (ok && input_avstream_video_frame != NULL && (video_frame = av_frame_alloc()) == NULL)
+            ok = false;
+        if (!ok) {
+            fprintf(stderr,"Failed to alloc video frame, decoding on the main thread\n");
+            free_decode_ring();
+            decode_ahead = 0;
+            return false;
+        }
+
+        /* hand the demuxer, decoders and scalers to the decoder. the current frames stay here, the decoder
+         * makes its own scaled frames as needed */
+        decoder = new InputFile(*this);
+        decoder->decoder = NULL;
+        decoder->decode_ring = NULL;
+        decoder->pending_rgb = NULL;
+        decoder->input_avstream_video_frame_rgb = NULL;
+
+        input_avfmt = NULL;
+        input_avstream_audio_codec_context = NULL;
+        input_avstream_video_codec_context = NULL;
+        input_avstream_audio_frame = NULL;
+        input_avstream_audio_resampler = NULL;
+        input_avstream_video_resampler = NULL;
+        audio_dst_data = NULL;
+        audio_dst_data_alloc_samples = 0;
+        avpkt_valid = false;
+        if (input_avstream_video_frame != NULL)
+            input_avstream_video_frame = video_frame;
+
+        sem_init(&decode_free,0,decode_ring_size);
+        sem_init(&decode_used,0,0);
+        if (pthread_create(&decode_thread,NULL,decode_ahead_thread,this) != 0) {
+            fprintf(stderr,"Failed to start decode thread, decoding on the main thread\n");
+            sem_destroy(&decode_free);
+            sem_destroy(&decode_used);
+            decode_quit = true; // nothing to join
+            return true;
+        }
+
+        return true;
+    }
+    void stop_decode_ahead(void) {
+        if (decoder == NULL) return;
+
+        if (!decode_quit) {
+            decode_quit = true;
+            sem_post(&decode_free);
+            pthread_join(decode_thread,NULL);
+            sem_destroy(&decode_free);
+            sem_destroy(&decode_used);
+        }
+
+        decoder->close_input();
+        delete decoder;
+        decoder = NULL;
+        free_decode_ring();
+
+        if (pending_rgb != NULL) av_frame_free(&pending_rgb);
+        pending_video = false;
+    }
     bool next_packet(void) {
+        if (decoder == NULL && !start_decode_ahead())
+            return decode_packet();
+        if (eof) return false;
+
+        if (decode_quit) { // the thread did not start, decode here
+            decoder->decode_packet();
+            got_audio = decoder->got_audio;
+            got_video = decoder->got_video;
+            eof = decoder->eof;
+            if (got_video) {
+                decoder->frame_copy_scale();
+                std::swap(pending_rgb,decoder->input_avstream_video_frame_rgb);
+                std::swap(input_avstream_video_frame,decoder->input_avstream_video_frame);
+                pending_video = true;
+            }
+            if (got_audio) {
+                DecodeSlot s;
+
+                s.audio_dst_data = audio_dst_data;
+                s.audio_dst_data_alloc_samples = audio_dst_data_alloc_samples;
+                s.audio_dst_data_linesize = audio_dst_data_linesize;
+                decoder->swap_audio(s);
+                s.audio_dst_data_samples = decoder->audio_dst_data_samples;
+                s.audio_dst_data_out_samples = decoder->audio_dst_data_out_samples;
+                s.audio_dst_data_out_audio_sample = decoder->audio_dst_data_out_audio_sample;
+                swap_audio(s);
+            }
+            return true;
+        }
+
+        while (sem_wait(&decode_used) != 0);
+
+        DecodeSlot &s = decode_ring[decode_head];
+        if ((++decode_head) >= decode_ring_size) decode_head = 0;
+
+        got_audio = s.got_audio;
+        got_video = s.got_video;
+        eof = s.eof;
+        if (s.got_video) {
+            std::swap(s.video,input_avstream_video_frame);
+            std::swap(s.rgb,pending_rgb);
+            pending_video = true;
+        }
+        if (s.got_audio)
+            swap_audio(s);
+
+        sem_post(&decode_free);
+        return true;
+    }
+    bool decode_packet(void) {
         if (eof) return false;
         if (input_avfmt == NULL) return false;
 
@@ -383,6 +618,14 @@ public:
         }
     }
     void frame_copy_scale(void) {
+        if (decoder != NULL) { // decode ahead: the decoder thread already scaled it
+            if (pending_video) {
+                std::swap(input_avstream_video_frame_rgb,pending_rgb);
+                pending_video = false;
+            }
+            return;
+        }
+
         if (input_avstream_video_frame_rgb == NULL) {
             fprintf(stderr,"New input frame\n");
             input_avstream_video_frame_rgb = av_frame_alloc();
@@ -479,6 +722,7 @@ public:
         got_video = false;
     }
     void close_input(void) {
+        stop_decode_ahead();
         eof = true;
         avpkt_release();
         if (input_avstream_audio_codec_context != NULL) {
@@ -552,6 +796,15 @@ public:
     bool                    avpkt_valid;
     double                  adj_time;
     double                  t,pt;
+    InputFile*              decoder;                            // decode ahead (see start_decode_ahead())
+    DecodeSlot*             decode_ring;
+    unsigned int            decode_ring_size;
+    unsigned int            decode_head;
+    volatile bool           decode_quit;
+    pthread_t               decode_thread;
+    sem_t                   decode_free,decode_used;
+    AVFrame*                pending_rgb;                        // scaled frame taken from the ring, shown at frame_copy_scale()
+    bool                    pending_video;
 };
 
 std::vector<InputFile>      input_files;
@@ -613,7 +866,14 @@ void preset_NTSC() {
 static void help(const char *arg0) {
 	fprintf(stderr,"%s [options]\n",arg0);
 	fprintf(stderr," -i <input file>               you can specify more than one input file, in order of layering\n");
+	fprintf(stderr," -decode-ahead <n>             decode and scale up to n packets ahead per input on a thread (default 8, 0=off)\n");
 	fprintf(stderr," -o <output file>\n");
+	fprintf(stderr," -vcodec <name>                video encoder: h264 (default), hevc, ffv1, prores, or any FFmpeg encoder name\n");
+	fprintf(stderr," -preset <name>                encoder preset (x264/x265: ultrafast ... veryslow)\n");
+	fprintf(stderr," -crf <n>                      encoder constant rate factor (x264/x265)\n");
+	fprintf(stderr," -b:v <rate>                   video bitrate in bits/sec (k and M suffixes allowed)\n");
+	fprintf(stderr," -encode-threads <n>           encoder threads (default 0, one per CPU core)\n");
+	fprintf(stderr," -encode-queue <n>             frames queued to the encode thread (default 8, 0=encode on the main thread)\n");
     fprintf(stderr,"\n");
     fprintf(stderr,"Note: Video is taken from first input file, and colormap taken from mid scanline of second video.\n");
 }
@@ -638,11 +898,65 @@ static int parse_argv(int argc,char **argv) {
                 output_width = (int)strtoul(a,NULL,0);
                 if (output_width < 32) return 1;
             }
+            else if (!strcmp(a,"decode-ahead")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                decode_ahead = (unsigned int)strtoul(a,NULL,0);
+                if (decode_ahead > 256) {
+                    fprintf(stderr,"Invalid decode ahead\n");
+                    return 1;
+                }
+            }
             else if (!strcmp(a,"i")) {
                 a = argv[i++];
                 if (a == NULL) return 1;
                 new_input_file().path = a;
             }
+            else if (!strcmp(a,"vcodec")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                output_video_codec = a;
+            }
+            else if (!strcmp(a,"preset")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                output_video_preset = a;
+            }
+            else if (!strcmp(a,"crf")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                output_video_crf = a;
+            }
+            else if (!strcmp(a,"b:v")) {
+                char *e = NULL;
+                double br;
+
+                a = argv[i++];
+                if (a == NULL) return 1;
+                br = strtod(a,&e);
+                if (*e == 'k' || *e == 'K') br *= 1000;
+                else if (*e == 'm' || *e == 'M') br *= 1000000;
+                if (br <= 0) {
+                    fprintf(stderr,"Invalid bitrate\n");
+                    return 1;
+                }
+                output_video_bitrate = (long)br;
+            }
+            else if (!strcmp(a,"encode-threads")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                output_video_threads = atoi(a);
+                if (output_video_threads < 0) output_video_threads = 0;
+            }
+            else if (!strcmp(a,"encode-queue")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                output_video_encode_queue = (unsigned int)strtoul(a,NULL,0);
+                if (output_video_encode_queue > 256) {
+                    fprintf(stderr,"Invalid encode queue\n");
+                    return 1;
+                }
+            }
             else if (!strcmp(a,"o")) {
                 a = argv[i++];
                 if (a == NULL) return 1;
@@ -698,6 +1012,42 @@ void process_audio(InputFile &fin) {
     // we don't do anything with audio in this filter
 }
 
+/* the video encode thread and the main thread (audio) both write to the muxer */
+pthread_mutex_t             output_mux_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int output_write_packet(AVPacket *pkt) {
+    int r;
+
+    pthread_mutex_lock(&output_mux_lock);
+    r = av_interleaved_write_frame(output_avfmt,pkt);
+    pthread_mutex_unlock(&output_mux_lock);
+    return r;
+}
+
+/* audio packets up to this many samples come from a pool, larger ones (pad fill) are allocated as before */
+#define OUTPUT_AUDIO_PACKET_POOL_SAMPLES    16384
+
+AVBufferPool*               output_audio_packet_pool = NULL;
+int                         output_audio_packet_pool_size = 0;
+
+int output_audio_new_packet(AVPacket *pkt,int size) {
+    if (output_audio_packet_pool == NULL) {
+        output_audio_packet_pool_size = OUTPUT_AUDIO_PACKET_POOL_SAMPLES * 2 * output_audio_channels;
+        output_audio_packet_pool = av_buffer_pool_init(output_audio_packet_pool_size + AV_INPUT_BUFFER_PADDING_SIZE,NULL);
+        if (output_audio_packet_pool == NULL) return AVERROR(ENOMEM);
+    }
+
+    if (size > output_audio_packet_pool_size)
+        return av_new_packet(pkt,size);
+
+    pkt->buf = av_buffer_pool_get(output_audio_packet_pool);
+    if (pkt->buf == NULL) return AVERROR(ENOMEM);
+    pkt->data = pkt->buf->data;
+    pkt->size = size;
+    memset(pkt->data + size,0,AV_INPUT_BUFFER_PADDING_SIZE);
+    return 0;
+}
+
 void write_out_audio(InputFile &fin) {
     if (fin.audio_dst_data == NULL || fin.audio_dst_data_out_samples == 0)
         return;
@@ -711,7 +1061,7 @@ void write_out_audio(InputFile &fin) {
 
         AVPacket dstpkt;
         av_init_packet(&dstpkt);
-        if (av_new_packet(&dstpkt,out_samples * 2 * output_audio_channels) >= 0) { // NTS: Will reset fields too!
+        if (output_audio_new_packet(&dstpkt,out_samples * 2 * output_audio_channels) >= 0) { // NTS: Will reset fields too!
             assert(dstpkt.data != NULL);
             assert(dstpkt.size >= (out_samples * 2 * output_audio_channels));
             memset(dstpkt.data,0,out_samples * 2 * output_audio_channels);
@@ -720,7 +1070,7 @@ void write_out_audio(InputFile &fin) {
         dstpkt.dts = fin.last_written_sample;
         dstpkt.stream_index = output_avstream_audio->index;
         av_packet_rescale_ts(&dstpkt,output_avstream_audio_codec_context->time_base,output_avstream_audio->time_base);
-        if (av_interleaved_write_frame(output_avfmt,&dstpkt) < 0)
+        if (output_write_packet(&dstpkt) < 0)
             fprintf(stderr,"Failed to write frame\n");
         av_packet_unref(&dstpkt);
 
@@ -732,7 +1082,7 @@ void write_out_audio(InputFile &fin) {
     // that way we can render directly to MP4 our VHS emulation.
     AVPacket dstpkt;
     av_init_packet(&dstpkt);
-    if (av_new_packet(&dstpkt,fin.audio_dst_data_out_samples * 2 * output_audio_channels) >= 0) { // NTS: Will reset fields too!
+    if (output_audio_new_packet(&dstpkt,fin.audio_dst_data_out_samples * 2 * output_audio_channels) >= 0) { // NTS: Will reset fields too!
         assert(dstpkt.data != NULL);
         assert(dstpkt.size >= (fin.audio_dst_data_out_samples * 2 * output_audio_channels));
         memcpy(dstpkt.data,fin.audio_dst_data[0],fin.audio_dst_data_out_samples * 2 * output_audio_channels);
@@ -741,44 +1091,28 @@ void write_out_audio(InputFile &fin) {
     dstpkt.dts = fin.audio_dst_data_out_audio_sample;
     dstpkt.stream_index = output_avstream_audio->index;
     av_packet_rescale_ts(&dstpkt,output_avstream_audio_codec_context->time_base,output_avstream_audio->time_base);
-    if (av_interleaved_write_frame(output_avfmt,&dstpkt) < 0)
+    if (output_write_packet(&dstpkt) < 0)
         fprintf(stderr,"Failed to write frame\n");
     av_packet_unref(&dstpkt);
 
     fin.audio_sample = fin.last_written_sample = fin.audio_dst_data_out_audio_sample + fin.audio_dst_data_out_samples;
 }
 
-void output_frame(AVFrame *frame,unsigned long long field_number) {
-	int gotit = 0;
-	AVPacket pkt;
-
-	av_init_packet(&pkt);
-	if (av_new_packet(&pkt,50000000/8) < 0) {
-		fprintf(stderr,"Failed to alloc vid packet\n");
-		return;
-	}
+/* encoded video from output_video_encode.cpp */
+int output_video_write_packet(AVPacket *pkt) {
+    return output_write_packet(pkt);
+}
 
+void output_frame(AVFrame *frame,unsigned long long field_number) {
 	frame->key_frame = (field_number % (15ULL * 2ULL)) == 0 ? 1 : 0;
 
     {
 		frame->interlaced_frame = 0;
 		frame->pts = field_number;
-		pkt.pts = field_number;
-		pkt.dts = field_number;
 	}
 
 	fprintf(stderr,"\x0D" "Output field %llu ",field_number); fflush(stderr);
-    if (avcodec_encode_video2(output_avstream_video_codec_context,&pkt,frame,&gotit) == 0) {
-        if (gotit) {
-            pkt.stream_index = output_avstream_video->index;
-            av_packet_rescale_ts(&pkt,output_avstream_video_codec_context->time_base,output_avstream_video->time_base);
-
-            if (av_interleaved_write_frame(output_avfmt,&pkt) < 0)
-                fprintf(stderr,"AV write frame failed video\n");
-        }
-    }
-
-	av_packet_unref(&pkt);
+    output_video_encode(frame);
 }
 
 void take_colormap(AVFrame *srcframe,InputFile &inputfile) {
@@ -893,7 +1227,15 @@ int main(int argc,char **argv) {
 		}
 
 		// FIXME: How do I get FFMPEG to write raw YUV 4:2:2?
-		avcodec_get_context_defaults3(output_avstream_video_codec_context,avcodec_find_encoder(AV_CODEC_ID_H264));
+		AVCodec *codec = output_video_encoder();
+		AVDictionary *opts = NULL;
+
+		if (codec == NULL) {
+			fprintf(stderr,"Video encoder '%s' not found\n",output_video_codec.c_str());
+			return 1;
+		}
+
+		avcodec_get_context_defaults3(output_avstream_video_codec_context,codec);
 		output_avstream_video_codec_context->width = output_width;
 		output_avstream_video_codec_context->height = output_height;
 		output_avstream_video_codec_context->sample_aspect_ratio = (AVRational){output_height*4, output_width*3};
@@ -906,10 +1248,14 @@ int main(int argc,char **argv) {
 		if (output_avfmt->oformat->flags & AVFMT_GLOBALHEADER)
 			output_avstream_video_codec_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
-		if (avcodec_open2(output_avstream_video_codec_context,avcodec_find_encoder(AV_CODEC_ID_H264),NULL) < 0) {
+		output_video_encoder_config(output_avstream_video_codec_context,codec,&opts);
+		if (avcodec_open2(output_avstream_video_codec_context,codec,&opts) < 0) {
 			fprintf(stderr,"Output stream cannot open codec\n");
+			av_dict_free(&opts);
 			return 1;
 		}
+		output_video_encoder_unused_options(codec,&opts);
+		fprintf(stderr,"Video encoder: %s\n",codec->name);
 	}
 
 	if (!(output_avfmt->oformat->flags & AVFMT_NOFILE)) {
@@ -924,6 +1270,9 @@ int main(int argc,char **argv) {
 		return 1;
 	}
 
+	/* video encode thread */
+	output_video_encode_start();
+
 	/* soft break on CTRL+C */
 	signal(SIGINT,sigma);
 	signal(SIGHUP,sigma);
@@ -1097,26 +1446,7 @@ int main(int argc,char **argv) {
     }
 
     /* flush encoder delay */
-    do {
-        AVPacket pkt;
-        int gotit=0;
-
-        av_init_packet(&pkt);
-        if (av_new_packet(&pkt,50000000/8) < 0) break;
-
-        if (avcodec_encode_video2(output_avstream_video_codec_context,&pkt,NULL,&gotit) == 0) {
-            if (gotit) {
-                pkt.stream_index = output_avstream_video->index;
-                av_packet_rescale_ts(&pkt,output_avstream_video_codec_context->time_base,output_avstream_video->time_base);
-
-                if (av_interleaved_write_frame(output_avfmt,&pkt) < 0)
-                    fprintf(stderr,"AV write frame failed video\n");
-            }
-        }
-
-        av_packet_unref(&pkt);
-        if (!gotit) break;
-    } while (1);
+    output_video_encode_flush();
 
     /* close output */
     if (output_avstream_video_resampler != NULL) {
@@ -1131,6 +1461,8 @@ int main(int argc,char **argv) {
 	if (output_avfmt != NULL && !(output_avfmt->oformat->flags & AVFMT_NOFILE))
 		avio_closep(&output_avfmt->pb);
 	avformat_free_context(output_avfmt);
+	av_buffer_pool_uninit(&output_video_packet_pool);
+	av_buffer_pool_uninit(&output_audio_packet_pool);
 
     /* close all */
     for (std::vector<InputFile>::iterator i=input_files.begin();i!=input_files.end();i++)
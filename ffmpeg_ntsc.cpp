@@ -15,6 +15,8 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 extern "C" {
 #include <libavutil/opt.h>
@@ -45,6 +47,8 @@ using namespace std;
 #include <vector>
 #include <stdexcept>
 
+#include "output_video_encode.h"
+
 /* return a floating point value specifying what to scale the sample
  * value by to reduce it from full volume to dB decibels */
 double dBFS(double dB)
@@ -104,56 +108,229 @@ public:
 	double			tau;
 };
 
-class HiLoPair {
-public:
-	LowpassFilter		hi,lo;	// highpass, lowpass
+/* Sample type of the YIQ working planes of composite_layer(). Normally int, at the x256 scale RGB_to_YIQ() gives.
+ * Built with -DNTSC_PLANES16 (configure --enable-ntsc-planes16) the planes are int16_t at x16 instead (PLANE_SHIFT
+ * bits less). That leaves room for 8x overshoot before the stages saturate, which composite preemphasis needs: it
+ * multiplies the subcarrier by 1 + -comp-pre (-comp-catv2 can still clip strongly saturated colors). It halves the
+ * memory traffic of every stage, for a little less precision. The stages do their math in int (or double) either
+ * way, samples are only narrowed with plane_sat() when stored. */
+#ifdef NTSC_PLANES16
+typedef int16_t plane_t;
+#define PLANE_SHIFT 4
+#else
+typedef int plane_t;
+#define PLANE_SHIFT 0
+#endif
+
+static inline plane_t plane_sat(const int x) {
+#ifdef NTSC_PLANES16
+	if (x < -32768)
+		return -32768;
+	else if (x > 32767)
+		return 32767;
+#endif
+	return (plane_t)x;
+}
+
+/* PLANE_LANES samples of a plane to and from int lanes */
+#define PLANE_LANES 8
+
+typedef int32_t plane_lanes_t __attribute__((vector_size(sizeof(int32_t) * PLANE_LANES)));
+#ifdef NTSC_PLANES16
+typedef int16_t plane_lanes_s_t __attribute__((vector_size(sizeof(int16_t) * PLANE_LANES)));
+#endif
+
+static inline void plane_lanes_load(plane_lanes_t &r,const plane_t *P) {
+#ifdef NTSC_PLANES16
+	plane_lanes_s_t t;
+
+	memcpy(&t,P,sizeof(t));
+	r = __builtin_convertvector(t,plane_lanes_t);
+#else
+	memcpy(&r,P,sizeof(r));
+#endif
+}
+
+/* store lanes that are known to fit the plane. the saturation is most of the cost of a 16-bit store on SSE2 */
+static inline void plane_lanes_store_fit(plane_t *P,const plane_lanes_t &s) {
+#ifdef NTSC_PLANES16
+	const plane_lanes_s_t t = __builtin_convertvector(s,plane_lanes_s_t);
+
+	memcpy(P,&t,sizeof(t));
+#else
+	memcpy(P,&s,sizeof(s));
+#endif
+}
+
+/* store lanes, saturating like plane_sat() */
+static inline void plane_lanes_store(plane_t *P,const plane_lanes_t &s) {
+#ifdef NTSC_PLANES16
+	const plane_lanes_t lo = s < -32768 ? -32768 : s;
+	const plane_lanes_t hi = lo > 32767 ? 32767 : lo;
+
+	plane_lanes_store_fit(P,hi);
+#else
+	memcpy(P,&s,sizeof(s));
+#endif
+}
+
+/* The same lowpass filter, run on several scanlines at once, one scanline per SIMD lane.
+ * Each lane does exactly the same double precision math as LowpassFilter, so the results match it bit for bit.
+ * The filter is recursive along the scanline (each pixel depends on the previous one) which is why
+ * the vector runs across scanlines instead. GCC maps the vector onto whatever the target has
+ * (4 x SSE2, 2 x AVX, 1 x AVX-512), more lanes than one register so the dependency chains overlap.
+ * NTS: Vectors are passed by reference only, passing them by value changes ABI between targets. */
+#define LOWPASS_LANES 8
+
+typedef double lowpass_lanes_t __attribute__((vector_size(sizeof(double) * LOWPASS_LANES)));
+
+static inline void lowpass_lanes_set(lowpass_lanes_t &r,const double v) {
+	for (unsigned int l=0;l < LOWPASS_LANES;l++) r[l] = v;
+}
+
+#ifdef NTSC_PLANES16
+typedef int16_t lowpass_lanes_s_t __attribute__((vector_size(sizeof(int16_t) * LOWPASS_LANES)));
+typedef int32_t lowpass_lanes_i_t __attribute__((vector_size(sizeof(int32_t) * LOWPASS_LANES)));
+#endif
+
+/* gather pixel x of each lane's scanline */
+static inline void lowpass_lanes_load(lowpass_lanes_t &r,plane_t * const *P,const unsigned int x) {
+#ifdef NTSC_PLANES16
+	lowpass_lanes_s_t t; /* gather 16-bit, then convert all lanes at once */
+
+	for (unsigned int l=0;l < LOWPASS_LANES;l++) t[l] = P[l][x];
+	r = __builtin_convertvector(__builtin_convertvector(t,lowpass_lanes_i_t),lowpass_lanes_t);
+#else
+	for (unsigned int l=0;l < LOWPASS_LANES;l++) r[l] = P[l][x];
+#endif
+}
+
+/* scatter to pixel x of each lane's scanline (truncating, like assigning double to int) */
+static inline void lowpass_lanes_store(plane_t * const *P,const unsigned int x,const lowpass_lanes_t &s) {
+#ifdef NTSC_PLANES16
+	lowpass_lanes_i_t i = __builtin_convertvector(s,lowpass_lanes_i_t);
+
+	i = i < -32768 ? -32768 : i;
+	i = i > 32767 ? 32767 : i;
+
+	const lowpass_lanes_s_t t = __builtin_convertvector(i,lowpass_lanes_s_t);
+
+	for (unsigned int l=0;l < LOWPASS_LANES;l++) P[l][x] = t[l];
+#else
+	for (unsigned int l=0;l < LOWPASS_LANES;l++) P[l][x] = (int)s[l];
+#endif
+}
+
+/* point the lanes at scanlines rows[i...i+LOWPASS_LANES-1]. lanes past the end get the scratch line. */
+static inline void lowpass_lanes_rows(plane_t **P,plane_t * const *rows,const unsigned int count,const unsigned int i,plane_t *scratch) {
+	for (unsigned int l=0;l < LOWPASS_LANES;l++) P[l] = ((i+l) < count) ? rows[i+l] : scratch;
+}
+
+class LowpassFilterLanes {
 public:
-	void setFilter(const double rate/*sample rate of audio*/,const double low_hz,const double high_hz) {
-		lo.setFilter(rate,low_hz);
-		hi.setFilter(rate,high_hz);
+	LowpassFilterLanes() {
+		lowpass_lanes_set(alpha,0);
+		lowpass_lanes_set(prev,0);
+	}
+	void setFilter(const double rate/*sample rate of audio*/,const double hz/*cutoff*/) {
+		LowpassFilter f;
+
+		f.setFilter(rate,hz);
+		lowpass_lanes_set(alpha,f.alpha);
+	}
+	void setAlpha(const double a) {
+		lowpass_lanes_set(alpha,a);
 	}
-	double filter(const double sample) {
-		return hi.highpass(lo.lowpass(sample)); /* first lowpass, then highpass */
+	void resetFilter(const double val=0) {
+		lowpass_lanes_set(prev,val);
+	}
+	void lowpass(lowpass_lanes_t &sample) { /* in place */
+		const lowpass_lanes_t stage1 = sample * alpha;
+		const lowpass_lanes_t stage2 = prev - (prev * alpha); /* NTS: Instead of prev * (1.0 - alpha) */
+		sample = (prev = (stage1 + stage2)); /* prev = stage1+stage2 then return prev */
 	}
+	void highpass(lowpass_lanes_t &sample) { /* in place */
+		const lowpass_lanes_t stage1 = sample * alpha;
+		const lowpass_lanes_t stage2 = prev - (prev * alpha); /* NTS: Instead of prev * (1.0 - alpha) */
+		sample -= (prev = (stage1 + stage2)); /* prev = stage1+stage2 then return (sample - prev) */
+	}
+public:
+	lowpass_lanes_t		alpha;
+	lowpass_lanes_t		prev;
 };
 
-class HiLoPass : public vector<HiLoPair> { // all passes, one sample of one channel
-public:
-	HiLoPass() : vector() { }
+/* Audio is processed in blocks of up to AUDIO_BLOCK sample periods, with the channels in the lanes of a vector
+ * (stereo doubles fill one SSE2 register). composite_audio_process() converts the interleaved 16-bit samples to
+ * lanes once, runs each filter over the whole block with its state held in a register, and converts back once.
+ * The arithmetic is that of LowpassFilter, in the same order, so each channel comes out as it did one sample at
+ * a time. */
+#define AUDIO_LANES 2           /* output_audio_channels is 1 or 2 */
+#define AUDIO_BLOCK 256
+#define AUDIO_HILO_PASSES 6     /* most passes HiLoComboPass can run */
+
+typedef double audio_lanes_t __attribute__((vector_size(sizeof(double) * AUDIO_LANES)));
+
+static inline void audio_lanes_set(audio_lanes_t &r,const double v) {
+	for (unsigned int l=0;l < AUDIO_LANES;l++) r[l] = v;
+}
+
+class LowpassFilterAudioLanes {
 public:
-	void setFilter(const double rate/*sample rate of audio*/,const double low_hz,const double high_hz) {
-		for (size_t i=0;i < size();i++) (*this)[i].setFilter(rate,low_hz,high_hz);
+	LowpassFilterAudioLanes() {
+		audio_lanes_set(alpha,0);
+		audio_lanes_set(prev,0);
 	}
-	double filter(double sample) {
-		for (size_t i=0;i < size();i++) sample = (*this)[i].lo.lowpass(sample);
-		for (size_t i=0;i < size();i++) sample = (*this)[i].hi.highpass(sample);
-		return sample;
+	void setFilter(const double rate/*sample rate of audio*/,const double hz/*cutoff*/) {
+		LowpassFilter f;
+
+		f.setFilter(rate,hz);
+		audio_lanes_set(alpha,f.alpha);
 	}
-	void init(const unsigned int passes) {
-		clear();
-		resize(passes);
-		assert(size() >= passes);
+	void resetFilter(const double val=0) {
+		audio_lanes_set(prev,val);
 	}
-};
+	void lowpass(audio_lanes_t *s,const unsigned int n) { /* in place, n sample periods */
+		audio_lanes_t p = prev;
 
-class HiLoSample : public vector<HiLoPass> { // all passes, all channels of one sample period
-public:
-	HiLoSample() : vector() { }
-public:
-	void init(const unsigned int channels,const unsigned int passes) {
-		clear();
-		resize(channels);
-		assert(size() >= channels);
-		for (size_t i=0;i < size();i++) (*this)[i].init(passes);
+		for (unsigned int i=0;i < n;i++) {
+			const audio_lanes_t stage1 = s[i] * alpha;
+			const audio_lanes_t stage2 = p - (p * alpha); /* NTS: Instead of prev * (1.0 - alpha) */
+			s[i] = p = stage1 + stage2;
+		}
+
+		prev = p;
+	}
+	void highpass(audio_lanes_t *s,const unsigned int n) { /* in place, n sample periods */
+		audio_lanes_t p = prev;
+
+		for (unsigned int i=0;i < n;i++) {
+			const audio_lanes_t stage1 = s[i] * alpha;
+			const audio_lanes_t stage2 = p - (p * alpha);
+			s[i] -= (p = stage1 + stage2);
+		}
+
+		prev = p;
 	}
-	void setFilter(const double rate/*sample rate of audio*/,const double low_hz,const double high_hz) {
-		for (size_t i=0;i < size();i++) (*this)[i].setFilter(rate,low_hz,high_hz);
+	void highboost(audio_lanes_t *s,const unsigned int n,const double amount) { /* s += highpass(s) * amount */
+		audio_lanes_t p = prev;
+
+		for (unsigned int i=0;i < n;i++) {
+			const audio_lanes_t stage1 = s[i] * alpha;
+			const audio_lanes_t stage2 = p - (p * alpha);
+			p = stage1 + stage2;
+			s[i] += (s[i] - p) * amount;
+		}
+
+		prev = p;
 	}
+public:
+	audio_lanes_t		alpha;
+	audio_lanes_t		prev;
 };
 
 class HiLoComboPass {
 public:
-	HiLoComboPass() : passes(0), channels(0), rate(0), low_cutoff(0), high_cutoff(0) {
+	HiLoComboPass() : rate(0), passes(0), channels(0), low_cutoff(0), high_cutoff(0), ready(false) {
 	}
 	~HiLoComboPass() {
 		clear();
@@ -184,13 +361,50 @@ public:
 		}
 	}
 	void clear() {
-		audiostate.clear();
+		ready = false;
 	}
 	void init() {
 		clear();
 		if (channels == 0 || passes == 0 || rate == 0 || low_cutoff == 0 || high_cutoff == 0) return;
-		audiostate.init(channels,passes);
-		audiostate.setFilter(rate,low_cutoff,high_cutoff);
+		if (channels > AUDIO_LANES || passes > AUDIO_HILO_PASSES) return;
+		/* the passes not used let the sample through unchanged: a lowpass with alpha 1, a highpass with alpha 0 */
+		for (size_t i=0;i < AUDIO_HILO_PASSES;i++) {
+			lo[i].setFilter(rate,low_cutoff);
+			hi[i].setFilter(rate,high_cutoff);
+			if (i >= passes) {
+				audio_lanes_set(lo[i].alpha,1.0);
+				audio_lanes_set(hi[i].alpha,0.0);
+			}
+			lo[i].resetFilter();
+			hi[i].resetFilter();
+		}
+		ready = true;
+	}
+	void filter(audio_lanes_t *s,const unsigned int n) { /* in place, n sample periods */
+		/* all passes in one loop, first the lowpasses, then the highpasses. the state of every pass stays in a
+		 * register and the passes of neighbouring samples overlap, where pass after pass over the block would
+		 * wait on each pass's own chain of multiply and add */
+		audio_lanes_t lp[AUDIO_HILO_PASSES],hp[AUDIO_HILO_PASSES];
+		unsigned int i,k;
+
+		for (k=0;k < AUDIO_HILO_PASSES;k++) {
+			lp[k] = lo[k].prev;
+			hp[k] = hi[k].prev;
+		}
+		for (i=0;i < n;i++) {
+			audio_lanes_t v = s[i];
+
+			for (k=0;k < AUDIO_HILO_PASSES;k++)
+				v = lp[k] = (v * lo[k].alpha) + (lp[k] - (lp[k] * lo[k].alpha));
+			for (k=0;k < AUDIO_HILO_PASSES;k++)
+				v -= (hp[k] = (v * hi[k].alpha) + (hp[k] - (hp[k] * hi[k].alpha)));
+
+			s[i] = v;
+		}
+		for (k=0;k < AUDIO_HILO_PASSES;k++) {
+			lo[k].prev = lp[k];
+			hi[k].prev = hp[k];
+		}
 	}
 public:
 	double		rate;
@@ -198,7 +412,9 @@ public:
 	size_t		channels;
 	double		low_cutoff;
 	double		high_cutoff;
-	HiLoSample	audiostate;
+	bool		ready;
+	LowpassFilterAudioLanes lo[AUDIO_HILO_PASSES];	// one pole stages, all channels in the lanes
+	LowpassFilterAudioLanes hi[AUDIO_HILO_PASSES];
 };
 
 bool            use_422_colorspace = false; // I would default this to true but Adobe Premiere Pro apparently can't handle 4:2:2 H.264 >:(
@@ -211,6 +427,22 @@ int		output_audio_channels = 2;	// VHS stereo (set to 1 for mono)
 int		output_audio_rate = 44100;	// VHS Hi-Fi goes up to 20KHz
 int     video_scanline_phase_shift = 180;
 int     video_scanline_phase_shift_offset = 0;
+int     video_threads = 0;          // worker threads for video emulation (0 = one per CPU core)
+bool    video_pipeline = true;      // run all per-scanline stages on a few scanlines at a time, instead of one pass over the field per stage
+bool    video_direct_yuv = true;    // write 4:2:2 / 4:2:0 straight from YIQ into the encoder frame, instead of ARGB + swscale
+bool    video_yuv_ingest = true;    // keep decoded 4:2:0 / 4:2:2 / 4:4:4 planes and convert to YIQ directly, instead of swscale to ARGB
+unsigned int video_chroma_shift = 0; // I/Q at 1/(1 << n) of the width from Y/C separation on (-chroma-res)
+unsigned int video_front_cache = 6; // front half cache entries (0 = off), see front_cache_plan(). 6 keeps both fields of a still at all 4 phases
+unsigned long long video_frame_serial_last = 0; // last serial given to a source frame (for the front half cache)
+bool    video_emulate_per_layer = false; // several -i: emulate every input over the last, instead of layering them and emulating once
+bool    debug_alloc = false;        // report heap allocations (operator new) per output field
+unsigned int decode_ahead = 8;      // frames each input decodes and scales ahead on its own thread (0 = decode on the main thread)
+std::string     output_video_codec = "h264";        // -vcodec, see output_video_encoder()
+std::string     output_video_preset;                // -preset, passed to the encoder if it has one
+std::string     output_video_crf;                   // -crf, passed to the encoder if it has one
+long            output_video_bitrate = 0;           // -b:v (0 = encoder default)
+int             output_video_threads = 0;           // encoder threads (0 = one per CPU core)
+unsigned int    output_video_encode_queue = 8;      // frames queued to the encode thread (0 = encode on the main thread)
 
 #define RGBTRIPLET(r,g,b)       (((uint32_t)(r) << (uint32_t)16) + ((uint32_t)(g) << (uint32_t)8) + ((uint32_t)(b) << (uint32_t)0))
 
@@ -225,6 +457,21 @@ size_t                      output_avstream_video_frame_delay = 1;
 size_t                      output_avstream_video_frame_index = 0;
 struct SwsContext*          output_avstream_video_resampler = NULL;
 
+/* decoded pixel formats that composite_layer() can take as is (Y'CbCr planar, 8 bits per sample) */
+static bool yuv_ingest_format(const int fmt,unsigned int &hshift,unsigned int &vshift,bool &full_range) {
+    switch (fmt) {
+        case AV_PIX_FMT_YUV420P:    hshift = 1; vshift = 1; full_range = false; return true;
+        case AV_PIX_FMT_YUV422P:    hshift = 1; vshift = 0; full_range = false; return true;
+        case AV_PIX_FMT_YUV444P:    hshift = 0; vshift = 0; full_range = false; return true;
+        case AV_PIX_FMT_YUVJ420P:   hshift = 1; vshift = 1; full_range = true;  return true;
+        case AV_PIX_FMT_YUVJ422P:   hshift = 1; vshift = 0; full_range = true;  return true;
+        case AV_PIX_FMT_YUVJ444P:   hshift = 0; vshift = 0; full_range = true;  return true;
+        default:                    break;
+    }
+
+    return false;
+}
+
 class InputFile {
 public:
     InputFile() {
@@ -237,8 +484,19 @@ public:
         input_avstream_video = NULL;
         input_avstream_video_frame = NULL;
         input_avstream_video_frame_rgb = NULL;
+        input_avstream_video_frame_yuv = NULL;
         input_avstream_video_resampler = NULL;
+        input_avstream_video_yuv_scaler = NULL;
         input_avstream_video_codec_context = NULL;
+        input_video_yuv = false;
+        video_frame_serial = 0;
+        decoder = NULL;
+        decode_ring = NULL;
+        decode_ring_size = 0;
+        decode_head = 0;
+        decode_quit = false;
+        pending_rgb = pending_yuv = NULL;
+        pending_video = pending_video_yuv = false;
         next_pts = next_dts = -1LL;
         avpkt_valid = false;
         eof_stream = false;
@@ -296,6 +554,8 @@ public:
                     }
                     else if (isctx->codec_type == AVMEDIA_TYPE_VIDEO) {
                         if (input_avstream_video == NULL && vc == 0) {
+                            isctx->thread_count = 0; // auto
+                            isctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
                             if (avcodec_open2(isctx,avcodec_find_decoder(isctx->codec_id),NULL) >= 0) {
                                 input_avstream_video = is;
                                 input_avstream_video_codec_context = isctx;
@@ -358,6 +618,11 @@ public:
         input_avstream_video_resampler_format = AV_PIX_FMT_NONE;
         input_avstream_video_resampler_height = -1;
         input_avstream_video_resampler_width = -1;
+        input_avstream_video_yuv_scaler_format = AV_PIX_FMT_NONE;
+        input_avstream_video_yuv_scaler_height = -1;
+        input_avstream_video_yuv_scaler_width = -1;
+        input_avstream_video_yuv_scaler_fields = false;
+        input_video_yuv = false;
         last_written_sample = 0;
         audio_dst_data_out_audio_sample = 0;
         audio_sample = 0;
@@ -378,7 +643,234 @@ public:
         next_pts = next_dts = -1LL;
         return (input_avfmt != NULL);
     }
+    /* decode ahead. the decoder is a copy of this InputFile that takes over the demuxer, decoders and scalers, and
+     * runs decode_packet() and frame_copy_scale() on its own thread into a ring of slots. the ring is single producer,
+     * single consumer, the two semaphores count the free and filled slots. this InputFile keeps only what the field
+     * loop looks at, and next_packet() / frame_copy_scale() swap frames and buffers with the slots instead. */
+    struct DecodeSlot {
+        bool                got_audio,got_video,eof;
+        AVFrame*            video;              // decoded frame (timestamps, flags)
+        AVFrame*            rgb;                // scaled ARGB
+        AVFrame*            yuv;                // or native YUV ingest
+        bool                video_yuv;
+        uint8_t**           audio_dst_data;
+        int                 audio_dst_data_alloc_samples;
+        int                 audio_dst_data_linesize;
+        int                 audio_dst_data_samples;
+        int                 audio_dst_data_out_samples;
+        unsigned long long  audio_dst_data_out_audio_sample;
+    };
+    void swap_audio(DecodeSlot &s) {
+        std::swap(audio_dst_data,s.audio_dst_data);
+        std::swap(audio_dst_data_alloc_samples,s.audio_dst_data_alloc_samples);
+        std::swap(audio_dst_data_linesize,s.audio_dst_data_linesize);
+        audio_dst_data_samples = s.audio_dst_data_samples;
+        audio_dst_data_out_samples = s.audio_dst_data_out_samples;
+        audio_dst_data_out_audio_sample = s.audio_dst_data_out_audio_sample;
+    }
+    static void *decode_ahead_thread(void *arg) {
+        ((InputFile*)arg)->decode_ahead_loop();
+        return NULL;
+    }
+    /* decoder thread (runs on the field loop's InputFile, works on the decoder) */
+    void decode_ahead_loop(void) {
+        unsigned int idx = 0;
+        bool done = false;
+
+        do {
+            while (sem_wait(&decode_free) != 0);
+            if (decode_quit) break;
+
+            DecodeSlot &s = decode_ring[idx];
+            if ((++idx) >= decode_ring_size) idx = 0;
+
+            decoder->decode_packet();
+            s.got_audio = decoder->got_audio;
+            s.got_video = decoder->got_video;
+            s.eof = done = decoder->eof;
+
+            if (s.got_video) {
+                decoder->frame_copy_scale();
+                std::swap(s.video,decoder->input_avstream_video_frame);
+                std::swap(s.rgb,decoder->input_avstream_video_frame_rgb);
+                std::swap(s.yuv,decoder->input_avstream_video_frame_yuv);
+                s.video_yuv = decoder->input_video_yuv;
+            }
+            if (s.got_audio) {
+                decoder->swap_audio(s);
+                s.audio_dst_data_samples = decoder->audio_dst_data_samples;
+                s.audio_dst_data_out_samples = decoder->audio_dst_data_out_samples;
+                s.audio_dst_data_out_audio_sample = decoder->audio_dst_data_out_audio_sample;
+            }
+
+            sem_post(&decode_used);
+        } while (!done);
+    }
+    /* the slots' frames and buffers, and the ring */
+    void free_decode_ring(void) {
+        unsigned int i;
+
+        for (i=0;i < decode_ring_size;i++) {
+            DecodeSlot &s = decode_ring[i];
+
+            if (s.video != NULL) av_frame_free(&s.video);
+            if (s.rgb != NULL) av_frame_free(&s.rgb);
+            if (s.yuv != NULL) av_frame_free(&s.yuv);
+            if (s.audio_dst_data != NULL) {
+                av_freep(&s.audio_dst_data[0]);
+                av_freep(&s.audio_dst_data);
+            }
+        }
+        delete[] decode_ring;
+        decode_ring = NULL;
+        decode_ring_size = 0;
+    }
+    bool start_decode_ahead(void) {
+        AVFrame *video_frame = NULL;
+        bool ok = true;
+        unsigned int i;
+
+        if (decode_ahead == 0 || input_avfmt == NULL || eof || decoder != NULL)
+            return false;
+
+        /* everything that can fail first, while the demuxer is still ours to decode from. if it does, decode
+         * on the main thread from now on instead of trying again on every packet */
+        decode_ring = new DecodeSlot[decode_ahead];
+        decode_ring_size = decode_ahead;
+        decode_head = 0;
+        decode_quit = false;
+        for (i=0;i < decode_ring_size;i++) {
+            DecodeSlot &s = decode_ring[i];
+
+            s.got_audio = s.got_video = s.eof = s.video_yuv = false;
+            s.video = av_frame_alloc();
+            s.rgb = s.yuv = NULL;
+            s.audio_dst_data = NULL;
+            s.audio_dst_data_alloc_samples = 0;
+            s.audio_dst_data_linesize = 0;
+            s.audio_dst_data_samples = 0;
+            s.audio_dst_data_out_samples = 0;
+            s.audio_dst_data_out_audio_sample = 0;
+            if (s.video == NULL) ok = false;
+        }
+        if (ok && input_avstream_video_frame != NULL && (video_frame = av_frame_alloc()) == NULL)
+            ok = false;
+        if (!ok) {
+            fprintf(stderr,"Failed to alloc video frame, decoding on the main thread\n");
+            free_decode_ring();
+            decode_ahead = 0;
+            return false;
+        }
+
+        /* hand the demuxer, decoders and scalers to the decoder. the current frames stay here, the decoder
+         * makes its own scaled frames as needed */
+        decoder = new InputFile(*this);
+        decoder->decoder = NULL;
+        decoder->decode_ring = NULL;
+        decoder->pending_rgb = decoder->pending_yuv = NULL;
+        decoder->input_avstream_video_frame_rgb = NULL;
+        decoder->input_avstream_video_frame_yuv = NULL;
+
+        input_avfmt = NULL;
+        input_avstream_audio_codec_context = NULL;
+        input_avstream_video_codec_context = NULL;
+        input_avstream_audio_frame = NULL;
+        input_avstream_audio_resampler = NULL;
+        input_avstream_video_resampler = NULL;
+        input_avstream_video_yuv_scaler = NULL;
+        audio_dst_data = NULL;
+        audio_dst_data_alloc_samples = 0;
+        avpkt_valid = false;
+        if (input_avstream_video_frame != NULL)
+            input_avstream_video_frame = video_frame;
+
+        sem_init(&decode_free,0,decode_ring_size);
+        sem_init(&decode_used,0,0);
+        if (pthread_create(&decode_thread,NULL,decode_ahead_thread,this) != 0) {
+            fprintf(stderr,"Failed to start decode thread, decoding on the main thread\n");
+            sem_destroy(&decode_free);
+            sem_destroy(&decode_used);
+            decode_quit = true; // nothing to join
+            return true;
+        }
+
+        return true;
+    }
+    void stop_decode_ahead(void) {
+        if (decoder == NULL) return;
+
+        if (!decode_quit) {
+            decode_quit = true;
+            sem_post(&decode_free);
+            pthread_join(decode_thread,NULL);
+            sem_destroy(&decode_free);
+            sem_destroy(&decode_used);
+        }
+
+        decoder->close_input();
+        delete decoder;
+        decoder = NULL;
+        free_decode_ring();
+
+        if (pending_rgb != NULL) av_frame_free(&pending_rgb);
+        if (pending_yuv != NULL) av_frame_free(&pending_yuv);
+        pending_video = false;
+    }
     bool next_packet(void) {
+        if (decoder == NULL && !start_decode_ahead())
+            return decode_packet();
+        if (eof) return false;
+
+        if (decode_quit) { // the thread did not start, decode here
+            decoder->decode_packet();
+            got_audio = decoder->got_audio;
+            got_video = decoder->got_video;
+            eof = decoder->eof;
+            if (got_video) {
+                decoder->frame_copy_scale();
+                std::swap(pending_rgb,decoder->input_avstream_video_frame_rgb);
+                std::swap(pending_yuv,decoder->input_avstream_video_frame_yuv);
+                std::swap(input_avstream_video_frame,decoder->input_avstream_video_frame);
+                pending_video_yuv = decoder->input_video_yuv;
+                pending_video = true;
+            }
+            if (got_audio) {
+                DecodeSlot s;
+
+                s.audio_dst_data = audio_dst_data;
+                s.audio_dst_data_alloc_samples = audio_dst_data_alloc_samples;
+                s.audio_dst_data_linesize = audio_dst_data_linesize;
+                decoder->swap_audio(s);
+                s.audio_dst_data_samples = decoder->audio_dst_data_samples;
+                s.audio_dst_data_out_samples = decoder->audio_dst_data_out_samples;
+                s.audio_dst_data_out_audio_sample = decoder->audio_dst_data_out_audio_sample;
+                swap_audio(s);
+            }
+            return true;
+        }
+
+        while (sem_wait(&decode_used) != 0);
+
+        DecodeSlot &s = decode_ring[decode_head];
+        if ((++decode_head) >= decode_ring_size) decode_head = 0;
+
+        got_audio = s.got_audio;
+        got_video = s.got_video;
+        eof = s.eof;
+        if (s.got_video) {
+            std::swap(s.video,input_avstream_video_frame);
+            std::swap(s.rgb,pending_rgb);
+            std::swap(s.yuv,pending_yuv);
+            pending_video_yuv = s.video_yuv;
+            pending_video = true;
+        }
+        if (s.got_audio)
+            swap_audio(s);
+
+        sem_post(&decode_free);
+        return true;
+    }
+    bool decode_packet(void) {
         if (eof) return false;
         if (input_avfmt == NULL) return false;
 
@@ -540,7 +1032,153 @@ public:
             }
         }
     }
+    /* frame_copy_scale() for the field loop. the frame gets a new serial, see front_cache_plan() */
+    void video_frame_next(void) {
+        frame_copy_scale();
+        video_frame_serial = ++video_frame_serial_last;
+    }
+    /* the frame composite_layer() should read: the decoded Y'CbCr planes, or the ARGB conversion */
+    AVFrame *video_frame(void) {
+        return input_video_yuv ? input_avstream_video_frame_yuv : input_avstream_video_frame_rgb;
+    }
+    /* native YUV ingest. planar 8-bit Y'CbCr at the output size is referenced as is, else only scaled
+     * (never color converted) to the output size. interlaced sources are scaled one field at a time. */
+    bool frame_copy_yuv(void) {
+        unsigned int hshift,vshift;
+        bool full_range;
+
+        if (!yuv_ingest_format(input_avstream_video_frame->format,hshift,vshift,full_range))
+            return false;
+
+        if (input_avstream_video_frame_yuv == NULL) {
+            input_avstream_video_frame_yuv = av_frame_alloc();
+            if (input_avstream_video_frame_yuv == NULL) {
+                fprintf(stderr,"Failed to alloc video frame\n");
+                return false;
+            }
+        }
+
+        if (input_avstream_video_frame->width == output_width && input_avstream_video_frame->height == output_height) {
+            /* no scaling needed. decoder frames are reference counted, this only copies if the decoder's aren't */
+            av_frame_unref(input_avstream_video_frame_yuv);
+            if (av_frame_ref(input_avstream_video_frame_yuv,input_avstream_video_frame) < 0) {
+                fprintf(stderr,"Failed to ref video frame\n");
+                return false;
+            }
+
+            return true;
+        }
+
+        /* field by field if interlaced, so that the fields do not bleed into each other.
+         * 4:2:0 chroma then needs the field height to be a multiple of 2 as well. */
+        const bool fields = input_avstream_video_frame->interlaced_frame &&
+            (input_avstream_video_frame->height % 4) == 0 && (output_height % 4) == 0;
+        const unsigned int passes = fields ? 2 : 1;
+
+        if (input_avstream_video_yuv_scaler != NULL) { // pixel format change or width/height change = free resampler and reinit
+            if (input_avstream_video_yuv_scaler_format != input_avstream_video_frame->format ||
+                    input_avstream_video_yuv_scaler_width != input_avstream_video_frame->width ||
+                    input_avstream_video_yuv_scaler_height != input_avstream_video_frame->height ||
+                    input_avstream_video_yuv_scaler_fields != fields) {
+                sws_freeContext(input_avstream_video_yuv_scaler);
+                input_avstream_video_yuv_scaler = NULL;
+            }
+        }
+
+        if (input_avstream_video_yuv_scaler == NULL) {
+            input_avstream_video_yuv_scaler = sws_getContext(
+                    // source
+                    input_avstream_video_frame->width,
+                    input_avstream_video_frame->height / passes,
+                    (AVPixelFormat)input_avstream_video_frame->format,
+                    // dest
+                    output_width,
+                    output_height / passes,
+                    (AVPixelFormat)input_avstream_video_frame->format,
+                    // opt
+                    SWS_BILINEAR, NULL, NULL, NULL);
+
+            if (input_avstream_video_yuv_scaler != NULL) {
+                fprintf(stderr,"sws_getContext new YUV scaler context\n");
+                input_avstream_video_yuv_scaler_format = (AVPixelFormat)input_avstream_video_frame->format;
+                input_avstream_video_yuv_scaler_width = input_avstream_video_frame->width;
+                input_avstream_video_yuv_scaler_height = input_avstream_video_frame->height;
+                input_avstream_video_yuv_scaler_fields = fields;
+            }
+            else {
+                fprintf(stderr,"sws_getContext fail\n");
+                return false;
+            }
+        }
+
+        /* the frame may still be a reference to a decoder frame from a previous unscaled frame (make it writable) */
+        if (input_avstream_video_frame_yuv->data[0] == NULL ||
+                input_avstream_video_frame_yuv->format != input_avstream_video_frame->format ||
+                input_avstream_video_frame_yuv->width != output_width ||
+                input_avstream_video_frame_yuv->height != output_height) {
+            av_frame_unref(input_avstream_video_frame_yuv);
+            input_avstream_video_frame_yuv->format = input_avstream_video_frame->format;
+            input_avstream_video_frame_yuv->width = output_width;
+            input_avstream_video_frame_yuv->height = output_height;
+            if (av_frame_get_buffer(input_avstream_video_frame_yuv,64) < 0) {
+                fprintf(stderr,"Failed to alloc YUV frame\n");
+                return false;
+            }
+        }
+        else if (av_frame_make_writable(input_avstream_video_frame_yuv) < 0) {
+            fprintf(stderr,"Failed to alloc YUV frame\n");
+            return false;
+        }
+
+        input_avstream_video_frame_yuv->pts = input_avstream_video_frame->pts;
+        input_avstream_video_frame_yuv->pkt_pts = input_avstream_video_frame->pkt_pts;
+        input_avstream_video_frame_yuv->pkt_dts = input_avstream_video_frame->pkt_dts;
+        input_avstream_video_frame_yuv->top_field_first = input_avstream_video_frame->top_field_first;
+        input_avstream_video_frame_yuv->interlaced_frame = input_avstream_video_frame->interlaced_frame;
+
+        for (unsigned int field=0;field < passes;field++) {
+            const uint8_t *src[4] = { NULL, NULL, NULL, NULL };
+            uint8_t *dst[4] = { NULL, NULL, NULL, NULL };
+            int srcstride[4] = { 0, 0, 0, 0 };
+            int dststride[4] = { 0, 0, 0, 0 };
+
+            for (unsigned int p=0;p < 3;p++) {
+                src[p] = input_avstream_video_frame->data[p] + (input_avstream_video_frame->linesize[p] * field);
+                srcstride[p] = input_avstream_video_frame->linesize[p] * passes;
+                dst[p] = input_avstream_video_frame_yuv->data[p] + (input_avstream_video_frame_yuv->linesize[p] * field);
+                dststride[p] = input_avstream_video_frame_yuv->linesize[p] * passes;
+            }
+
+            if (sws_scale(input_avstream_video_yuv_scaler,
+                        // source
+                        src,srcstride,
+                        0,input_avstream_video_frame->height / passes,
+                        // dest
+                        dst,dststride) <= 0)
+                fprintf(stderr,"WARNING: sws_scale failed\n");
+        }
+
+        return true;
+    }
     void frame_copy_scale(void) {
+        if (decoder != NULL) { // decode ahead: the decoder thread already scaled it
+            if (pending_video) {
+                std::swap(input_avstream_video_frame_rgb,pending_rgb);
+                std::swap(input_avstream_video_frame_yuv,pending_yuv);
+                input_video_yuv = pending_video_yuv;
+                pending_video = false;
+            }
+            return;
+        }
+
+        if (video_yuv_ingest) {
+            input_video_yuv = frame_copy_yuv();
+            if (input_video_yuv) return;
+        }
+        else {
+            input_video_yuv = false;
+        }
+
         if (input_avstream_video_frame_rgb == NULL) {
             fprintf(stderr,"New input frame\n");
             input_avstream_video_frame_rgb = av_frame_alloc();
@@ -637,6 +1275,7 @@ public:
         got_video = false;
     }
     void close_input(void) {
+        stop_decode_ahead();
         eof = true;
         avpkt_release();
         if (input_avstream_audio_codec_context != NULL) {
@@ -656,6 +1295,9 @@ public:
             av_frame_free(&input_avstream_video_frame);
         if (input_avstream_video_frame_rgb != NULL)
             av_frame_free(&input_avstream_video_frame_rgb);
+        if (input_avstream_video_frame_yuv != NULL)
+            av_frame_free(&input_avstream_video_frame_yuv);
+        input_video_yuv = false;
 
         if (input_avstream_audio_resampler != NULL)
             swr_free(&input_avstream_audio_resampler);
@@ -663,6 +1305,10 @@ public:
             sws_freeContext(input_avstream_video_resampler);
             input_avstream_video_resampler = NULL;
         }
+        if (input_avstream_video_yuv_scaler != NULL) {
+            sws_freeContext(input_avstream_video_yuv_scaler);
+            input_avstream_video_yuv_scaler = NULL;
+        }
 
 		if (audio_dst_data != NULL) {
 			av_freep(&audio_dst_data[0]); // NTS: Why??
@@ -699,17 +1345,36 @@ public:
     AVCodecContext*         input_avstream_video_codec_context; // do not free
     AVFrame*		        input_avstream_video_frame;
     AVFrame*		        input_avstream_video_frame_rgb;
+    AVFrame*		        input_avstream_video_frame_yuv;     // native YUV ingest (decoder frame ref, or scaled copy)
+    bool                    input_video_yuv;                    // last frame_copy_scale() went to input_avstream_video_frame_yuv
+    unsigned long long      video_frame_serial;                 // of the frame video_frame() returns (0 = none yet)
     struct SwrContext*      input_avstream_audio_resampler;
     struct SwsContext*	    input_avstream_video_resampler;
     AVPixelFormat           input_avstream_video_resampler_format;
     int                     input_avstream_video_resampler_height;
     int                     input_avstream_video_resampler_width;
+    struct SwsContext*	    input_avstream_video_yuv_scaler;
+    AVPixelFormat           input_avstream_video_yuv_scaler_format;
+    int                     input_avstream_video_yuv_scaler_height;
+    int                     input_avstream_video_yuv_scaler_width;
+    bool                    input_avstream_video_yuv_scaler_fields;
     signed long long        next_pts;
     signed long long        next_dts;
     AVPacket                avpkt;
     bool                    avpkt_valid;
     double                  adj_time;
     double                  t,pt;
+    InputFile*              decoder;                            // decode ahead (see start_decode_ahead())
+    DecodeSlot*             decode_ring;
+    unsigned int            decode_ring_size;
+    unsigned int            decode_head;
+    volatile bool           decode_quit;
+    pthread_t               decode_thread;
+    sem_t                   decode_free,decode_used;
+    AVFrame*                pending_rgb;                        // scaled frame taken from the ring, shown at frame_copy_scale()
+    AVFrame*                pending_yuv;
+    bool                    pending_video;
+    bool                    pending_video_yuv;
 };
 
 std::vector<InputFile>      input_files;
@@ -749,8 +1414,8 @@ volatile int DIE = 0;
 HiLoComboPass		audio_hilopass;
 
 // preemphsis emuluation
-LowpassFilter		audio_linear_preemphasis_pre[2];
-LowpassFilter		audio_linear_preemphasis_post[2];
+LowpassFilterAudioLanes	audio_linear_preemphasis_pre;	// one per channel, in the lanes
+LowpassFilterAudioLanes	audio_linear_preemphasis_post;
 
 double			composite_preemphasis = 0;	// analog artifacts related to anything that affects the raw composite signal i.e. CATV modulation
 double			composite_preemphasis_cut = 1000000;
@@ -833,6 +1498,12 @@ static void help(const char *arg0) {
 	fprintf(stderr,"%s [options]\n",arg0);
 	fprintf(stderr," -i <input file>               you can specify more than one input file, in order of layering\n");
 	fprintf(stderr," -o <output file>\n");
+	fprintf(stderr," -vcodec <name>            Video encoder: h264 (default), hevc, ffv1, prores, or any FFmpeg encoder name\n");
+	fprintf(stderr," -preset <name>            Encoder preset (x264/x265: ultrafast ... veryslow)\n");
+	fprintf(stderr," -crf <n>                  Encoder constant rate factor (x264/x265)\n");
+	fprintf(stderr," -b:v <rate>               Video bitrate in bits/sec (k and M suffixes allowed)\n");
+	fprintf(stderr," -encode-threads <n>       Encoder threads (default 0, one per CPU core)\n");
+	fprintf(stderr," -encode-queue <n>         Frames queued to the encode thread (default 8, 0=encode on the main thread)\n");
     fprintf(stderr," -d <n>                        Video delay buffer (n frames)\n");
 	fprintf(stderr," -tvstd <pal|ntsc>\n");
 	fprintf(stderr," -vhs                      Emulation of VHS artifacts\n");
@@ -845,6 +1516,7 @@ static void help(const char *arg0) {
 	fprintf(stderr," -subcarrier-amp <0...100> Subcarrier amplitude (0 to 100 percent of luma)\n");
 	fprintf(stderr," -noise <0..100>           Noise amplitude\n");
 	fprintf(stderr," -chroma-noise <0..100>    Chroma noise amplitude\n");
+	fprintf(stderr," -seed <n>                 Seed for all noise, the same seed gives the same noise (default 0)\n");
 	fprintf(stderr," -audio-hiss <-120..0>     Audio hiss in decibels (0=100%)\n");
 	fprintf(stderr," -vhs-linear-video-crosstalk <x> Emulate video crosstalk in audio. Loudness in dBFS (0=100%)\n");
 	fprintf(stderr," -chroma-phase-noise <x>   Chroma phase noise (0...100)\n");
@@ -880,13 +1552,184 @@ static void help(const char *arg0) {
     fprintf(stderr," -out-composite-lowpass-lite <n> Enable/disable chroma lowpass on composite out (lite)\n");
     fprintf(stderr," -bkey-feedback <n>        Black key feedback (black level <= N)\n");
     fprintf(stderr," -comp-phase <n>           NTSC subcarrier phase per scanline (0, 90, 180, or 270)\n");
+    fprintf(stderr," -threads <n>              Video emulation threads (default one per CPU core)\n");
+    fprintf(stderr," -pipeline <n>             Run video emulation a few scanlines at a time (default 1, 0=one pass per stage)\n");
+    fprintf(stderr," -direct-yuv <n>           Convert YIQ directly to the codec's 4:2:2/4:2:0 (default 1, 0=ARGB + swscale)\n");
+    fprintf(stderr," -yuv-ingest <n>           Convert decoded 4:2:0/4:2:2/4:4:4 directly to YIQ (default 1, 0=swscale to ARGB)\n");
+    fprintf(stderr," -chroma-res <1|2|4>       Process chroma at 1/n width after Y/C separation (default 1, 2 or 4 are faster)\n");
+    fprintf(stderr," -front-cache <n>          Keep the front half of n fields for source frames that last several fields (default 6, 0=off)\n");
+    fprintf(stderr," -emulate-per-layer <n>    Several -i: run the emulation on every input (default 0, layer by alpha then emulate once)\n");
+    fprintf(stderr," -debug-alloc              Report heap allocations per output field (should be 0 after warm-up).\n");
+    fprintf(stderr,"                           Only in a build with --enable-ntsc-debug-alloc, which counts every operator new\n");
+    fprintf(stderr," -decode-ahead <n>         Decode and scale up to n packets ahead per input on a thread (default 8, 0=off)\n");
 	fprintf(stderr,"\n");
 	fprintf(stderr," Output file will be up/down converted to 720x480 (NTSC 29.97fps) or 720x576 (PAL 25fps).\n");
 	fprintf(stderr," Output will be rendered as interlaced video.\n");
 }
 
+/* Counter-based random numbers for every noise source.
+ * A number is a pure function of (seed, field, scanline, stage, index). The seed, field, scanline and stage are
+ * mixed into a 64-bit stream key with the splitmix64 finalizer. Number n of the stream is n XOR the low half of
+ * the key through noise_hash32() (an xorshift-multiply integer hash), plus the high half, through noise_hash32()
+ * again. Nothing carries from one number to the next, so the scanline threads of composite_layer() get the same
+ * noise however the field is divided up among them. -seed picks a different set. */
+#define NOISE_LANES 8
+
+/* noise that is smoothed along the scanline (see NoiseBank) draws this many numbers ahead of x=0 to get going */
+#define NOISE_RUNIN 8
+
+enum {
+    NOISE_STAGE_LUMA=1,         // -noise
+    NOISE_STAGE_HEAD_SWITCH,    // -vhs-head-switching-noise-level
+    NOISE_STAGE_CHROMA_U,       // -chroma-noise
+    NOISE_STAGE_CHROMA_V,
+    NOISE_STAGE_CHROMA_PHASE,   // -chroma-phase-noise
+    NOISE_STAGE_CHROMA_LOSS,    // -chroma-dropout
+    NOISE_STAGE_AUDIO_HISS,     // -audio-hiss (field = sample >> 16, scanline = channel)
+    NOISE_STAGE_LUMA_BANK,      // NoiseBank contents (field = bank line)
+    NOISE_STAGE_CHROMA_BANK
+};
+
+static unsigned long long noise_seed = 0;
+
+static inline uint64_t noise_mix64(uint64_t z) { /* splitmix64 finalizer */
+    z = (z ^ (z >> 30ULL)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27ULL)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31ULL);
+}
+
+/* key of one stream of random numbers */
+static inline uint64_t noise_key(const unsigned long long field,const unsigned int scanline,const unsigned int stage) {
+    return noise_mix64(noise_mix64(noise_mix64(noise_seed) ^ field) ^ (((uint64_t)stage << 32ULL) + scanline));
+}
+
+static inline uint32_t noise_hash32(uint32_t x) {
+    x ^= x >> 16U; x *= 0x7FEB352DU;
+    x ^= x >> 15U; x *= 0x846CA68BU;
+    x ^= x >> 16U;
+    return x;
+}
+
+/* number n of the stream */
+static inline uint32_t noise_at(const uint64_t key,const uint32_t n) {
+    return noise_hash32(noise_hash32(n ^ (uint32_t)key) + (uint32_t)(key >> 32ULL));
+}
+
+typedef uint32_t noise_lanes_t __attribute__((vector_size(sizeof(uint32_t) * NOISE_LANES)));
+
+static inline void noise_lanes_hash32(noise_lanes_t &x) {
+    x ^= x >> 16U; x *= 0x7FEB352DU;
+    x ^= x >> 15U; x *= 0x846CA68BU;
+    x ^= x >> 16U;
+}
+
+/* numbers n...n+count-1 of the stream into dst[], NOISE_LANES numbers at a time. same results as noise_at(). */
+static void noise_fill(uint32_t *dst,const uint64_t key,const uint32_t n,const unsigned int count) {
+    const uint32_t klo = (uint32_t)key,khi = (uint32_t)(key >> 32ULL);
+    noise_lanes_t c,x;
+    unsigned int i = 0;
+
+    for (unsigned int l=0;l < NOISE_LANES;l++) c[l] = n + l;
+    for (;(i+NOISE_LANES) <= count;i += NOISE_LANES) {
+        x = c ^ klo;
+        noise_lanes_hash32(x);
+        x += khi;
+        noise_lanes_hash32(x);
+        memcpy(dst+i,&x,sizeof(x));
+        c += NOISE_LANES;
+    }
+    for (;i < count;i++)
+        dst[i] = noise_at(key,n+i);
+}
+
+/* Bank of pre-filtered scanline noise.
+ * Scanline noise is white noise through a first-order lowpass (noise = (noise + r) / 2 per pixel), which costs
+ * a random number and a serial step per pixel, about as much as one of the filter passes. The bank holds
+ * NOISE_BANK_LINES lines of it, made once with the same recurrence and amplitude. A scanline then adds the line
+ * picked by one random number, starting at a random offset and with a random sign (the noise is symmetric
+ * around 0), which keeps the spectrum and amplitude. The add is a plain loop that GCC vectorizes. */
+#define NOISE_BANK_LINES 256
+
+struct NoiseLinePick {
+    const int*          line;           // the scanline's noise, width values
+    int                 sign;           // +1 or -1
+};
+
+class NoiseBank {
+public:
+    NoiseBank() : amplitude(0), length(0) { }
+    /* make the bank for noise of +/- amp per pixel (x256 scale, stored at the plane scale), for scanlines up to
+     * width long. does nothing if already made. */
+    void prepare(const int amp,const unsigned int width,const unsigned int stage) {
+        uint32_t rnd[NOISE_RUNIN + (width * 2)];
+        int noise;
+
+        if (!bank.empty() && amp == amplitude && (width * 2) <= length)
+            return;
+
+        amplitude = amp;
+        length = width * 2; /* offsets 0...width, and enough of them that two picks rarely overlap much */
+        bank.resize(NOISE_BANK_LINES * length);
+        for (unsigned int l=0;l < NOISE_BANK_LINES;l++) {
+            int *N = &bank[l * length];
+
+            noise_fill(rnd,noise_key(l,0,stage),0,NOISE_RUNIN + length);
+            noise = 0;
+            for (unsigned int x=0;x < NOISE_RUNIN;x++) {
+                noise += ((int)(rnd[x] % ((amp*2)+1))) - amp;
+                noise /= 2;
+            }
+            for (unsigned int x=0;x < length;x++) {
+                N[x] = noise / (1 << PLANE_SHIFT);
+                noise += ((int)(rnd[x+NOISE_RUNIN] % ((amp*2)+1))) - amp;
+                noise /= 2;
+            }
+        }
+    }
+    /* line from bits 0-7, offset from bits 8-30, sign from bit 31 of the random number r */
+    NoiseLinePick pick(const uint32_t r,const unsigned int width) const {
+        NoiseLinePick p;
+
+        assert(width <= (length / 2));
+        p.line = &bank[((r % NOISE_BANK_LINES) * length) + (((r >> 8U) & 0x7FFFFFU) % (length + 1 - width))];
+        p.sign = (r & 0x80000000U) ? -1 : 1;
+        return p;
+    }
+public:
+    std::vector<int>    bank;
+    int                 amplitude;
+    unsigned int        length;
+};
+
+/* the random number that picks everything about one scanline of one stage: bank line, chroma dropout, head switching jitter */
+static inline uint32_t noise_pick(const unsigned long long field,const unsigned int scanline,const unsigned int stage) {
+    return noise_at(noise_key(field,scanline,stage),0);
+}
+
+/* add the picked noise to a scanline */
+static inline void noise_line_add(plane_t *P,const NoiseLinePick &p,const unsigned int width) {
+    const int *N = p.line;
+
+    if (p.sign > 0) {
+        for (unsigned int x=0;x < width;x++) P[x] = plane_sat(P[x] + N[x]);
+    }
+    else {
+        for (unsigned int x=0;x < width;x++) P[x] = plane_sat(P[x] - N[x]);
+    }
+}
+
+static NoiseBank luma_noise_bank,chroma_noise_bank;
+
+/* make the noise banks for the current settings. at startup, again only if a setting or the width changes */
+static void noise_banks_prepare(const unsigned int width) {
+    if (video_noise != 0)
+        luma_noise_bank.prepare(video_noise,width,NOISE_STAGE_LUMA_BANK);
+    if (video_chroma_noise != 0)
+        chroma_noise_bank.prepare(video_chroma_noise,width,NOISE_STAGE_CHROMA_BANK);
+}
+
 static unsigned long long audio_proc_count = 0;
-static LowpassFilter audio_post_vhs_boost[2];
+static LowpassFilterAudioLanes audio_post_vhs_boost;
 
 static inline int clips16(const int x) {
 	if (x < -32768)
@@ -897,74 +1740,129 @@ static inline int clips16(const int x) {
 	return x;
 }
 
+static audio_lanes_t audio_block[AUDIO_BLOCK];
+
+/* that faint "buzzing" noise on linear tracks because of audio/video crosstalk. the HSYNC and VSYNC pulses of one
+ * whole frame are tabulated once, 16 entries per sample of the output rate. each entry is what an audio sample
+ * starting there picks up from the pulses over 16 subsamples, the box filter that keeps the edges from aliasing.
+ * a frame is not a whole number of samples, so a phase accumulator steps through the table by about 16 entries
+ * per sample and interpolates. it carries over from call to call. */
+static std::vector<float> audio_buzz_table;     // one frame, plus the first entry again at the end
+static double audio_buzz_phase = 0;             // in table entries
+static double audio_buzz_step = 1;              // table entries per sample
+
+static void audio_buzz_prepare(const double linear_buzz) {
+	const double hsync_hz = output_ntsc ? /*NTSC*/15734 : /*PAL*/15625;
+	const int vsync_lines = output_ntsc ? /*NTSC*/525 : /*PAL*/625;
+	const int vpulse_end = output_ntsc ? /*NTSC*/10 : /*PAL*/12;
+	const double hpulse_end = output_ntsc ? /*NTSC*/(hsync_hz * (4.7/*us*/ / 1000000)) : /*PAL*/(hsync_hz * (4.0/*us*/ / 1000000));
+	const double frame = ((double)vsync_lines * output_audio_rate) / hsync_hz; // samples per frame
+	const unsigned int oversample = 16;
+	const size_t size = (size_t)floor((frame * oversample) + 0.5);
+
+	audio_buzz_table.resize(size + 1);
+	for (size_t j=0;j < size;j++) {
+		const double start = ((double)j * vsync_lines) / size; // in scanlines
+		double s = 0;
+
+		for (unsigned int oi=0;oi < oversample;oi++) {
+			double t = start + ((oi * hsync_hz) / output_audio_rate / oversample);
+			double hpos = fmod(t,1.0);
+			int vline = (int)fmod(floor(t + 0.0001/*fudge*/ - hpos),(double)vsync_lines / 2);
+			bool pulse = false;
+
+			if (hpos < hpulse_end)
+				pulse = true; // HSYNC
+			if (vline < vpulse_end)
+				pulse = true; // VSYNC
+
+			if (pulse)
+				s += linear_buzz / oversample / 2;
+		}
+
+		audio_buzz_table[j] = (float)s;
+	}
+	audio_buzz_table[size] = audio_buzz_table[0];
+
+	audio_buzz_step = (double)size / frame;
+	audio_buzz_phase = fmod((double)audio_proc_count * audio_buzz_step,(double)size);
+}
+
 void composite_audio_process(int16_t *audio,unsigned int samples) { // number of channels = output_audio_channels, sample rate = output_audio_rate. audio is interleaved.
-	assert(audio_hilopass.audiostate.size() >= output_audio_channels);
-	double linear_buzz = dBFS(output_audio_linear_buzz);
-	double hsync_hz = output_ntsc ? /*NTSC*/15734 : /*PAL*/15625;
-	int vsync_lines = output_ntsc ? /*NTSC*/525 : /*PAL*/625;
-	int vpulse_end = output_ntsc ? /*NTSC*/10 : /*PAL*/12;
-	double hpulse_end = output_ntsc ? /*NTSC*/(hsync_hz * (4.7/*us*/ / 1000000)) : /*PAL*/(hsync_hz * (4.0/*us*/ / 1000000));
-
-	for (unsigned int s=0;s < samples;s++,audio += output_audio_channels) {
-		for (unsigned int c=0;c < output_audio_channels;c++) {
-			double s;
-
-			s = (double)audio[c] / 32768;
-
-			/* lowpass filter */
-			s = audio_hilopass.audiostate[c].filter(s);
-
-			/* preemphasis */
-			if (emulating_preemphasis) {
-				for (unsigned int i=0;i < output_audio_channels;i++) {
-					s = s + audio_linear_preemphasis_pre[i].highpass(s);
-				}
-			}
+	assert(audio_hilopass.ready && output_audio_channels <= AUDIO_LANES);
+	const unsigned int channels = output_audio_channels;
+	const double linear_buzz = dBFS(output_audio_linear_buzz);
+	const bool buzz = !output_vhs_hifi && linear_buzz > 0.000000001;
+
+	if (buzz && audio_buzz_table.empty())
+		audio_buzz_prepare(linear_buzz);
+
+	while (samples > 0) {
+		const unsigned int n = std::min(samples,(unsigned int)AUDIO_BLOCK);
+		audio_lanes_t *b = audio_block;
+		unsigned int i,c;
+
+		/* to lanes. a lane without a channel is zero */
+		for (i=0;i < n;i++) {
+			audio_lanes_set(b[i],0);
+			for (c=0;c < channels;c++) b[i][c] = (double)audio[(i * channels) + c] / 32768;
+		}
 
-			/* that faint "buzzing" noise on linear tracks because of audio/video crosstalk */
-			if (!output_vhs_hifi && linear_buzz > 0.000000001) {
-				const unsigned int oversample = 16;
-				for (unsigned int oi=0;oi < oversample;oi++) {
-					double t = ((((double)audio_proc_count * oversample) + oi) * hsync_hz) / output_audio_rate / oversample;
-					double hpos = fmod(t,1.0);
-					int vline = (int)fmod(floor(t + 0.0001/*fudge*/ - hpos),(double)vsync_lines / 2);
-					bool pulse = false;
-
-					if (hpos < hpulse_end)
-						pulse = true; // HSYNC
-					if (vline < vpulse_end)
-						pulse = true; // VSYNC
-
-					if (pulse)
-						s -= linear_buzz / oversample / 2;
-				}
+		/* lowpass filter */
+		audio_hilopass.filter(b,n);
+
+		/* preemphasis */
+		if (emulating_preemphasis)
+			audio_linear_preemphasis_pre.highboost(b,n,1.0);
+
+		/* that faint "buzzing" noise on linear tracks because of audio/video crosstalk */
+		if (buzz) {
+			const double size = (double)(audio_buzz_table.size() - 1);
+			const float *tab = &audio_buzz_table[0];
+			double phase = audio_buzz_phase;
+
+			for (i=0;i < n;i++) {
+				const unsigned int j = (unsigned int)phase;
+
+				b[i] -= tab[j] + ((tab[j+1] - tab[j]) * (phase - j));
+				if ((phase += audio_buzz_step) >= size) phase -= size;
 			}
 
-			/* analog limiting (when the signal is too loud) */
-			if (s > 1.0)
-				s = 1.0;
-			else if (s < -1.0)
-				s = -1.0;
+			audio_buzz_phase = phase;
+		}
 
-			/* hiss */
-			if (output_audio_hiss_level != 0)
-				s += ((double)(((int)((unsigned int)rand() % ((output_audio_hiss_level * 2) + 1))) - output_audio_hiss_level)) / 20000;
+		/* analog limiting (when the signal is too loud) */
+		for (i=0;i < n;i++) {
+			b[i] = b[i] > 1.0 ? 1.0 : b[i];
+			b[i] = b[i] < -1.0 ? -1.0 : b[i];
+		}
 
-			/* some VCRs (at least mine) will boost higher frequencies if playing linear tracks */
-			if (!output_vhs_hifi && vhs_linear_high_boost > 0)
-				s += audio_post_vhs_boost[c].highpass(s) * vhs_linear_high_boost;
+		/* hiss */
+		if (output_audio_hiss_level != 0) {
+			for (i=0;i < n;i++) {
+				const unsigned long long count = audio_proc_count + i;
 
-			/* deemphasis */
-			if (emulating_deemphasis) {
-				for (unsigned int i=0;i < output_audio_channels;i++) {
-					s = audio_linear_preemphasis_post[i].lowpass(s);
-				}
+				for (c=0;c < channels;c++)
+					b[i][c] += ((double)(((int)(noise_at(noise_key(count >> 16ULL,c,NOISE_STAGE_AUDIO_HISS),(uint32_t)(count & 0xFFFFULL)) % ((output_audio_hiss_level * 2) + 1))) - output_audio_hiss_level)) / 20000;
 			}
+		}
+
+		/* some VCRs (at least mine) will boost higher frequencies if playing linear tracks */
+		if (!output_vhs_hifi && vhs_linear_high_boost > 0)
+			audio_post_vhs_boost.highboost(b,n,vhs_linear_high_boost);
 
-			audio[c] = clips16(s * 32768);
+		/* deemphasis */
+		if (emulating_deemphasis)
+			audio_linear_preemphasis_post.lowpass(b,n);
+
+		/* back to 16-bit interleaved */
+		for (i=0;i < n;i++) {
+			for (c=0;c < channels;c++) audio[(i * channels) + c] = clips16(b[i][c] * 32768);
 		}
 
-		audio_proc_count++;
+		audio_proc_count += n;
+		audio += n * channels;
+		samples -= n;
 	}
 }
 
@@ -993,26 +1891,134 @@ static int parse_argv(int argc,char **argv) {
                     return 1;
                 }
             }
-            else if (!strcmp(a,"width")) {
-                a = argv[i++];
-                if (a == NULL) return 1;
-                output_width = (int)strtoul(a,NULL,0);
-                if (output_width < 32) return 1;
+            else if (!strcmp(a,"pipeline")) {
+                video_pipeline = atoi(argv[i++]) > 0;
             }
-            else if (!strcmp(a,"d")) {
+            else if (!strcmp(a,"decode-ahead")) {
                 a = argv[i++];
                 if (a == NULL) return 1;
-                output_avstream_video_frame_delay = (unsigned int)strtoul(a,NULL,0);
-                if (output_avstream_video_frame_delay == 0 || output_avstream_video_frame_delay > 256) {
-                    fprintf(stderr,"Invalid delay\n");
+                decode_ahead = (unsigned int)strtoul(a,NULL,0);
+                if (decode_ahead > 256) {
+                    fprintf(stderr,"Invalid decode ahead\n");
                     return 1;
                 }
             }
-            else if (!strcmp(a,"i")) {
-                a = argv[i++];
+            else if (!strcmp(a,"debug-alloc")) {
+#ifdef NTSC_DEBUG_ALLOC
+                debug_alloc = true;
+#else
+                fprintf(stderr,"-debug-alloc needs a build with --enable-ntsc-debug-alloc\n");
+                return 1;
+#endif
+            }
+            else if (!strcmp(a,"direct-yuv")) {
+                video_direct_yuv = atoi(argv[i++]) > 0;
+            }
+            else if (!strcmp(a,"yuv-ingest")) {
+                video_yuv_ingest = atoi(argv[i++]) > 0;
+            }
+            else if (!strcmp(a,"emulate-per-layer")) {
+                video_emulate_per_layer = atoi(argv[i++]) > 0;
+            }
+            else if (!strcmp(a,"chroma-res")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                const int d = atoi(a);
+                if (d == 1)
+                    video_chroma_shift = 0;
+                else if (d == 2)
+                    video_chroma_shift = 1;
+                else if (d == 4)
+                    video_chroma_shift = 2;
+                else {
+                    fprintf(stderr,"Invalid chroma resolution\n");
+                    return 1;
+                }
+            }
+            else if (!strcmp(a,"front-cache")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                const int n = atoi(a);
+                if (n < 0 || n > 64) {
+                    fprintf(stderr,"Invalid front cache size\n");
+                    return 1;
+                }
+                video_front_cache = (unsigned int)n;
+            }
+            else if (!strcmp(a,"threads")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                video_threads = atoi(a);
+                if (video_threads < 0 || video_threads > 256) {
+                    fprintf(stderr,"Invalid thread count\n");
+                    return 1;
+                }
+            }
+            else if (!strcmp(a,"width")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                output_width = (int)strtoul(a,NULL,0);
+                if (output_width < 32) return 1;
+            }
+            else if (!strcmp(a,"d")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                output_avstream_video_frame_delay = (unsigned int)strtoul(a,NULL,0);
+                if (output_avstream_video_frame_delay == 0 || output_avstream_video_frame_delay > 256) {
+                    fprintf(stderr,"Invalid delay\n");
+                    return 1;
+                }
+            }
+            else if (!strcmp(a,"i")) {
+                a = argv[i++];
                 if (a == NULL) return 1;
                 new_input_file().path = a;
             }
+            else if (!strcmp(a,"vcodec")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                output_video_codec = a;
+            }
+            else if (!strcmp(a,"preset")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                output_video_preset = a;
+            }
+            else if (!strcmp(a,"crf")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                output_video_crf = a;
+            }
+            else if (!strcmp(a,"b:v")) {
+                char *e = NULL;
+                double br;
+
+                a = argv[i++];
+                if (a == NULL) return 1;
+                br = strtod(a,&e);
+                if (*e == 'k' || *e == 'K') br *= 1000;
+                else if (*e == 'm' || *e == 'M') br *= 1000000;
+                if (br <= 0) {
+                    fprintf(stderr,"Invalid bitrate\n");
+                    return 1;
+                }
+                output_video_bitrate = (long)br;
+            }
+            else if (!strcmp(a,"encode-threads")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                output_video_threads = atoi(a);
+                if (output_video_threads < 0) output_video_threads = 0;
+            }
+            else if (!strcmp(a,"encode-queue")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                output_video_encode_queue = (unsigned int)strtoul(a,NULL,0);
+                if (output_video_encode_queue > 256) {
+                    fprintf(stderr,"Invalid encode queue\n");
+                    return 1;
+                }
+            }
             else if (!strcmp(a,"o")) {
                 a = argv[i++];
                 if (a == NULL) return 1;
@@ -1122,6 +2128,9 @@ static int parse_argv(int argc,char **argv) {
 				int x = atoi(argv[i++]);
 				video_noise = x;
 			}
+			else if (!strcmp(a,"seed")) {
+				noise_seed = strtoull(argv[i++],NULL,0);
+			}
 			else if (!strcmp(a,"subcarrier-amp")) {
 				int x = atoi(argv[i++]);
 				subcarrier_amplitude = x;
@@ -1268,6 +2277,11 @@ static int parse_argv(int argc,char **argv) {
 	fprintf(stderr,"VHS head switching point: %.6f\n",vhs_head_switching_phase);
 	fprintf(stderr,"VHS head switching noise: %.6f\n",vhs_head_switching_phase_noise);
 
+    if (video_threads == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        video_threads = (n > 0) ? (int)std::min(n,256L) : 1;
+    }
+
     if (output_file.empty()) {
         fprintf(stderr,"No output file specified\n");
         return 1;
@@ -1277,6 +2291,11 @@ static int parse_argv(int argc,char **argv) {
         return 1;
     }
 
+    /* layers are keyed by their alpha, which only the ARGB conversion has */
+    if (input_files.size() > 1 && !video_emulate_per_layer) {
+        video_yuv_ingest = false;
+    }
+
 	return 0;
 }
 
@@ -1288,6 +2307,42 @@ void process_audio(InputFile &fin) {
         composite_audio_process((int16_t*)fin.audio_dst_data[0],fin.audio_dst_data_out_samples);
 }
 
+/* the video encode thread and the main thread (audio) both write to the muxer */
+pthread_mutex_t             output_mux_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int output_write_packet(AVPacket *pkt) {
+    int r;
+
+    pthread_mutex_lock(&output_mux_lock);
+    r = av_interleaved_write_frame(output_avfmt,pkt);
+    pthread_mutex_unlock(&output_mux_lock);
+    return r;
+}
+
+/* audio packets up to this many samples come from a pool, larger ones (pad fill) are allocated as before */
+#define OUTPUT_AUDIO_PACKET_POOL_SAMPLES    16384
+
+AVBufferPool*               output_audio_packet_pool = NULL;
+int                         output_audio_packet_pool_size = 0;
+
+int output_audio_new_packet(AVPacket *pkt,int size) {
+    if (output_audio_packet_pool == NULL) {
+        output_audio_packet_pool_size = OUTPUT_AUDIO_PACKET_POOL_SAMPLES * 2 * output_audio_channels;
+        output_audio_packet_pool = av_buffer_pool_init(output_audio_packet_pool_size + AV_INPUT_BUFFER_PADDING_SIZE,NULL);
+        if (output_audio_packet_pool == NULL) return AVERROR(ENOMEM);
+    }
+
+    if (size > output_audio_packet_pool_size)
+        return av_new_packet(pkt,size);
+
+    pkt->buf = av_buffer_pool_get(output_audio_packet_pool);
+    if (pkt->buf == NULL) return AVERROR(ENOMEM);
+    pkt->data = pkt->buf->data;
+    pkt->size = size;
+    memset(pkt->data + size,0,AV_INPUT_BUFFER_PADDING_SIZE);
+    return 0;
+}
+
 void write_out_audio(InputFile &fin) {
     if (fin.audio_dst_data == NULL || fin.audio_dst_data_out_samples == 0)
         return;
@@ -1301,7 +2356,7 @@ void write_out_audio(InputFile &fin) {
 
         AVPacket dstpkt;
         av_init_packet(&dstpkt);
-        if (av_new_packet(&dstpkt,out_samples * 2 * output_audio_channels) >= 0) { // NTS: Will reset fields too!
+        if (output_audio_new_packet(&dstpkt,out_samples * 2 * output_audio_channels) >= 0) { // NTS: Will reset fields too!
             assert(dstpkt.data != NULL);
             assert(dstpkt.size >= (out_samples * 2 * output_audio_channels));
             memset(dstpkt.data,0,out_samples * 2 * output_audio_channels);
@@ -1310,7 +2365,7 @@ void write_out_audio(InputFile &fin) {
         dstpkt.dts = fin.last_written_sample;
         dstpkt.stream_index = output_avstream_audio->index;
         av_packet_rescale_ts(&dstpkt,output_avstream_audio_codec_context->time_base,output_avstream_audio->time_base);
-        if (av_interleaved_write_frame(output_avfmt,&dstpkt) < 0)
+        if (output_write_packet(&dstpkt) < 0)
             fprintf(stderr,"Failed to write frame\n");
         av_packet_unref(&dstpkt);
 
@@ -1322,7 +2377,7 @@ void write_out_audio(InputFile &fin) {
     // that way we can render directly to MP4 our VHS emulation.
     AVPacket dstpkt;
     av_init_packet(&dstpkt);
-    if (av_new_packet(&dstpkt,fin.audio_dst_data_out_samples * 2 * output_audio_channels) >= 0) { // NTS: Will reset fields too!
+    if (output_audio_new_packet(&dstpkt,fin.audio_dst_data_out_samples * 2 * output_audio_channels) >= 0) { // NTS: Will reset fields too!
         assert(dstpkt.data != NULL);
         assert(dstpkt.size >= (fin.audio_dst_data_out_samples * 2 * output_audio_channels));
         memcpy(dstpkt.data,fin.audio_dst_data[0],fin.audio_dst_data_out_samples * 2 * output_audio_channels);
@@ -1331,144 +2386,608 @@ void write_out_audio(InputFile &fin) {
     dstpkt.dts = fin.audio_dst_data_out_audio_sample;
     dstpkt.stream_index = output_avstream_audio->index;
     av_packet_rescale_ts(&dstpkt,output_avstream_audio_codec_context->time_base,output_avstream_audio->time_base);
-    if (av_interleaved_write_frame(output_avfmt,&dstpkt) < 0)
+    if (output_write_packet(&dstpkt) < 0)
         fprintf(stderr,"Failed to write frame\n");
     av_packet_unref(&dstpkt);
 
     fin.audio_sample = fin.last_written_sample = fin.audio_dst_data_out_audio_sample + fin.audio_dst_data_out_samples;
 }
 
-void output_frame(AVFrame *frame,unsigned long long field_number) {
-	int gotit = 0;
-	AVPacket pkt;
+/* encoded video from output_video_encode.cpp */
+int output_video_write_packet(AVPacket *pkt) {
+    return output_write_packet(pkt);
+}
 
-	av_init_packet(&pkt);
-	if (av_new_packet(&pkt,50000000/8) < 0) {
-		fprintf(stderr,"Failed to alloc vid packet\n");
-		return;
-	}
+#ifdef NTSC_DEBUG_ALLOC
+/* heap allocation counter for -debug-alloc. this only sees C++ allocations (ours, and STL containers),
+ * not av_malloc() within FFmpeg. replacing operator new is a change to the whole program, so it is only
+ * there when built with -DNTSC_DEBUG_ALLOC (configure --enable-ntsc-debug-alloc) */
+volatile unsigned long      debug_alloc_count = 0;
+
+void *operator new(size_t sz) {
+    void *p;
+
+    __sync_fetch_and_add(&debug_alloc_count,1UL);
+    if ((p = malloc(sz != 0 ? sz : 1)) == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t sz) {
+    return operator new(sz);
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
 
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+void debug_alloc_report(unsigned long long field_number) {
+    static unsigned long last = 0;
+    const unsigned long count = debug_alloc_count;
+
+    // the first fields allocate the planes, filters and buffers that are then reused
+    if (field_number >= 4 && count != last)
+        fprintf(stderr,"WARNING: %lu heap allocations in steady state (field %llu)\n",count - last,field_number);
+
+    last = count;
+}
+#endif
+
+void output_frame(AVFrame *frame,unsigned long long field_number) {
 	frame->key_frame = (field_number % (15ULL * 2ULL)) == 0 ? 1 : 0;
 
     {
 		frame->interlaced_frame = 0;
 		frame->pts = field_number;
-		pkt.pts = field_number;
-		pkt.dts = field_number;
 	}
 
 	fprintf(stderr,"\x0D" "Output field %llu ",field_number); fflush(stderr);
-    if (avcodec_encode_video2(output_avstream_video_codec_context,&pkt,frame,&gotit) == 0) {
-        if (gotit) {
-            pkt.stream_index = output_avstream_video->index;
-            av_packet_rescale_ts(&pkt,output_avstream_video_codec_context->time_base,output_avstream_video->time_base);
+#ifdef NTSC_DEBUG_ALLOC
+	if (debug_alloc) debug_alloc_report(field_number);
+#endif
+    output_video_encode(frame);
+}
+
+static inline unsigned char clampu8(const int x) {
+    if (x < 0) return 0;
+    else if (x > 255) return 255;
+    return (unsigned char)x;
+}
 
-            if (av_interleaved_write_frame(output_avfmt,&pkt) < 0)
-                fprintf(stderr,"AV write frame failed video\n");
+/* RGB <-> YIQ. The RGB to YIQ rows are folded into one 3x3 matrix (I and Q are linear in R, G and B), the 1/256 of
+ * YIQ to RGB is folded into its matrix, and the math is single precision so that the scanline versions below
+ * vectorize on plain SSE2 too (which has float multiplies but no 32-bit integer multiply). Truncation toward zero
+ * like the (int) casts, within 1 LSB of the double precision math these replace. */
+struct RGB_YIQ_float_matrix {
+    RGB_YIQ_float_matrix() {
+        static const double lum[3] = { 0.30, 0.59, 0.11 };
+        static const double rgb[3][3] = {
+            { 1.000, 0.956, 0.621 },
+            { 1.000,-0.272,-0.647 },
+            { 1.000,-1.106, 1.703 } };
+
+        for (unsigned int k=0;k < 3;k++) {
+            const double yiq[3] = {
+                lum[k],
+                (-0.27 * ((k == 2 ? 1.0 : 0.0) - lum[k])) + ( 0.74 * ((k == 0 ? 1.0 : 0.0) - lum[k])),
+                ( 0.41 * ((k == 2 ? 1.0 : 0.0) - lum[k])) + ( 0.48 * ((k == 0 ? 1.0 : 0.0) - lum[k])) };
+
+            for (unsigned int o=0;o < 3;o++) {
+                to_yiq[o][k] = (float)(yiq[o] * 256);
+                to_rgb[o][k] = (float)(rgb[o][k] / 256);
+                plane_yiq[o][k] = (float)(yiq[o] * (256 >> PLANE_SHIFT));
+                plane_rgb[o][k] = (float)(rgb[o][k] / (256 >> PLANE_SHIFT));
+            }
         }
     }
+    float       to_yiq[3][3];   /* [Y,I,Q][R,G,B] */
+    float       to_rgb[3][3];   /* [R,G,B][Y,I,Q] */
+    float       plane_yiq[3][3]; /* the same, for YIQ at the working plane scale */
+    float       plane_rgb[3][3];
+};
 
-	av_packet_unref(&pkt);
-}
+static const RGB_YIQ_float_matrix RGB_YIQ_float;
 
 void RGB_to_YIQ(int &Y,int &I,int &Q,int r,int g,int b) {
-    double dY;
-
-    dY = (0.30 * r) + (0.59 * g) + (0.11 * b);
+    const RGB_YIQ_float_matrix &m = RGB_YIQ_float;
+    const float fr = r,fg = g,fb = b;
 
-    Y = (int)(256 * dY);
-    I = (int)(256 * ((-0.27 * (b - dY)) + ( 0.74 * (r - dY))));
-    Q = (int)(256 * (( 0.41 * (b - dY)) + ( 0.48 * (r - dY))));
+    Y = (int)((fr * m.to_yiq[0][0]) + (fg * m.to_yiq[0][1]) + (fb * m.to_yiq[0][2]));
+    I = (int)((fr * m.to_yiq[1][0]) + (fg * m.to_yiq[1][1]) + (fb * m.to_yiq[1][2]));
+    Q = (int)((fr * m.to_yiq[2][0]) + (fg * m.to_yiq[2][1]) + (fb * m.to_yiq[2][2]));
 }
 
 void YIQ_to_RGB(int &r,int &g,int &b,int Y,int I,int Q) {
-    // FIXME
-    r = (int)((( 1.000 * Y) + ( 0.956 * I) + ( 0.621 * Q)) / 256);
-    g = (int)((( 1.000 * Y) + (-0.272 * I) + (-0.647 * Q)) / 256);
-    b = (int)((( 1.000 * Y) + (-1.106 * I) + ( 1.703 * Q)) / 256);
-    if (r < 0) r = 0;
-    else if (r > 255) r = 255;
-    if (g < 0) g = 0;
-    else if (g > 255) g = 255;
-    if (b < 0) b = 0;
-    else if (b > 255) b = 255;
+    const RGB_YIQ_float_matrix &m = RGB_YIQ_float;
+    const float fY = Y,fI = I,fQ = Q;
+
+    r = clampu8((int)((fY * m.to_rgb[0][0]) + (fI * m.to_rgb[0][1]) + (fQ * m.to_rgb[0][2])));
+    g = clampu8((int)((fY * m.to_rgb[1][0]) + (fI * m.to_rgb[1][1]) + (fQ * m.to_rgb[1][2])));
+    b = clampu8((int)((fY * m.to_rgb[2][0]) + (fI * m.to_rgb[2][1]) + (fQ * m.to_rgb[2][2])));
 }
 
-/* lighter-weight filtering, probably what your old CRT does to reduce color fringes a bit */
-void composite_lowpass_tv(AVFrame *dstframe,int *fY,int *fI,int *fQ,unsigned int field,unsigned long long fieldno) {
-    unsigned int x,y;
+/* The same, a whole scanline of BGRA to or from the working planes at a time, YIQ_LANES pixels per vector */
+#define YIQ_LANES PLANE_LANES
+
+typedef plane_lanes_t yiq_lanes_t;
+typedef float yiq_lanes_f_t __attribute__((vector_size(sizeof(float) * YIQ_LANES)));
+
+static void RGB_to_YIQ_scanline(plane_t *Y,plane_t *I,plane_t *Q,const uint32_t *P,const unsigned int width) {
+    const RGB_YIQ_float_matrix m = RGB_YIQ_float; // local copy, the stores cannot alias it
+    yiq_lanes_f_t r,g,b;
+    yiq_lanes_t p;
+    unsigned int x;
+
+    for (x=0;(x+YIQ_LANES) <= width;x += YIQ_LANES) {
+        memcpy(&p,P+x,sizeof(p));
+        r = __builtin_convertvector((p >> 16) & 0xFF,yiq_lanes_f_t);
+        g = __builtin_convertvector((p >>  8) & 0xFF,yiq_lanes_f_t);
+        b = __builtin_convertvector((p >>  0) & 0xFF,yiq_lanes_f_t);
+
+        p = __builtin_convertvector((r * m.plane_yiq[0][0]) + (g * m.plane_yiq[0][1]) + (b * m.plane_yiq[0][2]),yiq_lanes_t);
+        plane_lanes_store_fit(Y+x,p); // 0...255 at the plane scale
+        p = __builtin_convertvector((r * m.plane_yiq[1][0]) + (g * m.plane_yiq[1][1]) + (b * m.plane_yiq[1][2]),yiq_lanes_t);
+        plane_lanes_store_fit(I+x,p);
+        p = __builtin_convertvector((r * m.plane_yiq[2][0]) + (g * m.plane_yiq[2][1]) + (b * m.plane_yiq[2][2]),yiq_lanes_t);
+        plane_lanes_store_fit(Q+x,p);
+    }
+    for (;x < width;x++) {
+        const float r = (P[x] >> 16UL) & 0xFF,g = (P[x] >> 8UL) & 0xFF,b = (P[x] >> 0UL) & 0xFF;
 
-    {
-        for (unsigned int p=1;p <= 2;p++) {
-            for (y=field;y < dstframe->height;y += 2) {
-                int *P = ((p == 1) ? fI : fQ) + (dstframe->width * y);
-                LowpassFilter lp[3];
-                double cutoff;
-                int delay;
-                double s;
-
-                cutoff = 2600000;
-                delay = 1;
-
-                for (unsigned int f=0;f < 3;f++) {
-                    lp[f].setFilter((315000000.00 * 4) / 88,cutoff); // 315/88 Mhz rate * 4
-                    lp[f].resetFilter(0);
-                }
+        Y[x] = plane_sat((int)((r * m.plane_yiq[0][0]) + (g * m.plane_yiq[0][1]) + (b * m.plane_yiq[0][2])));
+        I[x] = plane_sat((int)((r * m.plane_yiq[1][0]) + (g * m.plane_yiq[1][1]) + (b * m.plane_yiq[1][2])));
+        Q[x] = plane_sat((int)((r * m.plane_yiq[2][0]) + (g * m.plane_yiq[2][1]) + (b * m.plane_yiq[2][2])));
+    }
+}
 
-                for (x=0;x < dstframe->width;x++) {
-                    s = P[x];
-                    for (unsigned int f=0;f < 3;f++) s = lp[f].lowpass(s);
-                    if (x >= delay) P[x-delay] = s;
-                }
+static void YIQ_to_RGB_scanline(uint32_t *P,const plane_t *Y,const plane_t *I,const plane_t *Q,const unsigned int width) {
+    const RGB_YIQ_float_matrix m = RGB_YIQ_float; // local copy, the stores cannot alias it
+    yiq_lanes_f_t y,i,q,f;
+    yiq_lanes_t p,c[3];
+    unsigned int x;
+    int r,g,b;
+
+    for (x=0;(x+YIQ_LANES) <= width;x += YIQ_LANES) {
+        plane_lanes_load(p,Y+x);
+        y = __builtin_convertvector(p,yiq_lanes_f_t);
+        plane_lanes_load(p,I+x);
+        i = __builtin_convertvector(p,yiq_lanes_f_t);
+        plane_lanes_load(p,Q+x);
+        q = __builtin_convertvector(p,yiq_lanes_f_t);
+
+        for (unsigned int o=0;o < 3;o++) {
+            f = (y * m.plane_rgb[o][0]) + (i * m.plane_rgb[o][1]) + (q * m.plane_rgb[o][2]);
+            c[o] = __builtin_convertvector(f,yiq_lanes_t);
+            c[o] = c[o] < 0 ? 0 : c[o];
+            c[o] = c[o] > 255 ? 255 : c[o];
+        }
+
+        p = (c[0] << 16) + (c[1] << 8) + c[2];
+        memcpy(P+x,&p,sizeof(p));
+    }
+    for (;x < width;x++) {
+        const float fY = Y[x],fI = I[x],fQ = Q[x];
+
+        r = clampu8((int)((fY * m.plane_rgb[0][0]) + (fI * m.plane_rgb[0][1]) + (fQ * m.plane_rgb[0][2])));
+        g = clampu8((int)((fY * m.plane_rgb[1][0]) + (fI * m.plane_rgb[1][1]) + (fQ * m.plane_rgb[1][2])));
+        b = clampu8((int)((fY * m.plane_rgb[2][0]) + (fI * m.plane_rgb[2][1]) + (fQ * m.plane_rgb[2][2])));
+        P[x] = (r << 16) + (g << 8) + b;
+    }
+}
+
+/* YIQ straight to 8-bit limited range Y'CbCr (BT.601), the same as YIQ_to_RGB() followed by RGB to Y'CbCr
+ * in one matrix, without the RGB clipping in between. Fixed point: inputs are shifted down by 2 (6 fraction bits
+ * left of the 8 that RGB_to_YIQ gives) and the coefficients are Q10, so that even heavy overshoot fits in 32 bits. */
+struct YIQ_to_YCbCr_matrix {
+    YIQ_to_YCbCr_matrix() {
+        /* YIQ_to_RGB() */
+        static const double rgb[3][3] = {
+            { 1.000, 0.956, 0.621 },
+            { 1.000,-0.272,-0.647 },
+            { 1.000,-1.106, 1.703 } };
+        /* RGB to Y'CbCr, limited range */
+        static const double ycc[3][3] = {
+            { ( 0.299    * 219) / 255, ( 0.587    * 219) / 255, ( 0.114    * 219) / 255 },
+            { (-0.168736 * 224) / 255, (-0.331264 * 224) / 255, ( 0.5      * 224) / 255 },
+            { ( 0.5      * 224) / 255, (-0.418688 * 224) / 255, (-0.081312 * 224) / 255 } };
+
+        for (unsigned int o=0;o < 3;o++) {
+            for (unsigned int i=0;i < 3;i++) {
+                double sum = 0;
+
+                for (unsigned int k=0;k < 3;k++) sum += ycc[o][k] * rgb[k][i];
+                m[o][i] = (int)floor((sum * 1024) + 0.5);
+            }
+        }
+    }
+    int         m[3][3];    /* [Y,Cb,Cr][Y,I,Q], Q10. Cb and Cr do not depend on Y (m[1][0] == m[2][0] == 0) */
+};
+
+static const YIQ_to_YCbCr_matrix YIQ_to_YCbCr;
+
+/* Y'CbCr (BT.601) to YIQ, the same as Y'CbCr to RGB followed by RGB_to_YIQ(), without the RGB clipping in between.
+ * For chroma this is only a rotation and scale of the Cb/Cr axes. Fixed point: luma is multiplied by 8 and chroma
+ * comes in 8x from the chroma resampler, coefficients are Q9 of the x256 YIQ scale, so that results are (sum >> 12). */
+struct YCbCr_to_YIQ_matrix {
+    YCbCr_to_YIQ_matrix(const bool full_range) {
+        const double ys = full_range ? 1.0 : (255.0 / 219);
+        const double cs = full_range ? 1.0 : (255.0 / 224);
+        /* Y'CbCr to RGB */
+        const double rgb[3][3] = {
+            { ys, 0,              1.402    * cs },
+            { ys,-0.344136 * cs, -0.714136 * cs },
+            { ys, 1.772    * cs,  0             } };
+        /* RGB_to_YIQ() */
+        static const double lum[3] = { 0.30, 0.59, 0.11 };
+        double yiq[3][3];
+
+        for (unsigned int k=0;k < 3;k++) {
+            yiq[0][k] = lum[k];
+            yiq[1][k] = (-0.27 * ((k == 2 ? 1.0 : 0.0) - lum[k])) + ( 0.74 * ((k == 0 ? 1.0 : 0.0) - lum[k]));
+            yiq[2][k] = ( 0.41 * ((k == 2 ? 1.0 : 0.0) - lum[k])) + ( 0.48 * ((k == 0 ? 1.0 : 0.0) - lum[k]));
+        }
+
+        for (unsigned int o=0;o < 3;o++) {
+            for (unsigned int i=0;i < 3;i++) {
+                double sum = 0;
+
+                for (unsigned int k=0;k < 3;k++) sum += yiq[o][k] * rgb[k][i];
+                m[o][i] = (int)floor((sum * 256 * 512) + 0.5);
+            }
+        }
+
+        luma_offset = full_range ? 0 : 16;
+    }
+    int         m[3][3];    /* [Y,I,Q][Y,Cb,Cr], I and Q do not depend on Y (m[1][0] == m[2][0] == 0) */
+    int         luma_offset;
+};
+
+static const YCbCr_to_YIQ_matrix YCbCr_to_YIQ_limited(false);
+static const YCbCr_to_YIQ_matrix YCbCr_to_YIQ_full(true);
+
+/* worker pool that splits the scanlines of one field across CPU cores.
+ * the threads persist across fields, the calling thread renders the first slice itself.
+ * every slice is a run of scanlines of the same field (same parity). */
+typedef void (*scanline_slice_func_t)(void *ctx,unsigned int ystart,unsigned int yend);
+
+class ScanlineThreadPool {
+public:
+    ScanlineThreadPool() : slices(1), generation(0), pending(0), quit(false), func(NULL), func_ctx(NULL), field(0), height(0) {
+        pthread_mutex_init(&lock,NULL);
+        pthread_cond_init(&work_cond,NULL);
+        pthread_cond_init(&done_cond,NULL);
+    }
+    ~ScanlineThreadPool() {
+        stop();
+        pthread_cond_destroy(&done_cond);
+        pthread_cond_destroy(&work_cond);
+        pthread_mutex_destroy(&lock);
+    }
+public:
+    void start(const unsigned int n) {
+        stop();
+
+        slices = (n > 0) ? n : 1;
+        workers.resize(slices - 1);
+        for (size_t i=0;i < workers.size();i++) {
+            workers[i].pool = this;
+            workers[i].index = (unsigned int)(i + 1);
+            workers[i].seen = generation;
+            if (pthread_create(&workers[i].thread,NULL,worker_thread,&workers[i]) != 0) {
+                fprintf(stderr,"Failed to start worker thread\n");
+                workers.resize(i);
+                slices = (unsigned int)(i + 1);
+                break;
+            }
+        }
+    }
+    void stop(void) {
+        if (workers.empty()) return;
+
+        pthread_mutex_lock(&lock);
+        quit = true;
+        pthread_cond_broadcast(&work_cond);
+        pthread_mutex_unlock(&lock);
+
+        for (size_t i=0;i < workers.size();i++)
+            pthread_join(workers[i].thread,NULL);
+
+        workers.clear();
+        quit = false;
+        slices = 1;
+    }
+    /* run f() over all scanlines of the field, and wait for completion */
+    void run(scanline_slice_func_t f,void *ctx,const unsigned int _field,const unsigned int _height) {
+        unsigned int ystart,yend;
+
+        if (workers.empty()) {
+            f(ctx,_field,_height);
+            return;
+        }
+
+        pthread_mutex_lock(&lock);
+        func = f;
+        func_ctx = ctx;
+        field = _field;
+        height = _height;
+        pending = (unsigned int)workers.size();
+        generation++;
+        pthread_cond_broadcast(&work_cond);
+        pthread_mutex_unlock(&lock);
+
+        slice(0,ystart,yend);
+        f(ctx,ystart,yend);
+
+        pthread_mutex_lock(&lock);
+        while (pending != 0) pthread_cond_wait(&done_cond,&lock);
+        pthread_mutex_unlock(&lock);
+    }
+    unsigned int threads(void) const {
+        return slices;
+    }
+private:
+    struct Worker {
+        ScanlineThreadPool*     pool;
+        pthread_t               thread;
+        unsigned int            index;
+        unsigned long long      seen;
+    };
+    void slice(const unsigned int index,unsigned int &ystart,unsigned int &yend) const {
+        const unsigned int lines = (height > field) ? ((height - field + 1U) / 2U) : 0;
+        const unsigned int a = (unsigned int)(((unsigned long long)lines * index) / slices);
+        const unsigned int b = (unsigned int)(((unsigned long long)lines * (index + 1U)) / slices);
+
+        ystart = field + (a * 2U);
+        yend = std::min(field + (b * 2U),height);
+    }
+    static void *worker_thread(void *arg) {
+        Worker *w = (Worker*)arg;
+        ScanlineThreadPool *p = w->pool;
+        unsigned int ystart,yend;
+
+        do {
+            pthread_mutex_lock(&p->lock);
+            while (!p->quit && w->seen == p->generation) pthread_cond_wait(&p->work_cond,&p->lock);
+            if (p->quit) {
+                pthread_mutex_unlock(&p->lock);
+                break;
             }
+            w->seen = p->generation;
+            pthread_mutex_unlock(&p->lock);
+
+            p->slice(w->index,ystart,yend);
+            if (ystart < yend) p->func(p->func_ctx,ystart,yend);
+
+            pthread_mutex_lock(&p->lock);
+            if (--p->pending == 0) pthread_cond_signal(&p->done_cond);
+            pthread_mutex_unlock(&p->lock);
+        } while (1);
+
+        return NULL;
+    }
+private:
+    std::vector<Worker>         workers;
+    unsigned int                slices;
+    unsigned long long          generation;
+    unsigned int                pending;
+    bool                        quit;
+    scanline_slice_func_t       func;
+    void*                       func_ctx;
+    unsigned int                field;
+    unsigned int                height;
+    pthread_mutex_t             lock;
+    pthread_cond_t              work_cond;
+    pthread_cond_t              done_cond;
+};
+
+ScanlineThreadPool          video_thread_pool;
+
+/* NTS: The filter and subcarrier stages below process the scanlines ystart, ystart+2, ... up to but not including yend.
+ *      The parity of ystart selects the field. Pass field,height to process the whole field. */
+
+/* Reduced chroma resolution (-chroma-res): from Y/C separation on, the I and Q scanlines can be kept at 1/(1 << chroma_shift)
+ * of the width, in the first chroma_width() samples of each scanline of the plane. Sample k is the chroma at pixel
+ * k << chroma_shift. After the VHS chroma lowpass there is far less chroma bandwidth than even 1/4 of the width
+ * carries. The lowpass filters run at the reduced sample rate, and the chroma is interpolated back to full width
+ * only to put it back on the subcarrier or to write it out. */
+static inline unsigned int chroma_width(const unsigned int width,const unsigned int chroma_shift) {
+    return (width + (1U << chroma_shift) - 1U) >> chroma_shift;
+}
+
+/* one reduced resolution I or Q scanline back to full width, linear interpolation (the last sample is held).
+ * PLANE_LANES samples at a time, the in-between pixels interleaved in with shuffles. */
+static void chroma_line_upsample(plane_t *d,const plane_t *s,const unsigned int width,const unsigned int chroma_shift) {
+    static const plane_lanes_t lo = { 0, 8, 1, 9, 2, 10, 3, 11 },hi = { 4, 12, 5, 13, 6, 14, 7, 15 };
+    const unsigned int cw = chroma_width(width,chroma_shift);
+    const unsigned int n = 1U << chroma_shift;
+    plane_lanes_t a,b,m,q1,q3,u,v;
+    unsigned int k=0,r,x=0;
+
+    if (chroma_shift == 1) {
+        for (;(k+PLANE_LANES+1U) <= cw;k += PLANE_LANES,x += PLANE_LANES*2U) {
+            plane_lanes_load(a,s+k);
+            plane_lanes_load(b,s+k+1);
+            m = (a + b) >> 1;
+            plane_lanes_store_fit(d+x,__builtin_shuffle(a,m,lo));
+            plane_lanes_store_fit(d+x+PLANE_LANES,__builtin_shuffle(a,m,hi));
+        }
+    }
+    else if (chroma_shift == 2) {
+        for (;(k+PLANE_LANES+1U) <= cw;k += PLANE_LANES,x += PLANE_LANES*4U) {
+            plane_lanes_load(a,s+k);
+            plane_lanes_load(b,s+k+1);
+            m = (a + b) >> 1;
+            q1 = ((a * 3) + b) >> 2;
+            q3 = (a + (b * 3)) >> 2;
+            u = __builtin_shuffle(a,m,lo); // pixels 0 and 2 of each 4
+            v = __builtin_shuffle(q1,q3,lo); // pixels 1 and 3
+            plane_lanes_store_fit(d+x,__builtin_shuffle(u,v,lo));
+            plane_lanes_store_fit(d+x+PLANE_LANES,__builtin_shuffle(u,v,hi));
+            u = __builtin_shuffle(a,m,hi);
+            v = __builtin_shuffle(q1,q3,hi);
+            plane_lanes_store_fit(d+x+(PLANE_LANES*2U),__builtin_shuffle(u,v,lo));
+            plane_lanes_store_fit(d+x+(PLANE_LANES*3U),__builtin_shuffle(u,v,hi));
         }
     }
+
+    for (;(k+1U) < cw;k++) {
+        const int a = s[k],b = s[k+1];
+
+        for (r=0;r < n;r++) d[x++] = (plane_t)(((a * (int)(n - r)) + (b * (int)r)) >> chroma_shift);
+    }
+    for (;x < width;x++) d[x] = s[cw-1U];
 }
 
-void composite_lowpass(AVFrame *dstframe,int *fY,int *fI,int *fQ,unsigned int field,unsigned long long fieldno) {
-    unsigned int x,y;
+/* set up the 3 poles of a chroma lowpass filter of the I and Q planes at 1/(1 << chroma_shift) width, and the delay to take
+ * back off (delay pixels at full width). at full width that is setFilter() and delay whole pixels, as it always was. at less
+ * than full width each sample decays as much as 1 << chroma_shift samples at the full rate would, which lags a little
+ * less, so there is less delay to take back. the part of it that is not a whole number of samples is made up by
+ * interpolating the output back toward the output before it, by back of the way. */
+static void chroma_lowpass_setup(LowpassFilterLanes lp[3],unsigned int &samples,double &back,const double cutoff,const int delay,const unsigned int chroma_shift) {
+    const double rate = (315000000.00 * 4) / 88; // 315/88 Mhz rate * 4
+
+    if (chroma_shift == 0) {
+        for (unsigned int f=0;f < 3;f++) {
+            lp[f].setFilter(rate,cutoff);
+            lp[f].resetFilter(0);
+        }
 
-    { /* lowpass the chroma more. composite video does not allocate as much bandwidth to color as luma. */
-        for (unsigned int p=1;p <= 2;p++) {
-            for (y=field;y < dstframe->height;y += 2) {
-                int *P = ((p == 1) ? fI : fQ) + (dstframe->width * y);
-                LowpassFilter lp[3];
-                double cutoff;
-                int delay;
-                double s;
-
-                // NTSC YIQ bandwidth: I=1.3MHz Q=0.6MHz
-                cutoff = (p == 1) ? 1300000 : 600000;
-                delay = (p == 1) ? 2 : 4;
-
-                for (unsigned int f=0;f < 3;f++) {
-                    lp[f].setFilter((315000000.00 * 4) / 88,cutoff); // 315/88 Mhz rate * 4
-                    lp[f].resetFilter(0);
-                }
+        samples = (unsigned int)delay;
+        back = 0;
+    }
+    else {
+        const double n = (double)(1U << chroma_shift);
+        LowpassFilter full;
+
+        full.setFilter(rate,cutoff);
+
+        const double r = 1.0 - full.alpha,rn = pow(r,n);
+        const double lag = (r / (1.0 - r)) - ((n * rn) / (1.0 - rn)); // how much less each pole lags, in pixels
+        const double d = std::max(0.0,((double)delay - (3.0 * lag)) / n); // samples
+
+        for (unsigned int f=0;f < 3;f++) {
+            lp[f].setAlpha(1.0 - rn);
+            lp[f].resetFilter(0);
+        }
 
-                for (x=0;x < dstframe->width;x++) {
-                    s = P[x];
-                    for (unsigned int f=0;f < 3;f++) s = lp[f].lowpass(s);
-                    if (x >= delay) P[x-delay] = s;
+        samples = (unsigned int)ceil(d);
+        back = (double)samples - d;
+    }
+}
+
+/* 3-pole chroma lowpass of scanlines ystart...yend of the I and Q planes, LOWPASS_LANES scanlines at a time.
+ * the planes are at 1/(1 << chroma_shift) width, the delays are full width pixels */
+static void composite_chroma_lowpass_lanes(AVFrame *dstframe,plane_t *fI,plane_t *fQ,unsigned int ystart,unsigned int yend,const double cutoff_I,const int delay_I,const double cutoff_Q,const int delay_Q,const unsigned int chroma_shift) {
+    const unsigned int count = (yend > ystart) ? ((yend - ystart + 1U) / 2U) : 0;
+    const unsigned int width = chroma_width(dstframe->width,chroma_shift);
+    plane_t *rows[count + 1];
+    plane_t scratch[width];
+    unsigned int x,y,i;
+    plane_t *P[LOWPASS_LANES];
+
+    memset(scratch,0,sizeof(scratch));
+
+    for (unsigned int p=1;p <= 2;p++) {
+        const double cutoff = (p == 1) ? cutoff_I : cutoff_Q;
+
+        for (i=0,y=ystart;y < yend;y += 2) rows[i++] = ((p == 1) ? fI : fQ) + (dstframe->width * y);
+
+        for (i=0;i < count;i += LOWPASS_LANES) {
+            LowpassFilterLanes lp[3];
+            lowpass_lanes_t s,prev,w;
+            unsigned int delay;
+            double back;
+
+            lowpass_lanes_rows(P,rows,count,i,scratch);
+
+            chroma_lowpass_setup(lp,delay,back,cutoff,(p == 1) ? delay_I : delay_Q,chroma_shift);
+            lowpass_lanes_set(prev,0);
+            lowpass_lanes_set(w,back);
+
+            for (x=0;x < width;x++) {
+                lowpass_lanes_load(s,P,x);
+                for (unsigned int f=0;f < 3;f++) lp[f].lowpass(s);
+                if (x >= delay) {
+                    if (back != 0)
+                        lowpass_lanes_store(P,x-delay,s + ((prev - s) * w));
+                    else
+                        lowpass_lanes_store(P,x-delay,s);
                 }
+                prev = s;
             }
         }
     }
 }
 
-void chroma_into_luma(AVFrame *dstframe,int *fY,int *fI,int *fQ,unsigned int field,unsigned long long fieldno,int subcarrier_amplitude) {
+/* lighter-weight filtering, probably what your old CRT does to reduce color fringes a bit */
+void composite_lowpass_tv(AVFrame *dstframe,plane_t *fY,plane_t *fI,plane_t *fQ,unsigned int ystart,unsigned int yend,unsigned long long fieldno,unsigned int chroma_shift) {
+    composite_chroma_lowpass_lanes(dstframe,fI,fQ,ystart,yend,2600000,1,2600000,1,chroma_shift);
+}
+
+void composite_lowpass(AVFrame *dstframe,plane_t *fY,plane_t *fI,plane_t *fQ,unsigned int ystart,unsigned int yend,unsigned long long fieldno,unsigned int chroma_shift) {
+    /* lowpass the chroma more. composite video does not allocate as much bandwidth to color as luma. */
+    // NTSC YIQ bandwidth: I=1.3MHz Q=0.6MHz
+    composite_chroma_lowpass_lanes(dstframe,fI,fQ,ystart,yend,1300000,2,600000,4,chroma_shift);
+}
+
+/* Subcarrier modulator/demodulator kernels, SUBCARRIER_LANES pixels at a time.
+ * The subcarrier repeats every 4 pixels, so a vector of SUBCARRIER_LANES (a multiple of 4) pixels that starts at a
+ * multiple of 4 always sees the same part of it for a given phase xi. The per-pixel table lookups become a multiply
+ * by a pattern vector made once per scanline. Same results as the scalar code, bit for bit. */
+#define SUBCARRIER_LANES 8
+
+typedef int32_t subcarrier_lanes_t __attribute__((vector_size(sizeof(int32_t) * SUBCARRIER_LANES)));
+typedef double subcarrier_lanes_d_t __attribute__((vector_size(sizeof(double) * SUBCARRIER_LANES)));
+
+/* n / d, rounded toward zero like C integer division, as a multiply by the reciprocal of d.
+ * trunc(n * (1/d)) can land just below an exact quotient, so the reciprocal is made larger by 2^-40. That is
+ * enough to never fall short, and too little to reach the next integer for any 32-bit n and d. */
+class SubcarrierDivider {
+public:
+    SubcarrierDivider(const int d) : recip((1.0 / d) * (1.0 + (1.0 / 1099511627776.0/*2^40*/))) { }
+    inline int operator()(const int n) const {
+        return (int)((double)n * recip);
+    }
+    inline void lanes(subcarrier_lanes_t &n) const {
+        subcarrier_lanes_d_t f;
+
+        for (unsigned int l=0;l < SUBCARRIER_LANES;l++) f[l] = (double)n[l];
+        f *= recip;
+        for (unsigned int l=0;l < SUBCARRIER_LANES;l++) n[l] = (int32_t)f[l];
+    }
+public:
+    double recip;
+};
+
+void chroma_into_luma(AVFrame *dstframe,plane_t *fY,plane_t *fI,plane_t *fQ,unsigned int ystart,unsigned int yend,unsigned long long fieldno,int subcarrier_amplitude,unsigned int chroma_shift) {
     /* render chroma into luma, fake subcarrier */
+    const SubcarrierDivider div50(50);
+    subcarrier_lanes_t vY,vI,vQ,mU,mV;
+    plane_t upI[chroma_shift ? dstframe->width : 1];
+    plane_t upQ[chroma_shift ? dstframe->width : 1];
     unsigned int x,y;
 
-    for (y=field;y < dstframe->height;y += 2) {
+    for (y=ystart;y < yend;y += 2) {
         static const int8_t Umult[4] = { 1, 0,-1, 0 };
         static const int8_t Vmult[4] = { 0, 1, 0,-1 };
-        int *Y = fY + (y * dstframe->width);
-        int *I = fI + (y * dstframe->width);
-        int *Q = fQ + (y * dstframe->width);
+        plane_t *Y = fY + (y * dstframe->width);
+        plane_t *I = fI + (y * dstframe->width);
+        plane_t *Q = fQ + (y * dstframe->width);
         unsigned int xc = dstframe->width;
         unsigned int xi;
 
+        if (chroma_shift) { /* reduced resolution chroma, back to full width first */
+            chroma_line_upsample(upI,I,xc,chroma_shift);
+            chroma_line_upsample(upQ,Q,xc,chroma_shift);
+            memset(I,0,xc*sizeof(plane_t));
+            memset(Q,0,xc*sizeof(plane_t));
+            I = upI;
+            Q = upQ;
+        }
+
         if (video_scanline_phase_shift == 90)
             xi = (fieldno + video_scanline_phase_shift_offset + (y >> 1)) & 3;
         else if (video_scanline_phase_shift == 180)
@@ -1478,49 +2997,73 @@ void chroma_into_luma(AVFrame *dstframe,int *fY,int *fI,int *fQ,unsigned int fie
         else
             xi = video_scanline_phase_shift_offset & 3;
 
+        for (unsigned int l=0;l < SUBCARRIER_LANES;l++) {
+            mU[l] = subcarrier_amplitude * Umult[(xi+l)&3];
+            mV[l] = subcarrier_amplitude * Vmult[(xi+l)&3];
+        }
+
         /* remember: this code assumes 4:2:2 */
         /* NTS: the subcarrier is two sine waves superimposed on top of each other, 90 degrees apart */
-        for (x=0;x < xc;x++) {
+        for (x=0;(x+SUBCARRIER_LANES) <= xc;x += SUBCARRIER_LANES) {
+            plane_lanes_load(vY,Y+x);
+            plane_lanes_load(vI,I+x);
+            plane_lanes_load(vQ,Q+x);
+            vI = (vI * mU) + (vQ * mV);
+            div50.lanes(vI);
+            vY += vI;
+            plane_lanes_store(Y+x,vY);
+        }
+        for (;x < xc;x++) {
             unsigned int sxi = xi+x;
             int chroma;
 
             chroma  = (int)I[x] * subcarrier_amplitude * Umult[sxi&3];
             chroma += (int)Q[x] * subcarrier_amplitude * Vmult[sxi&3];
-            Y[x] += (chroma / 50);
-            I[x] = 0;
-            Q[x] = 0;
+            Y[x] = plane_sat(Y[x] + div50(chroma));
+        }
+
+        if (!chroma_shift) {
+            memset(I,0,xc*sizeof(plane_t));
+            memset(Q,0,xc*sizeof(plane_t));
         }
     }
 }
 
-void chroma_from_luma(AVFrame *dstframe,int *fY,int *fI,int *fQ,unsigned int field,unsigned long long fieldno,int subcarrier_amplitude) {
+void chroma_from_luma(AVFrame *dstframe,plane_t *fY,plane_t *fI,plane_t *fQ,unsigned int ystart,unsigned int yend,unsigned long long fieldno,int subcarrier_amplitude,unsigned int chroma_shift) {
     /* decode color from luma */
-    int chroma[dstframe->width]; // WARNING: This is more GCC-specific C++ than normal
+    const unsigned int width = dstframe->width;
+    int chroma[width]; // WARNING: This is more GCC-specific C++ than normal
+    int line[width + 4]; // the scanline with 1 pixel of padding before and 3 after, for the box blur
+    const SubcarrierDivider div(subcarrier_amplitude);
+    subcarrier_lanes_t a,b,c,d,m;
     unsigned int x,y;
 
-    for (y=field;y < dstframe->height;y += 2) {
-        int *Y = fY + (y * dstframe->width);
-        int *I = fI + (y * dstframe->width);
-        int *Q = fQ + (y * dstframe->width);
-        int delay[4] = {0,0,0,0};
-        int sum = 0;
-        int c;
-
-        // precharge by 2 pixels to center box blur
-        delay[2] = Y[0]; sum += delay[2];
-        delay[3] = Y[1]; sum += delay[3];
-        for (x=0;x < dstframe->width;x++) {
-            if ((x+2) < dstframe->width)
-                c = Y[x+2];
-            else
-                c = 0;
+    for (y=ystart;y < yend;y += 2) {
+        plane_t *Y = fY + (y * dstframe->width);
+        plane_t *I = fI + (y * dstframe->width);
+        plane_t *Q = fQ + (y * dstframe->width);
 
-            sum -= delay[0];
-            for (unsigned int j=0;j < (4-1);j++) delay[j] = delay[j+1];
-            delay[3] = c;
-            sum += delay[3];
-            Y[x] = sum / 4;
-            chroma[x] = c - Y[x];
+        /* 4 pixel box blur of x-1...x+2 (pixels off the scanline are 0), chroma is what the pixel at x+2 has on top of it */
+        line[0] = 0;
+        for (x=0;(x+SUBCARRIER_LANES) <= width;x += SUBCARRIER_LANES) {
+            plane_lanes_load(a,Y+x);
+            memcpy(line+1+x,&a,sizeof(a));
+        }
+        for (;x < width;x++) line[1+x] = Y[x];
+        line[width+1] = line[width+2] = line[width+3] = 0;
+        for (x=0;(x+SUBCARRIER_LANES) <= width;x += SUBCARRIER_LANES) {
+            memcpy(&a,line+x+0,sizeof(a));
+            memcpy(&b,line+x+1,sizeof(b));
+            memcpy(&c,line+x+2,sizeof(c));
+            memcpy(&d,line+x+3,sizeof(d));
+            a = (a + b + c + d) / 4;
+            plane_lanes_store_fit(Y+x,a); // the average of samples of the plane
+            d -= a;
+            memcpy(chroma+x,&d,sizeof(d));
+        }
+        for (;x < width;x++) {
+            Y[x] = (line[x] + line[x+1] + line[x+2] + line[x+3]) / 4;
+            chroma[x] = line[x+3] - Y[x];
         }
 
         {
@@ -1535,123 +3078,277 @@ void chroma_from_luma(AVFrame *dstframe,int *fY,int *fI,int *fQ,unsigned int fie
             else
                 xi = video_scanline_phase_shift_offset & 3;
 
-            for (x=((4-xi)&3);(x+3) < dstframe->width;x += 4) { // flip the part of the sine wave that would correspond to negative U and V values
-                chroma[x+2] = -chroma[x+2];
-                chroma[x+3] = -chroma[x+3];
+            /* flip the part of the sine wave that would correspond to negative U and V values: the last 2 pixels of
+             * each whole group of 4 from flip_start on. the flip and the amplitude are both in the multiplier. */
+            const unsigned int flip_start = (4-xi)&3;
+            const unsigned int flip_end = (width >= flip_start) ? (flip_start + (((width - flip_start) / 4) * 4)) : flip_start;
+
+            for (unsigned int l=0;l < SUBCARRIER_LANES;l++)
+                m[l] = (((xi+l)&3) >= 2) ? -50 : 50;
+
+            for (x=0;x < width;) {
+                if ((x & 3) == 0 && x >= flip_start && (x+SUBCARRIER_LANES) <= flip_end) {
+                    memcpy(&a,chroma+x,sizeof(a));
+                    a *= m;
+                    div.lanes(a);
+                    memcpy(chroma+x,&a,sizeof(a));
+                    x += SUBCARRIER_LANES;
+                }
+                else {
+                    chroma[x] = div(chroma[x] * ((x >= flip_start && x < flip_end && ((xi+x)&3) >= 2) ? -50 : 50));
+                    x++;
+                }
             }
 
-            for (x=0;x < dstframe->width;x++) {
-                chroma[x] = ((int)chroma[x] * 50) / subcarrier_amplitude;
-            }
+            /* decode the color right back out from the subcarrier we generated. even pixels take I and Q from the
+             * subcarrier, odd pixels are the average of the even pixels on either side. vectors while the chroma
+             * they read is all on the scanline, the usual two passes for the rest. */
+            if (chroma_shift) {
+                /* reduced resolution: the even pixels are all there is at 1/2 width, 1/4 width is those through a 1-2-1 filter */
+                static const subcarrier_lanes_t Isel = { 0, 2, 4, 6, 8, 10, 12, 14 };
+                static const subcarrier_lanes_t Qsel = { 1, 3, 5, 7, 9, 11, 13, 15 };
+                const unsigned int hw = chroma_width(width,1);
+                unsigned int k;
+
+                for (k=0;((k*2)+xi+(SUBCARRIER_LANES*2)) <= width;k += SUBCARRIER_LANES) {
+                    memcpy(&a,chroma+(k*2)+xi,sizeof(a));
+                    memcpy(&b,chroma+(k*2)+xi+SUBCARRIER_LANES,sizeof(b));
+                    plane_lanes_store(I+k,-__builtin_shuffle(a,b,Isel));
+                    plane_lanes_store(Q+k,-__builtin_shuffle(a,b,Qsel));
+                }
+                for (;((k*2)+xi+1) < width;k++) {
+                    I[k] = plane_sat(-chroma[(k*2)+xi+0]);
+                    Q[k] = plane_sat(-chroma[(k*2)+xi+1]);
+                }
+                for (;k < hw;k++) {
+                    I[k] = 0;
+                    Q[k] = 0;
+                }
 
-            /* decode the color right back out from the subcarrier we generated */
-            for (x=0;(x+xi+1) < dstframe->width;x += 2) {
-                I[x] = -chroma[x+xi+0];
-                Q[x] = -chroma[x+xi+1];
-            }
-            for (;x < dstframe->width;x += 2) {
-                I[x] = 0;
-                Q[x] = 0;
-            }
-            for (x=0;(x+2) < dstframe->width;x += 2) {
-                I[x+1] = (I[x] + I[x+2]) >> 1;
-                Q[x+1] = (Q[x] + Q[x+2]) >> 1;
+                if (chroma_shift > 1) { /* in place, sample k only reads samples k and up */
+                    const unsigned int cw = chroma_width(width,2);
+                    int pI = I[0],pQ = Q[0];
+
+                    for (k=0;k < cw;k++) {
+                        const int nI = ((k*2)+1) < hw ? I[(k*2)+1] : I[k*2];
+                        const int nQ = ((k*2)+1) < hw ? Q[(k*2)+1] : Q[k*2];
+                        const int cI = I[k*2],cQ = Q[k*2];
+
+                        I[k] = (pI + (cI * 2) + nI) >> 2;
+                        Q[k] = (pQ + (cQ * 2) + nQ) >> 2;
+                        pI = nI;
+                        pQ = nQ;
+                    }
+                }
             }
-            for (;x < dstframe->width;x++) {
-                I[x] = 0;
-                Q[x] = 0;
+            else {
+                static const subcarrier_lanes_t Isel = { 0, 0, 2, 2, 4, 4, 6, 6 },Inext = { 0, 2, 2, 4, 4, 6, 6, 8 };
+                static const subcarrier_lanes_t Qsel = { 1, 1, 3, 3, 5, 5, 7, 7 },Qnext = { 1, 3, 3, 5, 5, 7, 7, 9 };
+                unsigned int x0;
+
+                for (x=0;(x+xi+SUBCARRIER_LANES+2) <= width;x += SUBCARRIER_LANES) {
+                    memcpy(&a,chroma+x+xi,sizeof(a));
+                    memcpy(&b,chroma+x+xi+SUBCARRIER_LANES,sizeof(b));
+                    c = -(__builtin_shuffle(a,b,Isel) + __builtin_shuffle(a,b,Inext)) >> 1;
+                    d = -(__builtin_shuffle(a,b,Qsel) + __builtin_shuffle(a,b,Qnext)) >> 1;
+                    plane_lanes_store(I+x,c);
+                    plane_lanes_store(Q+x,d);
+                }
+
+                for (x0=x;(x+xi+1) < width;x += 2) {
+                    I[x] = plane_sat(-chroma[x+xi+0]);
+                    Q[x] = plane_sat(-chroma[x+xi+1]);
+                }
+                for (;x < width;x += 2) {
+                    I[x] = 0;
+                    Q[x] = 0;
+                }
+                for (x=x0;(x+2) < width;x += 2) {
+                    I[x+1] = (I[x] + I[x+2]) >> 1;
+                    Q[x+1] = (Q[x] + Q[x+2]) >> 1;
+                }
+                for (;x < width;x++) {
+                    I[x] = 0;
+                    Q[x] = 0;
+                }
             }
         }
     }
 }
 
-// This code assumes ARGB and the frame match resolution/
-void composite_layer(AVFrame *dstframe,AVFrame *srcframe,InputFile &inputfile,unsigned int field,unsigned long long fieldno) {
-    unsigned char opposite;
-    uint32_t *dscan,*sscan;
-    unsigned int x,y;
-    unsigned int shr;
-    int *fY,*fI,*fQ;
-    int r,g,b;
+/* front half cache (-front-cache). the front half of the chain (RGB or Y'CbCr to YIQ, input chroma lowpass,
+ * then chroma into luma and composite preemphasis) depends only on the source frame, the field, and for the
+ * second part the subcarrier phase of the field. a source frame that lasts several fields (film, low frame
+ * rates, frame holds) comes back with the same field every other field, and with the same phase every 4th
+ * field (every other one with -comp-phase 0). the cache keeps the field's scanlines at two points:
+ *
+ *   YIQ after the input chroma lowpass, keyed on (source, field)
+ *   luma after chroma into luma and preemphasis, keyed on (source, field, phase). I and Q are zero by then.
+ *
+ * the source is a serial number given to each new frame, see InputFile::video_frame_next(). fields are only kept
+ * while the source has frames that last more than 2 fields. where every frame is new every field or two (29.97i,
+ * 59.94p) no key ever comes back, and copying the planes in would make the render slower. */
+struct FrontCacheEntry {
+    FrontCacheEntry() : serial(0), field(0), phase(-1), used(0) { }
+    unsigned long long      serial;     // source frame (0 = empty)
+    unsigned int            field;
+    int                     phase;      // subcarrier phase of the modulated luma, -1 for the YIQ planes before it
+    unsigned long long      used;       // last use, the least recently used entry is replaced
+    std::vector<plane_t>    Y,I,Q;      // the field's scanlines only (scanline y at row y >> 1)
+};
 
-    if (dstframe == NULL || srcframe == NULL) return;
-    if (dstframe->data[0] == NULL || srcframe->data[0] == 0) return;
-    if (dstframe->linesize[0] < (dstframe->width*4)) return; // ARGB
-    if (srcframe->linesize[0] < (srcframe->width*4)) return; // ARGB
-    if (dstframe->width != srcframe->width) return;
-    if (dstframe->height != srcframe->height) return;
+static std::vector<FrontCacheEntry> front_cache;
+static unsigned long long   front_cache_clock = 0;
+static unsigned long long   front_cache_serial = 0;     // newest source frame seen
+static unsigned int         front_cache_fields = 0;     // fields it has lasted so far
+static unsigned long long   front_cache_long = 0;       // last source frame that lasted more than 2 fields
 
-    if (srcframe->interlaced_frame)
-        opposite = (srcframe->top_field_first ? 1 : 0);
-    else
-        opposite = 0;
+/* the subcarrier phase chroma_into_luma() gives the field's scanlines, as far as it differs between fields */
+static inline int front_cache_phase(const unsigned long long fieldno) {
+    if (video_scanline_phase_shift == 90 || video_scanline_phase_shift == 180 || video_scanline_phase_shift == 270)
+        return (int)(fieldno & 3ULL);
 
-    fY = new int[dstframe->width * dstframe->height];
-    fI = new int[dstframe->width * dstframe->height];
-    fQ = new int[dstframe->width * dstframe->height];
+    return (int)(fieldno & 1ULL);
+}
 
-    memset(fY,0,sizeof(dstframe->width*dstframe->height)*sizeof(int));
-    memset(fI,0,sizeof(dstframe->width*dstframe->height)*sizeof(int));
-    memset(fQ,0,sizeof(dstframe->width*dstframe->height)*sizeof(int));
+static FrontCacheEntry *front_cache_find(const unsigned long long serial,const unsigned int field,const int phase) {
+    for (size_t i=0;i < front_cache.size();i++) {
+        FrontCacheEntry &e = front_cache[i];
 
-    for (y=field;y < dstframe->height;y += 2) {
-        sscan = (uint32_t*)(srcframe->data[0] + (srcframe->linesize[0] * std::min(y+opposite,(unsigned int)dstframe->height-1U)));
-        for (x=0;x < dstframe->width;x++,dscan++,sscan++) {
-            r  = (*sscan >> 16UL) & 0xFF;
-            g  = (*sscan >>  8UL) & 0xFF;
-            b  = (*sscan >>  0UL) & 0xFF;
-            RGB_to_YIQ(fY[(y*dstframe->width)+x],fI[(y*dstframe->width)+x],fQ[(y*dstframe->width)+x],r,g,b);
+        if (e.serial == serial && e.field == field && e.phase == phase) {
+            e.used = ++front_cache_clock;
+            return &e;
         }
     }
 
-    if (composite_in_chroma_lowpass) 
-        composite_lowpass(dstframe,fY,fI,fQ,field,fieldno);
+    return NULL;
+}
 
-    chroma_into_luma(dstframe,fY,fI,fQ,field,fieldno,subcarrier_amplitude);
+/* take the least recently used entry (never 'keep') for a new key */
+static FrontCacheEntry *front_cache_take(const unsigned long long serial,const unsigned int field,const int phase,const FrontCacheEntry *keep,const size_t planes) {
+    FrontCacheEntry *e = NULL;
 
-	/* video composite preemphasis */
-	if (composite_preemphasis != 0 && composite_preemphasis_cut > 0) {
-	  
-		for (y=field;y < dstframe->height;y += 2) {
-			int *Y = fY + (y * dstframe->width);
-			LowpassFilter pre;
-			double s;
-			
-	                pre.setFilter((315000000.00 * 4) / 88,composite_preemphasis_cut); // 315/88 Mhz rate * 4  vs 1.0MHz cutoff
-			pre.resetFilter(16);
-			for (x=0;x < dstframe->width;x++) {
-				s = Y[x];
-				s += pre.highpass(s) * composite_preemphasis;
-				Y[x] = (int)s;
-			}
-		}
-	}
+    if (front_cache.size() != video_front_cache)
+        front_cache.resize(video_front_cache);
 
-	/* add video noise */
-	if (video_noise != 0) {
-	  int noise = 0, noise_mod = (video_noise*2)+1; /* ,noise_mod = (video_noise * 255) / 100; */
+    for (size_t i=0;i < front_cache.size();i++) {
+        if (&front_cache[i] == keep) continue;
+        if (e == NULL || front_cache[i].used < e->used) e = &front_cache[i];
+    }
+    if (e == NULL) return NULL;
+
+    e->serial = serial;
+    e->field = field;
+    e->phase = phase;
+    e->used = ++front_cache_clock;
+    e->Y.resize(planes);
+    if (phase < 0) {
+        e->I.resize(planes);
+        e->Q.resize(planes);
+    }
 
-		for (y=field;y < dstframe->height;y += 2) {
-			int *Y = fY + (y * dstframe->width);
+    return e;
+}
 
-			for (x=0;x < dstframe->width;x++) {
-				Y[x] += noise;
-				noise += ((int)((unsigned int)rand() % noise_mod)) - video_noise;
-				noise /= 2;
-			}
-		}
+/* state shared by the per-scanline stages of one composite_layer() call */
+struct CompositeLayerJob {
+    AVFrame*                dstframe;
+    AVFrame*                srcframe;
+    plane_t*                fY;
+    plane_t*                fI;
+    plane_t*                fQ;
+    unsigned long long      fieldno;
+    unsigned char           opposite;
+    unsigned int            field;
+    double                  luma_cut,chroma_cut;
+    int                     chroma_delay;
+    unsigned int            chroma_shift;   // I/Q resolution from Y/C separation on (see chroma_width())
+    /* front half cache, decided before the parallel stages (see front_cache_plan()) */
+    unsigned int            front_done;     // 0 = run the front half, 1 = YIQ from front_from, 2 = modulated luma from front_from
+    FrontCacheEntry*        front_from;
+    FrontCacheEntry*        front_toYIQ;    // keep the YIQ planes here (or NULL)
+    FrontCacheEntry*        front_toY;      // keep the modulated luma here (or NULL)
+    /* random decisions, made in scanline order before the parallel stages (see composite_layer_decide()) */
+    std::vector<NoiseLinePick> luma_noise;  // per scanline, from luma_noise_bank
+    std::vector<NoiseLinePick> chroma_noiseI; // per scanline, from chroma_noise_bank
+    std::vector<NoiseLinePick> chroma_noiseQ; // per scanline, same
+    std::vector<int>        head_switch;    // per scanline head switching shift (pixels)
+    std::vector<double>     chroma_phase;   // per scanline chroma phase noise (radians)
+    std::vector<unsigned char> chroma_loss; // per scanline, nonzero if the chroma drops out
+    /* pipeline mode: the chroma vertical blend needs the scanline above, which may be another slice's */
+    std::vector< std::vector<plane_t> > blend_carryI,blend_carryQ; // pre-blend chroma of the last scanline of a slice
+    std::vector<unsigned char> blend_deferred; // first scanline of a slice, finished after the parallel stage
+    /* YIQ working planes (fY, fI, fQ point into these) */
+    std::vector<plane_t>    planeY,planeI,planeQ;
+};
+
+/* there is only ever one composite_layer() at a time. the job is kept across calls so that its planes
+ * and per-scanline vectors keep their memory, and the steady state does not allocate. */
+static CompositeLayerJob composite_layer_job;
+
+/* look the field up in the front half cache, and pick the entries to keep this field's front half in */
+static void front_cache_plan(CompositeLayerJob &j,const unsigned long long serial) {
+    const size_t planes = (size_t)j.dstframe->width * (size_t)((j.dstframe->height + 1U) / 2U);
+    const int phase = front_cache_phase(j.fieldno);
+    bool fill;
+
+    j.front_done = 0;
+    j.front_from = j.front_toYIQ = j.front_toY = NULL;
+    if (serial == 0 || video_front_cache == 0)
+        return;
+
+    /* count the fields of the newest source frame (with -emulate-per-layer the other inputs' go by in between) */
+    if (serial > front_cache_serial) {
+        front_cache_serial = serial;
+        front_cache_fields = 0;
+    }
+    if (serial == front_cache_serial && (++front_cache_fields) > 2)
+        front_cache_long = serial;
+    fill = front_cache_long != 0 && serial <= (front_cache_long + 4); // a long one within the last 4 frames
+
+    for (size_t i=0;i < front_cache.size();i++) { // another frame size
+        if (front_cache[i].Y.size() != planes) front_cache[i].serial = 0;
+    }
+
+    if ((j.front_from = front_cache_find(serial,j.field,phase)) != NULL) {
+        j.front_done = 2;
+    }
+    else if ((j.front_from = front_cache_find(serial,j.field,-1)) != NULL) {
+        j.front_done = 1;
+        if (fill) j.front_toY = front_cache_take(serial,j.field,phase,j.front_from,planes);
+    }
+    else if (fill) {
+        j.front_toYIQ = front_cache_take(serial,j.field,-1,NULL,planes);
+        j.front_toY = front_cache_take(serial,j.field,phase,j.front_toYIQ,planes);
+    }
+}
+
+/* decide everything random about this field up front, so that the scanline stages can run in any order on
+ * any thread. every decision comes from the counter-based generator keyed by field, scanline and stage. */
+static void composite_layer_decide(CompositeLayerJob &j) {
+    AVFrame *dstframe = j.dstframe;
+    const unsigned int field = j.field;
+    unsigned int y;
+
+    noise_banks_prepare(dstframe->width);
+
+	/* video noise */
+	if (video_noise != 0) {
+		j.luma_noise.resize(dstframe->height);
+		for (y=field;y < dstframe->height;y += 2)
+			j.luma_noise[y] = luma_noise_bank.pick(noise_pick(j.fieldno,y,NOISE_STAGE_LUMA),dstframe->width);
 	}
 
 	// VHS head switching noise
 	if (vhs_head_switching) {
 		unsigned int twidth = dstframe->width + (dstframe->width / 10);
-		unsigned int tx,x,p,x2,shy=0;
+		unsigned int x,p,shy=0;
 		double noise = 0;
 		int shif,ishif,y;
 		double t;
 
 		if (vhs_head_switching_phase_noise != 0) {
-			unsigned int x = (unsigned int)rand() * (unsigned int)rand() * (unsigned int)rand() * (unsigned int)rand();
+			unsigned int x = noise_pick(j.fieldno,0,NOISE_STAGE_HEAD_SWITCH);
 			x %= 2000000000U;
 			noise = ((double)x / 1000000000U) - 1.0;
 			noise *= vhs_head_switching_phase_noise;
@@ -1673,81 +3370,334 @@ void composite_layer(AVFrame *dstframe,AVFrame *srcframe,InputFile &inputfile,un
 		else
 			y -= (312 - 288) * 2;
 
-		tx = x;
 		if (x >= (twidth/2))
 			ishif = x - twidth;
 		else
 			ishif = x;
 
+		/* NTS: the first scanline is never shifted (shif == 0), so the shift always starts at x=0 */
+		j.head_switch.assign(dstframe->height,0);
 		shif = 0;
 		while (y < dstframe->height) {
-			if (y >= 0) {
-			    int *Y = fY + (y * dstframe->width);
-
-				if (shif != 0) {
-					int tmp[twidth];
-
-					/* WARNING: This is not 100% accurate. On real VHS you'd see the line shifted over and the next line's contents after hsync. */
-
-					/* luma. the chroma subcarrier is there, so this is all we have to do. */
-					x2 = (tx + twidth + (unsigned int)shif) % (unsigned int)twidth;
-					memset(tmp,0,sizeof(tmp));
-					memcpy(tmp,Y,dstframe->width*sizeof(int));
-					for (x=tx;x < dstframe->width;x++) {
-						Y[x] = tmp[x2];
-						if ((++x2) == twidth) x2 = 0;
-					}
-				}
-			}
+			if (y >= 0)
+				j.head_switch[y] = shif;
 
 			if (shy == 0)
 				shif = ishif;
 			else
 				shif = (shif * 7) / 8;
 
-			tx = 0;
 			y += 2;
 			shy++;
 		}
 	}
 
-    if (!nocolor_subcarrier)
-        chroma_from_luma(dstframe,fY,fI,fQ,field,fieldno,subcarrier_amplitude_back);
-
 	/* add video noise */
 	if (video_chroma_noise != 0) {
-		int noiseU = 0,noiseV = 0,noise_mod = (video_chroma_noise * 255) / 100;
+		j.chroma_noiseI.resize(dstframe->height);
+		j.chroma_noiseQ.resize(dstframe->height);
+		for (y=field;y < dstframe->height;y += 2) {
+			j.chroma_noiseI[y] = chroma_noise_bank.pick(noise_pick(j.fieldno,y,NOISE_STAGE_CHROMA_U),dstframe->width);
+			j.chroma_noiseQ[y] = chroma_noise_bank.pick(noise_pick(j.fieldno,y,NOISE_STAGE_CHROMA_V),dstframe->width);
+		}
+	}
+	if (video_chroma_phase_noise != 0) {
+		int noise = 0;
+
+		/* the rotation is done by composite_layer_vhs_slice() */
+		j.chroma_phase.resize(dstframe->height);
+		for (y=field;y < dstframe->height;y += 2) {
+			noise += ((int)(noise_at(noise_key(j.fieldno,0,NOISE_STAGE_CHROMA_PHASE),y) % ((video_chroma_phase_noise*2)+1))) - video_chroma_phase_noise;
+			noise /= 2;
+			j.chroma_phase[y] = ((double)noise * M_PI) / 100;
+		}
+	}
 
+	if (video_chroma_loss != 0) {
+		j.chroma_loss.assign(dstframe->height,0);
 		for (y=field;y < dstframe->height;y += 2) {
-			int *U = fI + (y * dstframe->width);
-			int *V = fQ + (y * dstframe->width);
+			if ((noise_pick(j.fieldno,y,NOISE_STAGE_CHROMA_LOSS)%100000) < video_chroma_loss)
+				j.chroma_loss[y] = 1;
+		}
+	}
+}
+
+/* VHS chroma vertical blend of one scanline with the one above it (delay line) */
+static inline void composite_layer_vert_blend(plane_t *U,plane_t *V,plane_t *delayU,plane_t *delayV,const unsigned int width) {
+    int cU,cV;
+
+    for (unsigned int x=0;x < width;x++) {
+        cU = U[x];
+        cV = V[x];
+        U[x] = (delayU[x]+cU+1)>>1;
+        V[x] = (delayV[x]+cV+1)>>1;
+        delayU[x] = cU;
+        delayV[x] = cV;
+    }
+}
+
+/* native YUV ingest: decoded Y'CbCr planes straight to YIQ. chroma is cosited (MPEG-2), 4:2:0 chroma is interpolated
+ * vertically 3:1 from the two nearest chroma lines of the same field if the source is interlaced, 4:2:0 and 4:2:2
+ * chroma are interpolated horizontally. the loops are kept simple so that GCC can vectorize them. */
+static void composite_layer_ingest_yuv(CompositeLayerJob &j,unsigned int ystart,unsigned int yend) {
+    AVFrame *dstframe = j.dstframe;
+    AVFrame *srcframe = j.srcframe;
+    const unsigned int width = dstframe->width;
+    unsigned int hshift = 0,vshift = 0;
+    bool full_range = false;
+    unsigned int x,y;
+
+    yuv_ingest_format(srcframe->format,hshift,vshift,full_range);
+
+    const YCbCr_to_YIQ_matrix &mat = full_range ? YCbCr_to_YIQ_full : YCbCr_to_YIQ_limited;
+    const int cw = (int)((width + (1U << hshift) - 1U) >> hshift);
+    const int ch = (int)((dstframe->height + (1U << vshift) - 1U) >> vshift);
+    int vCb[cw],vCr[cw];                    // 4x
+    int Cb[width],Cr[width];                // 8x, less 128
+    const int m00 = mat.m[0][0],m01 = mat.m[0][1],m02 = mat.m[0][2];
+    const int m11 = mat.m[1][1],m12 = mat.m[1][2];
+    const int m21 = mat.m[2][1],m22 = mat.m[2][2];
+    const int lo = mat.luma_offset;
+
+    for (y=ystart;y < yend;y += 2) {
+        const int sy = (int)std::min(y+j.opposite,(unsigned int)dstframe->height-1U);
+        const unsigned char *sY = srcframe->data[0] + (srcframe->linesize[0] * sy);
+        int c0 = sy,c1 = sy,w0 = 4,w1 = 0;
+
+        if (vshift) {
+            if (srcframe->interlaced_frame) {
+                const int f = sy & 1;                       // field
+                const int k = sy >> 1;                      // line within the field
+                const int fch = (ch + 1 - f) >> 1;          // chroma lines in the field
+                const int m = std::min(k >> 1,fch - 1);
+                const int n = std::max(0,std::min((k & 1) ? (m + 1) : (m - 1),fch - 1));
+
+                c0 = (m << 1) + f;
+                c1 = (n << 1) + f;
+            }
+            else {
+                const int m = std::min(sy >> 1,ch - 1);
+
+                c0 = m;
+                c1 = std::max(0,std::min((sy & 1) ? (m + 1) : (m - 1),ch - 1));
+            }
+
+            w0 = 3;
+            w1 = 1;
+        }
+
+        {
+            const unsigned char *u0 = srcframe->data[1] + (srcframe->linesize[1] * c0);
+            const unsigned char *u1 = srcframe->data[1] + (srcframe->linesize[1] * c1);
+            const unsigned char *v0 = srcframe->data[2] + (srcframe->linesize[2] * c0);
+            const unsigned char *v1 = srcframe->data[2] + (srcframe->linesize[2] * c1);
+
+            for (x=0;x < (unsigned int)cw;x++) {
+                vCb[x] = (w0 * u0[x]) + (w1 * u1[x]);
+                vCr[x] = (w0 * v0[x]) + (w1 * v1[x]);
+            }
+        }
+
+        if (hshift) {
+            for (x=0;x < width;x++) {
+                const unsigned int k = x >> 1,n = std::min(k + (x & 1),(unsigned int)cw - 1U);
+
+                Cb[x] = vCb[k] + vCb[n] - (128 * 8);
+                Cr[x] = vCr[k] + vCr[n] - (128 * 8);
+            }
+        }
+        else {
+            for (x=0;x < width;x++) {
+                Cb[x] = (vCb[x] * 2) - (128 * 8);
+                Cr[x] = (vCr[x] * 2) - (128 * 8);
+            }
+        }
+
+        {
+            plane_t *oY = j.fY + (y * width);
+            plane_t *oI = j.fI + (y * width);
+            plane_t *oQ = j.fQ + (y * width);
+            const int rs = 12 + PLANE_SHIFT,rh = 1 << (rs - 1);
+
+            for (x=0;x < width;x++) {
+                const int l = ((int)sY[x] - lo) * 8;
+
+                oY[x] = plane_sat(((m00 * l) + (m01 * Cb[x]) + (m02 * Cr[x]) + rh) >> rs);
+                oI[x] = plane_sat((            (m11 * Cb[x]) + (m12 * Cr[x]) + rh) >> rs);
+                oQ[x] = plane_sat((            (m21 * Cb[x]) + (m22 * Cr[x]) + rh) >> rs);
+            }
+        }
+    }
+}
+
+/* video composite preemphasis */
+static void composite_layer_preemphasis(CompositeLayerJob &j,unsigned int ystart,unsigned int yend) {
+	AVFrame *dstframe = j.dstframe;
+	unsigned int x,y;
+
+	if (composite_preemphasis != 0 && composite_preemphasis_cut > 0) {
+		lowpass_lanes_t amount;
+		lowpass_lanes_set(amount,composite_preemphasis);
+		const unsigned int count = (yend - ystart + 1U) / 2U;
+		plane_t *rows[count + 1];
+		plane_t scratch[dstframe->width];
+		plane_t *Y[LOWPASS_LANES];
+		unsigned int i;
+
+		memset(scratch,0,sizeof(scratch));
+		for (i=0,y=ystart;y < yend;y += 2) rows[i++] = j.fY + (y * dstframe->width);
+
+		for (i=0;i < count;i += LOWPASS_LANES) {
+			LowpassFilterLanes pre;
+			lowpass_lanes_t s,t;
+
+			lowpass_lanes_rows(Y,rows,count,i,scratch);
 
+			pre.setFilter((315000000.00 * 4) / 88,composite_preemphasis_cut); // 315/88 Mhz rate * 4  vs 1.0MHz cutoff
+			pre.resetFilter(16 >> PLANE_SHIFT);
 			for (x=0;x < dstframe->width;x++) {
-				U[x] += noiseU;
-				V[x] += noiseV;
-				noiseU += ((int)((unsigned int)rand() % ((video_chroma_noise*2)+1))) - video_chroma_noise;
-				noiseU /= 2;
-				noiseV += ((int)((unsigned int)rand() % ((video_chroma_noise*2)+1))) - video_chroma_noise;
-				noiseV /= 2;
+				lowpass_lanes_load(s,Y,x);
+				t = s;
+				pre.highpass(t);
+				s += t * amount;
+				lowpass_lanes_store(Y,x,s);
 			}
 		}
 	}
+}
+
+/* copy the field's scanlines between the working planes and a front half cache entry */
+static void front_cache_copy(plane_t *to,const plane_t *from,const bool to_cache,const unsigned int width,unsigned int ystart,unsigned int yend) {
+    for (unsigned int y=ystart;y < yend;y += 2) {
+        if (to_cache)
+            memcpy(to + ((y >> 1) * width),from + (y * width),width * sizeof(plane_t));
+        else
+            memcpy(to + (y * width),from + ((y >> 1) * width),width * sizeof(plane_t));
+    }
+}
+
+/* RGB (or Y'CbCr) to YIQ, input chroma lowpass, subcarrier modulation, composite preemphasis */
+static void composite_layer_encode_slice(void *ctx,unsigned int ystart,unsigned int yend) {
+    CompositeLayerJob &j = *((CompositeLayerJob*)ctx);
+    AVFrame *dstframe = j.dstframe;
+    const unsigned int width = dstframe->width;
+    uint32_t *sscan;
+    unsigned int x,y;
+
+    if (j.front_done == 2) {
+        front_cache_copy(j.fY,&j.front_from->Y[0],false,width,ystart,yend);
+        for (y=ystart;y < yend;y += 2) {
+            memset(j.fI + (y * width),0,width * sizeof(plane_t));
+            memset(j.fQ + (y * width),0,width * sizeof(plane_t));
+        }
+    }
+    else {
+        if (j.front_done == 1) {
+            front_cache_copy(j.fY,&j.front_from->Y[0],false,width,ystart,yend);
+            front_cache_copy(j.fI,&j.front_from->I[0],false,width,ystart,yend);
+            front_cache_copy(j.fQ,&j.front_from->Q[0],false,width,ystart,yend);
+        }
+        else {
+            if (j.srcframe->format != AV_PIX_FMT_BGRA) {
+                composite_layer_ingest_yuv(j,ystart,yend);
+            }
+            else {
+                for (y=ystart;y < yend;y += 2) {
+                    sscan = (uint32_t*)(j.srcframe->data[0] + (j.srcframe->linesize[0] * std::min(y+j.opposite,(unsigned int)dstframe->height-1U)));
+                    RGB_to_YIQ_scanline(j.fY+(y*dstframe->width),j.fI+(y*dstframe->width),j.fQ+(y*dstframe->width),sscan,dstframe->width);
+                }
+            }
+
+            if (composite_in_chroma_lowpass)
+                composite_lowpass(dstframe,j.fY,j.fI,j.fQ,ystart,yend,j.fieldno,0);
+
+            if (j.front_toYIQ != NULL) {
+                front_cache_copy(&j.front_toYIQ->Y[0],j.fY,true,width,ystart,yend);
+                front_cache_copy(&j.front_toYIQ->I[0],j.fI,true,width,ystart,yend);
+                front_cache_copy(&j.front_toYIQ->Q[0],j.fQ,true,width,ystart,yend);
+            }
+        }
+
+        chroma_into_luma(dstframe,j.fY,j.fI,j.fQ,ystart,yend,j.fieldno,subcarrier_amplitude,0);
+        composite_layer_preemphasis(j,ystart,yend);
+
+        if (j.front_toY != NULL)
+            front_cache_copy(&j.front_toY->Y[0],j.fY,true,width,ystart,yend);
+    }
+
+	/* add video noise */
+	if (!j.luma_noise.empty()) {
+		for (y=ystart;y < yend;y += 2)
+			noise_line_add(j.fY + (y * dstframe->width),j.luma_noise[y],dstframe->width);
+	}
+
+	// VHS head switching noise
+	if (!j.head_switch.empty()) {
+		unsigned int twidth = dstframe->width + (dstframe->width / 10);
+		unsigned int x2;
+		int shif;
+
+		for (y=ystart;y < yend;y += 2) {
+			plane_t *Y = j.fY + (y * dstframe->width);
+
+			shif = j.head_switch[y];
+			if (shif != 0) {
+				plane_t tmp[twidth];
+
+				/* WARNING: This is not 100% accurate. On real VHS you'd see the line shifted over and the next line's contents after hsync. */
+
+				/* luma. the chroma subcarrier is there, so this is all we have to do. */
+				x2 = (twidth + (unsigned int)shif) % (unsigned int)twidth;
+				memset(tmp,0,sizeof(tmp));
+				memcpy(tmp,Y,dstframe->width*sizeof(plane_t));
+				for (x=0;x < dstframe->width;x++) {
+					Y[x] = tmp[x2];
+					if ((++x2) == twidth) x2 = 0;
+				}
+			}
+		}
+	}
+}
+
+/* Y/C separation, after noise and head switching, then chroma noise */
+static void composite_layer_decode_slice(void *ctx,unsigned int ystart,unsigned int yend) {
+	CompositeLayerJob &j = *((CompositeLayerJob*)ctx);
+	AVFrame *dstframe = j.dstframe;
+	const unsigned int cw = chroma_width(dstframe->width,j.chroma_shift);
+	unsigned int y;
+
+	if (!nocolor_subcarrier)
+		chroma_from_luma(dstframe,j.fY,j.fI,j.fQ,ystart,yend,j.fieldno,subcarrier_amplitude_back,j.chroma_shift);
+
+	/* add video noise */
+	if (!j.chroma_noiseI.empty()) {
+		for (y=ystart;y < yend;y += 2) {
+			noise_line_add(j.fI + (y * dstframe->width),j.chroma_noiseI[y],cw);
+			noise_line_add(j.fQ + (y * dstframe->width),j.chroma_noiseQ[y],cw);
+		}
+	}
+}
+
+/* chroma phase noise, VHS luma and chroma lowpass */
+static void composite_layer_vhs_slice(void *ctx,unsigned int ystart,unsigned int yend) {
+    CompositeLayerJob &j = *((CompositeLayerJob*)ctx);
+    AVFrame *dstframe = j.dstframe;
+    const unsigned int cw = chroma_width(dstframe->width,j.chroma_shift);
+    unsigned int x,y;
+
 	if (video_chroma_phase_noise != 0) {
-		int noise = 0,noise_mod = (video_chroma_noise * 255) / 100;
 		double pi,u,v,u_,v_, sinpi, cospi;
 
-		for (y=field;y < dstframe->height;y += 2) {
-			int *U = fI + (y * dstframe->width);
-			int *V = fQ + (y * dstframe->width);
+		for (y=ystart;y < yend;y += 2) {
+			plane_t *U = j.fI + (y * dstframe->width);
+			plane_t *V = j.fQ + (y * dstframe->width);
 
-			noise += ((int)((unsigned int)rand() % ((video_chroma_phase_noise*2)+1))) - video_chroma_phase_noise;
-			noise /= 2;
-			pi = ((double)noise * M_PI) / 100;
+			pi = j.chroma_phase[y];
 
 			sinpi = sin(pi);
 			cospi = cos(pi);
-			
-			for (x=0;x < dstframe->width;x++) {
+
+			for (x=0;x < cw;x++) {
 				u = U[x]; // think of 'u' as x-coord
 				v = V[x]; // and 'v' as y-coord
 
@@ -1756,167 +3706,537 @@ void composite_layer(AVFrame *dstframe,AVFrame *srcframe,InputFile &inputfile,un
 				v_ = (u * sinpi) + (v * cospi);
 
 				// put it back
-				U[x] = u_;
-				V[x] = v_;
+				U[x] = plane_sat((int)u_);
+				V[x] = plane_sat((int)v_);
 			}
 		}
 	}
 
-	// NTS: At this point, the video best resembles what you'd get from a typical DVD player's composite video output.
-	//      Slightly blurry, some color artifacts, and edges will have that "buzz" effect, but still a good picture.
-
 	if (emulating_vhs) {
-		double luma_cut,chroma_cut;
-		int chroma_delay;
-
-		switch (output_vhs_tape_speed) {
-			case VHS_SP:
-				luma_cut = 2400000; // 3.0MHz x 80%
-				chroma_cut = 320000; // 400KHz x 80%
-				chroma_delay = 9;
-				break;
-			case VHS_LP:
-				luma_cut = 1900000; // ..
-				chroma_cut = 300000; // 375KHz x 80%
-				chroma_delay = 12;
-				break;
-			case VHS_EP:
-				luma_cut = 1400000; // ..
-				chroma_cut = 280000; // 350KHz x 80%
-				chroma_delay = 14;
-				break;
-			default:
-				abort();
-		};
+		lowpass_lanes_t pre_amount;
+		lowpass_lanes_set(pre_amount,1.6);
+		const unsigned int count = (yend - ystart + 1U) / 2U;
+		plane_t *rows[(count * 2) + 1];
+		plane_t scratch[dstframe->width];
+		plane_t *P[LOWPASS_LANES];
+		unsigned int i;
+
+		memset(scratch,0,sizeof(scratch));
 
 		// luma lowpass
-		for (y=field;y < dstframe->height;y += 2) {
-			int *Y = fY + (y * dstframe->width);
-			LowpassFilter lp[3];
-			LowpassFilter pre;
-			double s;
+		for (i=0,y=ystart;y < yend;y += 2) rows[i++] = j.fY + (y * dstframe->width);
 
-			for (unsigned int f=0;f < 3;f++) {
-				lp[f].setFilter((315000000.00 * 4) / 88,luma_cut); // 315/88 Mhz rate * 4  vs 3.0MHz cutoff
-				lp[f].resetFilter(16);
-			}
-			pre.setFilter((315000000.00 * 4) / 88,luma_cut); // 315/88 Mhz rate * 4  vs 1.0MHz cutoff
-			pre.resetFilter(16);
-			for (x=0;x < dstframe->width;x++) {
-				s = Y[x];
-				for (unsigned int f=0;f < 3;f++) s = lp[f].lowpass(s);
-				s += pre.highpass(s) * 1.6;
-				Y[x] = s;
-			}
-		}
+		for (i=0;i < count;i += LOWPASS_LANES) {
+			LowpassFilterLanes lp[3];
+			LowpassFilterLanes pre;
+			lowpass_lanes_t s,t;
 
-		// chroma lowpass
-		for (y=field;y < dstframe->height;y += 2) {
-			int *U = fI + (y * dstframe->width);
-			int *V = fQ + (y * dstframe->width);
-			LowpassFilter lpU[3],lpV[3];
-			double s;
+			lowpass_lanes_rows(P,rows,count,i,scratch);
 
 			for (unsigned int f=0;f < 3;f++) {
-				lpU[f].setFilter((315000000.00 * 4) / 88,chroma_cut); // 315/88 Mhz rate * 4 (divide by 2 for 4:2:2) vs 400KHz cutoff
-				lpU[f].resetFilter(0);
-				lpV[f].setFilter((315000000.00 * 4) / 88,chroma_cut); // 315/88 Mhz rate * 4 (divide by 2 for 4:2:2) vs 400KHz cutoff
-				lpV[f].resetFilter(0);
+				lp[f].setFilter((315000000.00 * 4) / 88,j.luma_cut); // 315/88 Mhz rate * 4  vs 3.0MHz cutoff
+				lp[f].resetFilter(16 >> PLANE_SHIFT);
 			}
+			pre.setFilter((315000000.00 * 4) / 88,j.luma_cut); // 315/88 Mhz rate * 4  vs 1.0MHz cutoff
+			pre.resetFilter(16 >> PLANE_SHIFT);
 			for (x=0;x < dstframe->width;x++) {
-				s = U[x];
-				for (unsigned int f=0;f < 3;f++) s = lpU[f].lowpass(s);
-				if (x >= chroma_delay) U[x-chroma_delay] = s;
-
-				s = V[x];
-				for (unsigned int f=0;f < 3;f++) s = lpV[f].lowpass(s);
-				if (x >= chroma_delay) V[x-chroma_delay] = s;
+				lowpass_lanes_load(s,P,x);
+				for (unsigned int f=0;f < 3;f++) lp[f].lowpass(s);
+				t = s;
+				pre.highpass(t);
+				s += t * pre_amount;
+				lowpass_lanes_store(P,x,s);
 			}
 		}
 
-		// VHS decks also vertically smear the chroma subcarrier using a delay line
-		// to add the previous line's color subcarrier to the current line's color subcarrier.
-		// note that phase changes in NTSC are compensated for by the VHS deck to make the
-		// phase line up per scanline (else summing the previous line's carrier would
-		// cancel it out).
-		if (vhs_chroma_vert_blend && output_ntsc) {
-			int delayU[dstframe->width];
-			int delayV[dstframe->width];
-
-			memset(delayU,0,dstframe->width*sizeof(int));
-			memset(delayV,0,dstframe->width*sizeof(int));
-			for (y=(field+2);y < dstframe->height;y += 2) {
-				int *U = fI + (y * dstframe->width);
-				int *V = fQ + (y * dstframe->width);
-				int cU,cV;
-
-				for (x=0;x < dstframe->width;x++) {
-					cU = U[x];
-					cV = V[x];
-					U[x] = (delayU[x]+cU+1)>>1;
-					V[x] = (delayV[x]+cV+1)>>1;
-					delayU[x] = cU;
-					delayV[x] = cV;
-				}
-			}
+		// chroma lowpass. U and V use the same filter, so their scanlines share the lanes.
+		for (i=0,y=ystart;y < yend;y += 2) {
+			rows[i++] = j.fI + (y * dstframe->width);
+			rows[i++] = j.fQ + (y * dstframe->width);
 		}
 
-		// VHS decks tend to sharpen the picture on playback
-		if (true/*TODO make option*/) {
-			// luma
-			for (y=field;y < dstframe->height;y += 2) {
-				int *Y = fY + (y * dstframe->width);
-				LowpassFilter lp[3];
-				double s,ts;
-
-				for (unsigned int f=0;f < 3;f++) {
-					lp[f].setFilter((315000000.00 * 4) / 88,luma_cut*4); // 315/88 Mhz rate * 4  vs 3.0MHz cutoff
-					lp[f].resetFilter(0);
-				}
-				for (x=0;x < dstframe->width;x++) {
-					s = ts = Y[x];
-					for (unsigned int f=0;f < 3;f++) ts = lp[f].lowpass(ts);
-					Y[x] = s + ((s - ts) * vhs_out_sharpen * 2);
+		for (i=0;i < (count * 2);i += LOWPASS_LANES) {
+			LowpassFilterLanes lp[3];
+			lowpass_lanes_t s,prev,w;
+			unsigned int delay;
+			double back;
+
+			lowpass_lanes_rows(P,rows,count * 2,i,scratch);
+
+			chroma_lowpass_setup(lp,delay,back,j.chroma_cut,j.chroma_delay,j.chroma_shift); // vs 400KHz cutoff
+			lowpass_lanes_set(prev,0);
+			lowpass_lanes_set(w,back);
+
+			for (x=0;x < cw;x++) {
+				lowpass_lanes_load(s,P,x);
+				for (unsigned int f=0;f < 3;f++) lp[f].lowpass(s);
+				if (x >= delay) {
+					if (back != 0)
+						lowpass_lanes_store(P,x-delay,s + ((prev - s) * w));
+					else
+						lowpass_lanes_store(P,x-delay,s);
 				}
+				prev = s;
 			}
 		}
-
-		if (!vhs_svideo_out) {
-            chroma_into_luma(dstframe,fY,fI,fQ,field,fieldno,subcarrier_amplitude);
-            chroma_from_luma(dstframe,fY,fI,fQ,field,fieldno,subcarrier_amplitude);
-        }
 	}
+}
 
-	if (video_chroma_loss != 0) {
-		for (y=field;y < dstframe->height;y += 2) {
-			int *U = fI + (y * dstframe->width);
-			int *V = fQ + (y * dstframe->width);
+/* VHS playback sharpen, and composite out of the VCR */
+static void composite_layer_vhs_out_slice(void *ctx,unsigned int ystart,unsigned int yend) {
+	CompositeLayerJob &j = *((CompositeLayerJob*)ctx);
+	AVFrame *dstframe = j.dstframe;
+	unsigned int x,y;
+
+	// VHS decks tend to sharpen the picture on playback
+	if (true/*TODO make option*/) {
+		lowpass_lanes_t amount;
+		lowpass_lanes_set(amount,vhs_out_sharpen * 2);
+		const unsigned int count = (yend - ystart + 1U) / 2U;
+		plane_t *rows[count + 1];
+		plane_t scratch[dstframe->width];
+		plane_t *Y[LOWPASS_LANES];
+		unsigned int i;
+
+		memset(scratch,0,sizeof(scratch));
+		for (i=0,y=ystart;y < yend;y += 2) rows[i++] = j.fY + (y * dstframe->width);
+
+		// luma
+		for (i=0;i < count;i += LOWPASS_LANES) {
+			LowpassFilterLanes lp[3];
+			lowpass_lanes_t s,ts;
 
-			if ((((unsigned int)rand())%100000) < video_chroma_loss) {
-				memset(U,0,dstframe->width*sizeof(int));
-				memset(V,0,dstframe->width*sizeof(int));
+			lowpass_lanes_rows(Y,rows,count,i,scratch);
+
+			for (unsigned int f=0;f < 3;f++) {
+				lp[f].setFilter((315000000.00 * 4) / 88,j.luma_cut*4); // 315/88 Mhz rate * 4  vs 3.0MHz cutoff
+				lp[f].resetFilter(0);
+			}
+			for (x=0;x < dstframe->width;x++) {
+				lowpass_lanes_load(s,Y,x);
+				ts = s;
+				for (unsigned int f=0;f < 3;f++) lp[f].lowpass(ts);
+				s += (s - ts) * amount;
+				lowpass_lanes_store(Y,x,s);
 			}
 		}
 	}
 
+	if (!vhs_svideo_out) {
+		chroma_into_luma(dstframe,j.fY,j.fI,j.fQ,ystart,yend,j.fieldno,subcarrier_amplitude,j.chroma_shift);
+		chroma_from_luma(dstframe,j.fY,j.fI,j.fQ,ystart,yend,j.fieldno,subcarrier_amplitude,j.chroma_shift);
+	}
+}
+
+/* chroma dropout, output chroma lowpass, YIQ to RGB */
+static void composite_layer_output_slice(void *ctx,unsigned int ystart,unsigned int yend) {
+    CompositeLayerJob &j = *((CompositeLayerJob*)ctx);
+    AVFrame *dstframe = j.dstframe;
+    plane_t upI[j.chroma_shift ? dstframe->width : 1];
+    plane_t upQ[j.chroma_shift ? dstframe->width : 1];
+    uint32_t *dscan;
+    unsigned int x,y;
+
+    if (!j.chroma_loss.empty()) {
+        for (y=ystart;y < yend;y += 2) {
+            if (j.chroma_loss[y]) {
+                memset(j.fI + (y * dstframe->width),0,dstframe->width*sizeof(plane_t));
+                memset(j.fQ + (y * dstframe->width),0,dstframe->width*sizeof(plane_t));
+            }
+        }
+    }
+
     if (composite_out_chroma_lowpass) {
         if (composite_out_chroma_lowpass_lite)
-            composite_lowpass_tv(dstframe,fY,fI,fQ,field,fieldno);
+            composite_lowpass_tv(dstframe,j.fY,j.fI,j.fQ,ystart,yend,j.fieldno,j.chroma_shift);
         else
-            composite_lowpass(dstframe,fY,fI,fQ,field,fieldno);
+            composite_lowpass(dstframe,j.fY,j.fI,j.fQ,ystart,yend,j.fieldno,j.chroma_shift);
+    }
+
+    if (dstframe->format == AV_PIX_FMT_YUV420P || dstframe->format == AV_PIX_FMT_YUV422P) {
+        /* straight to the encoder's frame. every field scanline also fills the scanline above it (bob filter),
+         * in 4:2:0 the chroma row is the one shared with the scanline above (or below, for the top field) */
+        const int (*m)[3] = YIQ_to_YCbCr.m;
+        const bool is422 = (dstframe->format == AV_PIX_FMT_YUV422P);
+        const unsigned int cw = dstframe->width / 2;
+        /* the matrix takes YIQ at x64, coming from x256 that is >> 2 in and >> 16 out. from below x64, >> less out */
+        const int ish = (PLANE_SHIFT < 2) ? (2 - PLANE_SHIFT) : 0;
+        const int osh = 16 - ((PLANE_SHIFT > 2) ? (PLANE_SHIFT - 2) : 0);
+
+        for (y=ystart;y < yend;y += 2) {
+            const plane_t *Y = j.fY + (y * dstframe->width);
+            const plane_t *I = j.fI + (y * dstframe->width);
+            const plane_t *Q = j.fQ + (y * dstframe->width);
+            unsigned char *dY = dstframe->data[0] + (dstframe->linesize[0] * y);
+            unsigned char *dU = dstframe->data[1] + (dstframe->linesize[1] * (is422 ? y : (y >> 1)));
+            unsigned char *dV = dstframe->data[2] + (dstframe->linesize[2] * (is422 ? y : (y >> 1)));
+
+            if (j.chroma_shift) {
+                chroma_line_upsample(upI,I,dstframe->width,j.chroma_shift);
+                chroma_line_upsample(upQ,Q,dstframe->width,j.chroma_shift);
+                I = upI;
+                Q = upQ;
+            }
+
+            /* NTS: written so that GCC can vectorize it */
+            for (x=0;x < dstframe->width;x++)
+                dY[x] = clampu8(16 + (((m[0][0] * (Y[x] >> ish)) + (m[0][1] * (I[x] >> ish)) + (m[0][2] * (Q[x] >> ish)) + (1 << (osh - 1))) >> osh));
+
+            for (x=0;x < cw;x++) {
+                const int i = (I[x*2] + I[x*2+1]) >> (ish + 1);
+                const int q = (Q[x*2] + Q[x*2+1]) >> (ish + 1);
+
+                dU[x] = clampu8(128 + (((m[1][1] * i) + (m[1][2] * q) + (1 << (osh - 1))) >> osh));
+                dV[x] = clampu8(128 + (((m[2][1] * i) + (m[2][2] * q) + (1 << (osh - 1))) >> osh));
+            }
+
+            /* bob: this scanline also fills the one above it, and the bottom one for the top field */
+            if (y > 0) {
+                memcpy(dY - dstframe->linesize[0],dY,dstframe->width);
+                if (is422) {
+                    memcpy(dU - dstframe->linesize[1],dU,cw);
+                    memcpy(dV - dstframe->linesize[2],dV,cw);
+                }
+            }
+            if ((y + 2) == dstframe->height) {
+                memcpy(dY + dstframe->linesize[0],dY,dstframe->width);
+                if (is422) {
+                    memcpy(dU + dstframe->linesize[1],dU,cw);
+                    memcpy(dV + dstframe->linesize[2],dV,cw);
+                }
+            }
+        }
+    }
+    else {
+        for (y=ystart;y < yend;y += 2) {
+            const plane_t *I = j.fI + (y * dstframe->width);
+            const plane_t *Q = j.fQ + (y * dstframe->width);
+
+            if (j.chroma_shift) {
+                chroma_line_upsample(upI,I,dstframe->width,j.chroma_shift);
+                chroma_line_upsample(upQ,Q,dstframe->width,j.chroma_shift);
+                I = upI;
+                Q = upQ;
+            }
+
+            dscan = (uint32_t*)(dstframe->data[0] + (dstframe->linesize[0] * y));
+            YIQ_to_RGB_scanline(dscan,j.fY+(y*dstframe->width),I,Q,dstframe->width);
+        }
+    }
+}
+
+/* pipeline mode: all scanline stages back to back on a few scanlines at a time (one lowpass lanes batch),
+ * so that the scanlines stay in cache from RGB to YIQ all the way back to RGB. */
+static void composite_layer_pipeline_slice(void *ctx,unsigned int ystart,unsigned int yend) {
+    CompositeLayerJob &j = *((CompositeLayerJob*)ctx);
+    AVFrame *dstframe = j.dstframe;
+    const bool blend = emulating_vhs && vhs_chroma_vert_blend && output_ntsc;
+    const unsigned int cw = chroma_width(dstframe->width,j.chroma_shift);
+    plane_t delayI[cw];
+    plane_t delayQ[cw];
+    unsigned int b,bend,o,y;
+
+    memset(delayI,0,sizeof(delayI));
+    memset(delayQ,0,sizeof(delayQ));
+
+    for (b=ystart;b < yend;b = bend) {
+        bend = std::min(b + (LOWPASS_LANES * 2U),yend);
+
+        composite_layer_encode_slice(ctx,b,bend);
+        composite_layer_decode_slice(ctx,b,bend);
+        if (emulating_vhs || video_chroma_phase_noise != 0)
+            composite_layer_vhs_slice(ctx,b,bend);
+
+        o = b;
+        if (blend) {
+            for (y=b;y < bend;y += 2) {
+                plane_t *U = j.fI + (y * dstframe->width);
+                plane_t *V = j.fQ + (y * dstframe->width);
+
+                if (y == j.field) continue; // the first scanline is not blended, and does not blend into the next one
+
+                if (y == ystart && y > (j.field + 2U)) {
+                    /* the scanline above belongs to another slice. keep this one as it is before the blend
+                     * (it is the delay line for the next one) and finish it after the parallel stage. */
+                    memcpy(delayI,U,cw*sizeof(plane_t));
+                    memcpy(delayQ,V,cw*sizeof(plane_t));
+                    j.blend_deferred[y] = 1;
+                    o = y + 2;
+                    continue;
+                }
+
+                composite_layer_vert_blend(U,V,delayI,delayQ,cw);
+            }
+        }
+
+        if (o < bend) {
+            if (emulating_vhs)
+                composite_layer_vhs_out_slice(ctx,o,bend);
+
+            composite_layer_output_slice(ctx,o,bend);
+        }
+    }
+
+    if (blend && ystart < yend) {
+        y = ystart + (((yend - ystart - 1U) / 2U) * 2U); // last scanline
+        j.blend_carryI[y].assign(delayI,delayI+cw);
+        j.blend_carryQ[y].assign(delayQ,delayQ+cw);
+    }
+}
+
+// This code assumes ARGB and the frame match resolution/
+// srcserial identifies the source frame for the front half cache (0 = not cached, see front_cache_plan()).
+// The per-scanline stages are spread across video_thread_pool. Everything random is decided in scanline
+// order on this thread first, and the chroma vertical blend runs in order too (or, in pipeline mode, across
+// slice boundaries after the parallel stage), so the output does not depend on the number of threads or the mode.
+void composite_layer(AVFrame *dstframe,AVFrame *srcframe,const unsigned long long srcserial,unsigned int field,unsigned long long fieldno) {
+    CompositeLayerJob &job = composite_layer_job;
+    unsigned int y;
+    plane_t *fY,*fI,*fQ;
+
+    if (dstframe == NULL || srcframe == NULL) return;
+    if (dstframe->data[0] == NULL || srcframe->data[0] == 0) return;
+    if (dstframe->format == AV_PIX_FMT_YUV420P || dstframe->format == AV_PIX_FMT_YUV422P) { // straight to the encoder
+        if (dstframe->data[1] == NULL || dstframe->data[2] == NULL) return;
+        if (dstframe->linesize[0] < dstframe->width) return;
+    }
+    else {
+        if (dstframe->linesize[0] < (dstframe->width*4)) return; // ARGB
+    }
+    {
+        unsigned int hshift,vshift;
+        bool full_range;
+
+        if (yuv_ingest_format(srcframe->format,hshift,vshift,full_range)) { // native YUV ingest
+            if (srcframe->data[1] == NULL || srcframe->data[2] == NULL) return;
+            if (srcframe->linesize[0] < srcframe->width) return;
+        }
+        else {
+            if (srcframe->format != AV_PIX_FMT_BGRA) return;
+            if (srcframe->linesize[0] < (srcframe->width*4)) return; // ARGB
+        }
+    }
+    if (dstframe->width != srcframe->width) return;
+    if (dstframe->height != srcframe->height) return;
+
+    /* clear() keeps the memory. the stages check these for empty() */
+    job.luma_noise.clear();
+    job.chroma_noiseI.clear();
+    job.chroma_noiseQ.clear();
+    job.head_switch.clear();
+    job.chroma_phase.clear();
+    job.chroma_loss.clear();
+
+    job.dstframe = dstframe;
+    job.srcframe = srcframe;
+    job.fieldno = fieldno;
+    job.field = field;
+    job.chroma_shift = video_chroma_shift;
+
+    if (srcframe->interlaced_frame)
+        job.opposite = (srcframe->top_field_first ? 1 : 0);
+    else
+        job.opposite = 0;
+
+    if (emulating_vhs) {
+        switch (output_vhs_tape_speed) {
+            case VHS_SP:
+                job.luma_cut = 2400000; // 3.0MHz x 80%
+                job.chroma_cut = 320000; // 400KHz x 80%
+                job.chroma_delay = 9;
+                break;
+            case VHS_LP:
+                job.luma_cut = 1900000; // ..
+                job.chroma_cut = 300000; // 375KHz x 80%
+                job.chroma_delay = 12;
+                break;
+            case VHS_EP:
+                job.luma_cut = 1400000; // ..
+                job.chroma_cut = 280000; // 350KHz x 80%
+                job.chroma_delay = 14;
+                break;
+            default:
+                abort();
+        };
     }
 
-    for (y=field;y < dstframe->height;y += 2) {
-        dscan = (uint32_t*)(dstframe->data[0] + (dstframe->linesize[0] * y));
-        for (x=0;x < dstframe->width;x++,dscan++,sscan++) {
-            YIQ_to_RGB(r,g,b,fY[(y*dstframe->width)+x],fI[(y*dstframe->width)+x],fQ[(y*dstframe->width)+x]);
-            *dscan = (r << 16) + (g << 8) + b;
+    job.planeY.resize(dstframe->width * dstframe->height);
+    job.planeI.resize(dstframe->width * dstframe->height);
+    job.planeQ.resize(dstframe->width * dstframe->height);
+    fY = job.fY = &job.planeY[0];
+    fI = job.fI = &job.planeI[0];
+    fQ = job.fQ = &job.planeQ[0];
+
+    memset(fY,0,sizeof(dstframe->width*dstframe->height)*sizeof(plane_t));
+    memset(fI,0,sizeof(dstframe->width*dstframe->height)*sizeof(plane_t));
+    memset(fQ,0,sizeof(dstframe->width*dstframe->height)*sizeof(plane_t));
+
+    composite_layer_decide(job);
+    front_cache_plan(job,srcserial);
+
+    if (video_pipeline) {
+        const bool blend = emulating_vhs && vhs_chroma_vert_blend && output_ntsc;
+
+        if (blend) {
+            job.blend_carryI.resize(dstframe->height);
+            job.blend_carryQ.resize(dstframe->height);
+            job.blend_deferred.assign(dstframe->height,0);
+        }
+
+        video_thread_pool.run(composite_layer_pipeline_slice,&job,field,dstframe->height);
+
+        if (blend) {
+            for (y=field+4;y < dstframe->height;y += 2) {
+                if (!job.blend_deferred[y]) continue;
+
+                composite_layer_vert_blend(fI + (y * dstframe->width),fQ + (y * dstframe->width),
+                    &job.blend_carryI[y-2][0],&job.blend_carryQ[y-2][0],chroma_width(dstframe->width,job.chroma_shift));
+
+                if (emulating_vhs)
+                    composite_layer_vhs_out_slice(&job,y,y+1);
+
+                composite_layer_output_slice(&job,y,y+1);
+            }
         }
     }
+    else {
+        video_thread_pool.run(composite_layer_encode_slice,&job,field,dstframe->height);
+        video_thread_pool.run(composite_layer_decode_slice,&job,field,dstframe->height);
+
+        // NTS: At this point, the video best resembles what you'd get from a typical DVD player's composite video output.
+        //      Slightly blurry, some color artifacts, and edges will have that "buzz" effect, but still a good picture.
+
+        if (emulating_vhs || video_chroma_phase_noise != 0)
+            video_thread_pool.run(composite_layer_vhs_slice,&job,field,dstframe->height);
+
+        if (emulating_vhs) {
+            // VHS decks also vertically smear the chroma subcarrier using a delay line
+            // to add the previous line's color subcarrier to the current line's color subcarrier.
+            // note that phase changes in NTSC are compensated for by the VHS deck to make the
+            // phase line up per scanline (else summing the previous line's carrier would
+            // cancel it out).
+            if (vhs_chroma_vert_blend && output_ntsc) {
+                const unsigned int cw = chroma_width(dstframe->width,job.chroma_shift);
+                plane_t delayU[cw];
+                plane_t delayV[cw];
+
+                memset(delayU,0,cw*sizeof(plane_t));
+                memset(delayV,0,cw*sizeof(plane_t));
+                for (y=(field+2);y < dstframe->height;y += 2)
+                    composite_layer_vert_blend(fI + (y * dstframe->width),fQ + (y * dstframe->width),delayU,delayV,cw);
+            }
 
-    delete[] fY;
-    delete[] fI;
-    delete[] fQ;
+            video_thread_pool.run(composite_layer_vhs_out_slice,&job,field,dstframe->height);
+        }
+
+        video_thread_pool.run(composite_layer_output_slice,&job,field,dstframe->height);
+    }
+}
+
+/* several -i: the inputs are layered first, each over the ones before it by its own alpha (ARGB, see
+ * parse_argv()), and the emulation then runs once on the result instead of once per input. only the
+ * scanlines of the field are layered, each from the source scanline composite_layer() would have read
+ * from that input (its own field order). */
+struct VideoLayerJob {
+    AVFrame*                dstframe;
+    std::vector<AVFrame*>   layers;         // bottom first
+    std::vector<unsigned long long> serials; // of the layers
+};
+
+static VideoLayerJob video_layer_job;
+static AVFrame *video_layer_frame = NULL;
+static std::vector<unsigned long long> video_layer_serials; // of the layers, for a new serial when one changes
+unsigned long long video_layer_serial = 0;  // of the frame video_layer_inputs() returned (for the front half cache)
+
+/* s over d, by the alpha of s. the result alpha is not used (composite_layer() ignores it) */
+static inline uint32_t video_layer_over(const uint32_t s,const uint32_t d) {
+    const uint32_t a = s >> 24U,na = 255U - a;
+    uint32_t rb = ((s & 0x00FF00FFU) * a) + ((d & 0x00FF00FFU) * na) + 0x00800080U;
+    uint32_t ag = (((s >> 8U) & 0x00FF00FFU) * a) + (((d >> 8U) & 0x00FF00FFU) * na) + 0x00800080U;
+
+    /* x / 255 as (x + (x >> 8)) >> 8, both channels of the pair at once */
+    rb = ((rb + ((rb >> 8U) & 0x00FF00FFU)) >> 8U) & 0x00FF00FFU;
+    ag = (ag + ((ag >> 8U) & 0x00FF00FFU)) & 0xFF00FF00U;
+    return rb | ag;
+}
+
+static inline const uint32_t *video_layer_scanline(const AVFrame *f,const unsigned int y) {
+    const unsigned int opposite = f->interlaced_frame ? (f->top_field_first ? 1U : 0U) : 0U;
+
+    return (const uint32_t*)(f->data[0] + (f->linesize[0] * std::min(y + opposite,(unsigned int)f->height - 1U)));
+}
+
+static void video_layer_slice(void *ctx,unsigned int ystart,unsigned int yend) {
+    VideoLayerJob &j = *((VideoLayerJob*)ctx);
+    const unsigned int width = j.dstframe->width;
+    unsigned int x,y;
+
+    for (y=ystart;y < yend;y += 2) {
+        uint32_t *D = (uint32_t*)(j.dstframe->data[0] + (j.dstframe->linesize[0] * y));
+
+        memcpy(D,video_layer_scanline(j.layers[0],y),width * sizeof(uint32_t));
+        for (size_t l=1;l < j.layers.size();l++) {
+            const uint32_t *S = video_layer_scanline(j.layers[l],y);
+
+            /* NTS: written so that GCC can vectorize it */
+            for (x=0;x < width;x++)
+                D[x] = video_layer_over(S[x],D[x]);
+        }
+    }
+}
+
+/* layer the current frame of every input, for one field. returns NULL if no input has a frame yet */
+AVFrame *video_layer_inputs(unsigned int field) {
+    VideoLayerJob &job = video_layer_job;
+
+    job.layers.clear();
+    job.serials.clear();
+    for (std::vector<InputFile>::iterator i=input_files.begin();i!=input_files.end();i++) {
+        AVFrame *f = (*i).video_frame();
+
+        if (f == NULL || f->data[0] == NULL || f->format != AV_PIX_FMT_BGRA) continue;
+        if (f->width != output_width || f->height != output_height) continue;
+        job.layers.push_back(f);
+        job.serials.push_back((*i).video_frame_serial);
+    }
+
+    if (job.layers.empty())
+        return NULL;
+    if (job.layers.size() == 1) {
+        video_layer_serials.clear();
+        video_layer_serial = job.serials[0];
+        return job.layers[0];
+    }
+
+    if (job.serials != video_layer_serials) {
+        video_layer_serials = job.serials;
+        video_layer_serial = ++video_frame_serial_last;
+    }
+
+    if (video_layer_frame == NULL) {
+        video_layer_frame = av_frame_alloc();
+        if (video_layer_frame == NULL) {
+            fprintf(stderr,"Failed to alloc video frame\n");
+            return NULL;
+        }
+        video_layer_frame->format = AV_PIX_FMT_BGRA;
+        video_layer_frame->height = output_height;
+        video_layer_frame->width = output_width;
+        if (av_frame_get_buffer(video_layer_frame,64) < 0) {
+            fprintf(stderr,"Failed to alloc layer frame\n");
+            av_frame_free(&video_layer_frame);
+            return NULL;
+        }
+        memset(video_layer_frame->data[0],0,video_layer_frame->linesize[0]*video_layer_frame->height);
+    }
+
+    /* the layers are already in field order, see video_layer_scanline() */
+    video_layer_frame->interlaced_frame = 0;
+    video_layer_frame->top_field_first = 0;
+
+    job.dstframe = video_layer_frame;
+    video_thread_pool.run(video_layer_slice,&job,field,video_layer_frame->height);
+    return video_layer_frame;
 }
 
 int main(int argc,char **argv) {
@@ -1924,6 +4244,8 @@ int main(int argc,char **argv) {
     if (parse_argv(argc,argv))
 		return 1;
 
+    noise_banks_prepare(output_width);
+
 	av_register_all();
 	avformat_network_init();
 	avcodec_register_all();
@@ -1990,7 +4312,15 @@ int main(int argc,char **argv) {
 		}
 
 		// FIXME: How do I get FFMPEG to write raw YUV 4:2:2?
-		avcodec_get_context_defaults3(output_avstream_video_codec_context,avcodec_find_encoder(AV_CODEC_ID_H264));
+		AVCodec *codec = output_video_encoder();
+		AVDictionary *opts = NULL;
+
+		if (codec == NULL) {
+			fprintf(stderr,"Video encoder '%s' not found\n",output_video_codec.c_str());
+			return 1;
+		}
+
+		avcodec_get_context_defaults3(output_avstream_video_codec_context,codec);
 		output_avstream_video_codec_context->width = output_width;
 		output_avstream_video_codec_context->height = output_height;
 		output_avstream_video_codec_context->sample_aspect_ratio = (AVRational){output_height*4, output_width*3};
@@ -2003,10 +4333,14 @@ int main(int argc,char **argv) {
 		if (output_avfmt->oformat->flags & AVFMT_GLOBALHEADER)
 			output_avstream_video_codec_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
-		if (avcodec_open2(output_avstream_video_codec_context,avcodec_find_encoder(AV_CODEC_ID_H264),NULL) < 0) {
+		output_video_encoder_config(output_avstream_video_codec_context,codec,&opts);
+		if (avcodec_open2(output_avstream_video_codec_context,codec,&opts) < 0) {
 			fprintf(stderr,"Output stream cannot open codec\n");
+			av_dict_free(&opts);
 			return 1;
 		}
+		output_video_encoder_unused_options(codec,&opts);
+		fprintf(stderr,"Video encoder: %s\n",codec->name);
 	}
 
 	if (!(output_avfmt->oformat->flags & AVFMT_NOFILE)) {
@@ -2021,12 +4355,19 @@ int main(int argc,char **argv) {
 		return 1;
 	}
 
+	/* video encode thread */
+	output_video_encode_start();
+
 	/* soft break on CTRL+C */
 	signal(SIGINT,sigma);
 	signal(SIGHUP,sigma);
 	signal(SIGQUIT,sigma);
 	signal(SIGTERM,sigma);
 
+	/* video emulation worker threads */
+	video_thread_pool.start(video_threads);
+	fprintf(stderr,"Video emulation threads: %u\n",video_thread_pool.threads());
+
 	/* prepare audio filtering */
 	audio_hilopass.setChannels(output_audio_channels);
 	audio_hilopass.setRate(output_audio_rate);
@@ -2035,38 +4376,33 @@ int main(int argc,char **argv) {
 	audio_hilopass.init();
 
 	/* high boost on playback */
-	for (unsigned int i=0;i < 2;i++)
-		audio_post_vhs_boost[i].setFilter(output_audio_rate,10000);
+	audio_post_vhs_boost.setFilter(output_audio_rate,10000);
 
 	// TODO: VHS Hi-Fi is also documented to use 2:1 companding when recording, which we do not yet emulate
 
 	if (emulating_preemphasis) {
 		if (output_vhs_hifi) {
-			for (unsigned int i=0;i < output_audio_channels;i++) {
-				audio_linear_preemphasis_pre[i].setFilter(output_audio_rate,16000/*FIXME: Guess! Also let user set this.*/);
-			}
+			audio_linear_preemphasis_pre.setFilter(output_audio_rate,16000/*FIXME: Guess! Also let user set this.*/);
 		}
 		else {
-			for (unsigned int i=0;i < output_audio_channels;i++) {
-				audio_linear_preemphasis_pre[i].setFilter(output_audio_rate,8000/*FIXME: Guess! Also let user set this.*/);
-			}
+			audio_linear_preemphasis_pre.setFilter(output_audio_rate,8000/*FIXME: Guess! Also let user set this.*/);
 		}
 	}
 	if (emulating_deemphasis) {
 		if (output_vhs_hifi) {
-			for (unsigned int i=0;i < output_audio_channels;i++) {
-				audio_linear_preemphasis_post[i].setFilter(output_audio_rate,16000/*FIXME: Guess! Also let user set this.*/);
-			}
+			audio_linear_preemphasis_post.setFilter(output_audio_rate,16000/*FIXME: Guess! Also let user set this.*/);
 		}
 		else {
-			for (unsigned int i=0;i < output_audio_channels;i++) {
-				audio_linear_preemphasis_post[i].setFilter(output_audio_rate,8000/*FIXME: Guess! Also let user set this.*/);
-			}
+			audio_linear_preemphasis_post.setFilter(output_audio_rate,8000/*FIXME: Guess! Also let user set this.*/);
 		}
 	}
 
     /* prepare video encoding */
-    for (size_t i=0;i <= output_avstream_video_frame_delay;i++) {
+    if (output_avstream_video_codec_context->pix_fmt != AV_PIX_FMT_YUV422P &&
+        output_avstream_video_codec_context->pix_fmt != AV_PIX_FMT_YUV420P)
+        video_direct_yuv = false;
+
+    for (size_t i=0;!video_direct_yuv && i <= output_avstream_video_frame_delay;i++) {
         AVFrame *nf;
 
         nf = av_frame_alloc();
@@ -2118,7 +4454,7 @@ int main(int argc,char **argv) {
         }
     }
 
-    if (output_avstream_video_resampler == NULL) {
+    if (!video_direct_yuv && output_avstream_video_resampler == NULL) {
         output_avstream_video_resampler = sws_getContext(
                 // source
                 output_avstream_video_frame[0]->width,
@@ -2141,6 +4477,7 @@ int main(int argc,char **argv) {
         bool eof,copyaud;
         signed long long upto=0;
         signed long long current=0;
+        const bool layered = (input_files.size() > 1 && !video_emulate_per_layer); // see video_layer_inputs()
 
         do {
             if (DIE) break;
@@ -2176,7 +4513,7 @@ int main(int argc,char **argv) {
                             }
 
                             if ((*i).input_avstream_video_frame->pkt_pts == AV_NOPTS_VALUE || current >= (*i).input_avstream_video_frame->pkt_pts) {
-                                (*i).frame_copy_scale();
+                                (*i).video_frame_next();
                                 (*i).got_video = false;
                             }
                         }
@@ -2192,7 +4529,7 @@ int main(int argc,char **argv) {
                 }
                 else {
                     if ((*i).got_video) {
-                        (*i).frame_copy_scale();
+                        (*i).video_frame_next();
                         (*i).got_video = false;
                     }
                 }
@@ -2204,7 +4541,7 @@ int main(int argc,char **argv) {
                         if ((*i).input_avstream_video_frame != NULL) {
                             if ((*i).got_video) {
                                 if ((*i).input_avstream_video_frame->pkt_pts == AV_NOPTS_VALUE || current >= (*i).input_avstream_video_frame->pkt_pts) {
-                                    (*i).frame_copy_scale();
+                                    (*i).video_frame_next();
                                     (*i).got_video = false;
                                 }
                             }
@@ -2219,13 +4556,36 @@ int main(int argc,char **argv) {
                     }
                     else {
                         if ((*i).got_video) {
-                            (*i).frame_copy_scale();
+                            (*i).video_frame_next();
                             (*i).got_video = false;
                         }
                     }
 
-                    // composite the layer, keying against the color. all code assumes ARGB
-                    composite_layer(output_avstream_video_frame[output_avstream_video_frame_index],(*i).input_avstream_video_frame_rgb,*i,(current & 1) ^ 1,current);
+                    // several inputs are layered first, then emulated once below
+                    if (layered)
+                        continue;
+
+                    // composite the layer, keying against the color. input is ARGB or the decoder's YUV, output is ARGB or the codec's YUV
+                    if (video_direct_yuv)
+                        composite_layer(output_avstream_video_encode_frame,(*i).video_frame(),(*i).video_frame_serial,(current & 1) ^ 1,current);
+                    else
+                        composite_layer(output_avstream_video_frame[output_avstream_video_frame_index],(*i).video_frame(),(*i).video_frame_serial,(current & 1) ^ 1,current);
+                }
+
+                if (layered) {
+                    AVFrame *lf = video_layer_inputs((current & 1) ^ 1);
+
+                    if (video_direct_yuv)
+                        composite_layer(output_avstream_video_encode_frame,lf,video_layer_serial,(current & 1) ^ 1,current);
+                    else
+                        composite_layer(output_avstream_video_frame[output_avstream_video_frame_index],lf,video_layer_serial,(current & 1) ^ 1,current);
+                }
+
+                // direct YUV output already did the field deinterlace, and is already in the encoder's frame
+                if (video_direct_yuv) {
+                    output_frame(output_avstream_video_encode_frame,current);
+                    current++;
+                    continue;
                 }
 
                 // field deinterlace
@@ -2283,26 +4643,7 @@ int main(int argc,char **argv) {
     }
 
     /* flush encoder delay */
-    do {
-        AVPacket pkt;
-        int gotit=0;
-
-        av_init_packet(&pkt);
-        if (av_new_packet(&pkt,50000000/8) < 0) break;
-
-        if (avcodec_encode_video2(output_avstream_video_codec_context,&pkt,NULL,&gotit) == 0) {
-            if (gotit) {
-                pkt.stream_index = output_avstream_video->index;
-                av_packet_rescale_ts(&pkt,output_avstream_video_codec_context->time_base,output_avstream_video->time_base);
-
-                if (av_interleaved_write_frame(output_avfmt,&pkt) < 0)
-                    fprintf(stderr,"AV write frame failed video\n");
-            }
-        }
-
-        av_packet_unref(&pkt);
-        if (!gotit) break;
-    } while (1);
+    output_video_encode_flush();
 
     /* close output */
     if (output_avstream_video_resampler != NULL) {
@@ -2316,11 +4657,14 @@ int main(int argc,char **argv) {
         output_avstream_video_frame.pop_back();
         if (nf != NULL) av_frame_free(&nf);
     }
+	video_thread_pool.stop();
 	audio_hilopass.clear();
 	av_write_trailer(output_avfmt);
 	if (output_avfmt != NULL && !(output_avfmt->oformat->flags & AVFMT_NOFILE))
 		avio_closep(&output_avfmt->pb);
 	avformat_free_context(output_avfmt);
+	av_buffer_pool_uninit(&output_video_packet_pool);
+	av_buffer_pool_uninit(&output_audio_packet_pool);
 
     /* close all */
     for (std::vector<InputFile>::iterator i=input_files.begin();i!=input_files.end();i++)
@@ -21,6 +21,7 @@
 #define __STDC_CONSTANT_MACROS
 
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <signal.h>
 #include <stdint.h>
 #include <assert.h>
@@ -29,6 +30,9 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <math.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 extern "C" {
 #include <libavutil/opt.h>
@@ -36,6 +40,7 @@ extern "C" {
 #include <libavutil/pixfmt.h>
 #include <libavutil/pixdesc.h>
 #include <libavutil/samplefmt.h>
+#include <libavutil/audio_fifo.h>
 #include <libavutil/pixelutils.h>
 
 #include <libavcodec/avcodec.h>
@@ -58,6 +63,8 @@ using namespace std;
 #include <string>
 #include <vector>
 
+#include "output_video_encode.h"
+
 volatile int DIE = 0;
 
 void sigma(int x) {
@@ -129,56 +136,78 @@ public:
 	double			tau;
 };
 
-class HiLoPair {
-public:
-	LowpassFilter		hi,lo;	// highpass, lowpass
+/* Audio is processed in blocks of up to AUDIO_BLOCK sample periods, with the channels in the lanes of a vector
+ * (stereo doubles fill one SSE2 register). composite_audio_process() converts the interleaved 16-bit samples to
+ * lanes once, runs each filter over the whole block with its state held in a register, and converts back once.
+ * The arithmetic is that of LowpassFilter, in the same order, so each channel comes out as it did one sample at
+ * a time. */
+#define AUDIO_LANES 2           /* output_audio_channels is 1 or 2 */
+#define AUDIO_BLOCK 256
+#define AUDIO_HILO_PASSES 6     /* most passes HiLoComboPass can run */
+
+typedef double audio_lanes_t __attribute__((vector_size(sizeof(double) * AUDIO_LANES)));
+
+static inline void audio_lanes_set(audio_lanes_t &r,const double v) {
+	for (unsigned int l=0;l < AUDIO_LANES;l++) r[l] = v;
+}
+
+class LowpassFilterAudioLanes {
 public:
-	void setFilter(const double rate/*sample rate of audio*/,const double low_hz,const double high_hz) {
-		lo.setFilter(rate,low_hz);
-		hi.setFilter(rate,high_hz);
+	LowpassFilterAudioLanes() {
+		audio_lanes_set(alpha,0);
+		audio_lanes_set(prev,0);
 	}
-	double filter(const double sample) {
-		return hi.highpass(lo.lowpass(sample)); /* first lowpass, then highpass */
-	}
-};
+	void setFilter(const double rate/*sample rate of audio*/,const double hz/*cutoff*/) {
+		LowpassFilter f;
 
-class HiLoPass : public vector<HiLoPair> { // all passes, one sample of one channel
-public:
-	HiLoPass() : vector() { }
-public:
-	void setFilter(const double rate/*sample rate of audio*/,const double low_hz,const double high_hz) {
-		for (size_t i=0;i < size();i++) (*this)[i].setFilter(rate,low_hz,high_hz);
+		f.setFilter(rate,hz);
+		audio_lanes_set(alpha,f.alpha);
 	}
-	double filter(double sample) {
-		for (size_t i=0;i < size();i++) sample = (*this)[i].lo.lowpass(sample);
-		for (size_t i=0;i < size();i++) sample = (*this)[i].hi.highpass(sample);
-		return sample;
+	void resetFilter(const double val=0) {
+		audio_lanes_set(prev,val);
 	}
-	void init(const unsigned int passes) {
-		clear();
-		resize(passes);
-		assert(size() >= passes);
+	void lowpass(audio_lanes_t *s,const unsigned int n) { /* in place, n sample periods */
+		audio_lanes_t p = prev;
+
+		for (unsigned int i=0;i < n;i++) {
+			const audio_lanes_t stage1 = s[i] * alpha;
+			const audio_lanes_t stage2 = p - (p * alpha); /* NTS: Instead of prev * (1.0 - alpha) */
+			s[i] = p = stage1 + stage2;
+		}
+
+		prev = p;
 	}
-};
+	void highpass(audio_lanes_t *s,const unsigned int n) { /* in place, n sample periods */
+		audio_lanes_t p = prev;
 
-class HiLoSample : public vector<HiLoPass> { // all passes, all channels of one sample period
-public:
-	HiLoSample() : vector() { }
-public:
-	void init(const unsigned int channels,const unsigned int passes) {
-		clear();
-		resize(channels);
-		assert(size() >= channels);
-		for (size_t i=0;i < size();i++) (*this)[i].init(passes);
+		for (unsigned int i=0;i < n;i++) {
+			const audio_lanes_t stage1 = s[i] * alpha;
+			const audio_lanes_t stage2 = p - (p * alpha);
+			s[i] -= (p = stage1 + stage2);
+		}
+
+		prev = p;
 	}
-	void setFilter(const double rate/*sample rate of audio*/,const double low_hz,const double high_hz) {
-		for (size_t i=0;i < size();i++) (*this)[i].setFilter(rate,low_hz,high_hz);
+	void highboost(audio_lanes_t *s,const unsigned int n,const double amount) { /* s += highpass(s) * amount */
+		audio_lanes_t p = prev;
+
+		for (unsigned int i=0;i < n;i++) {
+			const audio_lanes_t stage1 = s[i] * alpha;
+			const audio_lanes_t stage2 = p - (p * alpha);
+			p = stage1 + stage2;
+			s[i] += (s[i] - p) * amount;
+		}
+
+		prev = p;
 	}
+public:
+	audio_lanes_t		alpha;
+	audio_lanes_t		prev;
 };
 
 class HiLoComboPass {
 public:
-	HiLoComboPass() : passes(0), channels(0), rate(0), low_cutoff(0), high_cutoff(0) {
+	HiLoComboPass() : rate(0), passes(0), channels(0), low_cutoff(0), high_cutoff(0), ready(false) {
 	}
 	~HiLoComboPass() {
 		clear();
@@ -209,13 +238,50 @@ public:
 		}
 	}
 	void clear() {
-		audiostate.clear();
+		ready = false;
 	}
 	void init() {
 		clear();
 		if (channels == 0 || passes == 0 || rate == 0 || low_cutoff == 0 || high_cutoff == 0) return;
-		audiostate.init(channels,passes);
-		audiostate.setFilter(rate,low_cutoff,high_cutoff);
+		if (channels > AUDIO_LANES || passes > AUDIO_HILO_PASSES) return;
+		/* the passes not used let the sample through unchanged: a lowpass with alpha 1, a highpass with alpha 0 */
+		for (size_t i=0;i < AUDIO_HILO_PASSES;i++) {
+			lo[i].setFilter(rate,low_cutoff);
+			hi[i].setFilter(rate,high_cutoff);
+			if (i >= passes) {
+				audio_lanes_set(lo[i].alpha,1.0);
+				audio_lanes_set(hi[i].alpha,0.0);
+			}
+			lo[i].resetFilter();
+			hi[i].resetFilter();
+		}
+		ready = true;
+	}
+	void filter(audio_lanes_t *s,const unsigned int n) { /* in place, n sample periods */
+		/* all passes in one loop, first the lowpasses, then the highpasses. the state of every pass stays in a
+		 * register and the passes of neighbouring samples overlap, where pass after pass over the block would
+		 * wait on each pass's own chain of multiply and add */
+		audio_lanes_t lp[AUDIO_HILO_PASSES],hp[AUDIO_HILO_PASSES];
+		unsigned int i,k;
+
+		for (k=0;k < AUDIO_HILO_PASSES;k++) {
+			lp[k] = lo[k].prev;
+			hp[k] = hi[k].prev;
+		}
+		for (i=0;i < n;i++) {
+			audio_lanes_t v = s[i];
+
+			for (k=0;k < AUDIO_HILO_PASSES;k++)
+				v = lp[k] = (v * lo[k].alpha) + (lp[k] - (lp[k] * lo[k].alpha));
+			for (k=0;k < AUDIO_HILO_PASSES;k++)
+				v -= (hp[k] = (v * hi[k].alpha) + (hp[k] - (hp[k] * hi[k].alpha)));
+
+			s[i] = v;
+		}
+		for (k=0;k < AUDIO_HILO_PASSES;k++) {
+			lo[k].prev = lp[k];
+			hi[k].prev = hp[k];
+		}
 	}
 public:
 	double		rate;
@@ -223,14 +289,16 @@ public:
 	size_t		channels;
 	double		low_cutoff;
 	double		high_cutoff;
-	HiLoSample	audiostate;
+	bool		ready;
+	LowpassFilterAudioLanes lo[AUDIO_HILO_PASSES];	// one pole stages, all channels in the lanes
+	LowpassFilterAudioLanes hi[AUDIO_HILO_PASSES];
 };
 
 HiLoComboPass		audio_hilopass;
 
 // preemphsis emuluation
-LowpassFilter		audio_linear_preemphasis_pre[2];
-LowpassFilter		audio_linear_preemphasis_post[2];
+LowpassFilterAudioLanes	audio_linear_preemphasis_pre;	// one per channel, in the lanes
+LowpassFilterAudioLanes	audio_linear_preemphasis_post;
 
 AVFormatContext*	input_avfmt = NULL;
 AVStream*		input_avstream_audio = NULL;	// do not free
@@ -262,6 +330,17 @@ bool            use_422_colorspace = false; // I would default this to true but
 double          transcode_start = -1;
 double          transcode_end = -1;
 double          transcode_dur = -1;
+double          transcode_origin = -1;      // input time of field 0: -ss, or for a -segments worker the start of the whole render (-1 = the first packet)
+unsigned int    transcode_preroll = 8;      // -ss: fields rendered before the start but not output, to settle the filters
+signed long long video_field_first = 0;     // first field rendered (negative during -ss pre-roll)
+unsigned int    render_segments = 0;        // -segments: render this many pieces of the input in parallel, see segments_render()
+unsigned int    render_field_threads = 0;   // -field-threads: render fields on this many worker threads, see field_submit() (0 = on the main thread)
+unsigned int    video_front_cache = 6;      // -front-cache: fields kept by the front half cache, see render_field_front() (0 = off)
+unsigned long long video_source_serial = 0; // serial number of the scaled source frame, for the front half cache
+signed long long segment_field_first = 0;   // fields this process outputs (the whole render, or one -segments piece)
+signed long long segment_field_end = -1;    // (-1 = to the end)
+unsigned long long output_audio_skip = 0;   // -segments: audio before this sample is pre-roll, emulated to settle the filters but not output
+bool            output_audio_preroll = false; // -segments: the first audio frame after the seek sets where the pre-roll starts
 
 double			composite_preemphasis = 0;	// analog artifacts related to anything that affects the raw composite signal i.e. CATV modulation
 double			composite_preemphasis_cut = 1000000;
@@ -276,6 +355,7 @@ double			vhs_head_switching_phase_noise = (((1.0 / 300)/*slight error, like most
 bool            composite_in_chroma_lowpass = true; // apply chroma lowpass before composite encode
 bool            composite_out_chroma_lowpass = true;
 bool            composite_out_chroma_lowpass_lite = true;
+bool            video_fixed_point = true; // run the 8-bit video filters in fixed point (see LowpassFilterFixedLanes) instead of double precision
 
 int		video_yc_recombine = 0;			// additional Y/C combine/sep phases (testing)
 int		video_color_fields = 4;			// NTSC color framing
@@ -295,6 +375,16 @@ bool		output_ntsc = true;	// NTSC color subcarrier emulation
 bool		output_pal = false;	// PAL color subcarrier emulation
 int		output_audio_channels = 2;	// VHS stereo (set to 1 for mono)
 int		output_audio_rate = 44100;	// VHS Hi-Fi goes up to 20KHz
+std::string     output_video_codec = "h264";        // -vcodec, see output_video_encoder()
+std::string     output_video_preset;                // -preset, passed to the encoder if it has one
+std::string     output_video_crf;                   // -crf, passed to the encoder if it has one
+long            output_video_bitrate = 0;           // -b:v (0 = encoder default)
+std::string     output_audio_codec = "pcm";         // -acodec, see output_audio_encoder()
+long            output_audio_bitrate = 0;           // -b:a (0 = encoder default)
+int             output_video_threads = 0;           // encoder threads (0 = one per CPU core)
+unsigned int    output_video_encode_queue = 8;      // frames queued to the encode thread (0 = encode on the main thread)
+unsigned int    output_audio_queue = 32;            // packets queued to the audio thread (0 = audio on the main thread)
+unsigned int    output_mux_queue = 32;              // packets queued to the muxer thread, each stream (0 = no muxer thread)
 double		output_audio_hiss_db = -72;
 double		output_audio_linear_buzz = -42;	// how loud the "buzz" is audible in dBFS (S/N). Ever notice on old VHS tapes (prior to Hi-Fi) you can almost hear the video signal sync pulses in the audio?
 double		output_audio_highpass = 20; // highpass to filter out below 20Hz
@@ -349,9 +439,143 @@ static inline int clips16(const int x) {
 	return x;
 }
 
+/* Fixed point version of LowpassFilter for the 8-bit video path, run on several scanlines at once, one scanline per SIMD lane.
+ * The filter is recursive along the scanline which is why the vector runs across scanlines instead.
+ *
+ * Samples and filter state have VIDEO_FIXED_SHIFT fraction bits (value * 128), alpha is Q14, so that
+ * (sample - prev) * alpha fits in 32 bits for any value -1024...1023. That covers 8-bit video plus
+ * the overshoot of the highpass, preemphasis and sharpen stages. Scale factors (preemphasis, sharpen)
+ * are Q8 and are limited to < 256.
+ *
+ * Accuracy: the state update is rounded to nearest, error per update is at most 1/256 of a code value,
+ * and a one-pole filter accumulates at most that divided by alpha (alpha is >= 0.1 for the cutoffs used here),
+ * so even after 3-4 stages the result is within a fraction of a code value of the double precision result.
+ * After the truncation to 8 bits each filter pass differs from the double precision version by at most
+ * 1 code value, and only where the double result lands close to an integer. The VHS passes feed each other
+ * through the preemphasis and sharpen gain, which can grow that to 2-3 code values by the end of the chain.
+ * Use -video-fixed-point 0 for the double precision filters. */
+#define VIDEO_FIXED_SHIFT 7
+#define VIDEO_FIXED_ALPHA_SHIFT 14
+#define VIDEO_FIXED_LANES 8 /* video_fixed_lanes_load() assumes 8 */
+
+typedef int32_t video_fixed_lanes_t __attribute__((vector_size(sizeof(int32_t) * VIDEO_FIXED_LANES)));
+
+static inline void video_fixed_lanes_set(video_fixed_lanes_t &r,const int32_t v) {
+	for (unsigned int l=0;l < VIDEO_FIXED_LANES;l++) r[l] = v;
+}
+
+/* gather pixel x of each lane's scanline.
+ * NTS: built as one vector, filling it lane by lane through memory stalls on every load. */
+static inline void video_fixed_lanes_load(video_fixed_lanes_t &r,unsigned char * const *P,const unsigned int x) {
+	const video_fixed_lanes_t t = { P[0][x], P[1][x], P[2][x], P[3][x], P[4][x], P[5][x], P[6][x], P[7][x] };
+	r = t << VIDEO_FIXED_SHIFT;
+}
+
+/* scatter to pixel x of each lane's scanline, clamped to 8 bits */
+static inline void video_fixed_lanes_store(unsigned char * const *P,const unsigned int x,const video_fixed_lanes_t &s) {
+	for (unsigned int l=0;l < VIDEO_FIXED_LANES;l++) P[l][x] = clampu8(s[l] >> VIDEO_FIXED_SHIFT);
+}
+
+/* point the lanes at scanlines rows[i...i+VIDEO_FIXED_LANES-1]. lanes past the end get the scratch line. */
+static inline void video_fixed_lanes_rows(unsigned char **P,unsigned char * const *rows,const unsigned int count,const unsigned int i,unsigned char *scratch) {
+	for (unsigned int l=0;l < VIDEO_FIXED_LANES;l++) P[l] = ((i+l) < count) ? rows[i+l] : scratch;
+}
+
+/* scale factor to Q8 */
+static inline int32_t video_fixed_amount(const double a) {
+	if (a >= 255)
+		return 255 << 8;
+	else if (a <= -255)
+		return -(255 << 8);
+
+	return (int32_t)floor((a * 256) + 0.5);
+}
+
+class LowpassFilterFixedLanes {
+public:
+	LowpassFilterFixedLanes() {
+		video_fixed_lanes_set(alpha,0);
+		video_fixed_lanes_set(prev,0);
+	}
+	void setFilter(const double rate/*sample rate of audio*/,const double hz/*cutoff*/) {
+		LowpassFilter f;
+
+		f.setFilter(rate,hz);
+		video_fixed_lanes_set(alpha,(int32_t)floor((f.alpha * (1 << VIDEO_FIXED_ALPHA_SHIFT)) + 0.5));
+	}
+	void resetFilter(const int val=0) {
+		video_fixed_lanes_set(prev,val << VIDEO_FIXED_SHIFT);
+	}
+	void lowpass(video_fixed_lanes_t &sample) { /* in place */
+		/* same as alpha*sample + prev - prev*alpha */
+		prev += (((sample - prev) * alpha) + (1 << (VIDEO_FIXED_ALPHA_SHIFT - 1))) >> VIDEO_FIXED_ALPHA_SHIFT;
+		sample = prev;
+	}
+	void highpass(video_fixed_lanes_t &sample) { /* in place */
+		prev += (((sample - prev) * alpha) + (1 << (VIDEO_FIXED_ALPHA_SHIFT - 1))) >> VIDEO_FIXED_ALPHA_SHIFT;
+		sample -= prev;
+	}
+public:
+	video_fixed_lanes_t	alpha; /* Q14 */
+	video_fixed_lanes_t	prev;
+};
+
 void composite_video_chroma_lowpass(AVFrame *dst,unsigned int field,unsigned long long fieldno) {
     unsigned int x,y;
 
+	if (video_fixed_point) {
+		const unsigned int count = (dst->height - field + 1U) / 2U;
+		unsigned char *rows[count + 1];
+		unsigned char scratch[dst->width/2];
+		unsigned char *P[VIDEO_FIXED_LANES];
+		unsigned int i;
+
+		memset(scratch,128,sizeof(scratch));
+		for (unsigned int p=1;p <= 2;p++) {
+			double cutoff;
+			unsigned int delay;
+
+			if (output_ntsc) {
+				// NTSC YIQ bandwidth: I=1.3MHz Q=0.6MHz
+				cutoff = (p == 1) ? 1300000 : 600000;
+				delay = (p == 1) ? 2 : 4;
+			}
+			else {
+				// PAL: R-Y and B-Y are 1.3MHz
+				cutoff = 1300000;
+				delay = 2;
+			}
+
+			for (i=0,y=field;y < dst->height;y += 2) rows[i++] = dst->data[p] + (y * dst->linesize[p]);
+
+			for (i=0;i < count;i += VIDEO_FIXED_LANES) {
+				LowpassFilterFixedLanes lp[3];
+				LowpassFilterFixedLanes hp;
+				video_fixed_lanes_t s,t;
+
+				video_fixed_lanes_rows(P,rows,count,i,scratch);
+
+				hp.setFilter((315000000.00 * 4) / (88 * 2),cutoff/2); // 315/88 Mhz rate * 4 (divide by 2 for 4:2:2)  vs 600KHz cutoff
+				hp.resetFilter(128);
+				for (unsigned int f=0;f < 3;f++) {
+					lp[f].setFilter((315000000.00 * 4) / (88 * 2),cutoff); // 315/88 Mhz rate * 4 (divide by 2 for 4:2:2)  vs 600KHz cutoff
+					lp[f].resetFilter(128);
+				}
+
+				for (x=0;x < (dst->width/2)/*4:2:2*/;x++) {
+					video_fixed_lanes_load(s,P,x);
+					t = s;
+					hp.highpass(t);
+					s += t;
+					lp[0].lowpass(s); lp[1].lowpass(s); lp[2].lowpass(s);
+					if (x >= delay) video_fixed_lanes_store(P,x-delay,s);
+				}
+			}
+		}
+
+		return;
+	}
+
 	{ /* lowpass the chroma more. composite video does not allocate as much bandwidth to color as luma. */
 		for (unsigned int p=1;p <= 2;p++) {
 			for (y=field;y < dst->height;y += 2) {
@@ -394,6 +618,44 @@ void composite_video_chroma_lowpass(AVFrame *dst,unsigned int field,unsigned lon
 void composite_video_chroma_lowpass_lite(AVFrame *dst,unsigned int field,unsigned long long fieldno) {
     unsigned int x,y;
 
+	if (video_fixed_point) {
+		const unsigned int count = (dst->height - field + 1U) / 2U;
+		unsigned char *rows[(count * 2) + 1];
+		unsigned char scratch[dst->width/2];
+		unsigned char *P[VIDEO_FIXED_LANES];
+		const double cutoff = (315000000.00 * 4) / (88 * 2 * 4); // same for NTSC and PAL
+		const unsigned int delay = 1;
+		unsigned int i;
+
+		memset(scratch,128,sizeof(scratch));
+
+		// U and V use the same filter, so their scanlines share the lanes.
+		for (i=0,y=field;y < dst->height;y += 2) {
+			rows[i++] = dst->data[1] + (y * dst->linesize[1]);
+			rows[i++] = dst->data[2] + (y * dst->linesize[2]);
+		}
+
+		for (i=0;i < (count * 2);i += VIDEO_FIXED_LANES) {
+			LowpassFilterFixedLanes lp[3];
+			video_fixed_lanes_t s;
+
+			video_fixed_lanes_rows(P,rows,count * 2,i,scratch);
+
+			for (unsigned int f=0;f < 3;f++) {
+				lp[f].setFilter((315000000.00 * 4) / (88 * 2),cutoff); // 315/88 Mhz rate * 4 (divide by 2 for 4:2:2)  vs 600KHz cutoff
+				lp[f].resetFilter(128);
+			}
+
+			for (x=0;x < (dst->width/2)/*4:2:2*/;x++) {
+				video_fixed_lanes_load(s,P,x);
+				lp[0].lowpass(s); lp[1].lowpass(s); lp[2].lowpass(s);
+				if (x >= delay) video_fixed_lanes_store(P,x-delay,s);
+			}
+		}
+
+		return;
+	}
+
 	{ /* lowpass the chroma more. composite video does not allocate as much bandwidth to color as luma. */
 		for (unsigned int p=1;p <= 2;p++) {
 			for (y=field;y < dst->height;y += 2) {
@@ -429,8 +691,38 @@ void composite_video_chroma_lowpass_lite(AVFrame *dst,unsigned int field,unsigne
 	}
 }
 
+/* Subcarrier modulator/demodulator kernels, SUBCARRIER_LANES pixels at a time in 16-bit lanes (one SSE2 register).
+ * The subcarrier repeats every 4 pixels, so a vector that starts at a multiple of 4 always sees the same part of it
+ * for a given phase xi, and the per-pixel table lookups become a multiply by a pattern vector made once per scanline.
+ * Same results as the scalar code, bit for bit. */
+#define SUBCARRIER_LANES 8
+
+typedef int16_t subcarrier_lanes_t __attribute__((vector_size(sizeof(int16_t) * SUBCARRIER_LANES)));
+typedef uint16_t subcarrier_pairs_t __attribute__((vector_size(sizeof(uint16_t) * SUBCARRIER_LANES)));
+typedef uint8_t subcarrier_bytes_t __attribute__((vector_size(SUBCARRIER_LANES)));
+
+/* SUBCARRIER_LANES pixels to lanes */
+static inline void subcarrier_lanes_load(subcarrier_lanes_t &r,const unsigned char *P) {
+	subcarrier_bytes_t b;
+
+	memcpy(&b,P,sizeof(b));
+	r = __builtin_convertvector(b,subcarrier_lanes_t);
+}
+
+/* lanes to SUBCARRIER_LANES pixels, clamped to 0...255 like clampu8() */
+static inline void subcarrier_lanes_store(unsigned char *P,const subcarrier_lanes_t &s) {
+	const subcarrier_lanes_t lo = s < 0 ? 0 : s;
+	const subcarrier_lanes_t hi = lo > 255 ? 255 : lo;
+	const subcarrier_bytes_t b = __builtin_convertvector(hi,subcarrier_bytes_t);
+
+	memcpy(P,&b,sizeof(b));
+}
+
 /* render the chroma into the luma as a fake NTSC color subcarrier */
 void composite_video_yuv_to_ntsc(AVFrame *dst,unsigned int field,unsigned long long fieldno,const int subcarrier_amplitude) {
+	/* (U-128)*amplitude has to fit in 16 bits for the vectors, which it does for any sane amplitude */
+	const bool lanes = subcarrier_amplitude >= -255 && subcarrier_amplitude <= 255;
+	subcarrier_lanes_t vY,vU,vV,mU,mV;
 	unsigned int x,y;
 
 	for (y=field;y < dst->height;y += 2) {
@@ -457,57 +749,99 @@ void composite_video_yuv_to_ntsc(AVFrame *dst,unsigned int field,unsigned long l
 			xi = (fieldno + y) & 3;
 		}
 
+		for (unsigned int l=0;l < SUBCARRIER_LANES;l++) {
+			mU[l] = subcarrier_amplitude * Umult[(xi+l)&3];
+			mV[l] = subcarrier_amplitude * Vmult[(xi+l)&3];
+		}
+
 		/* remember: this code assumes 4:2:2 */
-		/* NTS: the subcarrier is two sine waves superimposed on top of each other, 90 degrees apart */
-		for (x=0;x < xc;x += 2,Y += 2,U++,V++) {
+		/* NTS: the subcarrier is two sine waves superimposed on top of each other, 90 degrees apart.
+		 *      only one of them is nonzero at any pixel, so the sum fits in 16 bits as well. */
+		x = 0;
+		if (lanes) {
+			/* one load of U and V covers 2 vectors of Y, each chroma sample spread over the 2 pixels it belongs to */
+			static const subcarrier_lanes_t lo = { 0, 0, 1, 1, 2, 2, 3, 3 };
+			static const subcarrier_lanes_t hi = { 4, 4, 5, 5, 6, 6, 7, 7 };
+
+			for (;(x+(SUBCARRIER_LANES*2)) <= xc;x += SUBCARRIER_LANES*2) {
+				subcarrier_lanes_load(vU,U+(x>>1));
+				subcarrier_lanes_load(vV,V+(x>>1));
+				vU -= 128;
+				vV -= 128;
+
+				subcarrier_lanes_load(vY,Y+x);
+				vY += ((__builtin_shuffle(vU,lo) * mU) + (__builtin_shuffle(vV,lo) * mV)) / 50;
+				subcarrier_lanes_store(Y+x,vY);
+
+				subcarrier_lanes_load(vY,Y+x+SUBCARRIER_LANES);
+				vY += ((__builtin_shuffle(vU,hi) * mU) + (__builtin_shuffle(vV,hi) * mV)) / 50;
+				subcarrier_lanes_store(Y+x+SUBCARRIER_LANES,vY);
+			}
+		}
+		for (;x < xc;x += 2) {
 			for (unsigned int sx=0;sx < 2;sx++) {
 				unsigned int sxi = xi+x+sx;
 				int chroma;
 
-				chroma  = ((int)U[0] - 128) * subcarrier_amplitude * Umult[sxi&3];
-				chroma += ((int)V[0] - 128) * subcarrier_amplitude * Vmult[sxi&3];
-				Y[sx] = clampu8(Y[sx] + (chroma / 50));
+				chroma  = ((int)U[x>>1] - 128) * subcarrier_amplitude * Umult[sxi&3];
+				chroma += ((int)V[x>>1] - 128) * subcarrier_amplitude * Vmult[sxi&3];
+				Y[x+sx] = clampu8(Y[x+sx] + (chroma / 50));
 			}
+		}
 
-			if (nocolor_subcarrier)
-				U[0] = V[0] = 128;
+		if (nocolor_subcarrier) {
+			memset(U,128,(xc+1)/2);
+			memset(V,128,(xc+1)/2);
 		}
 	}
 }
 
 /* filter subcarrier back out, use result to emulate NTSC luma-chroma artifacts */
 void composite_ntsc_to_yuv(AVFrame *dst,unsigned int field,unsigned long long fieldno,const int subcarrier_amplitude_back) {
-	unsigned char chroma[dst->width]; // WARNING: This is more GCC-specific C++ than normal
+	const unsigned int width = dst->width;
+	unsigned char chroma[width]; // WARNING: This is more GCC-specific C++ than normal
+	unsigned char line[width + 3]; // the scanline with 1 pixel of padding before, and the 2 pixels past the end the box blur reads
+	unsigned char demod[256]; // subcarrier back to chroma for every byte value, so there is no division per pixel
+	subcarrier_lanes_t a,b,c,d;
 	unsigned int x,y;
 
+	if (!nocolor_subcarrier_after_yc_sep) {
+		for (x=0;x < 256;x++)
+			demod[x] = clampu8(((((int)x - 128) * 50) / subcarrier_amplitude_back) + 128);
+	}
+
 	for (y=field;y < dst->height;y += 2) {
 		unsigned char *Y = dst->data[0] + (y * dst->linesize[0]);
 		unsigned char *U = dst->data[1] + (y * dst->linesize[1]);
 		unsigned char *V = dst->data[2] + (y * dst->linesize[2]);
-		unsigned char delay[4] = {16,16,16,16};
-		unsigned int sum = 16 * (4 - 2);
-		unsigned char c;
-
-		// precharge by 2 pixels to center box blur
-		delay[2] = Y[0]; sum += delay[2];
-		delay[3] = Y[1]; sum += delay[3];
-		for (x=0;x < dst->width;x++) {
-			c = Y[x+2];
-			sum -= delay[0];
-			for (unsigned int j=0;j < (4-1);j++) delay[j] = delay[j+1];
-			delay[3] = c;
-			sum += delay[3];
-			Y[x] = sum / 4;
-			chroma[x] = clampu8(c + 128 - Y[x]);
-
-			if (nocolor_subcarrier_after_yc_sep) {
-				// debug option to SHOW what we got after filtering
+
+		/* 4 pixel box blur of x-1...x+2 (the pixel before the scanline is black), chroma is what the pixel at x+2
+		 * has on top of it. NTS: like it always has, this reads 2 pixels past the width into the line padding */
+		line[0] = 16;
+		memcpy(line+1,Y,width+2);
+		for (x=0;(x+SUBCARRIER_LANES) <= width;x += SUBCARRIER_LANES) {
+			subcarrier_lanes_load(a,line+x+0);
+			subcarrier_lanes_load(b,line+x+1);
+			subcarrier_lanes_load(c,line+x+2);
+			subcarrier_lanes_load(d,line+x+3);
+			a = (a + b + c + d) >> 2;
+			d += 128 - a;
+			subcarrier_lanes_store(Y+x,a);
+			subcarrier_lanes_store(chroma+x,d);
+		}
+		for (;x < width;x++) {
+			Y[x] = ((unsigned int)line[x] + line[x+1] + line[x+2] + line[x+3]) / 4;
+			chroma[x] = clampu8(line[x+3] + 128 - Y[x]);
+		}
+
+		if (nocolor_subcarrier_after_yc_sep) {
+			// debug option to SHOW what we got after filtering
+			for (x=0;x < width;x++) {
 				Y[x] = chroma[x];
 				U[x/2] = V[x/2] = 128;
 			}
 		}
-
-		if (!nocolor_subcarrier_after_yc_sep) {
+		else {
 			unsigned int xi = 0;
 
 			if (output_ntsc) { // NTSC 2 color frames long
@@ -525,114 +859,367 @@ void composite_ntsc_to_yuv(AVFrame *dst,unsigned int field,unsigned long long fi
 				xi = (fieldno + y) & 3;
 			}
 
-			for (x=((4-xi)&3);x < dst->width;x += 4) { // flip the part of the sine wave that would correspond to negative U and V values
-				chroma[x+2] = 255 - chroma[x+2];
-				chroma[x+3] = 255 - chroma[x+3];
+			/* flip the part of the sine wave that would correspond to negative U and V values (the last 2 pixels of
+			 * each group of 4 from flip_start on), then undo the amplitude. 255-c is c^255. */
+			const unsigned int flip_start = (4-xi)&3;
+			unsigned char flip[4];
+
+			for (x=0;x < 4;x++)
+				flip[x] = (((xi+x)&3) >= 2) ? 0xFF : 0x00;
+			for (x=0;x < flip_start && x < width;x++)
+				chroma[x] = demod[chroma[x]];
+			for (;x < width;x++)
+				chroma[x] = demod[chroma[x] ^ flip[x&3]];
+
+			/* decode the color right back out from the subcarrier we generated. each 16-bit lane holds an even
+			 * pixel in the low byte and an odd one in the high byte (little endian), which splits them. */
+			unsigned char *E = (xi & 1) ? V : U,*O = (xi & 1) ? U : V;
+
+			for (x=0;(x+SUBCARRIER_LANES) <= (width/2);x += SUBCARRIER_LANES) {
+				subcarrier_pairs_t p;
+				subcarrier_bytes_t e,o;
+
+				memcpy(&p,chroma+(x*2),sizeof(p));
+				e = 255 - __builtin_convertvector(p & 0xFF,subcarrier_bytes_t);
+				o = 255 - __builtin_convertvector(p >> 8,subcarrier_bytes_t);
+				memcpy(E+x,&e,sizeof(e));
+				memcpy(O+x,&o,sizeof(o));
 			}
-
-			for (x=0;x < dst->width;x++) {
-				chroma[x] = clampu8(((((int)chroma[x] - 128) * 50) / subcarrier_amplitude_back) + 128);
-			}
-
-			/* decode the color right back out from the subcarrier we generated */
-			if (xi & 1) {
-				for (x=0;x < (dst->width/2);x++) {
-					U[x] = 255 - chroma[(x*2)+1];
-					V[x] = 255 - chroma[(x*2)+0];
-				}
-			}
-			else {
-				for (x=0;x < (dst->width/2);x++) {
-					U[x] = 255 - chroma[(x*2)+0];
-					V[x] = 255 - chroma[(x*2)+1];
-				}
+			for (;x < (width/2);x++) {
+				E[x] = 255 - chroma[(x*2)+0];
+				O[x] = 255 - chroma[(x*2)+1];
 			}
 		}
 	}
 }
 
+/* Counter-based random numbers for the video noise and the audio hiss.
+ * (seed, field, scanline, stage) is mixed into a 64-bit stream key (splitmix64 finalizer), and number n of the
+ * stream comes from noise_hash32(), a 32-bit xorshift-multiply hash: once on n with the low half of the key XORed
+ * in, once more after adding the high half. No state, so the field threads can render fields in any order, and a
+ * -segments worker, which numbers its fields from where its piece sits, draws the numbers a continuous render
+ * would. -seed picks a different set. */
+#define NOISE_LANES 8
+
+/* noise that is smoothed along the scanline (see NoiseBank) draws this many numbers ahead of x=0 to get going */
+#define NOISE_RUNIN 8
+
+enum {
+    NOISE_STAGE_LUMA=1,         // -noise
+    NOISE_STAGE_HEAD_SWITCH,    // -vhs-head-switching-noise-level
+    NOISE_STAGE_CHROMA_U,       // -chroma-noise
+    NOISE_STAGE_CHROMA_V,
+    NOISE_STAGE_CHROMA_PHASE,   // -chroma-phase-noise
+    NOISE_STAGE_CHROMA_LOSS,    // -chroma-dropout
+    NOISE_STAGE_AUDIO_HISS,     // -audio-hiss (field = sample >> 16, scanline = channel)
+    NOISE_STAGE_LUMA_BANK,      // NoiseBank contents (field = bank line)
+    NOISE_STAGE_CHROMA_BANK
+};
+
+static unsigned long long noise_seed = 0;
+
+static inline uint64_t noise_mix64(uint64_t z) { /* splitmix64 finalizer */
+    z = (z ^ (z >> 30ULL)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27ULL)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31ULL);
+}
+
+/* key of one stream of random numbers */
+static inline uint64_t noise_key(const unsigned long long field,const unsigned int scanline,const unsigned int stage) {
+    return noise_mix64(noise_mix64(noise_mix64(noise_seed) ^ field) ^ (((uint64_t)stage << 32ULL) + scanline));
+}
+
+static inline uint32_t noise_hash32(uint32_t x) {
+    x ^= x >> 16U; x *= 0x7FEB352DU;
+    x ^= x >> 15U; x *= 0x846CA68BU;
+    x ^= x >> 16U;
+    return x;
+}
+
+/* number n of the stream */
+static inline uint32_t noise_at(const uint64_t key,const uint32_t n) {
+    return noise_hash32(noise_hash32(n ^ (uint32_t)key) + (uint32_t)(key >> 32ULL));
+}
+
+typedef uint32_t noise_lanes_t __attribute__((vector_size(sizeof(uint32_t) * NOISE_LANES)));
+
+static inline void noise_lanes_hash32(noise_lanes_t &x) {
+    x ^= x >> 16U; x *= 0x7FEB352DU;
+    x ^= x >> 15U; x *= 0x846CA68BU;
+    x ^= x >> 16U;
+}
+
+/* numbers n...n+count-1 of the stream into dst[], NOISE_LANES numbers at a time. same results as noise_at(). */
+static void noise_fill(uint32_t *dst,const uint64_t key,const uint32_t n,const unsigned int count) {
+    const uint32_t klo = (uint32_t)key,khi = (uint32_t)(key >> 32ULL);
+    noise_lanes_t c,x;
+    unsigned int i = 0;
+
+    for (unsigned int l=0;l < NOISE_LANES;l++) c[l] = n + l;
+    for (;(i+NOISE_LANES) <= count;i += NOISE_LANES) {
+        x = c ^ klo;
+        noise_lanes_hash32(x);
+        x += khi;
+        noise_lanes_hash32(x);
+        memcpy(dst+i,&x,sizeof(x));
+        c += NOISE_LANES;
+    }
+    for (;i < count;i++)
+        dst[i] = noise_at(key,n+i);
+}
+
+/* Bank of pre-filtered scanline noise.
+ * Scanline noise is white noise through a first-order lowpass (noise = (noise + r) / 2 per pixel), which costs
+ * a random number and a serial step per pixel, about as much as one of the filter passes. The bank holds
+ * NOISE_BANK_LINES lines of it, made once with the same recurrence and amplitude. A scanline then adds the line
+ * picked by one random number, starting at a random offset and with a random sign (the noise is symmetric
+ * around 0), which keeps the spectrum and amplitude. The add is a plain loop that GCC vectorizes. */
+#define NOISE_BANK_LINES 256
+
+struct NoiseLinePick {
+    const int*          line;           // the scanline's noise, width values
+    int                 sign;           // +1 or -1
+};
+
+class NoiseBank {
+public:
+    NoiseBank() : amplitude(0), length(0) { }
+    /* make the bank for noise of +/- amp per pixel, for scanlines up to width long. does nothing if already made. */
+    void prepare(const int amp,const unsigned int width,const unsigned int stage) {
+        uint32_t rnd[NOISE_RUNIN + (width * 2)];
+        int noise;
+
+        if (!bank.empty() && amp == amplitude && (width * 2) <= length)
+            return;
+
+        amplitude = amp;
+        length = width * 2; /* offsets 0...width, and enough of them that two picks rarely overlap much */
+        bank.resize(NOISE_BANK_LINES * length);
+        for (unsigned int l=0;l < NOISE_BANK_LINES;l++) {
+            int *N = &bank[l * length];
+
+            noise_fill(rnd,noise_key(l,0,stage),0,NOISE_RUNIN + length);
+            noise = 0;
+            for (unsigned int x=0;x < NOISE_RUNIN;x++) {
+                noise += ((int)(rnd[x] % ((amp*2)+1))) - amp;
+                noise /= 2;
+            }
+            for (unsigned int x=0;x < length;x++) {
+                N[x] = noise;
+                noise += ((int)(rnd[x+NOISE_RUNIN] % ((amp*2)+1))) - amp;
+                noise /= 2;
+            }
+        }
+    }
+    /* line from bits 0-7, offset from bits 8-30, sign from bit 31 of the random number r */
+    NoiseLinePick pick(const uint32_t r,const unsigned int width) const {
+        NoiseLinePick p;
+
+        assert(width <= (length / 2));
+        p.line = &bank[((r % NOISE_BANK_LINES) * length) + (((r >> 8U) & 0x7FFFFFU) % (length + 1 - width))];
+        p.sign = (r & 0x80000000U) ? -1 : 1;
+        return p;
+    }
+public:
+    std::vector<int>    bank;
+    int                 amplitude;
+    unsigned int        length;
+};
+
+/* the random number that picks everything about one scanline of one stage: bank line, chroma dropout, head switching jitter */
+static inline uint32_t noise_pick(const unsigned long long field,const unsigned int scanline,const unsigned int stage) {
+    return noise_at(noise_key(field,scanline,stage),0);
+}
+
+/* add the picked noise to an 8-bit scanline */
+static inline void noise_line_add(unsigned char *P,const NoiseLinePick &p,const unsigned int width) {
+    const int *N = p.line;
+
+    if (p.sign > 0) {
+        for (unsigned int x=0;x < width;x++) P[x] = clampu8(P[x] + N[x]);
+    }
+    else {
+        for (unsigned int x=0;x < width;x++) P[x] = clampu8(P[x] - N[x]);
+    }
+}
+
+static NoiseBank luma_noise_bank,chroma_noise_bank;
+
+/* make the noise banks for the current settings. at startup, again only if a setting or the width changes */
+static void noise_banks_prepare(const unsigned int width) {
+    if (video_noise != 0)
+        luma_noise_bank.prepare(video_noise,width,NOISE_STAGE_LUMA_BANK);
+    if (video_chroma_noise != 0)
+        chroma_noise_bank.prepare(video_chroma_noise,width,NOISE_STAGE_CHROMA_BANK);
+}
+
 static unsigned long long audio_proc_count = 0;
-static LowpassFilter audio_post_vhs_boost[2];
+static LowpassFilterAudioLanes audio_post_vhs_boost;
+
+static audio_lanes_t audio_block[AUDIO_BLOCK];
+
+/* that faint "buzzing" noise on linear tracks because of audio/video crosstalk. the HSYNC and VSYNC pulses of one
+ * whole frame are tabulated once, 16 entries per sample of the output rate. each entry is what an audio sample
+ * starting there picks up from the pulses over 16 subsamples, the box filter that keeps the edges from aliasing.
+ * a frame is not a whole number of samples, so a phase accumulator steps through the table by about 16 entries
+ * per sample and interpolates. it carries over from call to call. */
+static std::vector<float> audio_buzz_table;     // one frame, plus the first entry again at the end
+static double audio_buzz_phase = 0;             // in table entries
+static double audio_buzz_step = 1;              // table entries per sample
+
+static void audio_buzz_prepare(const double linear_buzz) {
+	const double hsync_hz = output_ntsc ? /*NTSC*/15734 : /*PAL*/15625;
+	const int vsync_lines = output_ntsc ? /*NTSC*/525 : /*PAL*/625;
+	const int vpulse_end = output_ntsc ? /*NTSC*/10 : /*PAL*/12;
+	const double hpulse_end = output_ntsc ? /*NTSC*/(hsync_hz * (4.7/*us*/ / 1000000)) : /*PAL*/(hsync_hz * (4.0/*us*/ / 1000000));
+	const double frame = ((double)vsync_lines * output_audio_rate) / hsync_hz; // samples per frame
+	const unsigned int oversample = 16;
+	const size_t size = (size_t)floor((frame * oversample) + 0.5);
+
+	audio_buzz_table.resize(size + 1);
+	for (size_t j=0;j < size;j++) {
+		const double start = ((double)j * vsync_lines) / size; // in scanlines
+		double s = 0;
+
+		for (unsigned int oi=0;oi < oversample;oi++) {
+			double t = start + ((oi * hsync_hz) / output_audio_rate / oversample);
+			double hpos = fmod(t,1.0);
+			int vline = (int)fmod(floor(t + 0.0001/*fudge*/ - hpos),(double)vsync_lines / 2);
+			bool pulse = false;
+
+			if (hpos < hpulse_end)
+				pulse = true; // HSYNC
+			if (vline < vpulse_end)
+				pulse = true; // VSYNC
+
+			if (pulse)
+				s += linear_buzz / oversample / 2;
+		}
 
-void composite_audio_process(int16_t *audio,unsigned int samples) { // number of channels = output_audio_channels, sample rate = output_audio_rate. audio is interleaved.
-	assert(audio_hilopass.audiostate.size() >= output_audio_channels);
-	double linear_buzz = dBFS(output_audio_linear_buzz);
-	double hsync_hz = output_ntsc ? /*NTSC*/15734 : /*PAL*/15625;
-	int vsync_lines = output_ntsc ? /*NTSC*/525 : /*PAL*/625;
-	int vpulse_end = output_ntsc ? /*NTSC*/10 : /*PAL*/12;
-	double hpulse_end = output_ntsc ? /*NTSC*/(hsync_hz * (4.7/*us*/ / 1000000)) : /*PAL*/(hsync_hz * (4.0/*us*/ / 1000000));
-
-	for (unsigned int s=0;s < samples;s++,audio += output_audio_channels) {
-		for (unsigned int c=0;c < output_audio_channels;c++) {
-			double s;
+		audio_buzz_table[j] = (float)s;
+	}
+	audio_buzz_table[size] = audio_buzz_table[0];
 
-			s = (double)audio[c] / 32768;
+	audio_buzz_step = (double)size / frame;
+	audio_buzz_phase = fmod((double)audio_proc_count * audio_buzz_step,(double)size);
+}
 
-			/* lowpass filter */
-			s = audio_hilopass.audiostate[c].filter(s);
+void composite_audio_process(int16_t *audio,unsigned int samples) { // number of channels = output_audio_channels, sample rate = output_audio_rate. audio is interleaved.
+	assert(audio_hilopass.ready && output_audio_channels <= AUDIO_LANES);
+	const unsigned int channels = output_audio_channels;
+	const double linear_buzz = dBFS(output_audio_linear_buzz);
+	const bool buzz = !output_vhs_hifi && linear_buzz > 0.000000001;
+
+	if (buzz && audio_buzz_table.empty())
+		audio_buzz_prepare(linear_buzz);
+
+	while (samples > 0) {
+		const unsigned int n = std::min(samples,(unsigned int)AUDIO_BLOCK);
+		audio_lanes_t *b = audio_block;
+		unsigned int i,c;
+
+		/* to lanes. a lane without a channel is zero */
+		for (i=0;i < n;i++) {
+			audio_lanes_set(b[i],0);
+			for (c=0;c < channels;c++) b[i][c] = (double)audio[(i * channels) + c] / 32768;
+		}
 
-			/* preemphasis */
-			if (emulating_preemphasis) {
-				for (unsigned int i=0;i < output_audio_channels;i++) {
-					s = s + audio_linear_preemphasis_pre[i].highpass(s);
-				}
-			}
+		/* lowpass filter */
+		audio_hilopass.filter(b,n);
 
-			/* that faint "buzzing" noise on linear tracks because of audio/video crosstalk */
-			if (!output_vhs_hifi && linear_buzz > 0.000000001) {
-				const unsigned int oversample = 16;
-				for (unsigned int oi=0;oi < oversample;oi++) {
-					double t = ((((double)audio_proc_count * oversample) + oi) * hsync_hz) / output_audio_rate / oversample;
-					double hpos = fmod(t,1.0);
-					int vline = (int)fmod(floor(t + 0.0001/*fudge*/ - hpos),(double)vsync_lines / 2);
-					bool pulse = false;
+		/* preemphasis */
+		if (emulating_preemphasis)
+			audio_linear_preemphasis_pre.highboost(b,n,1.0);
 
-					if (hpos < hpulse_end)
-						pulse = true; // HSYNC
-					if (vline < vpulse_end)
-						pulse = true; // VSYNC
+		/* that faint "buzzing" noise on linear tracks because of audio/video crosstalk */
+		if (buzz) {
+			const double size = (double)(audio_buzz_table.size() - 1);
+			const float *tab = &audio_buzz_table[0];
+			double phase = audio_buzz_phase;
 
-					if (pulse)
-						s -= linear_buzz / oversample / 2;
-				}
+			for (i=0;i < n;i++) {
+				const unsigned int j = (unsigned int)phase;
+
+				b[i] -= tab[j] + ((tab[j+1] - tab[j]) * (phase - j));
+				if ((phase += audio_buzz_step) >= size) phase -= size;
 			}
 
-			/* analog limiting (when the signal is too loud) */
-			if (s > 1.0)
-				s = 1.0;
-			else if (s < -1.0)
-				s = -1.0;
+			audio_buzz_phase = phase;
+		}
 
-			/* hiss */
-			if (output_audio_hiss_level != 0)
-				s += ((double)(((int)((unsigned int)rand() % ((output_audio_hiss_level * 2) + 1))) - output_audio_hiss_level)) / 20000;
+		/* analog limiting (when the signal is too loud) */
+		for (i=0;i < n;i++) {
+			b[i] = b[i] > 1.0 ? 1.0 : b[i];
+			b[i] = b[i] < -1.0 ? -1.0 : b[i];
+		}
 
-			/* some VCRs (at least mine) will boost higher frequencies if playing linear tracks */
-			if (!output_vhs_hifi && vhs_linear_high_boost > 0)
-				s += audio_post_vhs_boost[c].highpass(s) * vhs_linear_high_boost;
+		/* hiss */
+		if (output_audio_hiss_level != 0) {
+			for (i=0;i < n;i++) {
+				const unsigned long long count = audio_proc_count + i;
 
-			/* deemphasis */
-			if (emulating_deemphasis) {
-				for (unsigned int i=0;i < output_audio_channels;i++) {
-					s = audio_linear_preemphasis_post[i].lowpass(s);
-				}
+				for (c=0;c < channels;c++)
+					b[i][c] += ((double)(((int)(noise_at(noise_key(count >> 16ULL,c,NOISE_STAGE_AUDIO_HISS),(uint32_t)(count & 0xFFFFULL)) % ((output_audio_hiss_level * 2) + 1))) - output_audio_hiss_level)) / 20000;
 			}
+		}
+
+		/* some VCRs (at least mine) will boost higher frequencies if playing linear tracks */
+		if (!output_vhs_hifi && vhs_linear_high_boost > 0)
+			audio_post_vhs_boost.highboost(b,n,vhs_linear_high_boost);
+
+		/* deemphasis */
+		if (emulating_deemphasis)
+			audio_linear_preemphasis_post.lowpass(b,n);
 
-			audio[c] = clips16(s * 32768);
+		/* back to 16-bit interleaved */
+		for (i=0;i < n;i++) {
+			for (c=0;c < channels;c++) audio[(i * channels) + c] = clips16(b[i][c] * 32768);
 		}
 
-		audio_proc_count++;
+		audio_proc_count += n;
+		audio += n * channels;
+		samples -= n;
 	}
 }
 
-void composite_video_process(AVFrame *dst,unsigned int field,unsigned long long fieldno) {
+/* front half: input chroma lowpass, subcarrier modulation, composite preemphasis. the result depends only on the
+ * source and the subcarrier phase of the field, see front_cache_phase() */
+void composite_video_process_front(AVFrame *dst,unsigned int field,unsigned long long fieldno) {
 	unsigned int x,y;
 
     if (composite_in_chroma_lowpass) composite_video_chroma_lowpass(dst,field,fieldno);
 	composite_video_yuv_to_ntsc(dst,field,fieldno,subcarrier_amplitude);
 
 	/* video composite preemphasis */
-	if (composite_preemphasis != 0 && composite_preemphasis_cut > 0) {
+	if (composite_preemphasis != 0 && composite_preemphasis_cut > 0 && video_fixed_point) {
+		const int32_t amount = video_fixed_amount(composite_preemphasis);
+		const unsigned int count = (dst->height - field + 1U) / 2U;
+		unsigned char *rows[count + 1];
+		unsigned char scratch[dst->width];
+		unsigned char *Y[VIDEO_FIXED_LANES];
+		unsigned int i;
+
+		memset(scratch,16,sizeof(scratch));
+		for (i=0,y=field;y < dst->height;y += 2) rows[i++] = dst->data[0] + (y * dst->linesize[0]);
+
+		for (i=0;i < count;i += VIDEO_FIXED_LANES) {
+			LowpassFilterFixedLanes pre;
+			video_fixed_lanes_t s,t;
+
+			video_fixed_lanes_rows(Y,rows,count,i,scratch);
+
+			pre.setFilter((315000000.00 * 4) / 88,composite_preemphasis_cut); // 315/88 Mhz rate * 4  vs 1.0MHz cutoff
+			pre.resetFilter(16);
+			for (x=0;x < dst->width;x++) {
+				video_fixed_lanes_load(s,Y,x);
+				t = s;
+				pre.highpass(t);
+				s += (t * amount) >> 8;
+				video_fixed_lanes_store(Y,x,s);
+			}
+		}
+	}
+	else if (composite_preemphasis != 0 && composite_preemphasis_cut > 0) {
 		for (y=field;y < dst->height;y += 2) {
 			unsigned char *Y = dst->data[0] + (y * dst->linesize[0]);
 			LowpassFilter pre;
@@ -648,18 +1235,19 @@ void composite_video_process(AVFrame *dst,unsigned int field,unsigned long long
 		}
 	}
 
+}
+
+/* back half: noise, VHS emulation, decoding the subcarrier, everything that changes from field to field */
+void composite_video_process_back(AVFrame *dst,unsigned int field,unsigned long long fieldno) {
+	unsigned int x,y;
+
 	/* add video noise */
 	if (video_noise != 0) {
-		int noise = 0,noise_mod = (video_noise * 255) / 100;
-
+		noise_banks_prepare(dst->width);
 		for (y=field;y < dst->height;y += 2) {
 			unsigned char *Y = dst->data[0] + (y * dst->linesize[0]);
 
-			for (x=0;x < dst->width;x++) {
-				Y[x] = clampu8(Y[x] + noise);
-				noise += ((int)((unsigned int)rand() % ((video_noise*2)+1))) - video_noise;
-				noise /= 2;
-			}
+			noise_line_add(Y,luma_noise_bank.pick(noise_pick(fieldno,y,NOISE_STAGE_LUMA),dst->width),dst->width);
 		}
 	}
 
@@ -672,7 +1260,7 @@ void composite_video_process(AVFrame *dst,unsigned int field,unsigned long long
 		double t;
 
 		if (vhs_head_switching_phase_noise != 0) {
-			unsigned int x = (unsigned int)rand() * (unsigned int)rand() * (unsigned int)rand() * (unsigned int)rand();
+			unsigned int x = noise_pick(fieldno,0,NOISE_STAGE_HEAD_SWITCH);
 			x %= 2000000000U;
 			noise = ((double)x / 1000000000U) - 1.0;
 			noise *= vhs_head_switching_phase_noise;
@@ -735,20 +1323,13 @@ void composite_video_process(AVFrame *dst,unsigned int field,unsigned long long
 
 	/* add video noise */
 	if (video_chroma_noise != 0) {
-		int noiseU = 0,noiseV = 0,noise_mod = (video_chroma_noise * 255) / 100;
-
+		noise_banks_prepare(dst->width);
 		for (y=field;y < dst->height;y += 2) {
 			unsigned char *U = dst->data[1] + (y * dst->linesize[1]);
 			unsigned char *V = dst->data[2] + (y * dst->linesize[2]);
 
-			for (x=0;x < (dst->width/2);x++) {
-				U[x] = clampu8(U[x] + noiseU);
-				V[x] = clampu8(V[x] + noiseV);
-				noiseU += ((int)((unsigned int)rand() % ((video_chroma_noise*2)+1))) - video_chroma_noise;
-				noiseU /= 2;
-				noiseV += ((int)((unsigned int)rand() % ((video_chroma_noise*2)+1))) - video_chroma_noise;
-				noiseV /= 2;
-			}
+			noise_line_add(U,chroma_noise_bank.pick(noise_pick(fieldno,y,NOISE_STAGE_CHROMA_U),dst->width/2),dst->width/2);
+			noise_line_add(V,chroma_noise_bank.pick(noise_pick(fieldno,y,NOISE_STAGE_CHROMA_V),dst->width/2),dst->width/2);
 		}
 	}
 	if (video_chroma_phase_noise != 0) {
@@ -759,7 +1340,7 @@ void composite_video_process(AVFrame *dst,unsigned int field,unsigned long long
 			unsigned char *U = dst->data[1] + (y * dst->linesize[1]);
 			unsigned char *V = dst->data[2] + (y * dst->linesize[2]);
 
-			noise += ((int)((unsigned int)rand() % ((video_chroma_phase_noise*2)+1))) - video_chroma_phase_noise;
+			noise += ((int)(noise_at(noise_key(fieldno,0,NOISE_STAGE_CHROMA_PHASE),y) % ((video_chroma_phase_noise*2)+1))) - video_chroma_phase_noise;
 			noise /= 2;
 			pi = ((double)noise * M_PI) / 100;
 
@@ -805,48 +1386,109 @@ void composite_video_process(AVFrame *dst,unsigned int field,unsigned long long
 				abort();
 		};
 
-		// luma lowpass
-		for (y=field;y < dst->height;y += 2) {
-			unsigned char *Y = dst->data[0] + (y * dst->linesize[0]);
-			LowpassFilter lp[3];
-			LowpassFilter pre;
-			double s;
+		if (video_fixed_point) {
+			const int32_t pre_amount = video_fixed_amount(1.6);
+			const unsigned int count = (dst->height - field + 1U) / 2U;
+			unsigned char *rows[(count * 2) + 1];
+			unsigned char scratch[dst->width];
+			unsigned char *P[VIDEO_FIXED_LANES];
+			unsigned int i;
 
-			for (unsigned int f=0;f < 3;f++) {
-				lp[f].setFilter((315000000.00 * 4) / 88,luma_cut); // 315/88 Mhz rate * 4  vs 3.0MHz cutoff
-				lp[f].resetFilter(16);
+			memset(scratch,16,sizeof(scratch));
+
+			// luma lowpass
+			for (i=0,y=field;y < dst->height;y += 2) rows[i++] = dst->data[0] + (y * dst->linesize[0]);
+
+			for (i=0;i < count;i += VIDEO_FIXED_LANES) {
+				LowpassFilterFixedLanes lp[3];
+				LowpassFilterFixedLanes pre;
+				video_fixed_lanes_t s,t;
+
+				video_fixed_lanes_rows(P,rows,count,i,scratch);
+
+				for (unsigned int f=0;f < 3;f++) {
+					lp[f].setFilter((315000000.00 * 4) / 88,luma_cut); // 315/88 Mhz rate * 4  vs 3.0MHz cutoff
+					lp[f].resetFilter(16);
+				}
+				pre.setFilter((315000000.00 * 4) / 88,luma_cut); // 315/88 Mhz rate * 4  vs 1.0MHz cutoff
+				pre.resetFilter(16);
+				for (x=0;x < dst->width;x++) {
+					video_fixed_lanes_load(s,P,x);
+					lp[0].lowpass(s); lp[1].lowpass(s); lp[2].lowpass(s);
+					t = s;
+					pre.highpass(t);
+					s += (t * pre_amount) >> 8;
+					video_fixed_lanes_store(P,x,s);
+				}
 			}
-			pre.setFilter((315000000.00 * 4) / 88,luma_cut); // 315/88 Mhz rate * 4  vs 1.0MHz cutoff
-			pre.resetFilter(16);
-			for (x=0;x < dst->width;x++) {
-				s = Y[x];
-				for (unsigned int f=0;f < 3;f++) s = lp[f].lowpass(s);
-				s += pre.highpass(s) * 1.6;
-				Y[x] = clampu8(s);
+
+			// chroma lowpass. U and V use the same filter, so their scanlines share the lanes.
+			for (i=0,y=field;y < dst->height;y += 2) {
+				rows[i++] = dst->data[1] + (y * dst->linesize[1]);
+				rows[i++] = dst->data[2] + (y * dst->linesize[2]);
 			}
-		}
 
-		// chroma lowpass
-		for (y=field;y < dst->height;y += 2) {
-			unsigned char *U = dst->data[1] + (y * dst->linesize[1]);
-			unsigned char *V = dst->data[2] + (y * dst->linesize[2]);
-			LowpassFilter lpU[3],lpV[3];
-			double s;
+			for (i=0;i < (count * 2);i += VIDEO_FIXED_LANES) {
+				LowpassFilterFixedLanes lp[3];
+				video_fixed_lanes_t s;
 
-			for (unsigned int f=0;f < 3;f++) {
-				lpU[f].setFilter((315000000.00 * 4) / (88 * 2/*4:2:2*/),chroma_cut); // 315/88 Mhz rate * 4 (divide by 2 for 4:2:2) vs 400KHz cutoff
-				lpU[f].resetFilter(128);
-				lpV[f].setFilter((315000000.00 * 4) / (88 * 2/*4:2:2*/),chroma_cut); // 315/88 Mhz rate * 4 (divide by 2 for 4:2:2) vs 400KHz cutoff
-				lpV[f].resetFilter(128);
+				video_fixed_lanes_rows(P,rows,count * 2,i,scratch);
+
+				for (unsigned int f=0;f < 3;f++) {
+					lp[f].setFilter((315000000.00 * 4) / (88 * 2/*4:2:2*/),chroma_cut); // 315/88 Mhz rate * 4 (divide by 2 for 4:2:2) vs 400KHz cutoff
+					lp[f].resetFilter(128);
+				}
+				for (x=0;x < (dst->width/2);x++) {
+					video_fixed_lanes_load(s,P,x);
+					lp[0].lowpass(s); lp[1].lowpass(s); lp[2].lowpass(s);
+					if (x >= (unsigned int)chroma_delay) video_fixed_lanes_store(P,x-chroma_delay,s);
+				}
 			}
-			for (x=0;x < (dst->width/2);x++) {
-				s = U[x];
-				for (unsigned int f=0;f < 3;f++) s = lpU[f].lowpass(s);
-				if (x >= chroma_delay) U[x-chroma_delay] = clampu8(s);
+		}
+		else {
+			// luma lowpass
+			for (y=field;y < dst->height;y += 2) {
+				unsigned char *Y = dst->data[0] + (y * dst->linesize[0]);
+				LowpassFilter lp[3];
+				LowpassFilter pre;
+				double s;
+
+				for (unsigned int f=0;f < 3;f++) {
+					lp[f].setFilter((315000000.00 * 4) / 88,luma_cut); // 315/88 Mhz rate * 4  vs 3.0MHz cutoff
+					lp[f].resetFilter(16);
+				}
+				pre.setFilter((315000000.00 * 4) / 88,luma_cut); // 315/88 Mhz rate * 4  vs 1.0MHz cutoff
+				pre.resetFilter(16);
+				for (x=0;x < dst->width;x++) {
+					s = Y[x];
+					for (unsigned int f=0;f < 3;f++) s = lp[f].lowpass(s);
+					s += pre.highpass(s) * 1.6;
+					Y[x] = clampu8(s);
+				}
+			}
+
+			// chroma lowpass
+			for (y=field;y < dst->height;y += 2) {
+				unsigned char *U = dst->data[1] + (y * dst->linesize[1]);
+				unsigned char *V = dst->data[2] + (y * dst->linesize[2]);
+				LowpassFilter lpU[3],lpV[3];
+				double s;
 
-				s = V[x];
-				for (unsigned int f=0;f < 3;f++) s = lpV[f].lowpass(s);
-				if (x >= chroma_delay) V[x-chroma_delay] = clampu8(s);
+				for (unsigned int f=0;f < 3;f++) {
+					lpU[f].setFilter((315000000.00 * 4) / (88 * 2/*4:2:2*/),chroma_cut); // 315/88 Mhz rate * 4 (divide by 2 for 4:2:2) vs 400KHz cutoff
+					lpU[f].resetFilter(128);
+					lpV[f].setFilter((315000000.00 * 4) / (88 * 2/*4:2:2*/),chroma_cut); // 315/88 Mhz rate * 4 (divide by 2 for 4:2:2) vs 400KHz cutoff
+					lpV[f].resetFilter(128);
+				}
+				for (x=0;x < (dst->width/2);x++) {
+					s = U[x];
+					for (unsigned int f=0;f < 3;f++) s = lpU[f].lowpass(s);
+					if (x >= chroma_delay) U[x-chroma_delay] = clampu8(s);
+
+					s = V[x];
+					for (unsigned int f=0;f < 3;f++) s = lpV[f].lowpass(s);
+					if (x >= chroma_delay) V[x-chroma_delay] = clampu8(s);
+				}
 			}
 		}
 
@@ -878,7 +1520,65 @@ void composite_video_process(AVFrame *dst,unsigned int field,unsigned long long
 		}
 
 		// VHS decks tend to sharpen the picture on playback
-		if (true/*TODO make option*/) {
+		if (video_fixed_point) {
+			const int32_t amount = video_fixed_amount(vhs_out_sharpen);
+			const int32_t amount_chroma = video_fixed_amount(vhs_out_sharpen_chroma);
+			const unsigned int count = (dst->height - field + 1U) / 2U;
+			unsigned char *rows[(count * 2) + 1];
+			unsigned char scratch[dst->width];
+			unsigned char *P[VIDEO_FIXED_LANES];
+			unsigned int i;
+
+			memset(scratch,16,sizeof(scratch));
+
+			// luma
+			for (i=0,y=field;y < dst->height;y += 2) rows[i++] = dst->data[0] + (y * dst->linesize[0]);
+
+			for (i=0;i < count;i += VIDEO_FIXED_LANES) {
+				LowpassFilterFixedLanes lp[3];
+				video_fixed_lanes_t s,ts;
+
+				video_fixed_lanes_rows(P,rows,count,i,scratch);
+
+				for (unsigned int f=0;f < 3;f++) {
+					lp[f].setFilter((315000000.00 * 4) / 88,luma_cut*2); // 315/88 Mhz rate * 4  vs 3.0MHz cutoff
+					lp[f].resetFilter(16);
+				}
+				for (x=0;x < dst->width;x++) {
+					video_fixed_lanes_load(s,P,x);
+					ts = s;
+					lp[0].lowpass(ts); lp[1].lowpass(ts); lp[2].lowpass(ts);
+					s += ((s - ts) * amount) >> 8;
+					video_fixed_lanes_store(P,x,s);
+				}
+			}
+
+			// chroma. U and V use the same filter, so their scanlines share the lanes.
+			for (i=0,y=field;y < dst->height;y += 2) {
+				rows[i++] = dst->data[1] + (y * dst->linesize[1]);
+				rows[i++] = dst->data[2] + (y * dst->linesize[2]);
+			}
+
+			for (i=0;i < (count * 2);i += VIDEO_FIXED_LANES) {
+				LowpassFilterFixedLanes lp[3];
+				video_fixed_lanes_t s,ts;
+
+				video_fixed_lanes_rows(P,rows,count * 2,i,scratch);
+
+				for (unsigned int f=0;f < 3;f++) {
+					lp[f].setFilter((315000000.00 * 4) / (88 * 2/*4:2:2*/),chroma_cut*2); // 315/88 Mhz rate * 4 (divide by 2 for 4:2:2) vs 400KHz cutoff
+					lp[f].resetFilter(128);
+				}
+				for (x=0;x < (dst->width/2);x++) {
+					video_fixed_lanes_load(s,P,x);
+					ts = s;
+					lp[0].lowpass(ts); lp[1].lowpass(ts); lp[2].lowpass(ts);
+					s += ((s - ts) * amount_chroma) >> 8;
+					video_fixed_lanes_store(P,x,s);
+				}
+			}
+		}
+		else if (true/*TODO make option*/) {
 			// luma
 			for (y=field;y < dst->height;y += 2) {
 				unsigned char *Y = dst->data[0] + (y * dst->linesize[0]);
@@ -932,7 +1632,7 @@ void composite_video_process(AVFrame *dst,unsigned int field,unsigned long long
 			unsigned char *U = dst->data[1] + (y * dst->linesize[1]);
 			unsigned char *V = dst->data[2] + (y * dst->linesize[2]);
 
-			if ((((unsigned int)rand())%100000) < video_chroma_loss) {
+			if ((noise_pick(fieldno,y,NOISE_STAGE_CHROMA_LOSS)%100000) < video_chroma_loss) {
 				memset(U,128,dst->width/2);
 				memset(V,128,dst->width/2);
 			}
@@ -950,6 +1650,11 @@ void composite_video_process(AVFrame *dst,unsigned int field,unsigned long long
         composite_video_chroma_lowpass_lite(dst,field,fieldno);
 }
 
+void composite_video_process(AVFrame *dst,unsigned int field,unsigned long long fieldno) {
+	composite_video_process_front(dst,field,fieldno);
+	composite_video_process_back(dst,field,fieldno);
+}
+
 void black_key(unsigned char *dY,unsigned char *dU,unsigned char *dV,unsigned char *fY,unsigned char *fU,unsigned char *fV,bool wchroma) {
     int dLuma = *dY - (16 + black_key_level_feedback);
     int dChroma = abs(((int)(*dU)) + ((int)(*dV)) - 256) - black_key_level_feedback;
@@ -997,11 +1702,22 @@ void black_key_feedback(AVFrame *dst,AVFrame *flt,unsigned int field,unsigned lo
     }
 }
 
+/* the field of an interlaced source frame that field_number shows (0 = top, 1 = bottom) */
+static inline unsigned int render_field_which(AVFrame *src,unsigned long long field_number,signed long long src_pts) {
+	unsigned int which_field = src->top_field_first ? 0/*top*/ : 1/*bottom*/;
+	unsigned long long pts_delta = field_number - src_pts;
+
+	if (pts_delta >= ((unsigned long long)input_avstream_video_codec_context->ticks_per_frame / 2ULL))
+		which_field ^= 1;
+
+	return which_field;
+}
+
 void render_field(AVFrame *dst,AVFrame *src,unsigned int field,unsigned long long field_number,signed long long src_pts) {
 	unsigned int y,sy,sy2,syf,csy,csy2,csyf;
     unsigned int chroma_height;
 
-    if (output_avstream_video_input_frame->format == AV_PIX_FMT_YUV420P)
+    if (src->format == AV_PIX_FMT_YUV420P)
         chroma_height = src->height >> 1;
     else
         chroma_height = src->height;
@@ -1022,17 +1738,13 @@ void render_field(AVFrame *dst,AVFrame *src,unsigned int field,unsigned long lon
 
         csy = sy;
         csyf = syf;
-        if (output_avstream_video_input_frame->format == AV_PIX_FMT_YUV420P) {
+        if (src->format == AV_PIX_FMT_YUV420P) {
             if (!(csy&1)) csyf = 0;
             csy >>= 1;
         }
 
 		if (src->interlaced_frame) {
-			unsigned int which_field = src->top_field_first ? 0/*top*/ : 1/*bottom*/;
-			unsigned long long pts_delta = field_number - src_pts;
-
-			if (pts_delta >= ((unsigned long long)input_avstream_video_codec_context->ticks_per_frame / 2ULL))
-				which_field ^= 1;
+			const unsigned int which_field = render_field_which(src,field_number,src_pts);
 
 			if (which_field == 0) { // make it even. do not interpolate if first even line of the pair.
 				sy++; // but shift up the frame 1 line
@@ -1084,7 +1796,7 @@ void render_field(AVFrame *dst,AVFrame *src,unsigned int field,unsigned long lon
 			csy2 = csy + 1;
 		}
 
-        if (output_avstream_video_input_frame->format == AV_PIX_FMT_YUV420P) {
+        if (src->format == AV_PIX_FMT_YUV420P) {
             for (unsigned int p=0;p < 3;p++) {
                 unsigned char *s1 = src->data[p] + (src->linesize[p] * sy);
                 unsigned char *s2 = src->data[p] + (src->linesize[p] * sy2);
@@ -1127,15 +1839,275 @@ void render_field(AVFrame *dst,AVFrame *src,unsigned int field,unsigned long lon
 	}
 }
 
-void output_frame(AVFrame *frame,unsigned long long field_number,unsigned int field) {
-	int gotit = 0;
-	AVPacket pkt;
+/* front half cache (-front-cache). render_field() and the front half of composite_video_process() depend only on
+ * the source frame, the field, which field of an interlaced source it shows, and for the subcarrier its phase.
+ * a source frame that lasts several fields (film, low frame rates, frame holds) comes back as the same field
+ * with the same phase 2 or 4 fields later (every other field for NTSC without a scanline phase shift), and then
+ * only the back half has to run. the source is a serial number given to each scaled frame. the cache is shared
+ * by the -field-threads workers. fields only go into it while the source has frames that last more than 2 fields:
+ * where every frame is new every field or two (29.97i, 59.94p) nothing ever comes back, and the copy in would
+ * only cost time. */
+struct FrontCacheEntry {
+    FrontCacheEntry() : serial(0), field(0), which(0), phase(0), used(0), pins(0), ready(false) { }
+    unsigned long long      serial;         // source frame (0 = empty)
+    unsigned int            field;
+    unsigned int            which;          // field of an interlaced source frame
+    unsigned int            phase;          // see front_cache_phase()
+    unsigned long long      used;           // last use, the least recently used entry is replaced
+    unsigned int            pins;           // threads copying into or out of it
+    bool                    ready;          // filled in
+    std::vector<unsigned char> rows;        // Y, U, V of each scanline of the field, at the frame's linesize
+};
+
+std::vector<FrontCacheEntry> front_cache;
+unsigned long long          front_cache_clock = 0;
+unsigned long long          front_cache_serial = 0;     // newest source frame seen (the field threads may be behind)
+unsigned int                front_cache_fields = 0;     // fields it has lasted so far
+unsigned long long          front_cache_long = 0;       // last source frame that lasted more than 2 fields
+pthread_mutex_t             front_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* subcarrier phase of the field, as far as composite_video_yuv_to_ntsc() differs between fields */
+static inline unsigned int front_cache_phase(const unsigned long long fieldno) {
+    if (output_ntsc && video_scanline_phase_shift != 90 && video_scanline_phase_shift != 180 && video_scanline_phase_shift != 270)
+        return 0;
+
+    return (unsigned int)(fieldno & 3ULL);
+}
+
+/* copy the field's scanlines between the frame and a cache entry */
+static void front_cache_copy(AVFrame *dst,unsigned char *rows,const bool to_cache,const unsigned int field) {
+    for (unsigned int y=field;y < (unsigned int)dst->height;y += 2) {
+        for (unsigned int p=0;p < 3;p++) {
+            unsigned char *d = dst->data[p] + (y * dst->linesize[p]);
+
+            if (to_cache)
+                memcpy(rows,d,dst->linesize[p]);
+            else
+                memcpy(d,rows,dst->linesize[p]);
+
+            rows += dst->linesize[p];
+        }
+    }
+}
+
+/* render_field() and composite_video_process_front(), from the front half cache or into it. returns false if the
+ * caller has to do that itself: the cache is off, or the black key changes the field in between. */
+bool render_field_front(AVFrame *dst,AVFrame *src,unsigned long long serial,unsigned int field,unsigned long long field_number,signed long long src_pts) {
+    if (serial == 0 || video_front_cache == 0 || !enable_composite_emulation || black_key_level_feedback >= 0)
+        return false;
+
+    const unsigned int which = src->interlaced_frame ? render_field_which(src,field_number,src_pts) : 0;
+    const unsigned int phase = front_cache_phase(field_number);
+    const size_t size = (size_t)(dst->linesize[0] + dst->linesize[1] + dst->linesize[2]) * (size_t)((dst->height - field + 1U) / 2U);
+    FrontCacheEntry *e = NULL;
+    bool fill = false;
+    size_t i;
+
+    pthread_mutex_lock(&front_cache_lock);
+    if (front_cache.size() != video_front_cache)
+        front_cache.resize(video_front_cache);
+
+    if (serial > front_cache_serial) {
+        front_cache_serial = serial;
+        front_cache_fields = 0;
+    }
+    if (serial == front_cache_serial && (++front_cache_fields) > 2)
+        front_cache_long = serial;
+
+    for (i=0;i < front_cache.size();i++) {
+        FrontCacheEntry &c = front_cache[i];
+
+        if (c.serial == serial && c.field == field && c.which == which && c.phase == phase && c.rows.size() == size) {
+            if (c.ready) e = &c; /* else another thread is still filling it in, render here too */
+            break;
+        }
+    }
+    if (i == front_cache.size() && front_cache_long != 0 && serial <= (front_cache_long + 4)) { // a long one within the last 4 frames
+        for (i=0;i < front_cache.size();i++) {
+            if (front_cache[i].pins != 0) continue;
+            if (e == NULL || front_cache[i].used < e->used) e = &front_cache[i];
+        }
+        if (e != NULL) {
+            e->serial = serial;
+            e->field = field;
+            e->which = which;
+            e->phase = phase;
+            e->ready = false;
+            e->rows.resize(size);
+            fill = true;
+        }
+    }
+    if (e != NULL) {
+        e->used = ++front_cache_clock;
+        e->pins++;
+    }
+    pthread_mutex_unlock(&front_cache_lock);
+
+    if (e != NULL && !fill) {
+        front_cache_copy(dst,&e->rows[0],false,field);
+    }
+    else {
+        render_field(dst,src,field,field_number,src_pts);
+        composite_video_process_front(dst,field,field_number);
+        if (e != NULL) front_cache_copy(dst,&e->rows[0],true,field);
+    }
+
+    if (e != NULL) {
+        pthread_mutex_lock(&front_cache_lock);
+        if (fill) e->ready = true;
+        e->pins--;
+        pthread_mutex_unlock(&front_cache_lock);
+    }
+
+    return true;
+}
+
+/* muxer thread. it alone calls av_interleaved_write_frame(), for both streams. the video encode thread and the
+ * audio thread (or the main thread, for whichever of those is not running) each hand it their packets through a
+ * queue of their own, single producer, single consumer like the encode ring, so that a slow write or a stalled
+ * encoder never holds up the other stream. one more semaphore counts the packets in both queues plus one post
+ * to quit, and is what the muxer thread sleeps on. a producer posts its queue before that, so every wake-up finds
+ * a packet in one queue or the other, except the last one. without the thread, the writes take a lock instead. */
+struct OutputMuxQueue {
+    AVPacket*               ring;
+    unsigned int            size;
+    unsigned int            head;                   // next slot to fill (producer)
+    unsigned int            tail;                   // next slot to write (muxer thread)
+    sem_t                   free,used;
+};
+
+OutputMuxQueue              output_mux_video = { NULL, 0, 0, 0 };
+OutputMuxQueue              output_mux_audio = { NULL, 0, 0, 0 };
+bool                        output_mux_running = false;
+pthread_t                   output_mux_thread;
+sem_t                       output_mux_pending;
+pthread_mutex_t             output_mux_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void output_mux_queue_init(OutputMuxQueue &q,const unsigned int size) {
+    unsigned int i;
+
+    q.ring = new AVPacket[size];
+    q.size = size;
+    q.head = q.tail = 0;
+    for (i=0;i < q.size;i++)
+        av_init_packet(&q.ring[i]);
+
+    sem_init(&q.free,0,q.size);
+    sem_init(&q.used,0,0);
+}
+
+void output_mux_queue_free(OutputMuxQueue &q) {
+    unsigned int i;
 
-	av_init_packet(&pkt);
-	if (av_new_packet(&pkt,50000000/8) < 0) {
-		fprintf(stderr,"Failed to alloc vid packet\n");
+    if (q.ring == NULL)
+        return;
+
+    for (i=0;i < q.size;i++)
+        av_packet_unref(&q.ring[i]);
+
+    sem_destroy(&q.free);
+    sem_destroy(&q.used);
+    delete[] q.ring;
+    q.ring = NULL;
+    q.size = 0;
+}
+
+/* write the next packet of the queue, if there is one */
+bool output_mux_queue_write(OutputMuxQueue &q) {
+    if (sem_trywait(&q.used) != 0)
+        return false;
+
+    AVPacket &pkt = q.ring[q.tail];
+    if ((++q.tail) >= q.size) q.tail = 0;
+
+    if (av_interleaved_write_frame(output_avfmt,&pkt) < 0)
+        fprintf(stderr,"AV write frame failed\n");
+
+    av_packet_unref(&pkt);
+    sem_post(&q.free);
+    return true;
+}
+
+void *output_mux_thread_proc(void *arg) {
+    bool video_first = true;
+
+    (void)arg;
+    do {
+        while (sem_wait(&output_mux_pending) != 0);
+
+        /* take turns when both have a packet waiting */
+        OutputMuxQueue &a = video_first ? output_mux_video : output_mux_audio;
+        OutputMuxQueue &b = video_first ? output_mux_audio : output_mux_video;
+        if (!output_mux_queue_write(a) && !output_mux_queue_write(b))
+            break; // quit
+
+        video_first = !video_first;
+    } while (1);
+
+    return NULL;
+}
+
+void output_mux_start(void) {
+    if (output_mux_queue == 0 || output_mux_running)
+        return;
+
+    output_mux_queue_init(output_mux_video,output_mux_queue);
+    output_mux_queue_init(output_mux_audio,output_mux_queue);
+    sem_init(&output_mux_pending,0,0);
+    if (pthread_create(&output_mux_thread,NULL,output_mux_thread_proc,NULL) != 0) {
+        fprintf(stderr,"Failed to start muxer thread, writing from the encode and audio threads\n");
+        sem_destroy(&output_mux_pending);
+        output_mux_queue_free(output_mux_video);
+        output_mux_queue_free(output_mux_audio);
+        return;
+    }
+
+    output_mux_running = true;
+}
+
+/* everything queued is written before the thread ends. call after the encode and audio threads are done */
+void output_mux_flush(void) {
+    if (!output_mux_running)
+        return;
+
+    sem_post(&output_mux_pending);
+    pthread_join(output_mux_thread,NULL);
+    sem_destroy(&output_mux_pending);
+    output_mux_queue_free(output_mux_video);
+    output_mux_queue_free(output_mux_audio);
+    output_mux_running = false;
+}
+
+/* hand the packet to the muxer (it is moved, pkt comes back blank), from the one thread producing stream q */
+int output_write_packet(AVPacket *pkt,OutputMuxQueue &q) {
+    int r;
+
+    if (!output_mux_running) {
+        pthread_mutex_lock(&output_mux_lock);
+        r = av_interleaved_write_frame(output_avfmt,pkt);
+        pthread_mutex_unlock(&output_mux_lock);
+        return r;
+    }
+
+    while (sem_wait(&q.free) != 0);
+    av_packet_move_ref(&q.ring[q.head],pkt);
+    if ((++q.head) >= q.size) q.head = 0;
+
+    sem_post(&q.used);
+    sem_post(&output_mux_pending);
+    return 0;
+}
+
+/* encoded video from output_video_encode.cpp */
+int output_video_write_packet(AVPacket *pkt) {
+    return output_write_packet(pkt,output_mux_video);
+}
+
+void output_frame(AVFrame *frame,unsigned long long field_number,unsigned int field) {
+	if ((signed long long)field_number < segment_field_first) // -ss pre-roll, rendered only to settle the filters
+		return;
+	if (segment_field_end >= 0LL && (signed long long)field_number >= segment_field_end) // -segments: the next piece's
 		return;
-	}
 
 	frame->key_frame = (field_number % (15ULL * 2ULL)) == 0 ? 1 : 0;
 
@@ -1143,27 +2115,15 @@ void output_frame(AVFrame *frame,unsigned long long field_number,unsigned int fi
 		frame->interlaced_frame = 1;
 		frame->top_field_first = (field == 0)?1:0;
 		frame->pts = field_number / 2ULL;
-		pkt.pts = field_number / 2ULL;
-		pkt.dts = field_number / 2ULL;
 	}
 	else {
 		frame->interlaced_frame = 0;
 		frame->pts = field_number;
-		pkt.pts = field_number;
-		pkt.dts = field_number;
 	}
 
 	fprintf(stderr,"\x0D" "Output field %llu ",field_number); fflush(stderr);
 	if (output_video_as_interlaced && use_422_colorspace) { // 4:2:2 interlaced = use as-is
-        if (avcodec_encode_video2(output_avstream_video_codec_context,&pkt,frame,&gotit) == 0) {
-            if (gotit) {
-                pkt.stream_index = output_avstream_video->index;
-                av_packet_rescale_ts(&pkt,output_avstream_video_codec_context->time_base,output_avstream_video->time_base);
-
-                if (av_interleaved_write_frame(output_avfmt,&pkt) < 0)
-                    fprintf(stderr,"AV write frame failed video\n");
-            }
-        }
+        output_video_encode(frame);
     }
 	else {
 		output_avstream_video_bob_frame->interlaced_frame = frame->interlaced_frame;
@@ -1234,18 +2194,311 @@ void output_frame(AVFrame *frame,unsigned long long field_number,unsigned int fi
             }
         }
 
-		if (avcodec_encode_video2(output_avstream_video_codec_context,&pkt,output_avstream_video_bob_frame,&gotit) == 0) {
-			if (gotit) {
-				pkt.stream_index = output_avstream_video->index;
-				av_packet_rescale_ts(&pkt,output_avstream_video_codec_context->time_base,output_avstream_video->time_base);
-
-				if (av_interleaved_write_frame(output_avfmt,&pkt) < 0)
-					fprintf(stderr,"AV write frame failed video\n");
-			}
-		}
+		output_video_encode(output_avstream_video_bob_frame);
 	}
+}
+
+/* -field-threads: fields are rendered on a pool of worker threads as soon as their source frame is decoded.
+ * render_field() and composite_video_process() depend only on the source frame, the field number and the
+ * (counter based) noise, so any field can be rendered on any thread in any order. black_key_feedback() carries
+ * the key frame from field to field and is a serial stage: each field waits its turn there, in field order.
+ * finished fields go through a reorder ring back to output_frame() on the main thread, in field order.
+ * the audio path has a thread of its own, see output_audio_start().
+ *
+ * the ring is indexed by field number. in interlaced mode both fields of a frame render into the frame of
+ * the even slot (different lines), and a slot is not reused until the frame it belongs to is output. */
+struct FieldSource {
+    AVFrame*                frame;          // copy of the scaled source frame (the decode loop reuses its own)
+    unsigned int            refs;           // fields submitted from it and not yet output
+    unsigned long long      serial;         // video_source_serial of the frame (front half cache)
+};
+
+struct FieldSlot {
+    FieldSource*            src;            // NULL if the source could not be copied (field is not rendered)
+    AVFrame*                dst;
+    signed long long        src_pts;
+    bool                    done;
+};
+
+FieldSlot*                  field_ring = NULL;
+unsigned long long          field_ring_mask = 0;        // ring size - 1 (power of 2, the field number wraps cleanly)
+unsigned long long          field_ring_next = 0;        // next field to submit
+unsigned long long          field_ring_take = 0;        // next field for a worker to pick up
+unsigned long long          field_ring_out = 0;         // next field to output
+unsigned long long          field_key_next = 0;         // next field for the black key stage
+bool                        field_ring_started = false;
+std::vector<FieldSource*>   field_source_free;
+pthread_t*                  field_threads = NULL;
+unsigned int                field_threads_count = 0;
+bool                        field_threads_running = false;
+bool                        field_threads_quit = false;
+pthread_mutex_t             field_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t              field_work_cond = PTHREAD_COND_INITIALIZER;    // a field was submitted, or quit
+pthread_cond_t              field_done_cond = PTHREAD_COND_INITIALIZER;    // a field is done
+pthread_cond_t              field_key_cond = PTHREAD_COND_INITIALIZER;     // the black key stage moved on
+
+/* copy the scaled source frame for the fields about to be submitted */
+FieldSource *field_source_get(AVFrame *frame) {
+    FieldSource *s = NULL;
+
+    while (!field_source_free.empty()) {
+        s = field_source_free.back();
+        field_source_free.pop_back();
+        if (s->frame->format == frame->format && s->frame->width == frame->width && s->frame->height == frame->height)
+            break;
+
+        av_frame_free(&s->frame);
+        delete s;
+        s = NULL;
+    }
 
-	av_packet_unref(&pkt);
+    if (s == NULL) {
+        s = new FieldSource;
+        s->frame = av_frame_alloc();
+        if (s->frame == NULL) {
+            fprintf(stderr,"Failed to alloc video frame\n");
+            delete s;
+            return NULL;
+        }
+        s->frame->format = frame->format;
+        s->frame->height = frame->height;
+        s->frame->width = frame->width;
+        if (av_frame_get_buffer(s->frame,64) < 0) {
+            fprintf(stderr,"Failed to alloc source frame\n");
+            av_frame_free(&s->frame);
+            delete s;
+            return NULL;
+        }
+    }
+
+    av_frame_copy(s->frame,frame);
+    av_frame_copy_props(s->frame,frame);
+    s->refs = 0;
+    s->serial = video_source_serial;
+    return s;
+}
+
+void field_source_release(FieldSource *s) {
+    if (s != NULL && (--s->refs) == 0)
+        field_source_free.push_back(s);
+}
+
+/* the frame a field renders into */
+static inline AVFrame *field_ring_dst(const unsigned long long field_number) {
+    return field_ring[(output_video_as_interlaced ? (field_number & (~1ULL)) : field_number) & field_ring_mask].dst;
+}
+
+/* one field, on a worker thread: render, black key (serial, in field order), composite emulation */
+void field_render(FieldSlot &s,const unsigned long long field_number) {
+    const unsigned int field = (unsigned int)(field_number & 1ULL) ^ 1/*bottom field first*/;
+    AVFrame *dst = field_ring_dst(field_number);
+
+    bool front = false;
+
+    if (s.src != NULL)
+        front = render_field_front(dst,s.src->frame,s.src->serial,field,field_number,s.src_pts);
+    if (s.src != NULL && !front)
+        render_field(dst,s.src->frame,field,field_number,s.src_pts);
+
+    if (black_key_level_feedback >= 0) {
+        pthread_mutex_lock(&field_lock);
+        while (field_key_next != field_number)
+            pthread_cond_wait(&field_key_cond,&field_lock);
+        pthread_mutex_unlock(&field_lock);
+
+        if (s.src != NULL)
+            black_key_feedback(dst,output_avstream_video_filter_frame,field,field_number);
+
+        pthread_mutex_lock(&field_lock);
+        field_key_next++;
+        pthread_cond_broadcast(&field_key_cond);
+        pthread_mutex_unlock(&field_lock);
+    }
+
+    if (s.src != NULL && enable_composite_emulation) {
+        if (!front) composite_video_process_front(dst,field,field_number);
+        composite_video_process_back(dst,field,field_number);
+    }
+}
+
+void *field_thread_proc(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&field_lock);
+    do {
+        while (!field_threads_quit && field_ring_take == field_ring_next)
+            pthread_cond_wait(&field_work_cond,&field_lock);
+        if (field_ring_take == field_ring_next)
+            break;
+
+        const unsigned long long field_number = field_ring_take++;
+        FieldSlot &s = field_ring[field_number & field_ring_mask];
+
+        pthread_mutex_unlock(&field_lock);
+        field_render(s,field_number);
+        pthread_mutex_lock(&field_lock);
+
+        s.done = true;
+        pthread_cond_signal(&field_done_cond);
+    } while (1);
+    pthread_mutex_unlock(&field_lock);
+    return NULL;
+}
+
+/* output finished fields in field order. fields before 'upto' are waited for, later ones only if already done */
+void field_output(const unsigned long long upto) {
+    while (field_ring_out != field_ring_next) {
+        const unsigned long long field_number = field_ring_out;
+        FieldSlot &s = field_ring[field_number & field_ring_mask];
+
+        pthread_mutex_lock(&field_lock);
+        if (!s.done && (signed long long)(field_number - upto) >= 0LL) {
+            pthread_mutex_unlock(&field_lock);
+            break;
+        }
+        while (!s.done)
+            pthread_cond_wait(&field_done_cond,&field_lock);
+        pthread_mutex_unlock(&field_lock);
+
+        if (output_video_as_interlaced) {
+            if ((field_number & 1ULL)) output_frame(field_ring_dst(field_number),field_number - 1ULL,(int)((field_number - 1ULL) & 1ULL) ^ 1/*bottom field first*/);
+        }
+        else {
+            output_frame(field_ring_dst(field_number),field_number,(int)(field_number & 1ULL) ^ 1/*bottom field first*/);
+        }
+
+        field_source_release(s.src);
+        s.src = NULL;
+        s.done = false;
+        field_ring_out++;
+    }
+}
+
+/* hand a field to the workers. fields come in order, one after the other. if the ring is full, this waits
+ * for the oldest frame to finish and outputs it. */
+void field_submit(FieldSource *src,const unsigned long long field_number,const signed long long src_pts) {
+    if (!field_ring_started) {
+        pthread_mutex_lock(&field_lock);
+        field_ring_next = field_ring_take = field_ring_out = field_key_next = field_number;
+        pthread_mutex_unlock(&field_lock);
+        field_ring_started = true;
+    }
+    assert(field_number == field_ring_next);
+
+    /* take the reference first: outputting an earlier field of the same source must not free it */
+    if (src != NULL) src->refs++;
+
+    /* the slot (interlaced: the slot pair) must have been output */
+    field_output(((output_video_as_interlaced ? (field_number | 1ULL) : field_number) - field_ring_mask));
+
+    FieldSlot &s = field_ring[field_number & field_ring_mask];
+    s.src = src;
+    s.src_pts = src_pts;
+    s.done = false;
+
+    pthread_mutex_lock(&field_lock);
+    field_ring_next++;
+    pthread_cond_signal(&field_work_cond);
+    pthread_mutex_unlock(&field_lock);
+}
+
+void field_threads_start(void) {
+    unsigned long long size = 4;
+    unsigned int i;
+
+    if (render_field_threads == 0 || field_threads_running)
+        return;
+
+    /* enough fields in flight to keep every worker busy while the main thread decodes and outputs */
+    while (size < ((unsigned long long)render_field_threads * 2ULL) + 2ULL) size <<= 1ULL;
+
+    field_ring = new FieldSlot[size]();
+    field_ring_mask = size - 1ULL;
+    for (i=0;i < size;i++) {
+        FieldSlot &s = field_ring[i];
+
+        s.src = NULL;
+        s.src_pts = 0;
+        s.done = false;
+        s.dst = av_frame_alloc();
+        if (s.dst == NULL) {
+            fprintf(stderr,"Failed to alloc video frame\n");
+            break;
+        }
+        av_frame_set_colorspace(s.dst,AVCOL_SPC_SMPTE170M);
+        av_frame_set_color_range(s.dst,AVCOL_RANGE_MPEG);
+        s.dst->format = AV_PIX_FMT_YUV422P;
+        s.dst->height = output_height;
+        s.dst->width = output_width;
+        if (av_frame_get_buffer(s.dst,64) < 0) {
+            fprintf(stderr,"Failed to alloc render frame\n");
+            av_frame_free(&s.dst);
+            break;
+        }
+    }
+
+    field_threads = new pthread_t[render_field_threads];
+    field_threads_count = 0;
+    field_threads_quit = false;
+    if (i == size) {
+        while (field_threads_count < render_field_threads) {
+            if (pthread_create(&field_threads[field_threads_count],NULL,field_thread_proc,NULL) != 0) {
+                fprintf(stderr,"Failed to start field thread\n");
+                break;
+            }
+            field_threads_count++;
+        }
+    }
+
+    if (field_threads_count == 0) {
+        fprintf(stderr,"No field threads, rendering on the main thread\n");
+        for (i=0;i < size;i++) {
+            if (field_ring[i].dst != NULL)
+                av_frame_free(&field_ring[i].dst);
+        }
+        delete[] field_threads;
+        field_threads = NULL;
+        delete[] field_ring;
+        field_ring = NULL;
+        return;
+    }
+
+    field_ring_started = false;
+    field_threads_running = true;
+}
+
+/* output every field still in flight and end the worker threads */
+void field_threads_flush(void) {
+    unsigned int i;
+
+    if (!field_threads_running)
+        return;
+
+    field_output(field_ring_next);
+
+    pthread_mutex_lock(&field_lock);
+    field_threads_quit = true;
+    pthread_cond_broadcast(&field_work_cond);
+    pthread_mutex_unlock(&field_lock);
+    for (i=0;i < field_threads_count;i++)
+        pthread_join(field_threads[i],NULL);
+    field_threads_running = false;
+
+    for (i=0;i <= field_ring_mask;i++) {
+        if (field_ring[i].dst != NULL)
+            av_frame_free(&field_ring[i].dst);
+    }
+    while (!field_source_free.empty()) {
+        FieldSource *s = field_source_free.back();
+
+        field_source_free.pop_back();
+        av_frame_free(&s->frame);
+        delete s;
+    }
+    delete[] field_threads;
+    field_threads = NULL;
+    field_threads_count = 0;
+    delete[] field_ring;
+    field_ring = NULL;
 }
 
 void preset_PAL() {
@@ -1272,6 +2525,16 @@ static void help(const char *arg0) {
 	fprintf(stderr,"%s [options]\n",arg0);
 	fprintf(stderr," -i <input file>\n");
 	fprintf(stderr," -o <output file>\n");
+	fprintf(stderr," -vcodec <name>            Video encoder: h264 (default), hevc, ffv1, prores, or any FFmpeg encoder name\n");
+	fprintf(stderr," -preset <name>            Encoder preset (x264/x265: ultrafast ... veryslow)\n");
+	fprintf(stderr," -crf <n>                  Encoder constant rate factor (x264/x265)\n");
+	fprintf(stderr," -b:v <rate>               Video bitrate in bits/sec (k and M suffixes allowed)\n");
+	fprintf(stderr," -acodec <name>            Audio encoder: pcm (default, 16-bit PCM), aac, opus, flac, or any FFmpeg encoder name\n");
+	fprintf(stderr," -b:a <rate>               Audio bitrate in bits/sec (k and M suffixes allowed)\n");
+	fprintf(stderr," -encode-threads <n>       Encoder threads (default 0, one per CPU core)\n");
+	fprintf(stderr," -encode-queue <n>         Frames queued to the encode thread (default 8, 0=encode on the main thread)\n");
+	fprintf(stderr," -audio-queue <n>          Packets queued to the audio thread (default 32, 0=audio on the main thread)\n");
+	fprintf(stderr," -mux-queue <n>            Packets queued to the muxer thread, each stream (default 32, 0=no muxer thread)\n");
 	fprintf(stderr," -tvstd <pal|ntsc>\n");
 	fprintf(stderr," -vhs                      Emulation of VHS artifacts\n");
 	fprintf(stderr," -vhs-hifi <0|1>           (default on)\n");
@@ -1283,6 +2546,7 @@ static void help(const char *arg0) {
 	fprintf(stderr," -subcarrier-amp <0...100> Subcarrier amplitude (0 to 100 percent of luma)\n");
 	fprintf(stderr," -noise <0..100>           Noise amplitude\n");
 	fprintf(stderr," -chroma-noise <0..100>    Chroma noise amplitude\n");
+	fprintf(stderr," -seed <n>                 Seed for all noise, the same seed gives the same noise (default 0)\n");
 	fprintf(stderr," -audio-hiss <-120..0>     Audio hiss in decibels (0=100%)\n");
 	fprintf(stderr," -vhs-linear-video-crosstalk <x> Emulate video crosstalk in audio. Loudness in dBFS (0=100%)\n");
 	fprintf(stderr," -chroma-phase-noise <x>   Chroma phase noise (0...100)\n");
@@ -1311,9 +2575,14 @@ static void help(const char *arg0) {
     fprintf(stderr," -ss <t>                   Start transcoding from t seconds\n");
     fprintf(stderr," -se <t>                   Stop transcoding at t seconds\n");
     fprintf(stderr," -t <t>                    Transcode only t seconds\n");
+    fprintf(stderr," -preroll <n>              With -ss, render n fields before the start (not output) to settle filters (default 8)\n");
+    fprintf(stderr," -segments <n>             Split the input at keyframes and render n pieces in parallel, then join them\n");
+    fprintf(stderr," -field-threads <n>        Render fields on n worker threads, output in order (default 0, on the main thread)\n");
+    fprintf(stderr," -front-cache <n>          Keep the front half of n fields for source frames that last several fields (default 6, 0=off)\n");
     fprintf(stderr," -in-composite-lowpass <n> Enable/disable chroma lowpass on composite in\n");
     fprintf(stderr," -out-composite-lowpass <n> Enable/disable chroma lowpass on composite out\n");
     fprintf(stderr," -out-composite-lowpass-lite <n> Enable/disable chroma lowpass on composite out (lite)\n");
+    fprintf(stderr," -video-fixed-point <n>    Enable/disable fixed point video filters (default on, 0=double precision)\n");
     fprintf(stderr," -bkey-feedback <n>        Black key feedback (black level <= N)\n");
     fprintf(stderr," -comp-phase <n>           NTSC subcarrier phase per scanline (0, 90, 180, or 270)\n");
 	fprintf(stderr,"\n");
@@ -1364,6 +2633,9 @@ static int parse_argv(int argc,char **argv) {
             else if (!strcmp(a,"out-composite-lowpass-lite")) {
                 composite_out_chroma_lowpass_lite = atoi(argv[i++]) > 0;
             }
+            else if (!strcmp(a,"video-fixed-point")) {
+                video_fixed_point = atoi(argv[i++]) > 0;
+            }
             else if (!strcmp(a,"ss")) {
                 transcode_start = atof(argv[i++]);
             }
@@ -1373,6 +2645,31 @@ static int parse_argv(int argc,char **argv) {
             else if (!strcmp(a,"t")) {
                 transcode_dur = atof(argv[i++]);
             }
+            else if (!strcmp(a,"segments")) {
+                render_segments = (unsigned int)strtoul(argv[i++],NULL,0);
+                if (render_segments > 256) {
+                    fprintf(stderr,"Too many segments\n");
+                    return 1;
+                }
+            }
+            else if (!strcmp(a,"field-threads")) {
+                render_field_threads = (unsigned int)strtoul(argv[i++],NULL,0);
+                if (render_field_threads > 64) {
+                    fprintf(stderr,"Too many field threads\n");
+                    return 1;
+                }
+            }
+            else if (!strcmp(a,"front-cache")) {
+                video_front_cache = (unsigned int)strtoul(argv[i++],NULL,0);
+                if (video_front_cache > 64) {
+                    fprintf(stderr,"Front cache too large\n");
+                    return 1;
+                }
+            }
+            else if (!strcmp(a,"preroll")) {
+                transcode_preroll = (unsigned int)strtoul(argv[i++],NULL,0);
+                transcode_preroll = (transcode_preroll + 1u) & (~1u); // whole frames, so -vi pairs fields the same
+            }
             else if (!strcmp(a,"nocomp")) {
                 enable_composite_emulation = false;
                 enable_audio_emulation = false;
@@ -1464,6 +2761,9 @@ static int parse_argv(int argc,char **argv) {
 				int x = atoi(argv[i++]);
 				video_noise = x;
 			}
+			else if (!strcmp(a,"seed")) {
+				noise_seed = strtoull(argv[i++],NULL,0);
+			}
 			else if (!strcmp(a,"subcarrier-amp")) {
 				int x = atoi(argv[i++]);
 				subcarrier_amplitude = x;
@@ -1498,8 +2798,91 @@ static int parse_argv(int argc,char **argv) {
 				int x = atoi(argv[i++]);
 				emulating_deemphasis = (x > 0);
 			}
-			else if (!strcmp(a,"i")) {
-				input_file = argv[i++];
+			else if (!strcmp(a,"i")) {
+				input_file = argv[i++];
+			}
+			else if (!strcmp(a,"vcodec")) {
+				a = argv[i++];
+				if (a == NULL) return 1;
+				output_video_codec = a;
+			}
+			else if (!strcmp(a,"acodec")) {
+				a = argv[i++];
+				if (a == NULL) return 1;
+				output_audio_codec = a;
+			}
+			else if (!strcmp(a,"preset")) {
+				a = argv[i++];
+				if (a == NULL) return 1;
+				output_video_preset = a;
+			}
+			else if (!strcmp(a,"crf")) {
+				a = argv[i++];
+				if (a == NULL) return 1;
+				output_video_crf = a;
+			}
+			else if (!strcmp(a,"b:v")) {
+				char *e = NULL;
+				double br;
+
+				a = argv[i++];
+				if (a == NULL) return 1;
+				br = strtod(a,&e);
+				if (*e == 'k' || *e == 'K') br *= 1000;
+				else if (*e == 'm' || *e == 'M') br *= 1000000;
+				if (br <= 0) {
+					fprintf(stderr,"Invalid bitrate\n");
+					return 1;
+				}
+				output_video_bitrate = (long)br;
+			}
+			else if (!strcmp(a,"b:a")) {
+				char *e = NULL;
+				double br;
+
+				a = argv[i++];
+				if (a == NULL) return 1;
+				br = strtod(a,&e);
+				if (*e == 'k' || *e == 'K') br *= 1000;
+				else if (*e == 'm' || *e == 'M') br *= 1000000;
+				if (br <= 0) {
+					fprintf(stderr,"Invalid bitrate\n");
+					return 1;
+				}
+				output_audio_bitrate = (long)br;
+			}
+			else if (!strcmp(a,"encode-threads")) {
+				a = argv[i++];
+				if (a == NULL) return 1;
+				output_video_threads = atoi(a);
+				if (output_video_threads < 0) output_video_threads = 0;
+			}
+			else if (!strcmp(a,"encode-queue")) {
+				a = argv[i++];
+				if (a == NULL) return 1;
+				output_video_encode_queue = (unsigned int)strtoul(a,NULL,0);
+				if (output_video_encode_queue > 256) {
+					fprintf(stderr,"Invalid encode queue\n");
+					return 1;
+				}
+			}
+			else if (!strcmp(a,"audio-queue")) {
+				a = argv[i++];
+				if (a == NULL) return 1;
+				output_audio_queue = (unsigned int)strtoul(a,NULL,0);
+				if (output_audio_queue > 256) {
+					fprintf(stderr,"Invalid audio queue\n");
+					return 1;
+				}
+			}
+			else if (!strcmp(a,"mux-queue")) {
+				a = argv[i++];
+				if (a == NULL) return 1;
+				output_mux_queue = (unsigned int)strtoul(a,NULL,0);
+				if (output_mux_queue > 256) {
+					fprintf(stderr,"Invalid mux queue\n");
+					return 1;
+				}
 			}
 			else if (!strcmp(a,"o")) {
 				output_file = argv[i++];
@@ -1667,12 +3050,12 @@ bool do_video_decode_and_render(AVPacket &pkt,unsigned long long &video_field) {
             if (tgt_field == AV_NOPTS_VALUE)
                 tgt_field = video_field; // don't want me to guess? give me PTS timestamps then!
             else {
-                if ((signed long long)tgt_field < 0LL) tgt_field = 0LL;
+                if ((signed long long)tgt_field < 0LL && video_field_first == 0LL) tgt_field = 0LL; // -ss pre-roll frames stay negative
 
                 // deal with imperfections, prevent them from making an unstable frame rate
                 signed long long d = (signed long long)tgt_field - (signed long long)video_field;
 
-                if (llabs(d) < 4 && tgt_field < video_field)
+                if (llabs(d) < 4 && (signed long long)tgt_field < (signed long long)video_field)
                     tgt_field = video_field;
             }
 
@@ -1690,6 +3073,11 @@ bool do_video_decode_and_render(AVPacket &pkt,unsigned long long &video_field) {
                 }
             }
 
+            /* frames that end before the current field (-ss: from the keyframe seeked to, up to the pre-roll)
+             * only go through the decoder */
+            if ((signed long long)tgt_field <= (signed long long)video_field)
+                return (got_frame != 0);
+
             if (output_avstream_video_input_frame != NULL) {
                 if (output_avstream_video_input_frame->height != input_avstream_video_frame->height) {
                     if (output_avstream_video_input_frame != NULL)
@@ -1778,15 +3166,30 @@ bool do_video_decode_and_render(AVPacket &pkt,unsigned long long &video_field) {
                             output_avstream_video_input_frame->data,
                             output_avstream_video_input_frame->linesize) <= 0)
                     fprintf(stderr,"WARNING: sws_scale failed\n");
+                video_source_serial++;
+
+                FieldSource *src = NULL;
+
+                while ((signed long long)video_field < (signed long long)tgt_field) {
+                    if (field_threads_running) {
+                        if (src == NULL) src = field_source_get(output_avstream_video_input_frame);
+                        field_submit(src,video_field,tgt_pts);
+                        video_field++;
+                        continue;
+                    }
 
-                while (video_field < tgt_field) {
-                    render_field(output_avstream_video_frame,output_avstream_video_input_frame,(int)(video_field & 1ULL) ^ 1/*bottom field first*/,video_field,tgt_pts);
+                    const bool front = render_field_front(output_avstream_video_frame,output_avstream_video_input_frame,video_source_serial,(int)(video_field & 1ULL) ^ 1/*bottom field first*/,video_field,tgt_pts);
+
+                    if (!front)
+                        render_field(output_avstream_video_frame,output_avstream_video_input_frame,(int)(video_field & 1ULL) ^ 1/*bottom field first*/,video_field,tgt_pts);
 
                     if (black_key_level_feedback >= 0)
                         black_key_feedback(output_avstream_video_frame,output_avstream_video_filter_frame,(int)(video_field & 1ULL) ^ 1/*bottom field first*/,video_field);
 
-                    if (enable_composite_emulation)
-                        composite_video_process(output_avstream_video_frame,(int)(video_field & 1ULL) ^ 1/*bottom field first*/,video_field);
+                    if (enable_composite_emulation) {
+                        if (!front) composite_video_process_front(output_avstream_video_frame,(int)(video_field & 1ULL) ^ 1/*bottom field first*/,video_field);
+                        composite_video_process_back(output_avstream_video_frame,(int)(video_field & 1ULL) ^ 1/*bottom field first*/,video_field);
+                    }
 
                     if (output_video_as_interlaced) {
                         if ((video_field & 1ULL)) output_frame(output_avstream_video_frame,video_field - 1ULL,(int)((video_field - 1ULL) & 1ULL) ^ 1/*bottom field first*/);
@@ -1807,6 +3210,301 @@ bool do_video_decode_and_render(AVPacket &pkt,unsigned long long &video_field) {
     return (got_frame != 0);
 }
 
+/* audio packets up to this many samples come from a pool, larger ones (pad fill) are allocated as before */
+#define OUTPUT_AUDIO_PACKET_POOL_SAMPLES    16384
+
+AVBufferPool*               output_audio_packet_pool = NULL;
+int                         output_audio_packet_pool_size = 0;
+
+int output_audio_new_packet(AVPacket *pkt,int size) {
+    if (output_audio_packet_pool == NULL) {
+        output_audio_packet_pool_size = OUTPUT_AUDIO_PACKET_POOL_SAMPLES * 2 * output_audio_channels;
+        output_audio_packet_pool = av_buffer_pool_init(output_audio_packet_pool_size + AV_INPUT_BUFFER_PADDING_SIZE,NULL);
+        if (output_audio_packet_pool == NULL) return AVERROR(ENOMEM);
+    }
+
+    if (size > output_audio_packet_pool_size)
+        return av_new_packet(pkt,size);
+
+    pkt->buf = av_buffer_pool_get(output_audio_packet_pool);
+    if (pkt->buf == NULL) return AVERROR(ENOMEM);
+    pkt->data = pkt->buf->data;
+    pkt->size = size;
+    memset(pkt->data + size,0,AV_INPUT_BUFFER_PADDING_SIZE);
+    return 0;
+}
+
+/* audio encoder selection. -acodec takes any FFmpeg encoder or codec name, plus a few shorthands. pcm, the
+ * default, is 16-bit PCM as before */
+AVCodec *output_audio_encoder(void) {
+    static const char *alias[][2] = {
+        {"pcm",     "pcm_s16le"},
+        {"opus",    "libopus"},
+        {"aac",     "libfdk_aac"},
+        {NULL,      NULL}
+    };
+    const char *name = output_audio_codec.c_str();
+    AVCodec *codec = NULL;
+
+    for (unsigned int i=0;codec == NULL && alias[i][0] != NULL;i++) {
+        if (!strcmp(name,alias[i][0]))
+            codec = avcodec_find_encoder_by_name(alias[i][1]);
+    }
+    if (codec == NULL)
+        codec = avcodec_find_encoder_by_name(name);
+    if (codec == NULL) {
+        const AVCodecDescriptor *desc = avcodec_descriptor_get_by_name(name);
+        if (desc != NULL) codec = avcodec_find_encoder(desc->id);
+    }
+    if (codec != NULL && codec->type != AVMEDIA_TYPE_AUDIO)
+        codec = NULL;
+
+    return codec;
+}
+
+/* the emulation runs at the encoder's rate, the closest one above ours if it does not take ours (Opus is 48KHz only) */
+void output_audio_encoder_rate(AVCodec *codec) {
+    if (codec->supported_samplerates != NULL) {
+        const int *r = codec->supported_samplerates;
+        int best = 0;
+
+        while (*r != 0 && *r != output_audio_rate) {
+            if (best == 0 || (best < output_audio_rate ? *r > best : (*r >= output_audio_rate && *r < best)))
+                best = *r;
+            r++;
+        }
+        if (*r == 0 && best != 0) {
+            fprintf(stderr,"Encoder %s does not take %dHz, rendering audio at %dHz\n",codec->name,output_audio_rate,best);
+            output_audio_rate = best;
+        }
+    }
+}
+
+/* apply -b:a and settle the sample rate and format. the format is 16-bit PCM if the encoder takes it, else the
+ * encoder's own, which the audio thread converts to (AAC for example is planar float) */
+void output_audio_encoder_config(AVCodecContext *ctx,AVCodec *codec) {
+    if (output_audio_bitrate > 0)
+        ctx->bit_rate = output_audio_bitrate;
+    if (codec->capabilities & AV_CODEC_CAP_EXPERIMENTAL)
+        ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+
+    output_audio_encoder_rate(codec);
+    ctx->sample_rate = output_audio_rate;
+    ctx->time_base = (AVRational){1, output_audio_rate};
+
+    ctx->sample_fmt = AV_SAMPLE_FMT_S16;
+    if (codec->sample_fmts != NULL) {
+        const AVSampleFormat *f = codec->sample_fmts;
+
+        while (*f != AV_SAMPLE_FMT_NONE && *f != AV_SAMPLE_FMT_S16) f++;
+        if (*f == AV_SAMPLE_FMT_NONE)
+            ctx->sample_fmt = codec->sample_fmts[0];
+    }
+}
+
+/* compressed audio (-acodec). the emulation works on 16-bit PCM, which for PCM goes out as is, a packet at a time.
+ * an encoder wants frames of its own frame_size instead, so the samples collect in a FIFO, come out a frame at a
+ * time and go through swresample to the encoder's format (unless it takes 16-bit PCM). this all runs on the audio
+ * thread, as part of output_audio_write(). */
+AVAudioFifo*                output_audio_fifo = NULL;               // NULL = PCM
+AVFrame*                    output_audio_encode_frame = NULL;
+struct SwrContext*          output_audio_encode_converter = NULL;   // NULL = the encoder takes 16-bit PCM
+std::vector<int16_t>        output_audio_encode_s16;                // a frame out of the FIFO, for the converter
+std::vector<int16_t>        output_audio_encode_silence;            // a frame of it, for pad fill
+int                         output_audio_encode_frame_size = 0;
+unsigned long long          output_audio_encode_pts = 0;            // sample number of the first sample in the FIFO
+
+bool output_audio_encode_init(void) {
+    AVCodecContext *ctx = output_avstream_audio_codec_context;
+
+    output_audio_encode_frame_size = ctx->frame_size;
+    if (output_audio_encode_frame_size <= 0)
+        output_audio_encode_frame_size = 1024; // the encoder takes any size
+
+    output_audio_fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_S16,output_audio_channels,output_audio_encode_frame_size * 2);
+    if (output_audio_fifo == NULL) {
+        fprintf(stderr,"Failed to alloc audio FIFO\n");
+        return false;
+    }
+
+    output_audio_encode_frame = av_frame_alloc();
+    if (output_audio_encode_frame == NULL) {
+        fprintf(stderr,"Failed to alloc audio frame\n");
+        return false;
+    }
+    output_audio_encode_frame->format = ctx->sample_fmt;
+    output_audio_encode_frame->channel_layout = ctx->channel_layout;
+    output_audio_encode_frame->channels = ctx->channels;
+    output_audio_encode_frame->sample_rate = ctx->sample_rate;
+    output_audio_encode_frame->nb_samples = output_audio_encode_frame_size;
+    if (av_frame_get_buffer(output_audio_encode_frame,0) < 0) {
+        fprintf(stderr,"Failed to alloc audio encode frame\n");
+        return false;
+    }
+
+    if (ctx->sample_fmt != AV_SAMPLE_FMT_S16) {
+        output_audio_encode_converter = swr_alloc();
+        if (output_audio_encode_converter == NULL) {
+            fprintf(stderr,"Failed to alloc audio encode converter\n");
+            return false;
+        }
+        av_opt_set_int(output_audio_encode_converter, "in_channel_count", ctx->channels, 0);
+        av_opt_set_int(output_audio_encode_converter, "out_channel_count", ctx->channels, 0);
+        av_opt_set_int(output_audio_encode_converter, "in_channel_layout", ctx->channel_layout, 0);
+        av_opt_set_int(output_audio_encode_converter, "out_channel_layout", ctx->channel_layout, 0);
+        av_opt_set_int(output_audio_encode_converter, "in_sample_rate", ctx->sample_rate, 0);
+        av_opt_set_int(output_audio_encode_converter, "out_sample_rate", ctx->sample_rate, 0);
+        av_opt_set_sample_fmt(output_audio_encode_converter, "in_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+        av_opt_set_sample_fmt(output_audio_encode_converter, "out_sample_fmt", ctx->sample_fmt, 0);
+        if (swr_init(output_audio_encode_converter) < 0) {
+            fprintf(stderr,"Failed to init audio encode converter\n");
+            swr_free(&output_audio_encode_converter);
+            return false;
+        }
+
+        output_audio_encode_s16.resize((size_t)output_audio_encode_frame_size * output_audio_channels);
+    }
+
+    output_audio_encode_silence.assign((size_t)output_audio_encode_frame_size * output_audio_channels,0);
+    return true;
+}
+
+/* encode that many samples out of the FIFO, or with 0, drain one delayed packet. returns true if a packet came out */
+bool output_audio_encode_packet(const int samples) {
+    AVCodecContext *ctx = output_avstream_audio_codec_context;
+    AVFrame *frame = NULL;
+    int gotit = 0;
+    AVPacket pkt;
+
+    if (samples > 0) {
+        frame = output_audio_encode_frame;
+        if (av_frame_make_writable(frame) < 0) {
+            fprintf(stderr,"Failed to alloc audio encode frame\n");
+            return false;
+        }
+
+        frame->nb_samples = samples;
+        if (output_audio_encode_converter != NULL) {
+            uint8_t *s16 = (uint8_t*)(&output_audio_encode_s16[0]);
+
+            av_audio_fifo_read(output_audio_fifo,(void**)(&s16),samples);
+            if (swr_convert(output_audio_encode_converter,frame->data,samples,(const uint8_t**)(&s16),samples) < 0)
+                fprintf(stderr,"Failed to convert audio\n");
+        }
+        else {
+            av_audio_fifo_read(output_audio_fifo,(void**)frame->data,samples);
+        }
+
+        frame->pts = output_audio_encode_pts;
+        output_audio_encode_pts += samples;
+    }
+
+    av_init_packet(&pkt);
+    pkt.data = NULL; // the encoder allocates it
+    pkt.size = 0;
+    if (avcodec_encode_audio2(ctx,&pkt,frame,&gotit) == 0) {
+        if (gotit) {
+            pkt.stream_index = output_avstream_audio->index;
+            av_packet_rescale_ts(&pkt,ctx->time_base,output_avstream_audio->time_base);
+
+            if (output_write_packet(&pkt,output_mux_audio) < 0)
+                fprintf(stderr,"Failed to write frame\n");
+        }
+    }
+    else {
+        fprintf(stderr,"Failed to encode audio\n");
+    }
+
+    av_packet_unref(&pkt);
+    return gotit != 0;
+}
+
+/* the last, short frame (padded out with silence if the encoder only takes whole frames), then the encoder's
+ * delayed packets */
+void output_audio_encode_flush(void) {
+    if (output_audio_fifo != NULL) {
+        int left = av_audio_fifo_size(output_audio_fifo);
+
+        if (left > 0) {
+            if (!(output_avstream_audio_codec_context->codec->capabilities & (AV_CODEC_CAP_SMALL_LAST_FRAME|AV_CODEC_CAP_VARIABLE_FRAME_SIZE))) {
+                int16_t *z = &output_audio_encode_silence[0];
+
+                av_audio_fifo_write(output_audio_fifo,(void**)(&z),output_audio_encode_frame_size - left);
+                left = output_audio_encode_frame_size;
+            }
+
+            output_audio_encode_packet(left);
+        }
+
+        if (output_avstream_audio_codec_context->codec->capabilities & AV_CODEC_CAP_DELAY)
+            while (output_audio_encode_packet(0));
+
+        av_audio_fifo_free(output_audio_fifo);
+        output_audio_fifo = NULL;
+    }
+
+    if (output_audio_encode_converter != NULL)
+        swr_free(&output_audio_encode_converter);
+    if (output_audio_encode_frame != NULL)
+        av_frame_free(&output_audio_encode_frame);
+}
+
+/* samples, starting at sample number at, to the muxer. NULL is silence (pad fill) */
+void output_audio_write(const int16_t *audio,unsigned long long samples,unsigned long long at) {
+    /* -segments pre-roll: emulated, so the filters carry on into the piece as in a continuous render, not output */
+    if (at < output_audio_skip) {
+        const unsigned long long n = std::min(samples,output_audio_skip - at);
+
+        if (audio != NULL)
+            audio += n * output_audio_channels;
+        samples -= n;
+        at += n;
+        if (samples == 0)
+            return;
+    }
+
+    if (output_audio_fifo == NULL) {
+        AVPacket dstpkt;
+
+        av_init_packet(&dstpkt);
+        if (output_audio_new_packet(&dstpkt,samples * 2 * output_audio_channels) >= 0) { // NTS: Will reset fields too!
+            assert(dstpkt.data != NULL);
+            assert(dstpkt.size >= (samples * 2 * output_audio_channels));
+            if (audio != NULL)
+                memcpy(dstpkt.data,audio,samples * 2 * output_audio_channels);
+            else
+                memset(dstpkt.data,0,samples * 2 * output_audio_channels);
+        }
+        dstpkt.pts = at;
+        dstpkt.dts = at;
+        dstpkt.stream_index = output_avstream_audio->index;
+        av_packet_rescale_ts(&dstpkt,output_avstream_audio_codec_context->time_base,output_avstream_audio->time_base);
+        if (output_write_packet(&dstpkt,output_mux_audio) < 0)
+            fprintf(stderr,"Failed to write frame\n");
+        av_packet_unref(&dstpkt);
+        return;
+    }
+
+    if (av_audio_fifo_size(output_audio_fifo) == 0)
+        output_audio_encode_pts = at;
+
+    while (samples > 0) {
+        const int n = (int)std::min(samples,(unsigned long long)output_audio_encode_frame_size);
+        int16_t *s = (audio != NULL) ? (int16_t*)audio : &output_audio_encode_silence[0];
+
+        if (av_audio_fifo_write(output_audio_fifo,(void**)(&s),n) < n) {
+            fprintf(stderr,"Failed to write audio FIFO\n");
+            return;
+        }
+        if (audio != NULL)
+            audio += n * output_audio_channels;
+        samples -= (unsigned long long)n;
+
+        while (av_audio_fifo_size(output_audio_fifo) >= output_audio_encode_frame_size)
+            output_audio_encode_packet(output_audio_encode_frame_size);
+    }
+}
+
 bool do_audio_decode_and_render(AVPacket &pkt,unsigned long long &audio_sample) {
     int got_frame = 0;
 
@@ -1820,6 +3518,13 @@ bool do_audio_decode_and_render(AVPacket &pkt,unsigned long long &audio_sample)
             else {
                 if ((signed long long)tgt_sample < 0LL) tgt_sample = 0LL;
 
+                // -segments: the pre-roll starts where the audio after the seek does, hiss and buzz count from there too
+                if (output_audio_preroll) {
+                    if (tgt_sample < audio_sample)
+                        audio_sample = audio_proc_count = tgt_sample;
+                    output_audio_preroll = false;
+                }
+
                 // deal with imperfections, prevent them from making an unstable frame rate
                 signed long long d = (signed long long)tgt_sample - (signed long long)audio_sample;
 
@@ -1844,7 +3549,7 @@ bool do_audio_decode_and_render(AVPacket &pkt,unsigned long long &audio_sample)
                 av_opt_set_int(input_avstream_audio_resampler, "in_sample_rate", input_avstream_audio_codec_context->sample_rate, 0);
                 av_opt_set_int(input_avstream_audio_resampler, "out_sample_rate", output_avstream_audio_codec_context->sample_rate, 0);
                 av_opt_set_sample_fmt(input_avstream_audio_resampler, "in_sample_fmt", input_avstream_audio_codec_context->sample_fmt, 0);
-                av_opt_set_sample_fmt(input_avstream_audio_resampler, "out_sample_fmt", output_avstream_audio_codec_context->sample_fmt, 0);
+                av_opt_set_sample_fmt(input_avstream_audio_resampler, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0); // what the emulation takes, see output_audio_write()
                 if (swr_init(input_avstream_audio_resampler) < 0) {
                     fprintf(stderr,"Failed to init audio resampler\n");
                     swr_free(&input_avstream_audio_resampler);
@@ -1878,7 +3583,7 @@ bool do_audio_decode_and_render(AVPacket &pkt,unsigned long long &audio_sample)
                 fprintf(stderr,"Allocating audio buffer %u samples\n",(unsigned int)audio_dst_data_samples);
                 if (av_samples_alloc_array_and_samples(&audio_dst_data,&audio_dst_data_linesize,
                             output_avstream_audio_codec_context->channels,audio_dst_data_samples,
-                            output_avstream_audio_codec_context->sample_fmt, 0) >= 0) {
+                            AV_SAMPLE_FMT_S16, 0) >= 0) {
                     audio_dst_data_alloc_samples = audio_dst_data_samples;
                 }
                 else {
@@ -1894,21 +3599,7 @@ bool do_audio_decode_and_render(AVPacket &pkt,unsigned long long &audio_sample)
                 if (out_samples > output_audio_rate)
                     out_samples = output_audio_rate;
 
-                AVPacket dstpkt;
-                av_init_packet(&dstpkt);
-                if (av_new_packet(&dstpkt,out_samples * 2 * output_audio_channels) >= 0) { // NTS: Will reset fields too!
-                    assert(dstpkt.data != NULL);
-                    assert(dstpkt.size >= (out_samples * 2 * output_audio_channels));
-                    memset(dstpkt.data,0,out_samples * 2 * output_audio_channels);
-                }
-                dstpkt.pts = audio_sample;
-                dstpkt.dts = audio_sample;
-                dstpkt.stream_index = output_avstream_audio->index;
-                av_packet_rescale_ts(&dstpkt,output_avstream_audio_codec_context->time_base,output_avstream_audio->time_base);
-                if (av_interleaved_write_frame(output_avfmt,&dstpkt) < 0)
-                    fprintf(stderr,"Failed to write frame\n");
-                av_packet_unref(&dstpkt);
-
+                output_audio_write(NULL,out_samples,audio_sample);
                 fprintf(stderr,"Pad fill %llu samples\n",out_samples);
                 audio_sample += out_samples;
             }
@@ -1921,23 +3612,8 @@ bool do_audio_decode_and_render(AVPacket &pkt,unsigned long long &audio_sample)
                     // PROCESS THE AUDIO. At this point by design the code can assume S16LE (16-bit PCM interleaved)
                     if (enable_audio_emulation)
                         composite_audio_process((int16_t*)audio_dst_data[0],out_samples);
-                    // write it out. TODO: At some point, support conversion to whatever the codec needs and then convert to it.
-                    // that way we can render directly to MP4 our VHS emulation.
-                    AVPacket dstpkt;
-                    av_init_packet(&dstpkt);
-                    if (av_new_packet(&dstpkt,out_samples * 2 * output_audio_channels) >= 0) { // NTS: Will reset fields too!
-                        assert(dstpkt.data != NULL);
-                        assert(dstpkt.size >= (out_samples * 2 * output_audio_channels));
-                        memcpy(dstpkt.data,audio_dst_data[0],out_samples * 2 * output_audio_channels);
-                    }
-                    dstpkt.pts = audio_sample;
-                    dstpkt.dts = audio_sample;
-                    dstpkt.stream_index = output_avstream_audio->index;
-                    av_packet_rescale_ts(&dstpkt,output_avstream_audio_codec_context->time_base,output_avstream_audio->time_base);
-                    if (av_interleaved_write_frame(output_avfmt,&dstpkt) < 0)
-                        fprintf(stderr,"Failed to write frame\n");
-                    av_packet_unref(&dstpkt);
 
+                    output_audio_write((int16_t*)audio_dst_data[0],out_samples,audio_sample);
                     audio_sample += out_samples;
                 }
                 else if (out_samples < 0) {
@@ -1953,6 +3629,482 @@ bool do_audio_decode_and_render(AVPacket &pkt,unsigned long long &audio_sample)
     return (got_frame != 0);
 }
 
+/* audio thread. the main thread hands it the audio packets as it reads them, and it decodes, resamples, emulates
+ * and writes them out, so that audio runs alongside the video fields instead of in between them. the ring is
+ * single producer, single consumer like the encode ring, the two semaphores count the free and filled slots.
+ * the decoder, the resampler, the emulation state and output_audio_sample belong to the thread while it runs. */
+struct OutputAudioSlot {
+    AVPacket                pkt;
+    bool                    flush;                  // no packet, drain the decoder and end the thread
+};
+
+OutputAudioSlot*            output_audio_ring = NULL;
+unsigned int                output_audio_ring_size = 0;
+unsigned int                output_audio_head = 0;
+bool                        output_audio_running = false;
+pthread_t                   output_audio_thread;
+sem_t                       output_audio_free,output_audio_used;
+unsigned long long          output_audio_sample = 0;    // next sample out
+
+void *output_audio_thread_proc(void *arg) {
+    unsigned int idx = 0;
+    AVPacket pkt;
+
+    (void)arg;
+    do {
+        while (sem_wait(&output_audio_used) != 0);
+
+        OutputAudioSlot &s = output_audio_ring[idx];
+        if ((++idx) >= output_audio_ring_size) idx = 0;
+        if (s.flush) break;
+
+        do_audio_decode_and_render(/*&*/s.pkt,/*&*/output_audio_sample);
+        av_packet_unref(&s.pkt);
+        sem_post(&output_audio_free);
+    } while (1);
+
+    /* the decoder's delayed frames */
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    while (DIE == 0 && do_audio_decode_and_render(/*&*/pkt,/*&*/output_audio_sample));
+
+    output_audio_encode_flush();
+    return NULL;
+}
+
+void output_audio_start(void) {
+    unsigned int i;
+
+    if (output_audio_queue == 0 || output_audio_running)
+        return;
+
+    output_audio_ring = new OutputAudioSlot[output_audio_queue];
+    output_audio_ring_size = output_audio_queue;
+    output_audio_head = 0;
+    for (i=0;i < output_audio_ring_size;i++) {
+        av_init_packet(&output_audio_ring[i].pkt);
+        output_audio_ring[i].flush = false;
+    }
+
+    sem_init(&output_audio_free,0,output_audio_ring_size);
+    sem_init(&output_audio_used,0,0);
+    if (pthread_create(&output_audio_thread,NULL,output_audio_thread_proc,NULL) != 0) {
+        fprintf(stderr,"Failed to start audio thread, rendering audio on the main thread\n");
+        sem_destroy(&output_audio_free);
+        sem_destroy(&output_audio_used);
+        delete[] output_audio_ring;
+        output_audio_ring = NULL;
+        output_audio_ring_size = 0;
+        return;
+    }
+
+    output_audio_running = true;
+}
+
+/* the packet is moved to the audio thread, pkt comes back blank */
+void output_audio(AVPacket &pkt) {
+    if (!output_audio_running) {
+        do_audio_decode_and_render(/*&*/pkt,/*&*/output_audio_sample);
+        return;
+    }
+
+    while (sem_wait(&output_audio_free) != 0);
+
+    OutputAudioSlot &s = output_audio_ring[output_audio_head];
+    av_packet_move_ref(&s.pkt,&pkt);
+    if ((++output_audio_head) >= output_audio_ring_size) output_audio_head = 0;
+
+    sem_post(&output_audio_used);
+}
+
+/* the rest of the packets, then the decoder's delayed frames and the encoder's, and end the audio thread */
+void output_audio_flush(void) {
+    unsigned int i;
+
+    if (!output_audio_running) {
+        output_audio_encode_flush();
+        return;
+    }
+
+    while (sem_wait(&output_audio_free) != 0);
+    output_audio_ring[output_audio_head].flush = true;
+    sem_post(&output_audio_used);
+    pthread_join(output_audio_thread,NULL);
+    sem_destroy(&output_audio_free);
+    sem_destroy(&output_audio_used);
+    output_audio_running = false;
+
+    for (i=0;i < output_audio_ring_size;i++)
+        av_packet_unref(&output_audio_ring[i].pkt);
+    delete[] output_audio_ring;
+    output_audio_ring = NULL;
+    output_audio_ring_size = 0;
+}
+
+/* -segments: the input is split at keyframes into time ranges, and each range is rendered by a forked copy of
+ * this process (its own decoder, emulation state and encoder) into a temporary file next to the output. each
+ * worker seeks to its start with the usual -ss pre-roll, and numbers its fields from where the range sits in
+ * the whole render, so that subcarrier phase and field parity carry on across the joins. the pieces are then
+ * remuxed, without re-encoding the video, into the output file. with -acodec the pieces carry 16-bit PCM, which
+ * not every container takes (MP4), so they are NUT files then. */
+std::string segment_file_name(unsigned int n,const bool nut) {
+    std::string::size_type dot = output_file.find_last_of('.');
+    std::string::size_type sep = output_file.find_last_of('/');
+    char tmp[32];
+
+    sprintf(tmp,".seg%03u",n);
+    if (dot == std::string::npos || (sep != std::string::npos && dot < sep))
+        return output_file + tmp + (nut ? ".nut" : "");
+
+    return output_file.substr(0,dot) + tmp + (nut ? ".nut" : output_file.substr(dot));
+}
+
+/* keyframe times to split at, the start and end of the render included */
+bool segments_split(std::vector<double> &split) {
+    AVFormatContext *fmt = NULL;
+    AVStream *vs = NULL;
+    double start = transcode_start,end = transcode_end;
+    int vc = 0;
+    AVPacket pkt;
+
+    split.clear();
+    if (avformat_open_input(&fmt,input_file.c_str(),NULL,NULL) < 0) {
+        fprintf(stderr,"Failed to open input file\n");
+        return false;
+    }
+    if (avformat_find_stream_info(fmt,NULL) < 0)
+        fprintf(stderr,"WARNING: Did not find stream info on input\n");
+
+    for (size_t i=0;i < (size_t)fmt->nb_streams;i++) {
+        if (fmt->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+            if (vc++ == video_stream_index) vs = fmt->streams[i];
+        }
+    }
+
+    /* field 0 of the whole render, in input time. with -ss that is the start, without it the first packet with a
+     * time stamp, the same as the main loop picks (it is not 0 when the container starts later, MPEG-TS for example) */
+    if (start <= 0) {
+        av_init_packet(&pkt);
+        while (av_read_frame(fmt,&pkt) >= 0) {
+            const int64_t ts = (pkt.pts != AV_NOPTS_VALUE) ? pkt.pts : pkt.dts;
+
+            if (ts != AV_NOPTS_VALUE && pkt.stream_index < (int)fmt->nb_streams) {
+                const double pt = ts * av_q2d(fmt->streams[pkt.stream_index]->time_base);
+
+                if (pt >= 0) {
+                    start = pt;
+                    av_packet_unref(&pkt);
+                    break;
+                }
+            }
+
+            av_packet_unref(&pkt);
+        }
+    }
+
+    if (end < 0) {
+        if (fmt->duration == AV_NOPTS_VALUE) {
+            fprintf(stderr,"Input duration unknown, cannot split into segments (use -se or -t)\n");
+            avformat_close_input(&fmt);
+            return false;
+        }
+        end = (double)fmt->duration / AV_TIME_BASE;
+        if (fmt->start_time != AV_NOPTS_VALUE)
+            end += (double)fmt->start_time / AV_TIME_BASE;
+    }
+
+    split.push_back(start);
+    for (unsigned int s=1;s < render_segments;s++) {
+        double target = start + (((end - start) * s) / render_segments);
+        double t = -1;
+
+        if (av_seek_frame(fmt,-1,(int64_t)(target * AV_TIME_BASE),AVSEEK_FLAG_BACKWARD) < 0)
+            continue;
+
+        /* the first keyframe after the seek (seeking lands on the one at or before the target) */
+        av_init_packet(&pkt);
+        while (av_read_frame(fmt,&pkt) >= 0) {
+            AVStream *is = fmt->streams[pkt.stream_index];
+
+            if ((vs == NULL || is == vs) && (pkt.flags & AV_PKT_FLAG_KEY) && pkt.pts != AV_NOPTS_VALUE) {
+                t = pkt.pts * av_q2d(is->time_base);
+                av_packet_unref(&pkt);
+                break;
+            }
+
+            av_packet_unref(&pkt);
+        }
+
+        if (t > (split.back() + 1.0) && t < (end - 1.0))
+            split.push_back(t);
+    }
+    split.push_back(end);
+
+    avformat_close_input(&fmt);
+    return true;
+}
+
+/* join the pieces. every piece carries the timestamps of the whole render, the one thing to do here is to cut
+ * off what a piece rendered past the start of the next one (the workers read a little past their end).
+ * the audio of the pieces is 16-bit PCM. with -acodec it is encoded here, once, as the joined audio goes by, so
+ * that there is one encoder delay at the start and nothing to line up at the joins */
+bool segments_concat(const std::vector<std::string> &names,const std::vector<signed long long> &field) {
+    AVCodec *acodec = output_audio_encoder();
+    AVFormatContext *ofmt = NULL;
+    std::vector<int64_t> last_dts;
+    int encode_stream = -1;
+    bool ok = true;
+
+    if (avformat_alloc_output_context2(&ofmt,NULL,NULL,output_file.c_str()) < 0) {
+        fprintf(stderr,"Failed to open output file\n");
+        return false;
+    }
+
+    for (size_t s=0;ok && s < names.size();s++) {
+        AVFormatContext *ifmt = NULL;
+        AVPacket pkt;
+
+        if (avformat_open_input(&ifmt,names[s].c_str(),NULL,NULL) < 0) {
+            fprintf(stderr,"Failed to open segment %s\n",names[s].c_str());
+            ok = false;
+            break;
+        }
+        if (avformat_find_stream_info(ifmt,NULL) < 0)
+            fprintf(stderr,"WARNING: Did not find stream info on segment %s\n",names[s].c_str());
+
+        if (s == 0) {
+            for (size_t i=0;i < (size_t)ifmt->nb_streams;i++) {
+                AVStream *is = ifmt->streams[i];
+                AVStream *os;
+
+                last_dts.push_back(AV_NOPTS_VALUE);
+
+                if (is->codec->codec_type == AVMEDIA_TYPE_AUDIO && acodec != NULL && acodec->id != AV_CODEC_ID_PCM_S16LE) {
+                    /* the audio encoder, the same way main() sets it up. the FIFO and output_write_packet() work
+                     * on the output_* globals, which the parent has no other use for */
+                    os = avformat_new_stream(ofmt,NULL);
+                    if (os == NULL) {
+                        fprintf(stderr,"Unable to create output audio stream\n");
+                        ok = false;
+                        break;
+                    }
+
+                    output_avfmt = ofmt;
+                    output_avstream_audio = os;
+                    output_avstream_audio_codec_context = os->codec;
+                    encode_stream = (int)i;
+                    output_avstream_audio_codec_context->channel_layout = is->codec->channel_layout;
+                    output_avstream_audio_codec_context->channels = output_audio_channels;
+                    output_audio_encoder_config(output_avstream_audio_codec_context,acodec);
+                    os->time_base = output_avstream_audio_codec_context->time_base;
+                    if (ofmt->oformat->flags & AVFMT_GLOBALHEADER)
+                        output_avstream_audio_codec_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+                    if (avcodec_open2(output_avstream_audio_codec_context,acodec,NULL) < 0) {
+                        fprintf(stderr,"Output stream cannot open codec\n");
+                        ok = false;
+                        break;
+                    }
+                    if (!output_audio_encode_init()) {
+                        ok = false;
+                        break;
+                    }
+
+                    continue;
+                }
+
+                os = avformat_new_stream(ofmt,is->codec->codec);
+                if (os == NULL || avcodec_copy_context(os->codec,is->codec) < 0) {
+                    fprintf(stderr,"Unable to create output stream\n");
+                    ok = false;
+                    break;
+                }
+                os->codec->codec_tag = 0;
+                os->time_base = is->time_base;
+                if (ofmt->oformat->flags & AVFMT_GLOBALHEADER)
+                    os->codec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+            }
+
+            if (ok && !(ofmt->oformat->flags & AVFMT_NOFILE)) {
+                if (avio_open(&ofmt->pb,output_file.c_str(),AVIO_FLAG_WRITE) < 0) {
+                    fprintf(stderr,"Output file cannot open file\n");
+                    ok = false;
+                }
+            }
+            if (ok && avformat_write_header(ofmt,NULL) < 0) {
+                fprintf(stderr,"Failed to write header\n");
+                ok = false;
+            }
+        }
+        else if ((size_t)ifmt->nb_streams != last_dts.size()) {
+            fprintf(stderr,"Segment %s does not have the same streams\n",names[s].c_str());
+            ok = false;
+        }
+
+        av_init_packet(&pkt);
+        while (ok && av_read_frame(ifmt,&pkt) >= 0) {
+            AVStream *is = ifmt->streams[pkt.stream_index];
+            AVStream *os = ofmt->streams[pkt.stream_index];
+
+            if ((s+1) < names.size() && pkt.pts != AV_NOPTS_VALUE) {
+                /* where the next piece starts, in this stream's time base */
+                const int64_t cut = av_rescale_q(field[s+1],(AVRational){output_field_rate.den, output_field_rate.num},is->time_base);
+
+                if (pkt.pts >= cut) {
+                    av_packet_unref(&pkt);
+                    continue;
+                }
+
+                /* audio is 16-bit PCM, so a packet that runs into the next piece can be cut to the sample */
+                if (is->codec->codec_id == AV_CODEC_ID_PCM_S16LE && is->codec->channels > 0) {
+                    const int64_t keep = av_rescale_q(cut - pkt.pts,is->time_base,(AVRational){1, is->codec->sample_rate});
+                    const int bytes = (int)keep * 2 * is->codec->channels;
+
+                    if (bytes < pkt.size) {
+                        pkt.size = bytes;
+                        pkt.duration = cut - pkt.pts;
+                    }
+                }
+            }
+
+            if (pkt.dts != AV_NOPTS_VALUE) {
+                if (last_dts[pkt.stream_index] != AV_NOPTS_VALUE && pkt.dts <= last_dts[pkt.stream_index]) {
+                    av_packet_unref(&pkt);
+                    continue;
+                }
+                last_dts[pkt.stream_index] = pkt.dts;
+            }
+
+            if (pkt.stream_index == encode_stream) {
+                if (pkt.pts != AV_NOPTS_VALUE && is->codec->channels > 0)
+                    output_audio_write((const int16_t*)pkt.data,(unsigned long long)pkt.size / (2 * is->codec->channels),
+                        (unsigned long long)av_rescale_q(pkt.pts,is->time_base,(AVRational){1, output_audio_rate}));
+
+                av_packet_unref(&pkt);
+                continue;
+            }
+
+            av_packet_rescale_ts(&pkt,is->time_base,os->time_base);
+            pkt.pos = -1;
+            if (av_interleaved_write_frame(ofmt,&pkt) < 0) {
+                fprintf(stderr,"AV write frame failed\n");
+                ok = false;
+            }
+            av_packet_unref(&pkt);
+        }
+
+        avformat_close_input(&ifmt);
+    }
+
+    if (encode_stream >= 0) {
+        if (ok) output_audio_encode_flush();
+        avcodec_close(output_avstream_audio_codec_context);
+        output_avstream_audio_codec_context = NULL;
+        output_avstream_audio = NULL;
+        output_avfmt = NULL;
+    }
+
+    if (ok) av_write_trailer(ofmt);
+    if (!(ofmt->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&ofmt->pb);
+    avformat_free_context(ofmt);
+    return ok;
+}
+
+/* returns -1 in a worker, which carries on rendering its piece, or the exit code in the parent */
+int segments_render(void) {
+    std::vector<double> split;
+    std::vector<signed long long> field;
+    std::vector<std::string> names;
+    std::vector<pid_t> pids;
+    AVCodec *acodec;
+    bool ok = true;
+    long cpus;
+
+    if (!segments_split(split))
+        return 1;
+
+    /* compressed audio is encoded once, when joining, see segments_concat(). the workers write 16-bit PCM at the
+     * rate the encoder takes */
+    acodec = output_audio_encoder();
+    if (acodec == NULL) {
+        fprintf(stderr,"Audio encoder '%s' not found\n",output_audio_codec.c_str());
+        return 1;
+    }
+    output_audio_encoder_rate(acodec);
+
+    /* the first field of each piece, in whole frames so that -vi pairs fields the same */
+    for (size_t s=0;(s+1) < split.size();s++) {
+        signed long long f = (signed long long)floor((((split[s] - split[0]) * output_field_rate.num) / output_field_rate.den) + 0.5);
+        field.push_back(f & (~1LL));
+        names.push_back(segment_file_name((unsigned int)s,acodec->id != AV_CODEC_ID_PCM_S16LE));
+    }
+    field.push_back(-1);
+
+    fprintf(stderr,"Rendering %u segments:\n",(unsigned int)names.size());
+    for (size_t s=0;s < names.size();s++)
+        fprintf(stderr,"  %.3f-%.3f from field %lld to %s\n",split[s],split[s+1],field[s],names[s].c_str());
+
+    /* share the CPUs out among the workers' encoders */
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (output_video_threads == 0 && cpus > 0) {
+        output_video_threads = (int)(cpus / (long)names.size());
+        if (output_video_threads < 1) output_video_threads = 1;
+    }
+
+    /* soft break on CTRL+C, for the workers too (they stop and finish their piece) */
+    signal(SIGINT,sigma);
+    signal(SIGHUP,sigma);
+    signal(SIGQUIT,sigma);
+    signal(SIGTERM,sigma);
+
+    for (size_t s=0;s < names.size();s++) {
+        pid_t pid = fork();
+
+        if (pid == 0) {
+            render_segments = 0;
+            output_file = names[s];
+            output_audio_codec = "pcm";
+            transcode_origin = split[0]; // every piece numbers its fields from the same input time
+            if (s != 0)
+                transcode_start = split[s];
+            if ((s+2) < split.size())
+                transcode_end = split[s+1] + 1.0; // a little past, cut off again when joining
+            segment_field_first = field[s];
+            segment_field_end = field[s+1];
+            return -1;
+        }
+        else if (pid < 0) {
+            fprintf(stderr,"Failed to start segment worker\n");
+            ok = false;
+            break;
+        }
+
+        pids.push_back(pid);
+    }
+
+    for (size_t s=0;s < pids.size();s++) {
+        int status = 0;
+
+        while (waitpid(pids[s],&status,0) < 0 && errno == EINTR);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr,"Segment %u failed\n",(unsigned int)s);
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        fprintf(stderr,"Joining segments into %s\n",output_file.c_str());
+        ok = segments_concat(names,field);
+    }
+
+    for (size_t s=0;s < names.size();s++)
+        unlink(names[s].c_str());
+
+    return ok ? 0 : 1;
+}
+
 int main(int argc,char **argv) {
 	if (parse_argv(argc,argv))
 		return 1;
@@ -1961,6 +4113,14 @@ int main(int argc,char **argv) {
 	avformat_network_init();
 	avcodec_register_all();
 
+	/* -segments: the parent splits the input and forks the workers, each worker carries on from here */
+	if (render_segments > 1) {
+		int r = segments_render();
+		if (r >= 0) return r;
+	}
+
+	noise_banks_prepare(output_width);
+
 	assert(input_avfmt == NULL);
 	if (avformat_open_input(&input_avfmt,input_file.c_str(),NULL,NULL) < 0) {
 		fprintf(stderr,"Failed to open input file\n");
@@ -2048,19 +4208,29 @@ int main(int argc,char **argv) {
 		else
 			output_avstream_audio_codec_context->channel_layout = AV_CH_LAYOUT_MONO;
 
-		output_avstream_audio_codec_context->sample_rate = output_audio_rate;
+		AVCodec *codec = output_audio_encoder();
+
+		if (codec == NULL) {
+			fprintf(stderr,"Audio encoder '%s' not found\n",output_audio_codec.c_str());
+			return 1;
+		}
+
 		output_avstream_audio_codec_context->channels = output_audio_channels;
-		output_avstream_audio_codec_context->sample_fmt = AV_SAMPLE_FMT_S16;
-		output_avstream_audio_codec_context->time_base = (AVRational){1, output_audio_rate};
+		output_audio_encoder_config(output_avstream_audio_codec_context,codec);
 		output_avstream_audio->time_base = output_avstream_audio_codec_context->time_base;
 
 		if (output_avfmt->oformat->flags & AVFMT_GLOBALHEADER)
 			output_avstream_audio_codec_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
-		if (avcodec_open2(output_avstream_audio_codec_context,avcodec_find_encoder(AV_CODEC_ID_PCM_S16LE),NULL) < 0) {
+		if (avcodec_open2(output_avstream_audio_codec_context,codec,NULL) < 0) {
 			fprintf(stderr,"Output stream cannot open codec\n");
 			return 1;
 		}
+		if (codec->id != AV_CODEC_ID_PCM_S16LE) {
+			if (!output_audio_encode_init())
+				return 1;
+		}
+		fprintf(stderr,"Audio encoder: %s\n",codec->name);
 	}
 
 	if (input_avstream_video != NULL) {
@@ -2077,7 +4247,15 @@ int main(int argc,char **argv) {
 		}
 
 		// FIXME: How do I get FFMPEG to write raw YUV 4:2:2?
-		avcodec_get_context_defaults3(output_avstream_video_codec_context,avcodec_find_encoder(AV_CODEC_ID_H264));
+		AVCodec *codec = output_video_encoder();
+		AVDictionary *opts = NULL;
+
+		if (codec == NULL) {
+			fprintf(stderr,"Video encoder '%s' not found\n",output_video_codec.c_str());
+			return 1;
+		}
+
+		avcodec_get_context_defaults3(output_avstream_video_codec_context,codec);
 		output_avstream_video_codec_context->width = output_width;
 		output_avstream_video_codec_context->height = output_height;
 		output_avstream_video_codec_context->sample_aspect_ratio = (AVRational){output_height*4, output_width*3};
@@ -2098,10 +4276,14 @@ int main(int argc,char **argv) {
 		if (output_video_as_interlaced)
 			output_avstream_video_codec_context->flags |= AV_CODEC_FLAG_INTERLACED_DCT;
 
-		if (avcodec_open2(output_avstream_video_codec_context,avcodec_find_encoder(AV_CODEC_ID_H264),NULL) < 0) {
+		output_video_encoder_config(output_avstream_video_codec_context,codec,&opts);
+		if (avcodec_open2(output_avstream_video_codec_context,codec,&opts) < 0) {
 			fprintf(stderr,"Output stream cannot open codec\n");
+			av_dict_free(&opts);
 			return 1;
 		}
+		output_video_encoder_unused_options(codec,&opts);
+		fprintf(stderr,"Video encoder: %s\n",codec->name);
 	}
 
 	if (!(output_avfmt->oformat->flags & AVFMT_NOFILE)) {
@@ -2116,6 +4298,17 @@ int main(int argc,char **argv) {
 		return 1;
 	}
 
+	/* muxer thread */
+	output_mux_start();
+
+	/* video encode thread */
+	if (output_avstream_video_codec_context != NULL)
+		output_video_encode_start();
+
+	/* field render threads */
+	if (input_avstream_video != NULL)
+		field_threads_start();
+
 	/* soft break on CTRL+C */
 	signal(SIGINT,sigma);
 	signal(SIGHUP,sigma);
@@ -2130,33 +4323,24 @@ int main(int argc,char **argv) {
 	audio_hilopass.init();
 
 	/* high boost on playback */
-	for (unsigned int i=0;i < 2;i++)
-		audio_post_vhs_boost[i].setFilter(output_audio_rate,10000);
+	audio_post_vhs_boost.setFilter(output_audio_rate,10000);
 
 	// TODO: VHS Hi-Fi is also documented to use 2:1 companding when recording, which we do not yet emulate
 
 	if (emulating_preemphasis) {
 		if (output_vhs_hifi) {
-			for (unsigned int i=0;i < output_audio_channels;i++) {
-				audio_linear_preemphasis_pre[i].setFilter(output_audio_rate,16000/*FIXME: Guess! Also let user set this.*/);
-			}
+			audio_linear_preemphasis_pre.setFilter(output_audio_rate,16000/*FIXME: Guess! Also let user set this.*/);
 		}
 		else {
-			for (unsigned int i=0;i < output_audio_channels;i++) {
-				audio_linear_preemphasis_pre[i].setFilter(output_audio_rate,8000/*FIXME: Guess! Also let user set this.*/);
-			}
+			audio_linear_preemphasis_pre.setFilter(output_audio_rate,8000/*FIXME: Guess! Also let user set this.*/);
 		}
 	}
 	if (emulating_deemphasis) {
 		if (output_vhs_hifi) {
-			for (unsigned int i=0;i < output_audio_channels;i++) {
-				audio_linear_preemphasis_post[i].setFilter(output_audio_rate,16000/*FIXME: Guess! Also let user set this.*/);
-			}
+			audio_linear_preemphasis_post.setFilter(output_audio_rate,16000/*FIXME: Guess! Also let user set this.*/);
 		}
 		else {
-			for (unsigned int i=0;i < output_audio_channels;i++) {
-				audio_linear_preemphasis_post[i].setFilter(output_audio_rate,8000/*FIXME: Guess! Also let user set this.*/);
-			}
+			audio_linear_preemphasis_post.setFilter(output_audio_rate,8000/*FIXME: Guess! Also let user set this.*/);
 		}
 	}
 
@@ -2220,7 +4404,7 @@ int main(int argc,char **argv) {
 			}
 			av_frame_set_colorspace(output_avstream_video_bob_frame,AVCOL_SPC_SMPTE170M);
 			av_frame_set_color_range(output_avstream_video_bob_frame,AVCOL_RANGE_MPEG);
-			output_avstream_video_bob_frame->format = output_avstream_video_codec_context->pix_fmt;
+			output_avstream_video_bob_frame->format = use_422_colorspace ? AV_PIX_FMT_YUV422P : AV_PIX_FMT_YUV420P; // the encode thread converts if need be
 			output_avstream_video_bob_frame->height = output_height;
 			output_avstream_video_bob_frame->width = output_width;
 			if (av_frame_get_buffer(output_avstream_video_bob_frame,64) < 0) {
@@ -2233,13 +4417,56 @@ int main(int argc,char **argv) {
 	// PARSE
 	{
         unsigned long long av_frame_counter = 0;
-        unsigned long long audio_sample = 0;
 		unsigned long long video_field = 0;
         double adj_time = 0;
         int got_frame = 0;
         double t,pt = -1;
+        bool seeked = false;
 		AVPacket pkt;
 
+        /* field 0 is at the -ss start, or for a -segments worker where the whole render starts. every piece maps
+         * input time to field number the same way, whether or not it seeks. without either it is the first packet */
+        if (transcode_origin < 0 && transcode_start > 0)
+            transcode_origin = transcode_start;
+        if (transcode_origin >= 0)
+            adj_time = -transcode_origin;
+
+        /* -ss: seek to the keyframe before the start, instead of reading and throwing away everything up to it.
+         * video is decoded from that keyframe on, and the last few fields before the start are rendered but not
+         * output (negative field numbers) so that the first field comes out as if from a continuous render.
+         * audio before the start is dropped as before, except in a -segments worker: there the audio from the seek
+         * point on is emulated as pre-roll and cut to the sample at the start, see output_audio_write() */
+        if (transcode_start > 0) {
+            double seek_t = transcode_start;
+            int64_t ts;
+
+            if (input_avstream_video != NULL)
+                seek_t -= ((double)transcode_preroll * output_field_rate.den) / output_field_rate.num;
+            if (seek_t < 0)
+                seek_t = 0;
+
+            ts = (int64_t)(seek_t * AV_TIME_BASE);
+            if (av_seek_frame(input_avfmt,-1,ts,AVSEEK_FLAG_BACKWARD) >= 0) {
+                fprintf(stderr,"Seeked to %.3f for start at %.3f\n",seek_t,transcode_start);
+                seeked = true;
+                output_audio_sample = (unsigned long long)floor(((((double)segment_field_first * output_field_rate.den) * output_audio_rate) / output_field_rate.num) + 0.5);
+                audio_proc_count = output_audio_sample; /* hiss and buzz pick up where the previous segment left off */
+                output_audio_skip = output_audio_sample;
+                output_audio_preroll = transcode_origin < transcode_start;
+                if (input_avstream_video != NULL) {
+                    video_field_first = segment_field_first - (signed long long)transcode_preroll;
+                    video_field = (unsigned long long)video_field_first;
+                }
+            }
+            else {
+                fprintf(stderr,"WARNING: Unable to seek to %.3f, reading from the start\n",seek_t);
+            }
+        }
+
+        /* audio thread, from where the seek left the audio */
+        if (input_avstream_audio != NULL)
+            output_audio_start();
+
 		av_init_packet(&pkt);
 		while (av_read_frame(input_avfmt,&pkt) >= 0) {
 			if (DIE != 0) break;
@@ -2254,14 +4481,16 @@ int main(int argc,char **argv) {
                     if (transcode_end >= 0 && t >= transcode_end)
                         break;
 
-                    if (t < transcode_start) {
+                    if (t < transcode_start && !(seeked && input_avstream_video != NULL && pkt.stream_index == input_avstream_video->index) &&
+                        !(seeked && t >= transcode_origin && input_avstream_audio != NULL && pkt.stream_index == input_avstream_audio->index)) {
                         av_packet_unref(&pkt);
                         av_init_packet(&pkt);
                         continue;
                     }
 
-                    if (pt < 0)
-                        adj_time = -t;
+                    if (pt < 0) {
+                        if (transcode_origin < 0) adj_time = -t;
+                    }
                     else if ((t+1.5) < pt) { // time code jumps backwards (1.5 is safe for DVD timecode resets)
                         adj_time += pt - t;
                         fprintf(stderr,"Time code jump backwards %.6f->%.6f. adj_time=%.6f\n",pt,t,adj_time);
@@ -2293,7 +4522,7 @@ int main(int argc,char **argv) {
 
 			if (input_avstream_audio != NULL && pkt.stream_index == input_avstream_audio->index) {
 				av_packet_rescale_ts(&pkt,input_avstream_audio->time_base,output_avstream_audio->time_base);
-                do_audio_decode_and_render(/*&*/pkt,/*&*/audio_sample);
+                output_audio(/*&*/pkt);
 			}
 			else if (input_avstream_video != NULL && pkt.stream_index == input_avstream_video->index) {
 				AVRational m = (AVRational){output_field_rate.den, output_field_rate.num};
@@ -2326,17 +4555,30 @@ int main(int argc,char **argv) {
                 pkt.data = NULL;
                 if (input_avstream_video != NULL)
                     got_frame = do_video_decode_and_render(/*&*/pkt,/*&*/video_field) ? 1 : 0;
-                if (input_avstream_audio != NULL)
-                    got_frame |= do_audio_decode_and_render(/*&*/pkt,/*&*/audio_sample) ? 1 : 0;
+                if (input_avstream_audio != NULL && !output_audio_running)
+                    got_frame |= do_audio_decode_and_render(/*&*/pkt,/*&*/output_audio_sample) ? 1 : 0;
             } while (got_frame);
         }
 
+        /* the audio thread drains its decoder itself */
+        output_audio_flush();
+
 		if (audio_dst_data != NULL) {
 			av_freep(&audio_dst_data[0]); // NTS: Why??
 			av_freep(&audio_dst_data);
 		}
 	}
 
+	/* fields still on the field threads */
+	field_threads_flush();
+
+	/* flush encoder delay */
+	if (output_avstream_video_codec_context != NULL)
+		output_video_encode_flush();
+
+	/* packets still queued to the muxer */
+	output_mux_flush();
+
 	if (output_avstream_video_input_frame != NULL)
 		av_frame_free(&output_avstream_video_input_frame);
 	if (output_avstream_video_bob_frame != NULL)
@@ -2370,6 +4612,8 @@ int main(int argc,char **argv) {
 	if (output_avfmt != NULL && !(output_avfmt->oformat->flags & AVFMT_NOFILE))
 		avio_closep(&output_avfmt->pb);
 	avformat_free_context(output_avfmt);
+	av_buffer_pool_uninit(&output_video_packet_pool);
+	av_buffer_pool_uninit(&output_audio_packet_pool);
 	avformat_close_input(&input_avfmt);
 	return 0;
 }
@@ -0,0 +1,325 @@
+/* video encoder shared by the tools, see output_video_encode.h */
+
+#define __STDC_CONSTANT_MACROS
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+extern "C" {
+#include <libavutil/opt.h>
+#include <libavutil/avutil.h>
+#include <libavutil/pixfmt.h>
+#include <libavutil/pixdesc.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavcodec/version.h>
+
+#include <libavformat/avformat.h>
+
+#include <libswscale/swscale.h>
+#include <libswscale/version.h>
+}
+
+using namespace std;
+
+#include <string>
+
+#include "output_video_encode.h"
+
+/* encoded video packets come from a pool of 50Mbit buffers instead of a fresh av_new_packet() per frame.
+ * the muxer returns them to the pool when it is done with them, so the steady state does not allocate. */
+AVBufferPool*               output_video_packet_pool = NULL;
+
+int output_video_new_packet(AVPacket *pkt) {
+    const int size = 50000000/8;
+
+    if (output_video_packet_pool == NULL) {
+        output_video_packet_pool = av_buffer_pool_init(size + AV_INPUT_BUFFER_PADDING_SIZE,NULL);
+        if (output_video_packet_pool == NULL) return AVERROR(ENOMEM);
+    }
+
+    pkt->buf = av_buffer_pool_get(output_video_packet_pool);
+    if (pkt->buf == NULL) return AVERROR(ENOMEM);
+    pkt->data = pkt->buf->data;
+    pkt->size = size;
+    memset(pkt->data + size,0,AV_INPUT_BUFFER_PADDING_SIZE);
+    return 0;
+}
+
+/* video encoder selection. -vcodec takes any FFmpeg encoder or codec name, plus a few shorthands for the ones
+ * worth using here. h264 is the default, as before (libx264, or whatever H.264 encoder is there without it) */
+AVCodec *output_video_encoder(void) {
+    static const char *alias[][2] = {
+        {"h264",    "libx264"},
+        {"x264",    "libx264"},
+        {"hevc",    "libx265"},
+        {"h265",    "libx265"},
+        {"x265",    "libx265"},
+        {"prores",  "prores_ks"},
+        {NULL,      NULL}
+    };
+    const char *name = output_video_codec.c_str();
+    AVCodec *codec = NULL;
+
+    for (unsigned int i=0;codec == NULL && alias[i][0] != NULL;i++) {
+        if (!strcmp(name,alias[i][0]))
+            codec = avcodec_find_encoder_by_name(alias[i][1]);
+    }
+    if (codec == NULL)
+        codec = avcodec_find_encoder_by_name(name);
+    if (codec == NULL) {
+        const AVCodecDescriptor *desc = avcodec_descriptor_get_by_name(name);
+        if (desc != NULL) codec = avcodec_find_encoder(desc->id);
+    }
+    if (codec != NULL && codec->type != AVMEDIA_TYPE_VIDEO)
+        codec = NULL;
+
+    return codec;
+}
+
+/* apply -preset, -crf, -b:v and -encode-threads, and settle the pixel format: ours (4:2:0 or 4:2:2) if the encoder
+ * takes it, else the closest one it does, which the encode thread converts to (ProRes for example is 10-bit only) */
+void output_video_encoder_config(AVCodecContext *ctx,AVCodec *codec,AVDictionary **opts) {
+    ctx->thread_count = output_video_threads;
+    ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    if (output_video_bitrate > 0)
+        ctx->bit_rate = output_video_bitrate;
+
+    if (!output_video_preset.empty())
+        av_dict_set(opts,"preset",output_video_preset.c_str(),0);
+    if (!output_video_crf.empty())
+        av_dict_set(opts,"crf",output_video_crf.c_str(),0);
+    if (codec->id == AV_CODEC_ID_FFV1)
+        av_dict_set(opts,"level","3",AV_DICT_DONT_OVERWRITE); // FFV1 version 3 is what encodes in slices (threads)
+
+    if (codec->pix_fmts != NULL) {
+        const AVPixelFormat want = ctx->pix_fmt;
+        const AVPixelFormat *p = codec->pix_fmts;
+
+        while (*p != AV_PIX_FMT_NONE && *p != want) p++;
+        if (*p == AV_PIX_FMT_NONE) {
+            ctx->pix_fmt = avcodec_find_best_pix_fmt_of_list(codec->pix_fmts,want,0,NULL);
+            fprintf(stderr,"Encoder %s does not take %s, encoding as %s\n",
+                codec->name,av_get_pix_fmt_name(want),av_get_pix_fmt_name(ctx->pix_fmt));
+        }
+    }
+}
+
+/* encoder options that no encoder option took. x264 for example has a preset and a crf, FFV1 has neither */
+void output_video_encoder_unused_options(AVCodec *codec,AVDictionary **opts) {
+    AVDictionaryEntry *e = NULL;
+
+    while ((e = av_dict_get(*opts,"",e,AV_DICT_IGNORE_SUFFIX)) != NULL)
+        fprintf(stderr,"WARNING: Encoder %s does not take option '%s'\n",codec->name,e->key);
+
+    av_dict_free(opts);
+}
+
+/* video encode thread. output_frame() copies the finished frame into a ring of slots and returns to rendering,
+ * the encode thread converts the frame to the encoder's pixel format if it has to, encodes it and writes it out.
+ * the ring is single producer, single consumer, the two semaphores count the free and filled slots */
+struct OutputVideoEncodeSlot {
+    AVFrame*                frame;
+    bool                    flush;                  // no frame, drain the encoder and end the thread
+};
+
+OutputVideoEncodeSlot*      output_video_encode_ring = NULL;
+unsigned int                output_video_encode_ring_size = 0;
+unsigned int                output_video_encode_head = 0;
+bool                        output_video_encode_running = false;
+pthread_t                   output_video_encode_thread;
+sem_t                       output_video_encode_free,output_video_encode_used;
+struct SwsContext*          output_video_encode_converter = NULL;
+AVFrame*                    output_video_encode_converted = NULL;
+
+AVFrame *output_video_encode_convert(AVFrame *frame) {
+    AVCodecContext *ctx = output_avstream_video_codec_context;
+
+    if (output_video_encode_converted == NULL) {
+        output_video_encode_converted = av_frame_alloc();
+        if (output_video_encode_converted == NULL) {
+            fprintf(stderr,"Failed to alloc video frame\n");
+            return NULL;
+        }
+        output_video_encode_converted->format = ctx->pix_fmt;
+        output_video_encode_converted->height = ctx->height;
+        output_video_encode_converted->width = ctx->width;
+        if (av_frame_get_buffer(output_video_encode_converted,64) < 0) {
+            fprintf(stderr,"Failed to alloc encode frame\n");
+            av_frame_free(&output_video_encode_converted);
+            return NULL;
+        }
+    }
+
+    output_video_encode_converter = sws_getCachedContext(output_video_encode_converter,
+            // source
+            frame->width,frame->height,(AVPixelFormat)frame->format,
+            // dest
+            ctx->width,ctx->height,ctx->pix_fmt,
+            // opt
+            SWS_BILINEAR, NULL, NULL, NULL);
+    if (output_video_encode_converter == NULL) {
+        fprintf(stderr,"Failed to alloc frame -> codec converter\n");
+        return NULL;
+    }
+
+    av_frame_copy_props(output_video_encode_converted,frame);
+    if (sws_scale(output_video_encode_converter,
+                frame->data,frame->linesize,0,frame->height,
+                output_video_encode_converted->data,output_video_encode_converted->linesize) <= 0)
+        fprintf(stderr,"WARNING: sws_scale failed\n");
+
+    return output_video_encode_converted;
+}
+
+/* encode one frame, or with NULL, drain one delayed packet. returns true if a packet came out */
+bool output_video_encode_packet(AVFrame *frame) {
+    int gotit = 0;
+    AVPacket pkt;
+
+    if (frame != NULL && frame->format != output_avstream_video_codec_context->pix_fmt) {
+        frame = output_video_encode_convert(frame);
+        if (frame == NULL) return false;
+    }
+
+    av_init_packet(&pkt);
+    if (output_video_new_packet(&pkt) < 0) {
+        fprintf(stderr,"Failed to alloc vid packet\n");
+        return false;
+    }
+
+    if (avcodec_encode_video2(output_avstream_video_codec_context,&pkt,frame,&gotit) == 0) {
+        if (gotit) {
+            pkt.stream_index = output_avstream_video->index;
+            av_packet_rescale_ts(&pkt,output_avstream_video_codec_context->time_base,output_avstream_video->time_base);
+
+            if (output_video_write_packet(&pkt) < 0)
+                fprintf(stderr,"AV write frame failed video\n");
+        }
+    }
+
+    av_packet_unref(&pkt);
+    return gotit != 0;
+}
+
+void *output_video_encode_thread_proc(void *arg) {
+    unsigned int idx = 0;
+
+    (void)arg;
+    do {
+        while (sem_wait(&output_video_encode_used) != 0);
+
+        OutputVideoEncodeSlot &s = output_video_encode_ring[idx];
+        if ((++idx) >= output_video_encode_ring_size) idx = 0;
+        if (s.flush) break;
+
+        output_video_encode_packet(s.frame);
+        sem_post(&output_video_encode_free);
+    } while (1);
+
+    while (output_video_encode_packet(NULL));
+    return NULL;
+}
+
+void output_video_encode_start(void) {
+    unsigned int i;
+
+    if (output_video_encode_queue == 0 || output_video_encode_running)
+        return;
+
+    output_video_encode_ring = new OutputVideoEncodeSlot[output_video_encode_queue];
+    output_video_encode_ring_size = output_video_encode_queue;
+    output_video_encode_head = 0;
+    for (i=0;i < output_video_encode_ring_size;i++) {
+        output_video_encode_ring[i].frame = NULL;
+        output_video_encode_ring[i].flush = false;
+    }
+
+    sem_init(&output_video_encode_free,0,output_video_encode_ring_size);
+    sem_init(&output_video_encode_used,0,0);
+    if (pthread_create(&output_video_encode_thread,NULL,output_video_encode_thread_proc,NULL) != 0) {
+        fprintf(stderr,"Failed to start encode thread, encoding on the main thread\n");
+        sem_destroy(&output_video_encode_free);
+        sem_destroy(&output_video_encode_used);
+        delete[] output_video_encode_ring;
+        output_video_encode_ring = NULL;
+        output_video_encode_ring_size = 0;
+        return;
+    }
+
+    output_video_encode_running = true;
+}
+
+void output_video_encode(AVFrame *frame) {
+    if (!output_video_encode_running) {
+        output_video_encode_packet(frame);
+        return;
+    }
+
+    while (sem_wait(&output_video_encode_free) != 0);
+
+    OutputVideoEncodeSlot &s = output_video_encode_ring[output_video_encode_head];
+    if (s.frame == NULL || s.frame->format != frame->format || s.frame->width != frame->width || s.frame->height != frame->height) {
+        if (s.frame != NULL) av_frame_free(&s.frame);
+        s.frame = av_frame_alloc();
+        if (s.frame == NULL) {
+            fprintf(stderr,"Failed to alloc video frame\n");
+            sem_post(&output_video_encode_free);
+            return;
+        }
+        s.frame->format = frame->format;
+        s.frame->height = frame->height;
+        s.frame->width = frame->width;
+        if (av_frame_get_buffer(s.frame,64) < 0) {
+            fprintf(stderr,"Failed to alloc encode frame\n");
+            av_frame_free(&s.frame);
+            sem_post(&output_video_encode_free);
+            return;
+        }
+    }
+
+    av_frame_copy(s.frame,frame);
+    av_frame_copy_props(s.frame,frame);
+    if ((++output_video_encode_head) >= output_video_encode_ring_size) output_video_encode_head = 0;
+
+    sem_post(&output_video_encode_used);
+}
+
+/* drain the encoder (the frames it holds back for B-frames and lookahead) and end the encode thread */
+void output_video_encode_flush(void) {
+    unsigned int i;
+
+    if (output_video_encode_running) {
+        while (sem_wait(&output_video_encode_free) != 0);
+        output_video_encode_ring[output_video_encode_head].flush = true;
+        sem_post(&output_video_encode_used);
+        pthread_join(output_video_encode_thread,NULL);
+        sem_destroy(&output_video_encode_free);
+        sem_destroy(&output_video_encode_used);
+        output_video_encode_running = false;
+
+        for (i=0;i < output_video_encode_ring_size;i++) {
+            if (output_video_encode_ring[i].frame != NULL)
+                av_frame_free(&output_video_encode_ring[i].frame);
+        }
+        delete[] output_video_encode_ring;
+        output_video_encode_ring = NULL;
+        output_video_encode_ring_size = 0;
+    }
+    else {
+        while (output_video_encode_packet(NULL));
+    }
+
+    if (output_video_encode_converter != NULL) {
+        sws_freeContext(output_video_encode_converter);
+        output_video_encode_converter = NULL;
+    }
+    if (output_video_encode_converted != NULL)
+        av_frame_free(&output_video_encode_converted);
+}
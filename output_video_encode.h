@@ -0,0 +1,40 @@
+/* video encoder shared by the tools that write video: -vcodec selection and setup, the packet pool and the encode thread.
+ * the program defines the options and the output stream declared below, and output_video_write_packet() to mux what comes out */
+#ifndef OUTPUT_VIDEO_ENCODE_H
+#define OUTPUT_VIDEO_ENCODE_H
+
+#include <string>
+
+extern "C" {
+#include <libavutil/avutil.h>
+
+#include <libavcodec/avcodec.h>
+
+#include <libavformat/avformat.h>
+}
+
+/* defined by the program */
+extern std::string      output_video_codec;         // -vcodec, see output_video_encoder()
+extern std::string      output_video_preset;        // -preset
+extern std::string      output_video_crf;           // -crf
+extern long             output_video_bitrate;       // -b:v (0 = encoder default)
+extern int              output_video_threads;       // encoder threads (0 = one per CPU core)
+extern unsigned int     output_video_encode_queue;  // frames queued to the encode thread (0 = encode on the main thread)
+extern AVStream*        output_avstream_video;
+extern AVCodecContext*  output_avstream_video_codec_context;
+
+/* hand an encoded packet to the muxer. called from the encode thread */
+int output_video_write_packet(AVPacket *pkt);
+
+/* output_video_encode.cpp */
+extern AVBufferPool*    output_video_packet_pool;   // the program frees it with av_buffer_pool_uninit() when done
+
+int output_video_new_packet(AVPacket *pkt);
+AVCodec *output_video_encoder(void);
+void output_video_encoder_config(AVCodecContext *ctx,AVCodec *codec,AVDictionary **opts);
+void output_video_encoder_unused_options(AVCodec *codec,AVDictionary **opts);
+void output_video_encode_start(void);
+void output_video_encode(AVFrame *frame);
+void output_video_encode_flush(void);
+
+#endif //OUTPUT_VIDEO_ENCODE_H